@@ -0,0 +1,854 @@
+/** @file main.c
+*
+* @brief Access point stand-in for load testing the host without hardware.
+*        Opens a pty, sends RSSI tables (from a trace or a synthetic
+*        network) framed like the AP does, at up to MAX_SPEED times real
+*        time, and checks the route/power tables the host sends back.
+*
+* @author Alvaro Prieto
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <termios.h>
+#include "escape.h"
+#include "deframer.h"
+#include "rpupdate.h"
+#include "neighbors.h"
+#include "latency.h"
+#include "main.h"
+
+static uint8_t load_trace( FILE* );
+static uint8_t generate_random_tables( uint32_t, uint32_t );
+static uint8_t open_pty();
+static uint8_t wait_for_host();
+static void run( uint32_t, uint32_t );
+static uint8_t send_table( const uint8_t* );
+static uint16_t pack_neighbors( const uint8_t*, uint8_t* );
+static uint8_t receive_until( uint64_t, uint8_t );
+static void table_received( const uint8_t*, uint16_t, uint64_t );
+static uint8_t check_tables( const uint8_t*, uint16_t );
+static void print_stats( double );
+static uint8_t rssi_to_raw( double );
+static uint64_t now_ns();
+
+// Raw RSSI tables (as the AP sends them), one after another
+static uint8_t* rssi_tables;
+static uint32_t round_count;
+static uint16_t table_size;
+
+#define DEVICE_COUNT ( table_size - 1 )
+#define AP_NODE_ID ( table_size )
+
+static int pty_fd = -1;
+static deframer_t deframer;
+
+// Replies are route/power updates (host built with -DRP_DELTA_UPDATES)
+static uint8_t delta_updates;
+static rp_decoder_t decoder;
+
+// Tables are sent sparse, with the max_neighbors strongest neighbors of each
+// node (0 sends them dense)
+static uint8_t max_neighbors;
+static neighbor_table_t neighbors;
+
+// Send time of the last table and whether the host replied since (the AP
+// uses the first tables it gets each round)
+static uint64_t last_sent;
+static uint8_t round_answered;
+
+static apemu_stats_t stats;
+static latency_histogram_t round_trip;
+static uint64_t start_time;
+
+static volatile sig_atomic_t running = 1;
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  FILE* fp_rssi;
+  uint8_t arg_offset = 0;
+  uint32_t speed;
+  uint32_t rounds;
+
+  if( ( argc > 3 ) && ( 0 == strcmp( argv[1], "-r" ) ) )
+  {
+    // Synthetic network (arguments are one further along)
+    arg_offset = 1;
+  }
+
+  if( argc > ( 5 + arg_offset ) )
+  {
+    max_neighbors = atoi( argv[5 + arg_offset] );
+  }
+
+  if( arg_offset )
+  {
+    rounds = ( argc > 4 ) ? atoi( argv[4] ) : DEFAULT_RANDOM_ROUNDS;
+
+    if( generate_random_tables( atoi( argv[2] ), rounds ) )
+    {
+      return 1;
+    }
+  }
+  else if( argc > 2 )
+  {
+    fp_rssi = fopen( argv[1], "r" );
+
+    if( NULL == fp_rssi )
+    {
+      printf( "Error opening rssi input file.\r\n" );
+      return 1;
+    }
+
+    if( load_trace( fp_rssi ) )
+    {
+      return 1;
+    }
+
+    fclose( fp_rssi );
+  }
+  else
+  {
+    printf( "Usage: %s rssi.csv speed [rounds] [delta (0,1)] "
+                                                      "[neighbors k]\r\n"
+            "       %s -r devices speed [rounds] [delta (0,1)] "
+                                                      "[neighbors k]\r\n",
+                                                          argv[0], argv[0] );
+    return 1;
+  }
+
+  if( max_neighbors > 0 )
+  {
+    if( ( max_neighbors > NEIGHBORS_MAX_K ) ||
+        neighbor_table_allocate( &neighbors, DEVICE_COUNT, max_neighbors ) )
+    {
+      printf( "Invalid neighbors (1-%d).\r\n", NEIGHBORS_MAX_K );
+      return 1;
+    }
+  }
+  else if( table_size > MAX_DENSE_TABLE_SIZE )
+  {
+    printf( "Networks over %d devices need sparse tables (neighbors k).\r\n",
+                                                  MAX_DENSE_TABLE_SIZE - 1 );
+    return 1;
+  }
+
+  speed = atoi( argv[2 + arg_offset] );
+  if( speed > MAX_SPEED )
+  {
+    printf( "Speed is 1-%d times real time, or 0 to send each table as soon "
+            "as the last one is answered.\r\n", MAX_SPEED );
+    return 1;
+  }
+
+  // A trace is replayed from the start as many times as needed
+  rounds = round_count;
+  if( argc > ( 3 + arg_offset ) )
+  {
+    rounds = atoi( argv[3 + arg_offset] );
+  }
+
+  if( argc > ( 4 + arg_offset ) )
+  {
+    delta_updates = atoi( argv[4 + arg_offset] );
+  }
+
+  (void) signal( SIGINT, sigint_handler );
+
+  deframer_initialize( &deframer );
+  rp_decoder_initialize( &decoder );
+
+  if( open_pty() )
+  {
+    return 1;
+  }
+
+  if( wait_for_host() )
+  {
+    return 1;
+  }
+
+  printf( "Host connected, sending %d rounds of %d devices ", rounds,
+                                                            DEVICE_COUNT );
+  if( max_neighbors > 0 )
+  {
+    printf( "(%d neighbors each) ", max_neighbors );
+  }
+  if( speed > 0 )
+  {
+    printf( "every %.3f ms\n", (double)ROUND_PERIOD_MS / speed );
+  }
+  else
+  {
+    printf( "as fast as they are answered\n" );
+  }
+
+  run( rounds, speed );
+
+  print_stats( ( now_ns() - start_time ) / 1e9 );
+
+  close( pty_fd );
+  free( rssi_tables );
+  neighbor_table_free( &neighbors );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void run( uint32_t rounds, uint32_t speed )
+ *
+ * @brief Send the tables on schedule (every ROUND_PERIOD_MS / speed, speed 0
+ *        sends the next one once the last one is answered) and handle the
+ *        host's tables in between
+ * ****************************************************************************/
+static void run( uint32_t rounds, uint32_t speed )
+{
+  uint64_t period = speed ? ( ROUND_PERIOD_MS * 1000000ULL ) / speed : 0;
+  uint64_t next_round;
+  uint32_t round;
+
+  start_time = now_ns();
+  next_round = start_time;
+
+  for( round = 0; ( round < rounds ) && running; round++ )
+  {
+    if( speed > 0 )
+    {
+      // Rounds are on a fixed schedule, a late one doesn't move the rest
+      if( receive_until( next_round, 0 ) )
+      {
+        return;
+      }
+
+      if( now_ns() > ( next_round + period ) )
+      {
+        stats.behind++;
+      }
+      next_round += period;
+    }
+
+    if( send_table( &rssi_tables[(size_t)( round % round_count ) *
+                                              table_size * table_size] ) )
+    {
+      return;
+    }
+
+    if( 0 == speed )
+    {
+      if( receive_until( now_ns() + REPLY_TIMEOUT_MS * 1000000ULL, 1 ) )
+      {
+        return;
+      }
+    }
+  }
+
+  // Give the host time to answer the last table
+  if( !round_answered )
+  {
+    receive_until( now_ns() + REPLY_TIMEOUT_MS * 1000000ULL, 2 );
+  }
+
+  if( ( stats.sent > 0 ) && !round_answered )
+  {
+    stats.missed++;
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint8_t send_table( const uint8_t* p_table )
+ *
+ * @brief Frame an RSSI table (sparse if max_neighbors > 0) and write it to
+ *        the pty. Starts a new round, the last one is missed if the host
+ *        didn't reply during it. Returns 1 if the host closed the pty.
+ * ****************************************************************************/
+static uint8_t send_table( const uint8_t* p_table )
+{
+  static uint8_t packet[DEFRAMER_BUFFER_SIZE];
+  static uint8_t frame[FRAME_MAX_SIZE( DEFRAMER_BUFFER_SIZE )];
+  uint16_t packet_size;
+  uint16_t frame_size;
+  uint16_t sent = 0;
+  struct pollfd pty;
+  ssize_t bytes_written;
+
+  if( max_neighbors > 0 )
+  {
+    packet_size = pack_neighbors( p_table, packet );
+    p_table = packet;
+  }
+  else
+  {
+    packet_size = table_size * table_size;
+  }
+
+  if( packet_size > stats.largest )
+  {
+    stats.largest = packet_size;
+  }
+
+  frame_size = frame_escape( frame, p_table, packet_size );
+
+  pty.fd = pty_fd;
+  pty.events = POLLOUT;
+
+  while( sent < frame_size )
+  {
+    bytes_written = write( pty_fd, &frame[sent], frame_size - sent );
+    if( bytes_written > 0 )
+    {
+      sent += bytes_written;
+    }
+    else if( ( bytes_written < 0 ) && ( EAGAIN != errno ) &&
+                                                        ( EINTR != errno ) )
+    {
+      return 1;
+    }
+    else if( !running )
+    {
+      return 1;
+    }
+    else
+    {
+      // The host isn't reading, wait for room (this is what makes rounds
+      // go out behind schedule)
+      poll( &pty, 1, 100 );
+    }
+  }
+
+  if( ( stats.sent > 0 ) && !round_answered )
+  {
+    stats.missed++;
+  }
+
+  last_sent = now_ns();
+  round_answered = 0;
+  stats.sent++;
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t pack_neighbors( const uint8_t* p_table, uint8_t* p_packet )
+ *
+ * @brief Keep the strongest neighbors of each node of a raw RSSI table and
+ *        write them in the sparse packet format, like the AP does for large
+ *        networks (see ../lib/neighbors.h). Returns the packet size.
+ * ****************************************************************************/
+static uint16_t pack_neighbors( const uint8_t* p_table, uint8_t* p_packet )
+{
+  static energy_t rssi_table[MAX_TABLE_SIZE * MAX_TABLE_SIZE];
+  uint32_t cell_index;
+
+  for( cell_index = 0; cell_index < (uint32_t)table_size * table_size;
+                                                                cell_index++ )
+  {
+    // Same conversion as the host (0x80 is no link, see rssi_to_raw)
+    if( 0x80 == p_table[cell_index] )
+    {
+      rssi_table[cell_index] = NEIGHBOR_NO_SIGNAL;
+    }
+    else
+    {
+      rssi_table[cell_index] = (int8_t)p_table[cell_index] / 2.0 - 72.0;
+    }
+  }
+
+  neighbor_table_from_dense( &neighbors, rssi_table );
+
+  return neighbor_table_pack( &neighbors, p_packet );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t receive_until( uint64_t deadline, uint8_t stop )
+ *
+ * @brief Handle the host's tables until deadline (ns, see now_ns). stop 1
+ *        returns as soon as the host replies, 2 once the round is answered.
+ *        Returns 1 if the host closed the pty.
+ * ****************************************************************************/
+static uint8_t receive_until( uint64_t deadline, uint8_t stop )
+{
+  struct pollfd pty;
+  struct timespec timeout;
+  uint64_t now;
+  uint32_t replies = stats.replies;
+  uint8_t* p_space;
+  uint8_t* p_packet;
+  uint16_t room;
+  uint16_t packet_size;
+  ssize_t bytes_read;
+
+  pty.fd = pty_fd;
+  pty.events = POLLIN;
+
+  while( running )
+  {
+    if( ( ( 1 == stop ) && ( stats.replies != replies ) ) ||
+        ( ( 2 == stop ) && round_answered ) )
+    {
+      return 0;
+    }
+
+    now = now_ns();
+    if( now >= deadline )
+    {
+      return 0;
+    }
+
+    // ms is too coarse at high speeds
+    timeout.tv_sec = ( deadline - now ) / 1000000000ULL;
+    timeout.tv_nsec = ( deadline - now ) % 1000000000ULL;
+
+    if( ppoll( &pty, 1, &timeout, NULL ) <= 0 )
+    {
+      continue;
+    }
+
+    p_space = deframer_space( &deframer, &room );
+    bytes_read = read( pty_fd, p_space, room );
+    if( bytes_read <= 0 )
+    {
+      if( ( bytes_read < 0 ) && ( ( EAGAIN == errno ) || ( EINTR == errno ) ) )
+      {
+        continue;
+      }
+
+      // The host closed the port
+      printf( "Host disconnected.\n" );
+      return 1;
+    }
+
+    now = now_ns();
+    deframer_received( &deframer, bytes_read );
+
+    while( deframer_next( &deframer, &p_packet, &packet_size ) )
+    {
+      table_received( p_packet, packet_size, now );
+    }
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void table_received( const uint8_t* p_packet, uint16_t size,
+ *                                                          uint64_t arrival )
+ *
+ * @brief Check a packet from the host. The first valid one in a round
+ *        answers it. Replies don't say which table they are for, so the round
+ *        trip is measured from the last table sent: exact while the host
+ *        keeps up, and how long the AP waited for new tables when it doesn't
+ *        (it only routes the newest table it has, older ones are dropped).
+ * ****************************************************************************/
+static void table_received( const uint8_t* p_packet, uint16_t size,
+                                                            uint64_t arrival )
+{
+  stats.replies++;
+
+  if( check_tables( p_packet, size ) )
+  {
+    stats.invalid++;
+    return;
+  }
+
+  stats.valid++;
+
+  if( round_answered || ( 0 == stats.sent ) )
+  {
+    // Tables for an older round, the AP already has newer ones
+    stats.extra++;
+    return;
+  }
+
+  latency_histogram_add( &round_trip, arrival - last_sent );
+  round_answered = 1;
+  stats.answered++;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t check_tables( const uint8_t* p_packet, uint16_t size )
+ *
+ * @brief Check route/power tables (or an update of them) from the host:
+ *        right size, every route to another node or the AP (0 is
+ *        broadcast and 0xff not routed yet), and no routing loops.
+ *        Returns 1 if they aren't valid.
+ * ****************************************************************************/
+static uint8_t check_tables( const uint8_t* p_packet, uint16_t size )
+{
+  const uint8_t* p_routes;
+  uint8_t node;
+  uint8_t next;
+  uint8_t hops;
+
+  if( delta_updates )
+  {
+    if( rp_update_decode( &decoder, p_packet, size ) ||
+        ( decoder.device_count != DEVICE_COUNT ) )
+    {
+      return 1;
+    }
+    p_routes = decoder.rp_tables;
+  }
+  else
+  {
+    if( size != ( DEVICE_COUNT * 2 ) )
+    {
+      return 1;
+    }
+    p_routes = p_packet;
+  }
+
+  for( node = 1; node <= DEVICE_COUNT; node++ )
+  {
+    next = node;
+    for( hops = 0; hops <= DEVICE_COUNT; hops++ )
+    {
+      next = p_routes[next - 1];
+
+      if( ( 0 == next ) || ( 0xff == next ) || ( AP_NODE_ID == next ) )
+      {
+        break;
+      }
+
+      if( ( next > DEVICE_COUNT ) || ( next == node ) )
+      {
+        // Not a node, or back where it started
+        return 1;
+      }
+    }
+
+    if( hops > DEVICE_COUNT )
+    {
+      // Loop further up the path
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t open_pty()
+ *
+ * @brief Open a pty for the host to use as the AP's serial port
+ *        Returns 1 on error.
+ * ****************************************************************************/
+static uint8_t open_pty()
+{
+  struct termios settings;
+  int slave_fd;
+
+  pty_fd = posix_openpt( O_RDWR | O_NOCTTY );
+  if( ( pty_fd < 0 ) || grantpt( pty_fd ) || unlockpt( pty_fd ) )
+  {
+    perror( "Error opening pty" );
+    return 1;
+  }
+
+  // Raw until the host sets it up (it does, see OpenComport), so nothing
+  // sent early is mangled
+  slave_fd = open( ptsname( pty_fd ), O_RDWR | O_NOCTTY );
+  if( slave_fd >= 0 )
+  {
+    tcgetattr( slave_fd, &settings );
+    cfmakeraw( &settings );
+    tcsetattr( slave_fd, TCSANOW, &settings );
+    close( slave_fd );
+  }
+
+  fcntl( pty_fd, F_SETFL, fcntl( pty_fd, F_GETFL ) | O_NONBLOCK );
+
+  printf( "AP on %s\n", ptsname( pty_fd ) );
+  fflush( stdout );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t wait_for_host()
+ *
+ * @brief Wait until the host opens the pty (it reads as hung up until then)
+ *        and START_DELAY_MS more. Returns 1 if interrupted.
+ * ****************************************************************************/
+static uint8_t wait_for_host()
+{
+  struct pollfd pty;
+
+  pty.fd = pty_fd;
+  pty.events = POLLIN;
+
+  do
+  {
+    if( !running )
+    {
+      return 1;
+    }
+
+    usleep( 10000 );
+    pty.revents = 0;
+    poll( &pty, 1, 0 );
+  } while( pty.revents & POLLHUP );
+
+  usleep( START_DELAY_MS * 1000 );
+
+  return !running;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t load_trace( FILE* fp_rssi )
+ *
+ * @brief Read the RSSI tables of a trace (tables separated by blank lines)
+ *        and turn them into the bytes the AP sends. Returns 1 on error.
+ * ****************************************************************************/
+static uint8_t load_trace( FILE* fp_rssi )
+{
+  char line[4096];
+  char* p_value;
+  char* p_end;
+  uint8_t* p_tables;
+  uint8_t row[MAX_TABLE_SIZE];
+  uint16_t row_count = 0;
+  uint16_t column;
+  uint32_t capacity = 0;
+  double value;
+
+  while( ( NULL != fgets( line, sizeof(line), fp_rssi ) ) &&
+                                                ( round_count < MAX_ROUNDS ) )
+  {
+    column = 0;
+    p_value = line;
+    while( column < MAX_TABLE_SIZE )
+    {
+      value = strtod( p_value, &p_end );
+      if( p_end == p_value )
+      {
+        break;
+      }
+
+      row[column++] = rssi_to_raw( value );
+      p_value = ( ',' == *p_end ) ? p_end + 1 : p_end;
+    }
+
+    if( 0 == column )
+    {
+      // Blank line between tables
+      continue;
+    }
+
+    if( 0 == table_size )
+    {
+      table_size = column;
+    }
+
+    if( ( column != table_size ) || ( table_size < 2 ) )
+    {
+      printf( "Tables must all be square and the same size (2x2-%dx%d).\r\n",
+                                            MAX_TABLE_SIZE, MAX_TABLE_SIZE );
+      return 1;
+    }
+
+    // Room for the next table (the size is only known from the trace)
+    if( ( 0 == row_count ) && ( round_count == capacity ) )
+    {
+      capacity = capacity ? capacity * 2 : TRACE_INITIAL_ROUNDS;
+      p_tables = realloc( rssi_tables,
+                              (size_t)capacity * table_size * table_size );
+      if( NULL == p_tables )
+      {
+        printf( "Error allocating tables.\r\n" );
+        return 1;
+      }
+      rssi_tables = p_tables;
+    }
+
+    memcpy( &rssi_tables[( (size_t)round_count * table_size + row_count ) *
+                                            table_size], row, table_size );
+
+    if( ++row_count == table_size )
+    {
+      row_count = 0;
+      round_count++;
+    }
+  }
+
+  if( 0 == round_count )
+  {
+    printf( "No tables in trace.\r\n" );
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t generate_random_tables( uint32_t devices, uint32_t rounds )
+ *
+ * @brief Make up RSSI tables of devices moving around the AP with log
+ *        distance path loss and random shadowing. Returns 1 on error.
+ * ****************************************************************************/
+static uint8_t generate_random_tables( uint32_t devices, uint32_t rounds )
+{
+  double x[MAX_TABLE_SIZE];
+  double y[MAX_TABLE_SIZE];
+  double distance;
+  double rssi;
+  uint8_t* p_table;
+  uint16_t row_index;
+  uint16_t col_index;
+  uint32_t round;
+
+  if( ( devices < 1 ) || ( devices >= MAX_TABLE_SIZE ) ||
+      ( 0 == rounds ) || ( rounds > MAX_ROUNDS ) )
+  {
+    printf( "Invalid size (1-%d devices, 1-%d rounds).\r\n",
+                                      MAX_TABLE_SIZE - 1, MAX_ROUNDS );
+    return 1;
+  }
+
+  table_size = devices + 1;
+  round_count = rounds;
+
+  rssi_tables = malloc( (size_t)rounds * table_size * table_size );
+  if( NULL == rssi_tables )
+  {
+    printf( "Error allocating tables.\r\n" );
+    return 1;
+  }
+
+  srand( 1 );
+
+  for( row_index = 0; row_index < table_size; row_index++ )
+  {
+    x[row_index] = RANDOM_AREA_SIZE * rand() / RAND_MAX;
+    y[row_index] = RANDOM_AREA_SIZE * rand() / RAND_MAX;
+  }
+
+  for( round = 0; round < rounds; round++ )
+  {
+    p_table = &rssi_tables[(size_t)round * table_size * table_size];
+
+    // Devices move, the AP (index 0) stays put
+    for( row_index = 1; row_index < table_size; row_index++ )
+    {
+      x[row_index] += RANDOM_STEP * ( 2.0 * rand() / RAND_MAX - 1.0 );
+      y[row_index] += RANDOM_STEP * ( 2.0 * rand() / RAND_MAX - 1.0 );
+    }
+
+    for( row_index = 0; row_index < table_size; row_index++ )
+    {
+      for( col_index = 0; col_index < table_size; col_index++ )
+      {
+        if( row_index == col_index )
+        {
+          // Nodes don't hear themselves
+          p_table[row_index * table_size + col_index] = rssi_to_raw( -999 );
+          continue;
+        }
+
+        distance = sqrt( pow( x[row_index] - x[col_index], 2 ) +
+                         pow( y[row_index] - y[col_index], 2 ) );
+        if( distance < 1.0 )
+        {
+          distance = 1.0;
+        }
+
+        rssi = MAX_TX_POWER - RANDOM_PATH_LOSS_1M -
+               10 * RANDOM_PATH_LOSS_EXPONENT * log10( distance ) -
+               RANDOM_MAX_SHADOWING * rand() / RAND_MAX;
+
+        p_table[row_index * table_size + col_index] = rssi_to_raw( rssi );
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void print_stats( double elapsed )
+ *
+ * @brief Print what happened to the tables sent and the round trip times
+ * ****************************************************************************/
+static void print_stats( double elapsed )
+{
+  uint32_t dropped = 0;
+
+  // Tables the host never routed (one reply per table routed)
+  if( stats.sent > stats.valid )
+  {
+    dropped = stats.sent - stats.valid;
+  }
+
+  printf( "\n%d tables sent in %.2f s (%.1f rounds/s), %d sent behind "
+          "schedule, largest %d bytes\n", stats.sent, elapsed,
+          elapsed > 0 ? stats.sent / elapsed : 0.0, stats.behind,
+          stats.largest );
+  printf( "%d rounds answered, %d missed (no tables from the host during "
+          "the round)\n", stats.answered, stats.missed );
+  printf( "%d replies: %d invalid, %d for older rounds, %d tables dropped "
+          "by the host\n", stats.replies, stats.invalid, stats.extra,
+          dropped );
+  printf( "Bytes outside frames %d, frames cut short %d, oversized %d\n",
+          deframer.skipped, deframer.aborted, deframer.oversized );
+
+  if( round_trip.count > 0 )
+  {
+    printf( "Round trip p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            latency_histogram_percentile( &round_trip, 0.5 ) / 1e6,
+            latency_histogram_percentile( &round_trip, 0.99 ) / 1e6,
+            round_trip.max / 1e6 );
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint8_t rssi_to_raw( double rssi )
+ *
+ * @brief RSSI (dBm) as the cc2500 reports it (0.5 dB steps from -72 dBm,
+ *        two's complement). No link (-999) is sent as 0x80.
+ * ****************************************************************************/
+static uint8_t rssi_to_raw( double rssi )
+{
+  if( rssi <= -136.0 )
+  {
+    return 0x80;
+  }
+
+  if( rssi > -8.5 )
+  {
+    rssi = -8.5;
+  }
+
+  return (uint8_t)(int32_t)lround( ( rssi + 72.0 ) * 2 );
+}
+
+/*******************************************************************************
+ * @fn    uint64_t now_ns()
+ *
+ * @brief Monotonic time in ns
+ * ****************************************************************************/
+static uint64_t now_ns()
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*******************************************************************************
+ * @fn    void sigint_handler( int32_t sig )
+ *
+ * @brief Stop sending, the statistics are printed on the way out
+ * ****************************************************************************/
+void sigint_handler( int32_t sig )
+{
+  running = 0;
+}
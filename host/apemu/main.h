@@ -0,0 +1,69 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+
+// Largest network (N+1, AP included), as sparse tables
+#define MAX_TABLE_SIZE ( 255 )
+
+// Largest dense table the host takes ( (N+1)x(N+1) in DEFRAMER_BUFFER_SIZE )
+#define MAX_DENSE_TABLE_SIZE ( 128 )
+
+// Tables allocated at first when reading a trace (doubled as needed)
+#define TRACE_INITIAL_ROUNDS ( 64 )
+
+// Tables kept in memory
+#define MAX_ROUNDS ( 100000 )
+
+// Rounds sent with a synthetic network if not given
+#define DEFAULT_RANDOM_ROUNDS ( 1000 )
+
+// The eZ430 network does about 5 rounds per second (speed 1)
+#define ROUND_PERIOD_MS ( 200 )
+
+// Fastest replay (times real time)
+#define MAX_SPEED ( 1000 )
+
+// Time between the host opening the pty and the first table, so it isn't
+// flushed while the host starts up (ms)
+#define START_DELAY_MS ( 1000 )
+
+// Longest wait for the host's tables, before the next round when running
+// closed loop (speed 0) and after the last round (ms)
+#define REPLY_TIMEOUT_MS ( 1000 )
+
+// Synthetic tables (same model as ../../sim/linkbench): node positions in a
+// square this big (m), path loss at 1m and exponent, up to this much extra
+// loss in each direction (dB) for body shadowing, and movement per round (m)
+#define RANDOM_AREA_SIZE ( 10.0 )
+#define RANDOM_PATH_LOSS_1M ( 40.0 )
+#define RANDOM_PATH_LOSS_EXPONENT ( 3.0 )
+#define RANDOM_MAX_SHADOWING ( 20.0 )
+#define RANDOM_STEP ( 0.5 )
+
+// Highest cc2500 transmit power (dBm), RSSI tables are measured with it
+#define MAX_TX_POWER ( 1.5 )
+
+// What happened to the tables sent and the host's answers
+typedef struct
+{
+  uint32_t sent;            // RSSI tables sent (one per round)
+  uint32_t replies;         // Packets from the host
+  uint32_t valid;           // Replies with valid routes/powers
+  uint32_t invalid;         // Replies that weren't valid route/power tables
+  uint32_t answered;        // Rounds with valid tables from the host
+  uint32_t missed;          // Rounds without
+  uint32_t extra;           // Valid replies after the round was answered
+  uint32_t behind;          // Rounds sent over a period late
+  uint16_t largest;         // Largest RSSI table packet sent (bytes)
+} apemu_stats_t;
+
+void sigint_handler( int32_t sig );
+
+#endif /*_MAIN_H */
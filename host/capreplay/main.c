@@ -0,0 +1,250 @@
+/** @file main.c
+*
+* @brief Replay a raw serial capture (see ../lib/capture.h) through the
+*        deframer, at the original timing, faster, or as fast as possible
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "capture.h"
+#include "latency.h"
+#include "main.h"
+
+static void feed( stream_t* p_stream, const capture_chunk_t* p_chunk,
+                                                          uint8_t print );
+static void print_packet( const stream_t* p_stream, uint64_t time_us,
+                                const uint8_t* p_packet, uint16_t size );
+static void print_stream( const stream_t* p_stream );
+static uint64_t now_ns();
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  capture_file_t file;
+  capture_cursor_t cursor;
+  capture_chunk_t chunk;
+  stream_t streams[2];
+  latency_histogram_t lateness;
+  struct timespec wake;
+  double speed = 0;
+  uint64_t from_us = 0;
+  uint64_t first_us = 0;
+  uint64_t last_us = 0;
+  uint64_t start_ns;
+  uint64_t target_ns;
+  uint64_t time_ns;
+  double elapsed;
+  uint8_t print = 0;
+  uint8_t started = 0;
+
+  if( argc < 2 )
+  {
+    printf( "Usage: %s capture.cap [speed (0 fastest, 1 original timing)] "
+                            "[from (s)] [print (0,1)]\r\n", argv[0] );
+    return 1;
+  }
+
+  if( argc > 2 )
+  {
+    speed = atof( argv[2] );
+    if( ( speed < 0 ) || ( speed > MAX_SPEED ) )
+    {
+      printf( "Speed must be 0 or up to %g.\r\n", MAX_SPEED );
+      return 1;
+    }
+  }
+
+  if( argc > 3 )
+  {
+    from_us = atof( argv[3] ) * 1e6;
+  }
+
+  if( argc > 4 )
+  {
+    print = atoi( argv[4] );
+  }
+
+  if( capture_map( &file, argv[1] ) )
+  {
+    printf( "Error reading capture %s.\r\n", argv[1] );
+    return 1;
+  }
+
+  if( NULL == file.p_index )
+  {
+    printf( "No index (the capture wasn't closed), reading it all.\r\n" );
+  }
+
+  memset( streams, 0, sizeof(streams) );
+  streams[CAPTURE_RX].name = "RX";
+  streams[CAPTURE_TX].name = "TX";
+  deframer_initialize( &streams[CAPTURE_RX].deframer );
+  deframer_initialize( &streams[CAPTURE_TX].deframer );
+  memset( &lateness, 0, sizeof(lateness) );
+
+  capture_seek( &file, &cursor, from_us );
+
+  start_ns = now_ns();
+
+  while( capture_next( &file, &cursor, &chunk ) )
+  {
+    if( !started )
+    {
+      first_us = chunk.time_us;
+      started = 1;
+    }
+    last_us = chunk.time_us;
+
+    if( speed > 0 )
+    {
+      // When the chunk was read/written, scaled
+      target_ns = start_ns +
+                    (uint64_t)( ( chunk.time_us - first_us ) * 1000 / speed );
+
+      time_ns = now_ns();
+      if( time_ns < target_ns )
+      {
+        wake.tv_sec = target_ns / 1000000000;
+        wake.tv_nsec = target_ns % 1000000000;
+        while( EINTR == clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                                              &wake, NULL ) );
+        time_ns = now_ns();
+      }
+
+      latency_histogram_add( &lateness, time_ns - target_ns );
+    }
+
+    feed( &streams[chunk.direction], &chunk, print );
+  }
+
+  elapsed = ( now_ns() - start_ns ) / 1e9;
+
+  printf( "Replayed %g s of capture in %g s",
+                              ( last_us - first_us ) / 1e6, elapsed );
+  if( elapsed > 0 )
+  {
+    printf( ", %g MB/s",
+        ( streams[CAPTURE_RX].bytes + streams[CAPTURE_TX].bytes ) /
+                                                          elapsed / 1e6 );
+  }
+  printf( "\n" );
+
+  print_stream( &streams[CAPTURE_RX] );
+  print_stream( &streams[CAPTURE_TX] );
+
+  if( lateness.count > 0 )
+  {
+    printf( "Late: %.3f ms median, %.3f ms 99%%, %.3f ms max\n",
+            latency_histogram_percentile( &lateness, 0.5 ) / 1e6,
+            latency_histogram_percentile( &lateness, 0.99 ) / 1e6,
+            lateness.max / 1e6 );
+  }
+
+  capture_unmap( &file );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void feed( stream_t* p_stream, const capture_chunk_t* p_chunk,
+ *                                                         uint8_t print )
+ *
+ * @brief Deframe a chunk, like the host did when it was read (or like the AP
+ *        did when the host wrote it)
+ * ****************************************************************************/
+static void feed( stream_t* p_stream, const capture_chunk_t* p_chunk,
+                                                          uint8_t print )
+{
+  const uint8_t* p_data = p_chunk->p_data;
+  uint16_t left = p_chunk->size;
+  uint8_t* p_space;
+  uint8_t* p_packet;
+  uint16_t room;
+  uint16_t packet_size;
+
+  p_stream->chunks++;
+  p_stream->bytes += p_chunk->size;
+
+  // Chunks can be bigger than the deframer's buffer
+  while( left > 0 )
+  {
+    p_space = deframer_space( &p_stream->deframer, &room );
+    if( room > left )
+    {
+      room = left;
+    }
+
+    memcpy( p_space, p_data, room );
+    deframer_received( &p_stream->deframer, room );
+    p_data += room;
+    left -= room;
+
+    while( deframer_next( &p_stream->deframer, &p_packet, &packet_size ) )
+    {
+      p_stream->packet_bytes += packet_size;
+
+      if( print )
+      {
+        print_packet( p_stream, p_chunk->time_us, p_packet, packet_size );
+      }
+    }
+  }
+}
+
+/*******************************************************************************
+ * @fn    void print_packet( const stream_t* p_stream, uint64_t time_us,
+ *                               const uint8_t* p_packet, uint16_t size )
+ *
+ * @brief Print a packet in hex, with the time it was completed
+ * ****************************************************************************/
+static void print_packet( const stream_t* p_stream, uint64_t time_us,
+                                const uint8_t* p_packet, uint16_t size )
+{
+  uint16_t index;
+
+  printf( "%12.6f %s %d bytes", time_us / 1e6, p_stream->name, size );
+
+  for( index = 0; index < size; index++ )
+  {
+    if( 0 == ( index % PRINT_BYTES_PER_LINE ) )
+    {
+      printf( "\n  " );
+    }
+    printf( " %02x", p_packet[index] );
+  }
+  printf( "\n" );
+}
+
+/*******************************************************************************
+ * @fn    void print_stream( const stream_t* p_stream )
+ *
+ * @brief Print what was read or written and how it deframed
+ * ****************************************************************************/
+static void print_stream( const stream_t* p_stream )
+{
+  printf( "%s: %d chunks, %llu bytes, %d packets (%llu bytes), "
+          "%d bytes skipped, %d aborted, %d oversized\n",
+          p_stream->name, p_stream->chunks,
+          (unsigned long long)p_stream->bytes, p_stream->deframer.packets,
+          (unsigned long long)p_stream->packet_bytes,
+          p_stream->deframer.skipped, p_stream->deframer.aborted,
+          p_stream->deframer.oversized );
+}
+
+/*******************************************************************************
+ * @fn    uint64_t now_ns()
+ *
+ * @brief Nanoseconds on the monotonic clock
+ * ****************************************************************************/
+static uint64_t now_ns()
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
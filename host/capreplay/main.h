@@ -0,0 +1,29 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+#include "deframer.h"
+
+// Fastest timed replay (times real time), use 0 for no timing at all
+#define MAX_SPEED ( 1000.0 )
+
+// Packet bytes printed per line
+#define PRINT_BYTES_PER_LINE ( 32 )
+
+// One direction of the port and its own deframer
+typedef struct
+{
+  const char* name;
+  deframer_t deframer;
+  uint32_t chunks;          // Reads/writes captured
+  uint64_t bytes;           // Bytes in them
+  uint64_t packet_bytes;    // Unescaped bytes in them
+} stream_t;
+
+#endif /*_MAIN_H */
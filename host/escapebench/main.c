@@ -0,0 +1,473 @@
+/** @file main.c
+*
+* @brief Time the escape kernels (see ../lib/escape.h) against plain byte by
+*        byte loops, framing and deframing RSSI tables from a trace, close
+*        range tables full of bytes that need escaping, and random data.
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "escape.h"
+#include "deframer.h"
+#include "main.h"
+
+static uint8_t load_trace( FILE*, payload_set_t* );
+static void make_close_range( payload_set_t* );
+static void make_random( payload_set_t* );
+static void fill_set( payload_set_t*, const uint8_t*, uint32_t, uint16_t );
+static void run_set( payload_set_t*, uint32_t );
+static uint32_t frame_all( payload_set_t*, uint8_t*, uint8_t );
+static uint32_t deframe_all( const uint8_t*, uint32_t, payload_set_t*,
+                                                                  uint8_t );
+static uint32_t deframe_scalar( const uint8_t*, uint32_t, uint8_t* );
+static uint8_t rssi_to_raw( double );
+static double now_ns();
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  payload_set_t sets[3];
+  uint8_t set_count = 0;
+  uint8_t set_index;
+  uint32_t repeat = 10;
+  FILE* fp_rssi;
+
+  if( argc < 2 )
+  {
+    printf( "Usage: %s rssi.csv|- [repeat]\r\n", argv[0] );
+    return 1;
+  }
+
+  if( argc > 2 )
+  {
+    repeat = atoi( argv[2] );
+  }
+
+  if( repeat < 1 )
+  {
+    repeat = 1;
+  }
+
+  // - skips the trace, only the synthetic sets are run
+  if( strcmp( argv[1], "-" ) )
+  {
+    fp_rssi = fopen( argv[1], "r" );
+    if( NULL == fp_rssi )
+    {
+      printf( "Error opening rssi input file.\r\n" );
+      return 1;
+    }
+
+    if( load_trace( fp_rssi, &sets[set_count] ) )
+    {
+      fclose( fp_rssi );
+      return 1;
+    }
+    fclose( fp_rssi );
+    set_count++;
+  }
+
+  srand( 1 );
+  make_close_range( &sets[set_count++] );
+  make_random( &sets[set_count++] );
+
+  printf( "Kernel %s, %d repetitions, MB/s of payload\n",
+                                            escape_kernel_name(), repeat );
+  printf( "%-8s %7s %8s %10s %10s %8s %10s %10s %8s\n", "set", "packet",
+          "escaped", "escape", "scalar", "speedup", "deframe", "scalar",
+          "speedup" );
+
+  for( set_index = 0; set_index < set_count; set_index++ )
+  {
+    run_set( &sets[set_index], repeat );
+    free( sets[set_index].p_data );
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void run_set( payload_set_t* p_set, uint32_t repeat )
+ *
+ * @brief Frame and deframe a set repeat times with each implementation,
+ *        check they agree and print the throughput
+ * ****************************************************************************/
+static void run_set( payload_set_t* p_set, uint32_t repeat )
+{
+  uint32_t packet_count = p_set->size / p_set->packet_size;
+  uint32_t frame_size = packet_count *
+                                    FRAME_MAX_SIZE( p_set->packet_size );
+  uint8_t* p_frames = malloc( frame_size );
+  uint8_t* p_frames_scalar = malloc( frame_size );
+  uint32_t stream_size = 0;
+  uint32_t repeat_index;
+  uint32_t errors = 0;
+  double times[4] = { 0 };
+  double start;
+  uint8_t scalar;
+
+  if( ( NULL == p_frames ) || ( NULL == p_frames_scalar ) )
+  {
+    printf( "Error allocating frames.\r\n" );
+    exit( 1 );
+  }
+
+  for( repeat_index = 0; repeat_index < repeat; repeat_index++ )
+  {
+    // Kernel first, then scalar
+    for( scalar = 0; scalar < 2; scalar++ )
+    {
+      start = now_ns();
+      stream_size = frame_all( p_set, scalar ? p_frames_scalar : p_frames,
+                                                                  !scalar );
+      times[scalar] += now_ns() - start;
+    }
+
+    if( memcmp( p_frames, p_frames_scalar, stream_size ) )
+    {
+      errors++;
+    }
+
+    for( scalar = 0; scalar < 2; scalar++ )
+    {
+      start = now_ns();
+      if( deframe_all( p_frames, stream_size, p_set, !scalar ) !=
+                                                                packet_count )
+      {
+        errors++;
+      }
+      times[2 + scalar] += now_ns() - start;
+    }
+  }
+
+  printf( "%-8s %7d %7.1f%% %10.1f %10.1f %7.2fx %10.1f %10.1f %7.2fx\n",
+          p_set->name, p_set->packet_size,
+          100.0 * ( stream_size - 2 * packet_count - p_set->size ) /
+                                                                p_set->size,
+          p_set->size * 1e3 * repeat / times[0],
+          p_set->size * 1e3 * repeat / times[1], times[1] / times[0],
+          p_set->size * 1e3 * repeat / times[2],
+          p_set->size * 1e3 * repeat / times[3], times[3] / times[2] );
+
+  if( errors )
+  {
+    printf( "%s: %d mismatches between kernel and scalar\n", p_set->name,
+                                                                    errors );
+  }
+
+  free( p_frames );
+  free( p_frames_scalar );
+}
+
+/*******************************************************************************
+ * @fn    uint32_t frame_all( payload_set_t* p_set, uint8_t* p_frames,
+ *                                                         uint8_t kernel )
+ *
+ * @brief Frame every packet of a set back to back, with frame_escape
+ *        (kernel) or frame_escape_scalar. Returns the stream size.
+ * ****************************************************************************/
+static uint32_t frame_all( payload_set_t* p_set, uint8_t* p_frames,
+                                                            uint8_t kernel )
+{
+  uint32_t offset;
+  uint32_t stream_size = 0;
+
+  for( offset = 0; ( offset + p_set->packet_size ) <= p_set->size;
+                                              offset += p_set->packet_size )
+  {
+    if( kernel )
+    {
+      stream_size += frame_escape( &p_frames[stream_size],
+                              &p_set->p_data[offset], p_set->packet_size );
+    }
+    else
+    {
+      stream_size += frame_escape_scalar( &p_frames[stream_size],
+                              &p_set->p_data[offset], p_set->packet_size );
+    }
+  }
+
+  return stream_size;
+}
+
+/*******************************************************************************
+ * @fn    uint32_t deframe_all( const uint8_t* p_stream, uint32_t size,
+ *                                 payload_set_t* p_set, uint8_t kernel )
+ *
+ * @brief Deframe a stream READ_SIZE bytes at a time, with the deframer
+ *        (kernel) or a byte by byte loop. Returns the packets that matched
+ *        the set.
+ * ****************************************************************************/
+static uint32_t deframe_all( const uint8_t* p_stream, uint32_t size,
+                                        payload_set_t* p_set, uint8_t kernel )
+{
+  static deframer_t deframer;
+  uint8_t packet[DEFRAMER_BUFFER_SIZE];
+  uint32_t offset = 0;
+  uint32_t matched = 0;
+  uint32_t packet_offset = 0;
+  uint8_t* p_space;
+  uint8_t* p_packet;
+  uint16_t room;
+  uint16_t packet_size;
+  uint16_t chunk;
+
+  deframer_initialize( &deframer );
+
+  while( offset < size )
+  {
+    if( kernel )
+    {
+      p_space = deframer_space( &deframer, &room );
+      chunk = ( room < READ_SIZE ) ? room : READ_SIZE;
+      if( chunk > ( size - offset ) )
+      {
+        chunk = size - offset;
+      }
+
+      memcpy( p_space, &p_stream[offset], chunk );
+      deframer_received( &deframer, chunk );
+      offset += chunk;
+
+      while( deframer_next( &deframer, &p_packet, &packet_size ) )
+      {
+        if( ( packet_size == p_set->packet_size ) &&
+            ( 0 == memcmp( p_packet, &p_set->p_data[packet_offset],
+                                                            packet_size ) ) )
+        {
+          matched++;
+        }
+        packet_offset += p_set->packet_size;
+      }
+    }
+    else
+    {
+      // One frame at a time, like the old read loops
+      chunk = deframe_scalar( &p_stream[offset], size - offset, packet );
+      offset += chunk;
+
+      if( 0 == memcmp( packet, &p_set->p_data[packet_offset],
+                                                      p_set->packet_size ) )
+      {
+        matched++;
+      }
+      packet_offset += p_set->packet_size;
+    }
+  }
+
+  return matched;
+}
+
+/*******************************************************************************
+ * @fn    uint32_t deframe_scalar( const uint8_t* p_stream, uint32_t size,
+ *                                                         uint8_t* p_packet )
+ *
+ * @brief Unescape the first frame of p_stream byte by byte into p_packet.
+ *        Returns the stream bytes used (up to its closing sync byte).
+ * ****************************************************************************/
+static uint32_t deframe_scalar( const uint8_t* p_stream, uint32_t size,
+                                                          uint8_t* p_packet )
+{
+  uint32_t index = 1;
+  uint16_t packet_size = 0;
+
+  while( ( index < size ) && ( SYNC_BYTE != p_stream[index] ) &&
+                                      ( packet_size < DEFRAMER_BUFFER_SIZE ) )
+  {
+    if( ESCAPE_BYTE == p_stream[index] )
+    {
+      index++;
+      p_packet[packet_size++] = p_stream[index++] ^ ESCAPE_XOR;
+    }
+    else
+    {
+      p_packet[packet_size++] = p_stream[index++];
+    }
+  }
+
+  return index + 1;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t load_trace( FILE* fp_rssi, payload_set_t* p_set )
+ *
+ * @brief Read the RSSI tables of a trace (tables separated by blank lines)
+ *        and turn them into the bytes the AP sends. Returns 1 on error.
+ * ****************************************************************************/
+static uint8_t load_trace( FILE* fp_rssi, payload_set_t* p_set )
+{
+  char line[4096];
+  char* p_value;
+  char* p_end;
+  uint8_t* p_tables = NULL;
+  uint8_t* p_resized;
+  uint32_t size = 0;
+  uint32_t capacity = 0;
+  uint16_t table_size = 0;
+  uint16_t column;
+  double value;
+
+  while( NULL != fgets( line, sizeof(line), fp_rssi ) )
+  {
+    if( ( capacity - size ) < MAX_TABLE_SIZE )
+    {
+      capacity = capacity ? capacity * 2 : 65536;
+      p_resized = realloc( p_tables, capacity );
+      if( NULL == p_resized )
+      {
+        free( p_tables );
+        printf( "Error allocating tables.\r\n" );
+        return 1;
+      }
+      p_tables = p_resized;
+    }
+
+    column = 0;
+    p_value = line;
+    while( column < MAX_TABLE_SIZE )
+    {
+      value = strtod( p_value, &p_end );
+      if( p_end == p_value )
+      {
+        break;
+      }
+
+      p_tables[size + column++] = rssi_to_raw( value );
+      p_value = ( ',' == *p_end ) ? p_end + 1 : p_end;
+    }
+
+    if( column > 0 )
+    {
+      table_size = column;
+      size += column;
+    }
+  }
+
+  if( 0 == table_size )
+  {
+    free( p_tables );
+    printf( "No tables in trace.\r\n" );
+    return 1;
+  }
+
+  fill_set( p_set, p_tables, size - ( size % ( table_size * table_size ) ),
+                                                  table_size * table_size );
+  p_set->name = "trace";
+  free( p_tables );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void make_close_range( payload_set_t* p_set )
+ *
+ * @brief Tables of devices a few cm apart, reported around -9 dBm, so a lot
+ *        of them are SYNC_BYTE or ESCAPE_BYTE
+ * ****************************************************************************/
+static void make_close_range( payload_set_t* p_set )
+{
+  uint16_t table_size = SYNTHETIC_DEVICES + 1;
+  uint8_t table[( SYNTHETIC_DEVICES + 1 ) * ( SYNTHETIC_DEVICES + 1 )];
+  uint16_t index;
+
+  for( index = 0; index < sizeof(table); index++ )
+  {
+    if( ( index / table_size ) == ( index % table_size ) )
+    {
+      // Nodes don't hear themselves
+      table[index] = rssi_to_raw( -999 );
+    }
+    else
+    {
+      table[index] = rssi_to_raw( CLOSE_RSSI_MIN +
+          ( CLOSE_RSSI_MAX - CLOSE_RSSI_MIN ) * ( rand() / (double)RAND_MAX ) );
+    }
+  }
+
+  fill_set( p_set, table, sizeof(table), sizeof(table) );
+  p_set->name = "close";
+}
+
+/*******************************************************************************
+ * @fn    void make_random( payload_set_t* p_set )
+ *
+ * @brief Random bytes in packets the size of a table
+ * ****************************************************************************/
+static void make_random( payload_set_t* p_set )
+{
+  uint32_t index;
+
+  fill_set( p_set, NULL, 0, ( SYNTHETIC_DEVICES + 1 ) *
+                                                  ( SYNTHETIC_DEVICES + 1 ) );
+  for( index = 0; index < p_set->size; index++ )
+  {
+    p_set->p_data[index] = rand();
+  }
+  p_set->name = "random";
+}
+
+/*******************************************************************************
+ * @fn    void fill_set( payload_set_t* p_set, const uint8_t* p_packets,
+ *                             uint32_t size, uint16_t packet_size )
+ *
+ * @brief Allocate SET_BYTES (rounded down to whole packets) and repeat
+ *        p_packets over them (if not NULL)
+ * ****************************************************************************/
+static void fill_set( payload_set_t* p_set, const uint8_t* p_packets,
+                                        uint32_t size, uint16_t packet_size )
+{
+  uint32_t offset;
+
+  p_set->packet_size = packet_size;
+  p_set->size = SET_BYTES - ( SET_BYTES % packet_size );
+  p_set->p_data = malloc( p_set->size );
+  if( NULL == p_set->p_data )
+  {
+    printf( "Error allocating set.\r\n" );
+    exit( 1 );
+  }
+
+  if( NULL == p_packets )
+  {
+    return;
+  }
+
+  for( offset = 0; offset < p_set->size; offset += packet_size )
+  {
+    memcpy( &p_set->p_data[offset], &p_packets[offset % size], packet_size );
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint8_t rssi_to_raw( double rssi )
+ *
+ * @brief RSSI (dBm) as the cc2500 reports it (0.5 dB steps from -72 dBm,
+ *        two's complement). No link (-999) is sent as 0x80.
+ * ****************************************************************************/
+static uint8_t rssi_to_raw( double rssi )
+{
+  if( rssi <= -999 )
+  {
+    return 0x80;
+  }
+
+  return (uint8_t)(int32_t)lround( ( rssi + 72.0 ) * 2 );
+}
+
+/*******************************************************************************
+ * @fn    double now_ns()
+ *
+ * @brief Monotonic time in ns
+ * ****************************************************************************/
+static double now_ns()
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
@@ -0,0 +1,36 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+
+// Largest table read from a trace ( (N+1)x(N+1) )
+#define MAX_TABLE_SIZE ( 22 )
+
+// Payload bytes in each set (tables are repeated until there are this many)
+#define SET_BYTES ( 4 * 1024 * 1024 )
+
+// Bytes read from the port at a time when deframing (same as routingd)
+#define READ_SIZE ( 256 )
+
+// Synthetic tables: devices, and the RSSI range (dBm) of the close range set,
+// around -9 dBm, which the cc2500 reports as SYNC_BYTE
+#define SYNTHETIC_DEVICES ( 21 )
+#define CLOSE_RSSI_MIN ( -12.0 )
+#define CLOSE_RSSI_MAX ( -6.0 )
+
+// Payloads of one set, back to back
+typedef struct
+{
+  const char* name;
+  uint8_t* p_data;
+  uint32_t size;
+  uint16_t packet_size;
+} payload_set_t;
+
+#endif /*_MAIN_H */
@@ -0,0 +1,468 @@
+/** @file capture.c
+*
+* @brief Raw serial capture (see capture.h for the file layout)
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+
+// stdio buffer, so the read and write threads rarely wait on the disk
+#define CAPTURE_BUFFER_SIZE ( 64 * 1024 )
+
+// Index entries allocated at first (doubled when full)
+#define CAPTURE_INDEX_START ( 256 )
+
+static uint64_t monotonic_us( void );
+static void write_record( capture_t*, uint32_t, uint8_t, const uint8_t*,
+                                                                  uint16_t );
+static uint8_t read_footer( capture_file_t* );
+
+/*******************************************************************************
+ * @fn    uint8_t capture_open( capture_t* p_capture, const char* filename )
+ *
+ * @brief Start capturing to filename (overwritten). Returns 1 on error.
+ * ****************************************************************************/
+uint8_t capture_open( capture_t* p_capture, const char* filename )
+{
+  capture_header_t header;
+  struct timespec now;
+
+  memset( p_capture, 0, sizeof(capture_t) );
+  pthread_mutex_init( &p_capture->mutex, NULL );
+
+  p_capture->fp = fopen( filename, "wb" );
+  if( NULL == p_capture->fp )
+  {
+    printf( "Unable to open capture file %s\n", filename );
+    return 1;
+  }
+  setvbuf( p_capture->fp, NULL, _IOFBF, CAPTURE_BUFFER_SIZE );
+
+  p_capture->index_capacity = CAPTURE_INDEX_START;
+  p_capture->p_index = malloc( p_capture->index_capacity *
+                                                    sizeof(capture_index_t) );
+  if( NULL == p_capture->p_index )
+  {
+    fclose( p_capture->fp );
+    p_capture->fp = NULL;
+    return 1;
+  }
+
+  clock_gettime( CLOCK_REALTIME, &now );
+
+  memset( &header, 0, sizeof(header) );
+  header.magic = CAPTURE_MAGIC;
+  header.version = CAPTURE_VERSION;
+  header.start_time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+  if( 1 != fwrite( &header, sizeof(header), 1, p_capture->fp ) )
+  {
+    printf( "Unable to write capture file %s\n", filename );
+    fclose( p_capture->fp );
+    p_capture->fp = NULL;
+    free( p_capture->p_index );
+    return 1;
+  }
+
+  p_capture->offset = sizeof(header);
+  p_capture->start_us = monotonic_us();
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void capture_write( capture_t* p_capture, uint8_t direction,
+ *                                      const uint8_t* p_data, size_t size )
+ *
+ * @brief Log a chunk read from (CAPTURE_RX) or written to (CAPTURE_TX) the
+ *        port, timestamped now. Does nothing if the capture isn't open or
+ *        writing it failed.
+ * ****************************************************************************/
+void capture_write( capture_t* p_capture, uint8_t direction,
+                                        const uint8_t* p_data, size_t size )
+{
+  uint64_t delta_us;
+  uint16_t chunk_size;
+  int cancel_state;
+
+  if( NULL == p_capture )
+  {
+    return;
+  }
+
+  // A read thread cancelled in fwrite would keep the mutex
+  pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &cancel_state );
+  pthread_mutex_lock( &p_capture->mutex );
+
+  if( NULL == p_capture->fp )
+  {
+    // Closed meanwhile
+    pthread_mutex_unlock( &p_capture->mutex );
+    pthread_setcancelstate( cancel_state, NULL );
+    return;
+  }
+
+  delta_us = monotonic_us() - p_capture->start_us - p_capture->time_us;
+
+  // Only after more than an hour without data
+  while( !p_capture->failed && ( delta_us > UINT32_MAX ) )
+  {
+    write_record( p_capture, UINT32_MAX, CAPTURE_IDLE, NULL, 0 );
+    delta_us -= UINT32_MAX;
+  }
+
+  do
+  {
+    chunk_size = ( size > CAPTURE_MAX_CHUNK ) ? CAPTURE_MAX_CHUNK : size;
+    write_record( p_capture, delta_us, direction, p_data, chunk_size );
+
+    // The rest of a split chunk is logged at the same time
+    delta_us = 0;
+    p_data += chunk_size;
+    size -= chunk_size;
+  } while( !p_capture->failed && ( size > 0 ) );
+
+  pthread_mutex_unlock( &p_capture->mutex );
+  pthread_setcancelstate( cancel_state, NULL );
+}
+
+/*******************************************************************************
+ * @fn    void capture_close( capture_t* p_capture )
+ *
+ * @brief Write the index and close the capture. Threads still running can
+ *        keep calling capture_write, it does nothing from now on.
+ * ****************************************************************************/
+void capture_close( capture_t* p_capture )
+{
+  capture_footer_t footer;
+
+  pthread_mutex_lock( &p_capture->mutex );
+
+  if( NULL == p_capture->fp )
+  {
+    pthread_mutex_unlock( &p_capture->mutex );
+    return;
+  }
+
+  if( !p_capture->failed )
+  {
+    memset( &footer, 0, sizeof(footer) );
+    footer.index_offset = p_capture->offset;
+    footer.index_count = p_capture->index_count;
+    footer.record_count = p_capture->record_count;
+    footer.duration_us = p_capture->time_us;
+    footer.magic = CAPTURE_INDEX_MAGIC;
+
+    if( ( p_capture->index_count != fwrite( p_capture->p_index,
+                  sizeof(capture_index_t), p_capture->index_count,
+                  p_capture->fp ) ) ||
+        ( 1 != fwrite( &footer, sizeof(footer), 1, p_capture->fp ) ) )
+    {
+      printf( "Unable to write capture index\n" );
+    }
+  }
+
+  printf( "Captured %d records, %g s\n", p_capture->record_count,
+                                          p_capture->time_us / 1000000.0 );
+
+  // Without the index the records can still be read (see capture_map)
+  fclose( p_capture->fp );
+  p_capture->fp = NULL;
+
+  free( p_capture->p_index );
+  p_capture->p_index = NULL;
+
+  // The mutex is kept, other threads may still be waiting on it
+  pthread_mutex_unlock( &p_capture->mutex );
+}
+
+/*******************************************************************************
+ * @fn    void write_record( capture_t* p_capture, uint32_t delta_us,
+ *                uint8_t direction, const uint8_t* p_data, uint16_t size )
+ *
+ * @brief Append one record (and an index entry every
+ *        CAPTURE_INDEX_INTERVAL records). Called with the mutex held.
+ * ****************************************************************************/
+static void write_record( capture_t* p_capture, uint32_t delta_us,
+                  uint8_t direction, const uint8_t* p_data, uint16_t size )
+{
+  static const uint8_t padding[8] = {0};
+  capture_record_t record;
+  capture_index_t* p_index;
+  uint32_t padding_size;
+
+  if( p_capture->failed )
+  {
+    return;
+  }
+
+  p_capture->time_us += delta_us;
+
+  if( 0 == ( p_capture->record_count % CAPTURE_INDEX_INTERVAL ) )
+  {
+    if( p_capture->index_count == p_capture->index_capacity )
+    {
+      p_index = realloc( p_capture->p_index, 2 * p_capture->index_capacity *
+                                                    sizeof(capture_index_t) );
+      if( NULL == p_index )
+      {
+        printf( "Capture stopped, out of memory\n" );
+        p_capture->failed = 1;
+        return;
+      }
+      p_capture->p_index = p_index;
+      p_capture->index_capacity *= 2;
+    }
+
+    p_capture->p_index[p_capture->index_count].time_us = p_capture->time_us;
+    p_capture->p_index[p_capture->index_count].offset = p_capture->offset;
+    p_capture->index_count++;
+  }
+
+  record.delta_us = delta_us;
+  record.size = size;
+  record.direction = direction;
+  record.reserved = 0;
+
+  padding_size = CAPTURE_RECORD_SIZE( size ) - sizeof(record) - size;
+
+  if( ( 1 != fwrite( &record, sizeof(record), 1, p_capture->fp ) ) ||
+      ( size != fwrite( p_data, 1, size, p_capture->fp ) ) ||
+      ( padding_size != fwrite( padding, 1, padding_size, p_capture->fp ) ) )
+  {
+    printf( "Capture stopped, unable to write\n" );
+    p_capture->failed = 1;
+    return;
+  }
+
+  p_capture->offset += CAPTURE_RECORD_SIZE( size );
+  p_capture->record_count++;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t capture_map( capture_file_t* p_file, const char* filename )
+ *
+ * @brief Map a capture for reading. Returns 1 if it can't be read or isn't a
+ *        capture.
+ * ****************************************************************************/
+uint8_t capture_map( capture_file_t* p_file, const char* filename )
+{
+  struct stat info;
+  int fd;
+
+  memset( p_file, 0, sizeof(capture_file_t) );
+
+  fd = open( filename, O_RDONLY );
+  if( fd < 0 )
+  {
+    return 1;
+  }
+
+  if( fstat( fd, &info ) || ( info.st_size < (off_t)sizeof(capture_header_t) ) )
+  {
+    close( fd );
+    return 1;
+  }
+
+  p_file->size = info.st_size;
+  p_file->p_map = mmap( NULL, p_file->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+  // The mapping stays valid after closing
+  close( fd );
+
+  if( MAP_FAILED == p_file->p_map )
+  {
+    return 1;
+  }
+
+  p_file->p_header = (capture_header_t*)p_file->p_map;
+  if( ( CAPTURE_MAGIC != p_file->p_header->magic ) ||
+      ( CAPTURE_VERSION != p_file->p_header->version ) )
+  {
+    munmap( p_file->p_map, p_file->size );
+    return 1;
+  }
+
+  if( read_footer( p_file ) )
+  {
+    // Not closed (i.e. the host was killed), records go up to the end
+    p_file->records_end = p_file->size;
+  }
+
+  // Read front to back, let the kernel read ahead
+  madvise( p_file->p_map, p_file->size, MADV_SEQUENTIAL );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t read_footer( capture_file_t* p_file )
+ *
+ * @brief Find the index of a mapped capture. Returns 1 if there isn't a
+ *        valid one.
+ * ****************************************************************************/
+static uint8_t read_footer( capture_file_t* p_file )
+{
+  capture_footer_t* p_footer;
+
+  if( p_file->size < sizeof(capture_header_t) + sizeof(capture_footer_t) )
+  {
+    return 1;
+  }
+
+  p_footer = (capture_footer_t*)( p_file->p_map + p_file->size -
+                                                  sizeof(capture_footer_t) );
+
+  if( ( CAPTURE_INDEX_MAGIC != p_footer->magic ) ||
+      ( p_footer->index_offset < sizeof(capture_header_t) ) ||
+      ( p_footer->index_offset % 8 ) ||
+      ( p_footer->index_offset + (uint64_t)p_footer->index_count *
+        sizeof(capture_index_t) + sizeof(capture_footer_t) != p_file->size ) )
+  {
+    return 1;
+  }
+
+  p_file->p_index = (capture_index_t*)( p_file->p_map +
+                                                    p_footer->index_offset );
+  p_file->index_count = p_footer->index_count;
+  p_file->record_count = p_footer->record_count;
+  p_file->records_end = p_footer->index_offset;
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void capture_unmap( capture_file_t* p_file )
+ *
+ * @brief Unmap a capture from capture_map
+ * ****************************************************************************/
+void capture_unmap( capture_file_t* p_file )
+{
+  munmap( p_file->p_map, p_file->size );
+  p_file->p_map = NULL;
+}
+
+/*******************************************************************************
+ * @fn    void capture_seek( const capture_file_t* p_file,
+ *                           capture_cursor_t* p_cursor, uint64_t time_us )
+ *
+ * @brief Point p_cursor so capture_next returns the first chunk at or after
+ *        time_us (us since the capture started). Jumps with the index,
+ *        without one it reads from the start.
+ * ****************************************************************************/
+void capture_seek( const capture_file_t* p_file, capture_cursor_t* p_cursor,
+                                                              uint64_t time_us )
+{
+  capture_cursor_t next;
+  capture_chunk_t chunk;
+  capture_record_t* p_record;
+  uint32_t low = 0;
+  uint32_t high = p_file->index_count;
+  uint32_t middle;
+
+  p_cursor->offset = sizeof(capture_header_t);
+  p_cursor->time_us = 0;
+
+  // Last entry at or before time_us
+  while( high - low > 1 )
+  {
+    middle = low + ( high - low ) / 2;
+    if( p_file->p_index[middle].time_us <= time_us )
+    {
+      low = middle;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  if( ( p_file->index_count > 0 ) &&
+      ( p_file->p_index[low].time_us <= time_us ) &&
+      ( p_file->p_index[low].offset + sizeof(capture_record_t) <=
+                                                      p_file->records_end ) )
+  {
+    // Just before that record
+    p_record = (capture_record_t*)( p_file->p_map +
+                                                p_file->p_index[low].offset );
+    p_cursor->offset = p_file->p_index[low].offset;
+    p_cursor->time_us = p_file->p_index[low].time_us - p_record->delta_us;
+  }
+
+  // At most CAPTURE_INDEX_INTERVAL records to skip
+  next = *p_cursor;
+  while( capture_next( p_file, &next, &chunk ) && ( chunk.time_us < time_us ) )
+  {
+    *p_cursor = next;
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint8_t capture_next( const capture_file_t* p_file,
+ *                  capture_cursor_t* p_cursor, capture_chunk_t* p_chunk )
+ *
+ * @brief Read the next chunk (idle records are skipped). Returns 0 at the
+ *        end of the capture, or at a record that wasn't written completely.
+ * ****************************************************************************/
+uint8_t capture_next( const capture_file_t* p_file,
+                  capture_cursor_t* p_cursor, capture_chunk_t* p_chunk )
+{
+  capture_record_t* p_record;
+
+  for(;;)
+  {
+    if( p_cursor->offset + sizeof(capture_record_t) > p_file->records_end )
+    {
+      return 0;
+    }
+
+    p_record = (capture_record_t*)( p_file->p_map + p_cursor->offset );
+
+    // The padding of the last record may be missing
+    if( ( p_cursor->offset + sizeof(capture_record_t) + p_record->size >
+                                                      p_file->records_end ) ||
+        ( p_record->direction > CAPTURE_IDLE ) )
+    {
+      return 0;
+    }
+
+    p_cursor->offset += CAPTURE_RECORD_SIZE( p_record->size );
+    p_cursor->time_us += p_record->delta_us;
+
+    if( CAPTURE_IDLE != p_record->direction )
+    {
+      break;
+    }
+  }
+
+  p_chunk->time_us = p_cursor->time_us;
+  p_chunk->direction = p_record->direction;
+  p_chunk->size = p_record->size;
+  p_chunk->p_data = (uint8_t*)p_record + sizeof(capture_record_t);
+
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn    uint64_t monotonic_us()
+ *
+ * @brief Microseconds on the monotonic clock
+ * ****************************************************************************/
+static uint64_t monotonic_us( void )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -0,0 +1,131 @@
+/** @file capture.h
+*
+* @brief Raw serial capture. Every chunk read from or written to a port is
+*        logged with a monotonic timestamp, so a session (timing, malformed
+*        frames and the host's answers) can be replayed byte for byte (see
+*        ../capreplay). Linux only.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define CAPTURE_MAGIC       ( 0x50414353 ) // "SCAP"
+#define CAPTURE_INDEX_MAGIC ( 0x58444953 ) // "SIDX"
+#define CAPTURE_VERSION     ( 1 )
+
+// Records between index entries
+#define CAPTURE_INDEX_INTERVAL ( 1024 )
+
+// Largest chunk in one record (larger ones are split)
+#define CAPTURE_MAX_CHUNK ( 0xffff )
+
+// Direction of a chunk
+#define CAPTURE_RX    ( 0 )   // Read from the port (AP to host)
+#define CAPTURE_TX    ( 1 )   // Written to the port (host to AP)
+#define CAPTURE_IDLE  ( 2 )   // No data, only moves time forward
+
+//
+// File layout: capture_header_t, then one record per chunk, then the index
+// and capture_footer_t. A record is capture_record_t followed by the chunk,
+// padded to 8 bytes. Time is kept as microseconds since the previous
+// record (idle records carry gaps that don't fit in 32 bits).
+// The index has the absolute time and file offset of every
+// CAPTURE_INDEX_INTERVAL-th record, to start a replay anywhere.
+// A capture that wasn't closed has no index or footer, readers then use the
+// records up to the last complete one.
+//
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t start_time_ns;       // CLOCK_REALTIME when the capture started
+} capture_header_t;
+
+typedef struct
+{
+  uint32_t delta_us;            // Since the previous record
+  uint16_t size;
+  uint8_t direction;
+  uint8_t reserved;
+} capture_record_t;
+
+typedef struct
+{
+  uint64_t time_us;             // Since the capture started
+  uint64_t offset;              // Of the record in the file
+} capture_index_t;
+
+typedef struct
+{
+  uint64_t index_offset;
+  uint32_t index_count;
+  uint32_t record_count;
+  uint64_t duration_us;
+  uint32_t magic;
+  uint32_t reserved;
+} capture_footer_t;
+
+#define CAPTURE_RECORD_SIZE( size ) \
+  ( ( sizeof(capture_record_t) + (size) + 7 ) & ~7u )
+
+// Capture being written (one per port, shared by its read and write threads)
+typedef struct
+{
+  FILE* fp;
+  pthread_mutex_t mutex;
+  uint64_t start_us;            // CLOCK_MONOTONIC
+  uint64_t time_us;             // Of the last record, since start_us
+  uint64_t offset;
+  uint32_t record_count;
+  capture_index_t* p_index;
+  uint32_t index_count;
+  uint32_t index_capacity;
+  uint8_t failed;               // Writing stopped (disk full, no memory)
+} capture_t;
+
+// Capture being read (mapped)
+typedef struct
+{
+  uint8_t* p_map;
+  size_t size;
+  capture_header_t* p_header;
+  capture_index_t* p_index;     // NULL if the capture wasn't closed
+  uint32_t index_count;
+  uint32_t record_count;        // 0 if unknown
+  uint64_t records_end;         // Offset after the last record
+} capture_file_t;
+
+// Position in a mapped capture
+typedef struct
+{
+  uint64_t offset;
+  uint64_t time_us;             // Of the last record read
+} capture_cursor_t;
+
+// One chunk of a mapped capture (p_data points into the mapping)
+typedef struct
+{
+  uint64_t time_us;
+  uint8_t direction;
+  uint16_t size;
+  const uint8_t* p_data;
+} capture_chunk_t;
+
+uint8_t capture_open( capture_t*, const char* );
+void capture_write( capture_t*, uint8_t, const uint8_t*, size_t );
+void capture_close( capture_t* );
+
+uint8_t capture_map( capture_file_t*, const char* );
+void capture_unmap( capture_file_t* );
+void capture_seek( const capture_file_t*, capture_cursor_t*, uint64_t );
+uint8_t capture_next( const capture_file_t*, capture_cursor_t*,
+                                                        capture_chunk_t* );
+
+#endif /* _CAPTURE_H */
@@ -0,0 +1,280 @@
+/** @file csvmap.c
+*
+* @brief Fast reading of the CSV traces (see csvmap.h)
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "csvmap.h"
+
+// Powers of ten that are exact as doubles
+static const double exact_powers[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+#define EXACT_POWER_MAX ( sizeof(exact_powers) / sizeof(double) - 1 )
+
+static const char* parse_value( const char*, const char*, energy_t* );
+static const char* parse_slow( const char*, const char*, energy_t* );
+
+/*******************************************************************************
+ * @fn    uint8_t csv_open( csv_file_t* p_file, const char* filename )
+ *
+ * @brief Map a CSV file for reading. Returns 1 on error.
+ * ****************************************************************************/
+uint8_t csv_open( csv_file_t* p_file, const char* filename )
+{
+  struct stat info;
+  int fd;
+
+  memset( p_file, 0, sizeof(csv_file_t) );
+
+  fd = open( filename, O_RDONLY );
+  if( fd < 0 )
+  {
+    return 1;
+  }
+
+  if( fstat( fd, &info ) )
+  {
+    close( fd );
+    return 1;
+  }
+
+  p_file->size = info.st_size;
+
+  if( 0 == p_file->size )
+  {
+    // Nothing to map, reads as a file without lines
+    close( fd );
+    return 0;
+  }
+
+  p_file->p_map = mmap( NULL, p_file->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+  // The mapping stays valid after closing
+  close( fd );
+
+  if( MAP_FAILED == p_file->p_map )
+  {
+    p_file->p_map = NULL;
+    return 1;
+  }
+
+  // Read front to back, let the kernel read ahead
+  madvise( (void*)p_file->p_map, p_file->size, MADV_SEQUENTIAL );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void csv_close( csv_file_t* p_file )
+ *
+ * @brief Unmap a file from csv_open
+ * ****************************************************************************/
+void csv_close( csv_file_t* p_file )
+{
+  if( NULL != p_file->p_map )
+  {
+    munmap( (void*)p_file->p_map, p_file->size );
+    p_file->p_map = NULL;
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint8_t csv_next_line( csv_file_t* p_file, const char** pp_line,
+ *                                                      const char** pp_end )
+ *
+ * @brief Find the next line, *pp_line to *pp_end (the newline isn't
+ *        included, the line points into the mapping). Returns 0 at the end
+ *        of the file.
+ * ****************************************************************************/
+uint8_t csv_next_line( csv_file_t* p_file, const char** pp_line,
+                                                        const char** pp_end )
+{
+  const char* p_line;
+  const char* p_newline;
+  size_t left;
+
+  if( p_file->offset >= p_file->size )
+  {
+    return 0;
+  }
+
+  p_line = p_file->p_map + p_file->offset;
+  left = p_file->size - p_file->offset;
+
+  // glibc's memchr looks at 16/32 bytes at a time
+  p_newline = memchr( p_line, '\n', left );
+  if( NULL == p_newline )
+  {
+    // Last line without a newline
+    p_newline = p_line + left;
+  }
+
+  *pp_line = p_line;
+  *pp_end = p_newline;
+
+  p_file->offset += ( p_newline - p_line ) + 1;
+  p_file->line++;
+
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t csv_parse_line( const char* p_line, const char* p_end,
+ *                  energy_t* p_values, uint16_t skip, uint16_t max_items )
+ *
+ * @brief Parse the comma separated values of a line into p_values, after
+ *        skipping the first skip of them. Empty fields are skipped and
+ *        values are read like strtod does. Returns the number of values
+ *        read (max_items at most).
+ * ****************************************************************************/
+uint16_t csv_parse_line( const char* p_line, const char* p_end,
+                    energy_t* p_values, uint16_t skip, uint16_t max_items )
+{
+  const char* p_field = p_line;
+  uint16_t item_index = 0;
+
+  while( ( p_field < p_end ) && ( item_index < max_items ) )
+  {
+    if( ',' == *p_field )
+    {
+      // Empty field
+      p_field++;
+      continue;
+    }
+
+    if( skip > 0 )
+    {
+      skip--;
+      p_field = memchr( p_field, ',', p_end - p_field );
+    }
+    else
+    {
+      // The parser stops at the comma, no need to look for it first
+      p_field = parse_value( p_field, p_end, &p_values[item_index++] );
+    }
+
+    if( NULL == p_field )
+    {
+      break;
+    }
+  }
+
+  return item_index;
+}
+
+/*******************************************************************************
+ * @fn    const char* parse_value( const char* p_field, const char* p_end,
+ *                                                    energy_t* p_value )
+ *
+ * @brief Parse the field starting at p_field. Plain decimal numbers of up to
+ *        15 digits (all in the traces) are an integer and a power of ten
+ *        that are both exact as doubles, so one division rounds them the
+ *        same as strtod. Anything else goes to strtod. Returns the comma
+ *        after the field, or NULL if it was the last one.
+ * ****************************************************************************/
+static const char* parse_value( const char* p_field, const char* p_end,
+                                                          energy_t* p_value )
+{
+  const char* p_char = p_field;
+  uint64_t mantissa = 0;
+  int32_t exponent = 0;
+  uint8_t negative = 0;
+  uint8_t fraction = 0;
+  uint8_t digits = 0;
+  uint8_t any_digits = 0;
+  double value;
+
+  if( ( p_char < p_end ) && ( ( '-' == *p_char ) || ( '+' == *p_char ) ) )
+  {
+    negative = ( '-' == *p_char );
+    p_char++;
+  }
+
+  for( ; p_char < p_end; p_char++ )
+  {
+    if( ( '.' == *p_char ) && !fraction )
+    {
+      fraction = 1;
+      continue;
+    }
+
+    if( ( *p_char < '0' ) || ( *p_char > '9' ) )
+    {
+      break;
+    }
+
+    mantissa = mantissa * 10 + ( *p_char - '0' );
+    any_digits = 1;
+
+    // Leading zeros don't count
+    if( ( mantissa > 0 ) && ( ++digits > 15 ) )
+    {
+      return parse_slow( p_field, p_end, p_value );
+    }
+
+    exponent -= fraction;
+  }
+
+  if( !any_digits )
+  {
+    // i.e. "nan", a space, or a lone sign
+    return parse_slow( p_field, p_end, p_value );
+  }
+
+  if( ( p_char < p_end ) && ( ',' != *p_char ) && ( ' ' != *p_char ) &&
+      ( '\r' != *p_char ) && ( '\t' != *p_char ) )
+  {
+    // Something strtod may read differently (i.e. an exponent, or hex)
+    return parse_slow( p_field, p_end, p_value );
+  }
+
+  if( (uint32_t)-exponent > EXACT_POWER_MAX )
+  {
+    return parse_slow( p_field, p_end, p_value );
+  }
+
+  value = (double)mantissa / exact_powers[-exponent];
+  *p_value = negative ? -value : value;
+
+  return memchr( p_char, ',', p_end - p_char );
+}
+
+/*******************************************************************************
+ * @fn    const char* parse_slow( const char* p_field, const char* p_end,
+ *                                                    energy_t* p_value )
+ *
+ * @brief Parse a field with strtod (the mapping isn't nul terminated, so the
+ *        field is copied first). Returns like parse_value.
+ * ****************************************************************************/
+static const char* parse_slow( const char* p_field, const char* p_end,
+                                                          energy_t* p_value )
+{
+  char field[CSV_FIELD_MAX_SIZE];
+  const char* p_comma;
+  size_t size;
+
+  p_comma = memchr( p_field, ',', p_end - p_field );
+  size = ( ( NULL == p_comma ) ? p_end : p_comma ) - p_field;
+  if( size >= sizeof(field) )
+  {
+    size = sizeof(field) - 1;
+  }
+
+  memcpy( field, p_field, size );
+  field[size] = '\0';
+
+  *p_value = (energy_t)strtod( field, NULL );
+
+  return p_comma;
+}
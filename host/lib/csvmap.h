@@ -0,0 +1,34 @@
+/** @file csvmap.h
+*
+* @brief Fast reading of the CSV traces (rssi.csv, powers.csv, ...). The file
+*        is mapped instead of read, lines are found with memchr and values
+*        are parsed straight from the mapping into the caller's arrays.
+*        Linux only.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _CSVMAP_H
+#define _CSVMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dijkstra.h"
+
+// Longest field handed to strtod when it isn't a plain decimal number
+#define CSV_FIELD_MAX_SIZE ( 64 )
+
+typedef struct
+{
+  const char* p_map;
+  size_t size;
+  size_t offset;            // Start of the next line
+  uint32_t line;            // Lines read so far
+} csv_file_t;
+
+uint8_t csv_open( csv_file_t*, const char* );
+void csv_close( csv_file_t* );
+uint8_t csv_next_line( csv_file_t*, const char**, const char** );
+uint16_t csv_parse_line( const char*, const char*, energy_t*, uint16_t,
+                                                                  uint16_t );
+
+#endif /* _CSVMAP_H */
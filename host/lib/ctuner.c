@@ -0,0 +1,400 @@
+/** @file ctuner.c
+*
+* @brief Online tuning of the cost function exponent (C factor). Every so
+*        often the last CTUNER_WINDOW_ROUNDS rounds of a network are routed
+*        again with each candidate C on a context of their own (so the live
+*        graph is never touched) and the energy the devices would have used
+*        is scored. The live C is replaced when a candidate is clearly better.
+*
+*        NOTE: The what-if runs start with every device at the same energy
+*        and don't use the RSSI filter or route hysteresis of the network,
+*        so they compare the candidates with each other rather than predict
+*        the network exactly.
+*
+* @author Alvaro Prieto
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "ctuner.h"
+
+static void *ctuner_thread( void* );
+static uint8_t replay_candidate( ctuner_t*, const energy_t*, uint16_t,
+                                  uint8_t, uint8_t, energy_t, energy_t* );
+
+static const energy_t candidates[] = CTUNER_CANDIDATES;
+
+/*******************************************************************************
+ * @fn    void ctuner_initialize( ctuner_t* p_tuner, routing_context_t* p_live,
+ *                                                     ctuner_score_t score )
+ *
+ * @brief Set up a tuner for the network routed on p_live (see
+ *        routing_get_context) and start recording its tables
+ * ****************************************************************************/
+void ctuner_initialize( ctuner_t* p_tuner, routing_context_t* p_live,
+                                                        ctuner_score_t score )
+{
+  routing_context_t* p_caller = routing_get_context();
+
+  memset( p_tuner, 0, sizeof(ctuner_t) );
+
+  p_tuner->p_live = p_live;
+  p_tuner->score = score;
+
+  routing_select( p_live );
+  routing_set_history( CTUNER_WINDOW_ROUNDS );
+  routing_select( p_caller );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t ctuner_start( ctuner_t* p_tuner, uint32_t period_ms )
+ *
+ * @brief Evaluate the candidates every period_ms in a thread of its own. The
+ *        thread runs at idle priority (where supported) so it never holds up
+ *        a round.
+ * ****************************************************************************/
+uint8_t ctuner_start( ctuner_t* p_tuner, uint32_t period_ms )
+{
+  p_tuner->period_ms = period_ms;
+  p_tuner->running = 1;
+
+  pthread_mutex_init( &p_tuner->mutex_wait, NULL );
+  pthread_cond_init( &p_tuner->cond_wait, NULL );
+
+  if( pthread_create( &p_tuner->thread, NULL, ctuner_thread, p_tuner ) )
+  {
+    p_tuner->running = 0;
+    pthread_mutex_destroy( &p_tuner->mutex_wait );
+    pthread_cond_destroy( &p_tuner->cond_wait );
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void ctuner_stop( ctuner_t* p_tuner )
+ *
+ * @brief Stop the tuner thread (waits for an evaluation in progress)
+ * ****************************************************************************/
+void ctuner_stop( ctuner_t* p_tuner )
+{
+  if( !p_tuner->running )
+  {
+    return;
+  }
+
+  pthread_mutex_lock( &p_tuner->mutex_wait );
+  p_tuner->running = 0;
+  pthread_cond_signal( &p_tuner->cond_wait );
+  pthread_mutex_unlock( &p_tuner->mutex_wait );
+
+  pthread_join( p_tuner->thread, NULL );
+
+  pthread_mutex_destroy( &p_tuner->mutex_wait );
+  pthread_cond_destroy( &p_tuner->cond_wait );
+}
+
+/*******************************************************************************
+ * @fn    void *ctuner_thread( void* arg )
+ *
+ * @brief Tuner thread, see ctuner_start
+ * ****************************************************************************/
+static void *ctuner_thread( void* arg )
+{
+  ctuner_t* p_tuner = (ctuner_t*)arg;
+  struct timespec wake_time;
+  int32_t rc;
+#ifdef SCHED_IDLE
+  struct sched_param param = { 0 };
+
+  // Only run when no round needs the CPU
+  pthread_setschedparam( pthread_self(), SCHED_IDLE, &param );
+#endif
+
+  pthread_mutex_lock( &p_tuner->mutex_wait );
+
+  while( p_tuner->running )
+  {
+    clock_gettime( CLOCK_REALTIME, &wake_time );
+    wake_time.tv_sec += p_tuner->period_ms / 1000;
+    wake_time.tv_nsec += ( p_tuner->period_ms % 1000 ) * 1000000L;
+    if( wake_time.tv_nsec >= 1000000000L )
+    {
+      wake_time.tv_sec++;
+      wake_time.tv_nsec -= 1000000000L;
+    }
+
+    // Sleep for a period, unless stopped
+    rc = 0;
+    while( p_tuner->running && ( ETIMEDOUT != rc ) )
+    {
+      rc = pthread_cond_timedwait( &p_tuner->cond_wait, &p_tuner->mutex_wait,
+                                                                &wake_time );
+    }
+
+    if( !p_tuner->running )
+    {
+      break;
+    }
+
+    pthread_mutex_unlock( &p_tuner->mutex_wait );
+    ctuner_evaluate( p_tuner );
+    pthread_mutex_lock( &p_tuner->mutex_wait );
+  }
+
+  pthread_mutex_unlock( &p_tuner->mutex_wait );
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t ctuner_evaluate( ctuner_t* p_tuner )
+ *
+ * @brief Score every candidate (and the C in use) on the recorded rounds and
+ *        switch the live C if one is better by CTUNER_MIN_GAIN, for
+ *        CTUNER_CONFIRMATIONS evaluations in a row. Can be called
+ *        between rounds instead of running the tuner thread (i.e. when
+ *        replaying traces faster than real time). Returns 1 if C changed.
+ * ****************************************************************************/
+uint8_t ctuner_evaluate( ctuner_t* p_tuner )
+{
+  routing_context_t* p_caller = routing_get_context();
+  energy_t* p_history;
+  uint16_t rounds;
+  uint8_t device_count = 0;
+  uint8_t directed;
+  uint8_t index;
+  energy_t current_c;
+  energy_t current_score;
+  energy_t best_c;
+  energy_t best_score;
+  energy_t score;
+  struct timespec start;
+  struct timespec end;
+  double elapsed;
+
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  // Take a copy of the live network's tables and settings
+  routing_select( p_tuner->p_live );
+  rounds = routing_get_history( &p_history, &device_count );
+  current_c = routing_get_c_factor();
+  directed = graph_is_directed();
+  routing_select( p_caller );
+
+  if( rounds < CTUNER_MIN_ROUNDS )
+  {
+    free( p_history );
+    return 0;
+  }
+
+  if( replay_candidate( p_tuner, p_history, rounds, device_count, directed,
+                                                  current_c, &current_score ) )
+  {
+    free( p_history );
+    return 0;
+  }
+
+  best_c = current_c;
+  best_score = current_score;
+
+  for( index = 0; index < sizeof(candidates)/sizeof(energy_t); index++ )
+  {
+    if( ( candidates[index] != current_c ) &&
+        ( 0 == replay_candidate( p_tuner, p_history, rounds, device_count,
+                                  directed, candidates[index], &score ) ) &&
+        ( score < best_score ) )
+    {
+      best_c = candidates[index];
+      best_score = score;
+    }
+  }
+
+  free( p_history );
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  elapsed = ( end.tv_sec - start.tv_sec ) +
+                                    ( end.tv_nsec - start.tv_nsec ) / 1e9;
+
+  p_tuner->evaluations++;
+  p_tuner->last_score = current_score;
+  p_tuner->evaluation_time += elapsed;
+  if( elapsed > p_tuner->max_evaluation_time )
+  {
+    p_tuner->max_evaluation_time = elapsed;
+  }
+
+  if( best_score >= current_score * ( 1.0 - CTUNER_MIN_GAIN ) )
+  {
+    p_tuner->pending_wins = 0;
+    return 0;
+  }
+
+  // One window can favor a candidate by chance
+  if( ( 0 == p_tuner->pending_wins ) || ( best_c != p_tuner->pending_c ) )
+  {
+    p_tuner->pending_c = best_c;
+    p_tuner->pending_wins = 0;
+  }
+
+  p_tuner->pending_wins++;
+  if( p_tuner->pending_wins < CTUNER_CONFIRMATIONS )
+  {
+    return 0;
+  }
+
+  p_tuner->pending_wins = 0;
+
+  routing_select( p_tuner->p_live );
+  routing_set_c_factor( best_c );
+  routing_select( p_caller );
+
+  p_tuner->switches++;
+  p_tuner->last_score = best_score;
+
+  printf( "C factor %g -> %g (score %g -> %g over %d rounds)\n", current_c,
+                                  best_c, current_score, best_score, rounds );
+
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t replay_candidate( ctuner_t* p_tuner,
+ *                  const energy_t* p_history, uint16_t rounds,
+ *                  uint8_t device_count, uint8_t directed,
+ *                  energy_t c_factor, energy_t* p_score )
+ *
+ * @brief Route the recorded rounds with c_factor on a context of its own and
+ *        score the energy each device used. A device left without a route
+ *        broadcasts at MAX_LINK_POWER, so those rounds are charged that much
+ *        (otherwise a C that disconnects the network would score best).
+ *        Returns 1 on error.
+ * ****************************************************************************/
+static uint8_t replay_candidate( ctuner_t* p_tuner, const energy_t* p_history,
+                                 uint16_t rounds, uint8_t device_count,
+                                 uint8_t directed, energy_t c_factor,
+                                 energy_t* p_score )
+{
+  routing_context_t* p_caller = routing_get_context();
+  routing_context_t* p_sim;
+  uint32_t round_size = ROUTING_HISTORY_SIZE( device_count );
+  uint32_t table_cells = ( device_count + 1 ) * ( device_count + 1 );
+  uint16_t round_index;
+  uint16_t unrouted_rounds[MAX_NETWORK_SIZE + 1];
+  uint8_t node_index;
+  energy_t used;
+  energy_t sum = 0;
+  energy_t sum_squares = 0;
+  energy_t max_used = 0;
+
+  p_sim = routing_context_create();
+  if( NULL == p_sim )
+  {
+    return 1;
+  }
+
+  routing_select( p_sim );
+  routing_set_verbose( ROUTING_OUTPUT_NONE );
+  graph_set_directed( directed );
+
+  if( routing_start( c_factor, NULL ) )
+  {
+    routing_select( p_caller );
+    routing_context_destroy( p_sim );
+    return 1;
+  }
+
+  memset( unrouted_rounds, 0, sizeof(unrouted_rounds) );
+
+  for( round_index = 0; round_index < rounds; round_index++ )
+  {
+    // parse_table_d doesn't change the tables it's given
+    if( parse_table_d( (energy_t*)&p_history[round_index * round_size],
+                (energy_t*)&p_history[round_index * round_size + table_cells],
+                device_count ) )
+    {
+      break;
+    }
+
+    routing_compute_round( p_tuner->rp_tables );
+
+    for( node_index = 1; node_index <= device_count; node_index++ )
+    {
+      if( !node_has_path( node_index ) )
+      {
+        unrouted_rounds[node_index]++;
+      }
+    }
+  }
+
+  // Every device starts the run with MAX_LINK_POWER
+  for( node_index = 1; node_index <= device_count; node_index++ )
+  {
+    used = get_node_energy( node_index ) - MAX_LINK_POWER +
+                                  unrouted_rounds[node_index] * MAX_LINK_POWER;
+
+    sum += used;
+    sum_squares += used * used;
+    if( used > max_used )
+    {
+      max_used = used;
+    }
+  }
+
+  routing_finalize();
+  routing_select( p_caller );
+  routing_context_destroy( p_sim );
+
+  if( round_index < rounds )
+  {
+    return 1;
+  }
+
+  if( CTUNER_SCORE_VARIANCE == p_tuner->score )
+  {
+    *p_score = sum_squares / device_count -
+                              ( sum / device_count ) * ( sum / device_count );
+  }
+  else
+  {
+    // The busiest device runs out first
+    *p_score = max_used;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void ctuner_print_stats( ctuner_t* p_tuner )
+ *
+ * @brief Print how often C was evaluated and changed, and what it cost
+ * ****************************************************************************/
+void ctuner_print_stats( ctuner_t* p_tuner )
+{
+  routing_context_t* p_caller = routing_get_context();
+  energy_t c_factor;
+
+  if( 0 == p_tuner->evaluations )
+  {
+    return;
+  }
+
+  routing_select( p_tuner->p_live );
+  c_factor = routing_get_c_factor();
+  routing_select( p_caller );
+
+  printf( "C tuner: %d evaluations, %d changes, C is %g (score %g)\n",
+          p_tuner->evaluations, p_tuner->switches, c_factor,
+          p_tuner->last_score );
+  printf( "C tuner: %g ms per evaluation (%g ms max)\n",
+          p_tuner->evaluation_time * 1000 / p_tuner->evaluations,
+          p_tuner->max_evaluation_time * 1000 );
+}
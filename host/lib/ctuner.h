@@ -0,0 +1,78 @@
+/** @file ctuner.h
+*
+* @brief Online tuning of the cost function exponent (C factor)
+*
+* @author Alvaro Prieto
+*/
+#ifndef _CTUNER_H
+#define _CTUNER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "routing.h"
+
+// How candidates are compared (lower is better)
+typedef enum
+{
+  CTUNER_SCORE_LIFETIME = 1,  // Energy of the busiest device (first death)
+  CTUNER_SCORE_VARIANCE       // Variance of the energy used by the devices
+} ctuner_score_t;
+
+// Rounds of recorded tables each candidate is evaluated on
+#define CTUNER_WINDOW_ROUNDS ( 50 )
+
+// Don't evaluate with fewer rounds than this
+#define CTUNER_MIN_ROUNDS ( 20 )
+
+// Time between evaluations of the tuner thread
+#define CTUNER_PERIOD_MS ( 5000 )
+
+// Rounds between evaluations when replaying traces (see ctuner_evaluate)
+#define CTUNER_PERIOD_ROUNDS ( 25 )
+
+// A candidate must score this much (fraction) better than the C in use to
+// replace it, so C doesn't flip between two values that are about as good
+#define CTUNER_MIN_GAIN ( 0.05 )
+
+// ...and win this many evaluations in a row (each on a newer window)
+#define CTUNER_CONFIRMATIONS ( 2 )
+
+// Candidates, in addition to the C in use
+#define CTUNER_CANDIDATES { 0.0, 1.0, 2.0, 5.0, 10.0, 20.0, 50.0, 100.0, \
+                            200.0, 500.0, 1000.0 }
+
+typedef struct
+{
+  // Network being tuned
+  routing_context_t* p_live;
+  ctuner_score_t score;
+
+  // Tuner thread (see ctuner_start)
+  pthread_t thread;
+  uint8_t running;
+  uint32_t period_ms;
+  pthread_mutex_t mutex_wait;
+  pthread_cond_t cond_wait;
+
+  // Candidate that won the last evaluations, not switched to yet
+  energy_t pending_c;
+  uint8_t pending_wins;
+
+  // Routes and powers of the what-if runs (thrown away)
+  uint8_t rp_tables[RP_TABLES_SIZE];
+
+  // Statistics
+  uint32_t evaluations;
+  uint32_t switches;
+  energy_t last_score;        // Score of the C in use at the last evaluation
+  double evaluation_time;     // Seconds spent evaluating
+  double max_evaluation_time;
+} ctuner_t;
+
+void ctuner_initialize( ctuner_t*, routing_context_t*, ctuner_score_t );
+uint8_t ctuner_start( ctuner_t*, uint32_t );
+void ctuner_stop( ctuner_t* );
+uint8_t ctuner_evaluate( ctuner_t* );
+void ctuner_print_stats( ctuner_t* );
+
+#endif /* _CTUNER_H */
@@ -0,0 +1,171 @@
+/** @file deframer.c
+*
+* @brief Incremental deframer for packets from the AP (see deframer.h)
+*
+* @author Alvaro Prieto
+*/
+#include <string.h>
+#include "deframer.h"
+
+/*******************************************************************************
+ * @fn    void deframer_initialize( deframer_t* p_deframer )
+ *
+ * @brief Start with an empty buffer, waiting for a sync byte
+ * ****************************************************************************/
+void deframer_initialize( deframer_t* p_deframer )
+{
+  memset( p_deframer, 0, sizeof(deframer_t) );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t* deframer_space( deframer_t* p_deframer, uint16_t* p_room )
+ *
+ * @brief Where to read the next bytes to, and how many fit (p_room). Call
+ *        deframer_next until it returns 0 first, so no byte is left unscanned.
+ * ****************************************************************************/
+uint8_t* deframer_space( deframer_t* p_deframer, uint16_t* p_room )
+{
+  uint16_t kept = p_deframer->in_frame ? p_deframer->frame_size : 0;
+  uint16_t unscanned = p_deframer->end - p_deframer->scan;
+
+  // Only the partial packet (and anything not scanned yet) is kept
+  if( kept && p_deframer->frame_start )
+  {
+    memmove( p_deframer->buffer, &p_deframer->buffer[p_deframer->frame_start],
+                                                                        kept );
+  }
+
+  if( unscanned && ( p_deframer->scan != kept ) )
+  {
+    memmove( &p_deframer->buffer[kept], &p_deframer->buffer[p_deframer->scan],
+                                                                  unscanned );
+  }
+
+  p_deframer->frame_start = 0;
+  p_deframer->scan = kept;
+  p_deframer->end = kept + unscanned;
+
+  *p_room = sizeof(p_deframer->buffer) - p_deframer->end;
+
+  return &p_deframer->buffer[p_deframer->end];
+}
+
+/*******************************************************************************
+ * @fn    void deframer_received( deframer_t* p_deframer, uint16_t size )
+ *
+ * @brief size bytes were read to where deframer_space pointed
+ * ****************************************************************************/
+void deframer_received( deframer_t* p_deframer, uint16_t size )
+{
+  p_deframer->end += size;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t deframer_next( deframer_t* p_deframer, uint8_t** pp_packet,
+ *                                                         uint16_t* p_size )
+ *
+ * @brief Scan the bytes received up to the end of the next packet. Returns 1
+ *        with the unescaped packet in pp_packet and p_size, or 0 once every
+ *        byte was scanned without finishing one.
+ * ****************************************************************************/
+uint8_t deframer_next( deframer_t* p_deframer, uint8_t** pp_packet,
+                                                            uint16_t* p_size )
+{
+  uint8_t* p_buffer = p_deframer->buffer;
+  uint8_t* p_sync;
+  uint16_t written;
+  uint16_t run;
+  uint8_t byte;
+  uint8_t done;
+
+  while( p_deframer->scan < p_deframer->end )
+  {
+    if( !p_deframer->in_frame )
+    {
+      // Skip to the start of the next packet
+      p_sync = memchr( &p_buffer[p_deframer->scan], SYNC_BYTE,
+                                        p_deframer->end - p_deframer->scan );
+      run = ( NULL == p_sync ) ? ( p_deframer->end - p_deframer->scan ) :
+                                    ( p_sync - &p_buffer[p_deframer->scan] );
+      p_deframer->skipped += run;
+      p_deframer->scan += run;
+      if( NULL == p_sync )
+      {
+        break;
+      }
+    }
+    else if( !p_deframer->escaped )
+    {
+      // Unescape in place up to the next sync byte (the state machine
+      // below only sees sync bytes, escapes split over reads and the end
+      // of packets that are too long)
+      run = unescape_run( &p_buffer[p_deframer->frame_start +
+                                                      p_deframer->frame_size],
+                          &p_buffer[p_deframer->scan],
+                          p_deframer->end - p_deframer->scan,
+                          DEFRAMER_BUFFER_SIZE - p_deframer->frame_size,
+                          &written );
+      if( run > 0 )
+      {
+        p_deframer->frame_size += written;
+        p_deframer->scan += run;
+        continue;
+      }
+    }
+
+    byte = p_buffer[p_deframer->scan++];
+
+    if( SYNC_BYTE == byte )
+    {
+      done = 0;
+
+      if( p_deframer->in_frame && p_deframer->escaped )
+      {
+        // Bytes were lost in between, the packet can't be trusted
+        p_deframer->aborted++;
+      }
+      else if( p_deframer->in_frame && ( p_deframer->frame_size > 0 ) )
+      {
+        *pp_packet = &p_buffer[p_deframer->frame_start];
+        *p_size = p_deframer->frame_size;
+        p_deframer->packets++;
+        done = 1;
+      }
+
+      // Closing sync byte, or an opening one (back to back packets may
+      // share it)
+      p_deframer->in_frame = 1;
+      p_deframer->escaped = 0;
+      p_deframer->frame_start = p_deframer->scan;
+      p_deframer->frame_size = 0;
+
+      if( done )
+      {
+        return 1;
+      }
+    }
+    else if( ESCAPE_BYTE == byte )
+    {
+      p_deframer->escaped = 1;
+    }
+    else if( p_deframer->frame_size >= DEFRAMER_BUFFER_SIZE )
+    {
+      // Too long, drop it and wait for the next packet
+      p_deframer->oversized++;
+      p_deframer->in_frame = 0;
+    }
+    else
+    {
+      if( p_deframer->escaped )
+      {
+        byte ^= ESCAPE_XOR;
+        p_deframer->escaped = 0;
+      }
+
+      // Never ahead of scan, escapes only make the packet shorter
+      p_buffer[p_deframer->frame_start + p_deframer->frame_size++] = byte;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+/** @file deframer.h
+*
+* @brief Incremental deframer for packets from the AP. Packets are SYNC_BYTE,
+*        payload with SYNC_BYTE and ESCAPE_BYTE escaped, SYNC_BYTE.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _DEFRAMER_H
+#define _DEFRAMER_H
+
+#include <stdint.h>
+#include "escape.h"
+
+// Received bytes kept at once, so also the longest packet (unescaped). Fits
+// a sparse table of the largest network from neighbors.h,
+// NEIGHBOR_PACKET_MAX_SIZE( MAX_NETWORK_SIZE, NEIGHBORS_MAX_K ) (checked in
+// routing.c, most programs with a deframer don't include those), and dense
+// tables of up to 127 devices.
+#define DEFRAMER_BUFFER_SIZE ( 3 + ( 254 + 1 ) * ( 1 + 2 * 32 ) + 1 )
+
+//
+// Bytes are read straight into the deframer (see deframer_space) and
+// unescaped in place as they are scanned (see unescape_run), so each packet
+// ends up contiguous at the start of the bytes it came in. Every byte is only
+// looked at once however the packet is split over reads. When a read ends in
+// the middle of a packet, only that partial packet is moved to the start of
+// the buffer.
+// Packets returned by deframer_next stay valid until the next call to
+// deframer_space.
+//
+// Bytes outside a packet are skipped and a SYNC_BYTE always starts a new
+// packet, so the deframer gets back in sync on its own after lost bytes or
+// a packet that is too long.
+//
+typedef struct
+{
+  uint8_t buffer[DEFRAMER_BUFFER_SIZE + 1]; // + room for the closing byte
+  uint16_t end;             // Bytes in buffer
+  uint16_t scan;            // Bytes looked at so far
+  uint16_t frame_start;     // Packet being deframed (after its sync byte)
+  uint16_t frame_size;      // and its size so far, unescaped
+  uint8_t in_frame;
+  uint8_t escaped;
+
+  // Statistics
+  uint32_t packets;         // Packets deframed
+  uint32_t skipped;         // Bytes found outside a packet
+  uint32_t aborted;         // Packets cut short by a sync byte after an escape
+  uint32_t oversized;       // Packets longer than DEFRAMER_BUFFER_SIZE
+} deframer_t;
+
+void deframer_initialize( deframer_t* );
+uint8_t* deframer_space( deframer_t*, uint16_t* );
+void deframer_received( deframer_t*, uint16_t );
+uint8_t deframer_next( deframer_t*, uint8_t**, uint16_t* );
+
+#endif /* _DEFRAMER_H */
@@ -0,0 +1,274 @@
+/** @file escape.c
+*
+* @brief Escaping for the serial framing (see escape.h)
+*
+* @author Alvaro Prieto
+*/
+#include <string.h>
+#include "escape.h"
+
+#if !defined(ESCAPE_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#define ESCAPE_AVX2
+#define ESCAPE_BLOCK ( 32 )
+#elif !defined(ESCAPE_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define ESCAPE_SSE2
+#define ESCAPE_BLOCK ( 16 )
+#endif
+
+static uint16_t escape_run( uint8_t*, const uint8_t*, uint16_t );
+#ifdef ESCAPE_BLOCK
+static uint32_t special_mask( const uint8_t* p_data );
+#endif
+
+/*******************************************************************************
+ * @fn    uint16_t frame_escape( uint8_t* p_frame, const uint8_t* p_packet,
+ *                                                             uint16_t size )
+ *
+ * @brief Build the frame for a packet in p_frame (room for
+ *        FRAME_MAX_SIZE( size ) bytes). Returns the frame size.
+ * ****************************************************************************/
+uint16_t frame_escape( uint8_t* p_frame, const uint8_t* p_packet,
+                                                              uint16_t size )
+{
+#ifdef ESCAPE_BLOCK
+  uint16_t in_index = 0;
+  uint16_t out_index = 0;
+  uint32_t mask;
+  uint8_t run;
+
+  p_frame[out_index++] = SYNC_BYTE;
+
+  while( ( in_index + ESCAPE_BLOCK ) <= size )
+  {
+    mask = special_mask( &p_packet[in_index] );
+
+    // Copy the whole block, bytes after the first hit are written again
+    // later. Never past the end: out_index is at most 2 * in_index + 1.
+    memcpy( &p_frame[out_index], &p_packet[in_index], ESCAPE_BLOCK );
+
+    if( 0 == mask )
+    {
+      in_index += ESCAPE_BLOCK;
+      out_index += ESCAPE_BLOCK;
+      continue;
+    }
+
+    if( mask & ( mask - 1 ) )
+    {
+      // Several hits, not worth finding them one by one
+      out_index += escape_run( &p_frame[out_index], &p_packet[in_index],
+                                                              ESCAPE_BLOCK );
+      in_index += ESCAPE_BLOCK;
+      continue;
+    }
+
+    run = __builtin_ctz( mask );
+    in_index += run;
+    out_index += run;
+
+    p_frame[out_index++] = ESCAPE_BYTE;
+    p_frame[out_index++] = p_packet[in_index++] ^ ESCAPE_XOR;
+  }
+
+  // Tail shorter than a block
+  out_index += escape_run( &p_frame[out_index], &p_packet[in_index],
+                                                          size - in_index );
+  p_frame[out_index++] = SYNC_BYTE;
+
+  return out_index;
+#else
+  return frame_escape_scalar( p_frame, p_packet, size );
+#endif
+}
+
+/*******************************************************************************
+ * @fn    uint16_t unescape_run( uint8_t* p_out, const uint8_t* p_in,
+ *                      uint16_t size, uint16_t max_out, uint16_t* p_written )
+ *
+ * @brief Unescape p_in into p_out (p_in itself or before it, to unescape in
+ *        place) up to the next SYNC_BYTE, max_out bytes written or an escape
+ *        that can't be finished yet (last byte, or followed by a SYNC_BYTE).
+ *        Returns the bytes of p_in used, p_written the bytes written.
+ * ****************************************************************************/
+uint16_t unescape_run( uint8_t* p_out, const uint8_t* p_in, uint16_t size,
+                                      uint16_t max_out, uint16_t* p_written )
+{
+#ifdef ESCAPE_BLOCK
+  uint16_t in_index = 0;
+  uint16_t out_index = 0;
+  uint16_t used;
+  uint16_t written;
+  uint32_t mask;
+
+  while( ( ( in_index + ESCAPE_BLOCK ) <= size ) &&
+         ( ( out_index + ESCAPE_BLOCK ) <= max_out ) )
+  {
+    mask = special_mask( &p_in[in_index] );
+
+    if( 0 == mask )
+    {
+      // p_out never gets ahead of p_in, so this never overwrites bytes
+      // that haven't been read yet
+      if( &p_out[out_index] != &p_in[in_index] )
+      {
+        memmove( &p_out[out_index], &p_in[in_index], ESCAPE_BLOCK );
+      }
+      in_index += ESCAPE_BLOCK;
+      out_index += ESCAPE_BLOCK;
+      continue;
+    }
+
+    // Block with escapes or the end of the packet
+    used = unescape_run_scalar( &p_out[out_index], &p_in[in_index],
+                                            ESCAPE_BLOCK, ESCAPE_BLOCK,
+                                            &written );
+    in_index += used;
+    out_index += written;
+    if( used < ( ESCAPE_BLOCK - 1 ) )
+    {
+      // Stopped at a sync byte
+      *p_written = out_index;
+      return in_index;
+    }
+  }
+
+  used = unescape_run_scalar( &p_out[out_index], &p_in[in_index],
+                          size - in_index, max_out - out_index, &written );
+  *p_written = out_index + written;
+
+  return in_index + used;
+#else
+  return unescape_run_scalar( p_out, p_in, size, max_out, p_written );
+#endif
+}
+
+/*******************************************************************************
+ * @fn    uint16_t frame_escape_scalar( uint8_t* p_frame,
+ *                                  const uint8_t* p_packet, uint16_t size )
+ *
+ * @brief Byte by byte frame_escape (escapebench compares the two)
+ * ****************************************************************************/
+uint16_t frame_escape_scalar( uint8_t* p_frame, const uint8_t* p_packet,
+                                                              uint16_t size )
+{
+  uint16_t out_index = 0;
+
+  p_frame[out_index++] = SYNC_BYTE;
+  out_index += escape_run( &p_frame[out_index], p_packet, size );
+  p_frame[out_index++] = SYNC_BYTE;
+
+  return out_index;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t unescape_run_scalar( uint8_t* p_out, const uint8_t* p_in,
+ *                      uint16_t size, uint16_t max_out, uint16_t* p_written )
+ *
+ * @brief Byte by byte unescape_run
+ * ****************************************************************************/
+uint16_t unescape_run_scalar( uint8_t* p_out, const uint8_t* p_in,
+                  uint16_t size, uint16_t max_out, uint16_t* p_written )
+{
+  uint16_t in_index = 0;
+  uint16_t out_index = 0;
+
+  while( ( in_index < size ) && ( out_index < max_out ) )
+  {
+    if( SYNC_BYTE == p_in[in_index] )
+    {
+      break;
+    }
+
+    if( ESCAPE_BYTE == p_in[in_index] )
+    {
+      if( ( ( in_index + 1 ) >= size ) ||
+          ( SYNC_BYTE == p_in[in_index + 1] ) )
+      {
+        break;
+      }
+
+      p_out[out_index++] = p_in[in_index + 1] ^ ESCAPE_XOR;
+      in_index += 2;
+    }
+    else
+    {
+      p_out[out_index++] = p_in[in_index++];
+    }
+  }
+
+  *p_written = out_index;
+
+  return in_index;
+}
+
+/*******************************************************************************
+ * @fn    const char* escape_kernel_name()
+ *
+ * @brief Kernel this file was compiled with
+ * ****************************************************************************/
+const char* escape_kernel_name()
+{
+#if defined(ESCAPE_AVX2)
+  return "avx2";
+#elif defined(ESCAPE_SSE2)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+/*******************************************************************************
+ * @fn    uint16_t escape_run( uint8_t* p_out, const uint8_t* p_in,
+ *                                                             uint16_t size )
+ *
+ * @brief Escape size bytes one by one (no sync bytes added). Returns the
+ *        bytes written to p_out.
+ * ****************************************************************************/
+static uint16_t escape_run( uint8_t* p_out, const uint8_t* p_in,
+                                                              uint16_t size )
+{
+  uint16_t in_index;
+  uint16_t out_index = 0;
+
+  for( in_index = 0; in_index < size; in_index++ )
+  {
+    if( ( SYNC_BYTE == p_in[in_index] ) || ( ESCAPE_BYTE == p_in[in_index] ) )
+    {
+      p_out[out_index++] = ESCAPE_BYTE;
+      p_out[out_index++] = p_in[in_index] ^ ESCAPE_XOR;
+    }
+    else
+    {
+      p_out[out_index++] = p_in[in_index];
+    }
+  }
+
+  return out_index;
+}
+
+#ifdef ESCAPE_BLOCK
+/*******************************************************************************
+ * @fn    uint32_t special_mask( const uint8_t* p_data )
+ *
+ * @brief Bit n is set if byte n of the block at p_data is a SYNC_BYTE or an
+ *        ESCAPE_BYTE
+ * ****************************************************************************/
+static uint32_t special_mask( const uint8_t* p_data )
+{
+#ifdef ESCAPE_AVX2
+  __m256i block = _mm256_loadu_si256( (const __m256i*)p_data );
+
+  return (uint32_t)_mm256_movemask_epi8( _mm256_or_si256(
+                _mm256_cmpeq_epi8( block, _mm256_set1_epi8( SYNC_BYTE ) ),
+                _mm256_cmpeq_epi8( block, _mm256_set1_epi8( ESCAPE_BYTE ) ) ) );
+#else
+  __m128i block = _mm_loadu_si128( (const __m128i*)p_data );
+
+  return (uint32_t)_mm_movemask_epi8( _mm_or_si128(
+                _mm_cmpeq_epi8( block, _mm_set1_epi8( SYNC_BYTE ) ),
+                _mm_cmpeq_epi8( block, _mm_set1_epi8( ESCAPE_BYTE ) ) ) );
+#endif
+}
+#endif
@@ -0,0 +1,35 @@
+/** @file escape.h
+*
+* @brief Escaping for the serial framing. Packets are sent as SYNC_BYTE,
+*        payload, SYNC_BYTE, with every SYNC_BYTE or ESCAPE_BYTE in the
+*        payload sent as ESCAPE_BYTE followed by the byte XOR ESCAPE_XOR.
+*
+*        Plain bytes are scanned 32 (AVX2) or 16 (SSE2) at a time and copied
+*        in bulk, only blocks with bytes that need escaping (or unescaping)
+*        are handled one byte at a time.
+*        The kernel is picked at compile time: x86-64 always has SSE2, add
+*        -mavx2 for AVX2 and -DESCAPE_SCALAR to use plain C everywhere.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _ESCAPE_H
+#define _ESCAPE_H
+
+#include <stdint.h>
+
+#define SYNC_BYTE   ( 0x7E )
+#define ESCAPE_BYTE ( 0x7D )
+#define ESCAPE_XOR  ( 0x20 )
+
+// Largest frame a packet of size bytes can turn into (every byte escaped)
+#define FRAME_MAX_SIZE( size ) ( 2 * (size) + 2 )
+
+uint16_t frame_escape( uint8_t*, const uint8_t*, uint16_t );
+uint16_t unescape_run( uint8_t*, const uint8_t*, uint16_t, uint16_t,
+                                                                uint16_t* );
+uint16_t frame_escape_scalar( uint8_t*, const uint8_t*, uint16_t );
+uint16_t unescape_run_scalar( uint8_t*, const uint8_t*, uint16_t, uint16_t,
+                                                                uint16_t* );
+const char* escape_kernel_name();
+
+#endif /* _ESCAPE_H */
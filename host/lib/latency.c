@@ -0,0 +1,340 @@
+/** @file latency.c
+*
+* @brief Per-round latency measurement. Each stage of a round is stamped with
+*        a monotonic clock and the time between stages goes into fixed size
+*        histograms. A summary is printed every LATENCY_SUMMARY_ROUNDS rounds,
+*        on SIGUSR1 and on request (i.e. at exit).
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "latency.h"
+
+static void latency_signal_handler( int32_t sig );
+static uint32_t histogram_index( uint64_t value );
+static uint64_t histogram_value( uint32_t index );
+
+static const char* stage_names[LAT_STAGE_COUNT] = {
+  "packet in",
+  "deframe",
+  "parse",
+  "handoff",
+  "graph build",
+  "dijkstra",
+  "postprocess",
+  "log",
+  "tx wakeup",
+  "tx",
+};
+
+// Stamps of the stages before the routing thread picks up the round. They are
+// written by the serial thread, which can already be on the next packet.
+static _Atomic uint64_t input_stamps[LAT_ROUND_START];
+
+// Stamps of the round being routed (0 if the stage wasn't stamped). Only
+// touched by the thread routing it, other threads routing (i.e. the C tuner)
+// have their own.
+static __thread uint64_t round_stamps[LAT_STAGE_COUNT];
+
+// Last round routed, handed over to the thread sending the tables under the
+// lock that hands over the round (see latency_round_routed)
+static uint64_t routed_stamps[LAT_STAGE_COUNT];
+
+// Stamps of the round being sent, only touched by the thread sending it
+static uint64_t output_stamps[LAT_STAGE_COUNT];
+
+// Time ending at each stage (index 0 is the whole round)
+static latency_histogram_t histograms[LAT_STAGE_COUNT];
+
+static uint64_t rounds;
+static volatile sig_atomic_t summary_requested;
+
+/*******************************************************************************
+ * @fn    uint64_t latency_now()
+ *
+ * @brief Monotonic time in ns
+ * ****************************************************************************/
+static inline uint64_t latency_now()
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*******************************************************************************
+ * @fn    void latency_initialize()
+ *
+ * @brief Clear histograms and print a summary on SIGUSR1
+ * ****************************************************************************/
+void latency_initialize()
+{
+  memset( histograms, 0, sizeof(histograms) );
+  memset( routed_stamps, 0, sizeof(routed_stamps) );
+  memset( output_stamps, 0, sizeof(output_stamps) );
+  rounds = 0;
+
+  (void) signal( SIGUSR1, latency_signal_handler );
+}
+
+/*******************************************************************************
+ * @fn    void latency_stamp( latency_stage_t stage )
+ *
+ * @brief Record the time a stage of the current round finished
+ * ****************************************************************************/
+void latency_stamp( latency_stage_t stage )
+{
+  uint64_t now = latency_now();
+  uint8_t stage_index;
+
+  if( stage < LAT_ROUND_START )
+  {
+    atomic_store_explicit( &input_stamps[stage], now, memory_order_relaxed );
+    return;
+  }
+
+  // Take over the input stamps for this round
+  if( LAT_ROUND_START == stage )
+  {
+    for( stage_index = 0; stage_index < LAT_ROUND_START; stage_index++ )
+    {
+      round_stamps[stage_index] = atomic_exchange_explicit(
+                      &input_stamps[stage_index], 0, memory_order_relaxed );
+    }
+  }
+
+  if( stage < LAT_TX_START )
+  {
+    round_stamps[stage] = now;
+  }
+  else
+  {
+    output_stamps[stage] = now;
+  }
+}
+
+/*******************************************************************************
+ * @fn    void latency_round_routed()
+ *
+ * @brief Hand the stamps of the round just routed over to the thread sending
+ *        the tables. Call from the routing thread, holding the same lock as
+ *        the call to latency_round_taken, so neither thread ever sees the
+ *        other's stamps half written.
+ * ****************************************************************************/
+void latency_round_routed()
+{
+  memcpy( routed_stamps, round_stamps, sizeof(routed_stamps) );
+  memset( round_stamps, 0, sizeof(round_stamps) );
+}
+
+/*******************************************************************************
+ * @fn    void latency_round_taken()
+ *
+ * @brief Take over the stamps of the last round routed, to send its tables.
+ *        Call from the thread sending them, holding the lock it was handed
+ *        over with (see latency_round_routed).
+ * ****************************************************************************/
+void latency_round_taken()
+{
+  memcpy( output_stamps, routed_stamps, sizeof(output_stamps) );
+  memset( routed_stamps, 0, sizeof(routed_stamps) );
+}
+
+/*******************************************************************************
+ * @fn    void latency_round_done()
+ *
+ * @brief Add the stage times of the round taken (see latency_round_taken)
+ *        to the histograms
+ * ****************************************************************************/
+void latency_round_done()
+{
+  uint8_t stage_index;
+  uint64_t first = 0;
+  uint64_t previous = 0;
+
+  for( stage_index = 0; stage_index < LAT_STAGE_COUNT; stage_index++ )
+  {
+    if( 0 == output_stamps[stage_index] )
+    {
+      continue;
+    }
+
+    if( 0 == previous )
+    {
+      first = output_stamps[stage_index];
+    }
+    else
+    {
+      latency_histogram_add( &histograms[stage_index],
+                                  output_stamps[stage_index] - previous );
+    }
+
+    previous = output_stamps[stage_index];
+  }
+
+  if( previous > first )
+  {
+    latency_histogram_add( &histograms[0], previous - first );
+  }
+
+  memset( output_stamps, 0, sizeof(output_stamps) );
+  rounds++;
+
+  if( summary_requested ||
+      ( ( LATENCY_SUMMARY_ROUNDS > 0 ) &&
+        ( 0 == ( rounds % LATENCY_SUMMARY_ROUNDS ) ) ) )
+  {
+    summary_requested = 0;
+    latency_print_summary();
+  }
+}
+
+/*******************************************************************************
+ * @fn    void latency_print_summary()
+ *
+ * @brief Print percentiles of every stage (in microseconds)
+ * ****************************************************************************/
+void latency_print_summary()
+{
+  uint8_t stage_index;
+  latency_histogram_t* p_histogram;
+
+  printf( "Latency after %llu rounds (us)\n", (unsigned long long)rounds );
+  printf( "%-12s %10s %10s %10s %10s %10s\n", "stage", "count", "p50", "p99",
+                                                            "p999", "max" );
+
+  for( stage_index = 0; stage_index < LAT_STAGE_COUNT; stage_index++ )
+  {
+    p_histogram = &histograms[stage_index];
+
+    if( 0 == p_histogram->count )
+    {
+      continue;
+    }
+
+    printf( "%-12s %10llu %10.1f %10.1f %10.1f %10.1f\n",
+      ( 0 == stage_index ) ? "round" : stage_names[stage_index],
+      (unsigned long long)p_histogram->count,
+      latency_histogram_percentile( p_histogram, 0.5 ) / 1000.0,
+      latency_histogram_percentile( p_histogram, 0.99 ) / 1000.0,
+      latency_histogram_percentile( p_histogram, 0.999 ) / 1000.0,
+      p_histogram->max / 1000.0 );
+  }
+}
+
+/*******************************************************************************
+ * @fn    void latency_histogram_add( latency_histogram_t* p_histogram,
+ *                                                            uint64_t value )
+ *
+ * @brief Add value (ns) to histogram
+ * ****************************************************************************/
+void latency_histogram_add( latency_histogram_t* p_histogram, uint64_t value )
+{
+  if( value >= ( 1ull << LATENCY_MAX_BITS ) )
+  {
+    value = ( 1ull << LATENCY_MAX_BITS ) - 1;
+  }
+
+  p_histogram->buckets[histogram_index( value )]++;
+  p_histogram->count++;
+
+  if( value > p_histogram->max )
+  {
+    p_histogram->max = value;
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint64_t latency_histogram_percentile(
+ *                          latency_histogram_t* p_histogram, double fraction )
+ *
+ * @brief Value (ns) below which fraction (0.0-1.0) of the samples are. Uses
+ *        the top of the bucket, so it's never lower than the real value.
+ * ****************************************************************************/
+uint64_t latency_histogram_percentile( latency_histogram_t* p_histogram,
+                                                              double fraction )
+{
+  uint64_t target = (uint64_t)( fraction * p_histogram->count + 0.5 );
+  uint64_t total = 0;
+  uint32_t bucket_index;
+  uint64_t value;
+
+  if( target < 1 )
+  {
+    target = 1;
+  }
+
+  for( bucket_index = 0; bucket_index < LATENCY_BUCKETS; bucket_index++ )
+  {
+    total += p_histogram->buckets[bucket_index];
+    if( total >= target )
+    {
+      value = histogram_value( bucket_index );
+      return ( value < p_histogram->max ) ? value : p_histogram->max;
+    }
+  }
+
+  return p_histogram->max;
+}
+
+/*******************************************************************************
+ * @fn    uint32_t histogram_index( uint64_t value )
+ *
+ * @brief Bucket for value. The top LATENCY_SUB_BITS bits of the value select
+ *        the bucket within its power of two.
+ * ****************************************************************************/
+static uint32_t histogram_index( uint64_t value )
+{
+  uint32_t shift;
+
+  if( value < ( 1 << LATENCY_SUB_BITS ) )
+  {
+    return value;
+  }
+
+  shift = ( 63 - __builtin_clzll( value ) ) - ( LATENCY_SUB_BITS - 1 );
+
+  return ( 1 << LATENCY_SUB_BITS ) + ( shift - 1 ) *
+                                        ( 1 << ( LATENCY_SUB_BITS - 1 ) ) +
+          ( ( value >> shift ) - ( 1 << ( LATENCY_SUB_BITS - 1 ) ) );
+}
+
+/*******************************************************************************
+ * @fn    uint64_t histogram_value( uint32_t index )
+ *
+ * @brief Highest value that goes in bucket index
+ * ****************************************************************************/
+static uint64_t histogram_value( uint32_t index )
+{
+  uint32_t shift;
+  uint64_t mantissa;
+
+  if( index < ( 1 << LATENCY_SUB_BITS ) )
+  {
+    return index;
+  }
+
+  index -= ( 1 << LATENCY_SUB_BITS );
+  shift = index / ( 1 << ( LATENCY_SUB_BITS - 1 ) ) + 1;
+  mantissa = index % ( 1 << ( LATENCY_SUB_BITS - 1 ) ) +
+                                              ( 1 << ( LATENCY_SUB_BITS - 1 ) );
+
+  return ( ( mantissa + 1 ) << shift ) - 1;
+}
+
+/*******************************************************************************
+ * @fn    void latency_signal_handler( int32_t sig )
+ *
+ * @brief Print a summary at the end of the current round
+ * ****************************************************************************/
+static void latency_signal_handler( int32_t sig )
+{
+  summary_requested = 1;
+}
@@ -0,0 +1,79 @@
+/** @file latency.h
+*
+* @brief Per-round latency measurement. Compile with -DLATENCY_ON (and
+*        latency.c) to enable, otherwise all LATENCY_ macros do nothing.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdint.h>
+
+// Round stages, in the order they happen. Each stage's time is measured from
+// the previous stage that was stamped in the same round. Stages up to
+// LAT_ROUND_START are stamped by the thread reading the port, up to
+// LAT_LOGGED by the routing thread and the rest by the thread sending the
+// tables, each round's stamps are handed from one to the next.
+typedef enum
+{
+  LAT_PACKET_IN = 0,  // Last serial read of the RSSI packet
+  LAT_DEFRAMED,       // Closing sync byte found, escapes removed
+  LAT_PARSED,         // parse_table done
+  LAT_ROUND_START,    // Routing thread started the round
+  LAT_GRAPH_BUILT,    // build_links_from_table done
+  LAT_DIJKSTRA,       // dijkstra (and route hysteresis) done
+  LAT_POSTPROCESS,    // Energies, rp tables and powers done
+  LAT_LOGGED,         // Round queued for the round log
+  LAT_TX_START,       // Main thread woke up to send the tables
+  LAT_TX_DONE,        // Tables queued for the serial port
+  LAT_STAGE_COUNT
+} latency_stage_t;
+
+// Print a summary every this many rounds (0 to only print on request)
+#define LATENCY_SUMMARY_ROUNDS ( 1000 )
+
+//
+// Histograms are log-linear (HDR style): values below 2^LATENCY_SUB_BITS ns
+// are exact, above that each power of two is split in 2^(LATENCY_SUB_BITS-1)
+// buckets (< 1% error with 7 bits). Values are capped at 2^LATENCY_MAX_BITS ns.
+//
+#define LATENCY_SUB_BITS ( 7 )
+#define LATENCY_MAX_BITS ( 40 )
+#define LATENCY_BUCKETS ( ( 1 << LATENCY_SUB_BITS ) + \
+          ( LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1 ) * \
+          ( 1 << ( LATENCY_SUB_BITS - 1 ) ) )
+
+typedef struct
+{
+  uint64_t count;
+  uint64_t max;
+  uint32_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+void latency_initialize();
+void latency_stamp( latency_stage_t stage );
+void latency_round_routed();
+void latency_round_taken();
+void latency_round_done();
+void latency_print_summary();
+void latency_histogram_add( latency_histogram_t*, uint64_t );
+uint64_t latency_histogram_percentile( latency_histogram_t*, double );
+
+#ifdef LATENCY_ON
+#define LATENCY_INITIALIZE()    latency_initialize()
+#define LATENCY_STAMP( stage )  latency_stamp( stage )
+#define LATENCY_ROUND_ROUTED()  latency_round_routed()
+#define LATENCY_ROUND_TAKEN()   latency_round_taken()
+#define LATENCY_ROUND_DONE()    latency_round_done()
+#define LATENCY_SUMMARY()       latency_print_summary()
+#else
+#define LATENCY_INITIALIZE()    ((void)0)
+#define LATENCY_STAMP( stage )  ((void)0)
+#define LATENCY_ROUND_ROUTED()  ((void)0)
+#define LATENCY_ROUND_TAKEN()   ((void)0)
+#define LATENCY_ROUND_DONE()    ((void)0)
+#define LATENCY_SUMMARY()       ((void)0)
+#endif
+
+#endif /* _LATENCY_H */
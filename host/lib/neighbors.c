@@ -0,0 +1,299 @@
+/** @file neighbors.c
+*
+* @brief Sparse (top-k neighbor) RSSI tables and their packet format. See
+*        neighbors.h for the layout.
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "neighbors.h"
+
+static uint8_t is_square( uint32_t value );
+static uint8_t rssi_to_raw( energy_t rssi );
+
+/*******************************************************************************
+ * @fn    uint8_t neighbor_table_allocate( neighbor_table_t* p_table,
+ *                              uint8_t device_count, uint8_t max_neighbors )
+ *
+ * @brief Size table for device_count devices (plus the AP) with up to
+ *        max_neighbors neighbors each. Only allocates if the size changed.
+ *        All rows start empty.
+ * ****************************************************************************/
+uint8_t neighbor_table_allocate( neighbor_table_t* p_table,
+                                uint8_t device_count, uint8_t max_neighbors )
+{
+  uint32_t cells = ( (uint32_t)device_count + 1 ) * max_neighbors;
+
+  if( ( 0 == max_neighbors ) || ( max_neighbors > NEIGHBORS_MAX_K ) )
+  {
+    return 1;
+  }
+
+  if( ( NULL == p_table->counts ) ||
+      ( device_count != p_table->device_count ) ||
+      ( max_neighbors != p_table->max_neighbors ) )
+  {
+    neighbor_table_free( p_table );
+
+    p_table->counts = calloc( device_count + 1, sizeof(uint8_t) );
+    p_table->ids = calloc( cells, sizeof(uint8_t) );
+    p_table->rssi = calloc( cells, sizeof(energy_t) );
+
+    if( ( NULL == p_table->counts ) || ( NULL == p_table->ids ) ||
+        ( NULL == p_table->rssi ) )
+    {
+      neighbor_table_free( p_table );
+      return 1;
+    }
+
+    p_table->device_count = device_count;
+    p_table->max_neighbors = max_neighbors;
+  }
+
+  memset( p_table->counts, 0, device_count + 1 );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void neighbor_table_free( neighbor_table_t* p_table )
+ *
+ * @brief Free table storage
+ * ****************************************************************************/
+void neighbor_table_free( neighbor_table_t* p_table )
+{
+  free( p_table->counts );
+  free( p_table->ids );
+  free( p_table->rssi );
+
+  memset( p_table, 0, sizeof(neighbor_table_t) );
+}
+
+/*******************************************************************************
+ * @fn    void neighbor_table_from_dense( neighbor_table_t* p_table,
+ *                                               const energy_t* p_dense )
+ *
+ * @brief Keep the strongest neighbors of each row of a dense
+ *        (N+1)x(N+1) table (what the AP does before sending). Pairs that
+ *        didn't hear each other are left out. Rows are sorted strongest
+ *        first. The table must already be allocated for N and k.
+ * ****************************************************************************/
+void neighbor_table_from_dense( neighbor_table_t* p_table,
+                                                      const energy_t* p_dense )
+{
+  uint16_t table_size = p_table->device_count + 1;
+  uint8_t max_neighbors = p_table->max_neighbors;
+  uint16_t row_index;
+  uint16_t col_index;
+  uint8_t slot;
+  uint8_t count;
+  uint8_t* p_ids;
+  energy_t* p_rssi;
+  energy_t rssi;
+
+  for( row_index = 0; row_index < table_size; row_index++ )
+  {
+    p_ids = &p_table->ids[row_index * max_neighbors];
+    p_rssi = &p_table->rssi[row_index * max_neighbors];
+    count = 0;
+
+    for( col_index = 0; col_index < table_size; col_index++ )
+    {
+      rssi = p_dense[row_index * table_size + col_index];
+
+      if( ( col_index == row_index ) || ( rssi <= NEIGHBOR_NO_SIGNAL ) )
+      {
+        continue;
+      }
+
+      // Not stronger than any kept neighbor
+      if( ( count == max_neighbors ) && ( rssi <= p_rssi[count - 1] ) )
+      {
+        continue;
+      }
+
+      // Insert in order, dropping the weakest if the row is full
+      if( count < max_neighbors )
+      {
+        count++;
+      }
+
+      for( slot = count - 1; ( slot > 0 ) && ( p_rssi[slot - 1] < rssi );
+                                                                      slot-- )
+      {
+        p_ids[slot] = p_ids[slot - 1];
+        p_rssi[slot] = p_rssi[slot - 1];
+      }
+
+      p_ids[slot] = col_index;
+      p_rssi[slot] = rssi;
+    }
+
+    p_table->counts[row_index] = count;
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint16_t neighbor_table_pack( const neighbor_table_t* p_table,
+ *                                                        uint8_t* p_packet )
+ *
+ * @brief Write table in packet format. p_packet must hold
+ *        NEIGHBOR_PACKET_MAX_SIZE( N, k ) bytes. Returns packet size.
+ * ****************************************************************************/
+uint16_t neighbor_table_pack( const neighbor_table_t* p_table,
+                                                            uint8_t* p_packet )
+{
+  uint16_t packet_size = NEIGHBOR_HEADER_SIZE;
+  uint16_t row_index;
+  uint8_t slot;
+  uint32_t cell_index;
+
+  p_packet[0] = NEIGHBOR_PACKET_MARKER;
+  p_packet[1] = p_table->device_count;
+  p_packet[2] = p_table->max_neighbors;
+
+  for( row_index = 0; row_index <= p_table->device_count; row_index++ )
+  {
+    p_packet[packet_size++] = p_table->counts[row_index];
+
+    cell_index = row_index * p_table->max_neighbors;
+    for( slot = 0; slot < p_table->counts[row_index]; slot++ )
+    {
+      p_packet[packet_size++] = p_table->ids[cell_index + slot];
+      p_packet[packet_size++] = rssi_to_raw( p_table->rssi[cell_index + slot] );
+    }
+  }
+
+  if( is_square( packet_size ) )
+  {
+    p_packet[packet_size++] = 0;
+  }
+
+  return packet_size;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t neighbor_table_unpack( neighbor_table_t* p_table,
+ *                                  const uint8_t* p_packet, uint16_t size )
+ *
+ * @brief Read packet into table, (re)allocating it if the size changed.
+ *        Returns 1 if the packet is not valid, 0 otherwise.
+ * ****************************************************************************/
+uint8_t neighbor_table_unpack( neighbor_table_t* p_table,
+                                      const uint8_t* p_packet, uint16_t size )
+{
+  uint16_t packet_index = NEIGHBOR_HEADER_SIZE;
+  uint8_t device_count;
+  uint8_t max_neighbors;
+  uint16_t row_index;
+  uint8_t slot;
+  uint8_t count;
+  uint32_t cell_index;
+
+  if( !is_neighbor_packet( p_packet, size ) )
+  {
+    return 1;
+  }
+
+  device_count = p_packet[1];
+  max_neighbors = p_packet[2];
+
+  if( ( 0 == device_count ) ||
+      neighbor_table_allocate( p_table, device_count, max_neighbors ) )
+  {
+    return 1;
+  }
+
+  for( row_index = 0; row_index <= device_count; row_index++ )
+  {
+    if( packet_index >= size )
+    {
+      return 1;
+    }
+
+    count = p_packet[packet_index++];
+
+    if( ( count > max_neighbors ) ||
+        ( ( packet_index + 2 * count ) > size ) )
+    {
+      return 1;
+    }
+
+    cell_index = row_index * max_neighbors;
+    for( slot = 0; slot < count; slot++ )
+    {
+      // Neighbor must be in the network and not the receiver itself
+      if( ( p_packet[packet_index] > device_count ) ||
+          ( p_packet[packet_index] == row_index ) )
+      {
+        return 1;
+      }
+
+      p_table->ids[cell_index + slot] = p_packet[packet_index++];
+      p_table->rssi[cell_index + slot] =
+                              (int8_t)p_packet[packet_index++] / 2.0 - 72.0;
+    }
+
+    p_table->counts[row_index] = count;
+  }
+
+  // Only the padding byte can be left
+  if( ( packet_index != size ) &&
+      ( ( ( packet_index + 1 ) != size ) || ( !is_square( packet_index ) ) ) )
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t is_neighbor_packet( const uint8_t* p_packet, uint16_t size )
+ *
+ * @brief Returns 1 if the packet is in neighbor format (dense tables are
+ *        always a perfect square size, neighbor packets never are)
+ * ****************************************************************************/
+uint8_t is_neighbor_packet( const uint8_t* p_packet, uint16_t size )
+{
+  return ( size > NEIGHBOR_HEADER_SIZE ) &&
+         ( NEIGHBOR_PACKET_MARKER == p_packet[0] ) && ( !is_square( size ) );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t is_square( uint32_t value )
+ *
+ * @brief Returns 1 if value is a perfect square
+ * ****************************************************************************/
+static uint8_t is_square( uint32_t value )
+{
+  uint32_t root = (uint32_t)( sqrt( (double)value ) + 0.5 );
+
+  return ( root * root ) == value;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t rssi_to_raw( energy_t rssi )
+ *
+ * @brief Convert received power (dBm) to the cc2500 register value
+ *        (0.5dB steps, -72dBm offset). 0x80 is reserved for no signal.
+ * ****************************************************************************/
+static uint8_t rssi_to_raw( energy_t rssi )
+{
+  int32_t raw = (int32_t)lround( ( rssi + 72.0 ) * 2 );
+
+  if( raw > 127 )
+  {
+    raw = 127;
+  }
+  else if( raw < -127 )
+  {
+    raw = -127;
+  }
+
+  return (uint8_t)(int8_t)raw;
+}
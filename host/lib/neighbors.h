@@ -0,0 +1,56 @@
+/** @file neighbors.h
+*
+* @brief Sparse RSSI tables. Each receiver (row) only keeps its strongest
+*        neighbors, so tables, packets and routing scale with N*k instead
+*        of (N+1)^2. Most pairs are out of range in a large network anyway.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _NEIGHBORS_H
+#define _NEIGHBORS_H
+
+#include <stdint.h>
+#include "dijkstra.h"
+
+// Neighbors kept per row if not specified, and the most allowed
+#define NEIGHBORS_DEFAULT_K ( 8 )
+#define NEIGHBORS_MAX_K ( 32 )
+
+// RSSI (dBm) of pairs that didn't hear each other
+#define NEIGHBOR_NO_SIGNAL ( -999.0 )
+
+#define NEIGHBOR_PACKET_MARKER ( 'K' )
+#define NEIGHBOR_HEADER_SIZE ( 3 )
+
+//
+// Packet layout (all uint8_t):
+//   [0] NEIGHBOR_PACKET_MARKER
+//   [1] N (devices, not including the AP)
+//   [2] k (most neighbors in a row)
+//   Then for each row (receiver) 0..N, index 0 is the AP:
+//   [count] followed by count pairs of [transmitter index][raw cc2500 RSSI]
+//
+// A zero is added at the end if the size would be a perfect square, so a
+// neighbor packet is never mistaken for a dense (N+1)x(N+1) table.
+//
+#define NEIGHBOR_PACKET_MAX_SIZE( n, k ) \
+  ( NEIGHBOR_HEADER_SIZE + ( (n) + 1 ) * ( 1 + 2 * (k) ) + 1 )
+
+typedef struct
+{
+  uint8_t device_count;   // N
+  uint8_t max_neighbors;  // k, the size of each row
+  uint8_t* counts;        // Neighbors in each row [N+1]
+  uint8_t* ids;           // Table index of each neighbor (transmitter)
+                          // [(N+1)*k], row major
+  energy_t* rssi;         // Received power (dBm) [(N+1)*k]
+} neighbor_table_t;
+
+uint8_t neighbor_table_allocate( neighbor_table_t*, uint8_t, uint8_t );
+void neighbor_table_free( neighbor_table_t* );
+void neighbor_table_from_dense( neighbor_table_t*, const energy_t* );
+uint16_t neighbor_table_pack( const neighbor_table_t*, uint8_t* );
+uint8_t neighbor_table_unpack( neighbor_table_t*, const uint8_t*, uint16_t );
+uint8_t is_neighbor_packet( const uint8_t*, uint16_t );
+
+#endif /* _NEIGHBORS_H */
@@ -0,0 +1,436 @@
+/** @file roundlog.c
+*
+* @brief Binary round log. The routing thread fills a preallocated record
+*        every round and pushes it into a lock-free single producer/single
+*        consumer queue. A background thread drains the queue into the log
+*        file with large sequential writes, so no formatting or file I/O
+*        happens on the routing thread. See logexport to get the csv files.
+*
+*        Each network has its own log (see roundlog_select), and one writer
+*        thread serves all open logs.
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "roundlog.h"
+
+static void *roundlog_write_thread( void* );
+static void roundlog_flush( roundlog_t* p_flush );
+
+struct roundlog_s
+{
+  int32_t fd;
+
+  // Queue storage. head is only written by the producer (routing thread)
+  // and tail only by the writer thread. Both always increase, the ring
+  // offset is (counter % ROUNDLOG_QUEUE_SIZE)
+  uint8_t* ring;
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+
+  uint32_t dropped;
+
+  // Record handed out by roundlog_get_record (reused every round)
+  roundlog_record_t* p_record;
+  uint8_t record_device_count;
+  uint8_t record_max_neighbors;
+
+  // Next open log (see open_logs)
+  roundlog_t* p_next;
+};
+
+// Log used by threads that never call roundlog_select()
+static roundlog_t default_log = { -1 };
+static __thread roundlog_t* p_log = &default_log;
+
+// Fields of the selected log
+#define log_fd ( p_log->fd )
+#define queue ( p_log->ring )
+#define queue_head ( p_log->head )
+#define queue_tail ( p_log->tail )
+#define dropped_records ( p_log->dropped )
+#define p_current_record ( p_log->p_record )
+#define current_device_count ( p_log->record_device_count )
+#define current_max_neighbors ( p_log->record_max_neighbors )
+
+// Logs the writer thread drains. mutex_writer is held while the thread is
+// started or stopped, mutex_open_logs while the list is used.
+static roundlog_t* open_logs;
+static pthread_mutex_t mutex_open_logs = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mutex_writer = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t write_thread;
+static atomic_int running;
+
+/*******************************************************************************
+ * @fn    roundlog_t* roundlog_create()
+ *
+ * @brief Allocate a (closed) log, see roundlog_select
+ * ****************************************************************************/
+roundlog_t* roundlog_create()
+{
+  roundlog_t* p_new_log = calloc( 1, sizeof(roundlog_t) );
+
+  if( NULL != p_new_log )
+  {
+    p_new_log->fd = -1;
+  }
+
+  return p_new_log;
+}
+
+/*******************************************************************************
+ * @fn    void roundlog_destroy( roundlog_t* p_destroy )
+ *
+ * @brief Close (if open) and free a log from roundlog_create
+ * ****************************************************************************/
+void roundlog_destroy( roundlog_t* p_destroy )
+{
+  roundlog_t* p_selected = p_log;
+
+  if( NULL == p_destroy )
+  {
+    return;
+  }
+
+  p_log = p_destroy;
+  roundlog_close();
+
+  p_log = ( p_selected == p_destroy ) ? &default_log : p_selected;
+  free( p_destroy );
+}
+
+/*******************************************************************************
+ * @fn    void roundlog_select( roundlog_t* p_select )
+ *
+ * @brief Make the calling thread use p_select from now on (NULL for the
+ *        default log). Only one thread may push to a log.
+ * ****************************************************************************/
+void roundlog_select( roundlog_t* p_select )
+{
+  p_log = ( NULL != p_select ) ? p_select : &default_log;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t roundlog_open( const char* filename )
+ *
+ * @brief Create log file, write header and start writer thread
+ * ****************************************************************************/
+uint8_t roundlog_open( const char* filename )
+{
+  roundlog_header_t header;
+
+  log_fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if( log_fd < 0 )
+  {
+    printf( "Error opening round log file.\r\n" );
+    return 1;
+  }
+
+  header.magic = ROUNDLOG_MAGIC;
+  header.version = ROUNDLOG_VERSION;
+  header.energy_size = sizeof(energy_t);
+
+  if( write( log_fd, &header, sizeof(header) ) != sizeof(header) )
+  {
+    printf( "Error writing round log header.\r\n" );
+    close( log_fd );
+    return 1;
+  }
+
+  queue = malloc( ROUNDLOG_QUEUE_SIZE );
+  if( NULL == queue )
+  {
+    close( log_fd );
+    return 1;
+  }
+
+  atomic_store( &queue_head, 0 );
+  atomic_store( &queue_tail, 0 );
+
+  pthread_mutex_lock( &mutex_writer );
+
+  // First open log starts the writer thread
+  if( NULL == open_logs )
+  {
+    atomic_store( &running, 1 );
+
+    if( pthread_create( &write_thread, NULL, roundlog_write_thread, NULL ) )
+    {
+      pthread_mutex_unlock( &mutex_writer );
+      printf( "Error creating round log thread\n" );
+      free( queue );
+      queue = NULL;
+      close( log_fd );
+      log_fd = -1;
+      return 1;
+    }
+  }
+
+  pthread_mutex_lock( &mutex_open_logs );
+  p_log->p_next = open_logs;
+  open_logs = p_log;
+  pthread_mutex_unlock( &mutex_open_logs );
+
+  pthread_mutex_unlock( &mutex_writer );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void roundlog_close()
+ *
+ * @brief Write out everything still queued and close the file
+ * ****************************************************************************/
+void roundlog_close()
+{
+  roundlog_t** pp_open;
+
+  if( log_fd < 0 )
+  {
+    return;
+  }
+
+  pthread_mutex_lock( &mutex_writer );
+
+  // Once off the list the writer thread won't touch this log again
+  pthread_mutex_lock( &mutex_open_logs );
+  for( pp_open = &open_logs; NULL != *pp_open; pp_open = &(*pp_open)->p_next )
+  {
+    if( *pp_open == p_log )
+    {
+      *pp_open = p_log->p_next;
+      break;
+    }
+  }
+  pthread_mutex_unlock( &mutex_open_logs );
+
+  roundlog_flush( p_log );
+
+  // Last open log stops the writer thread
+  if( NULL == open_logs )
+  {
+    atomic_store( &running, 0 );
+    pthread_join( write_thread, NULL );
+  }
+
+  pthread_mutex_unlock( &mutex_writer );
+
+  close( log_fd );
+  log_fd = -1;
+
+  if( dropped_records > 0 )
+  {
+    printf( "Round log dropped %d records.\n", dropped_records );
+  }
+
+  free( queue );
+  free( p_current_record );
+  queue = NULL;
+  p_current_record = NULL;
+  current_device_count = 0;
+  current_max_neighbors = 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t roundlog_get_record( uint8_t device_count,
+ *                  uint8_t max_neighbors, roundlog_tables_t* p_tables )
+ *
+ * @brief Get the record to fill in for this round (max_neighbors is 0 for
+ *        dense tables). Only allocates when the network size changes.
+ * ****************************************************************************/
+uint8_t roundlog_get_record( uint8_t device_count, uint8_t max_neighbors,
+                                                  roundlog_tables_t* p_tables )
+{
+  roundlog_record_t* p_record;
+  uint32_t record_size = ROUNDLOG_RECORD_SIZE( device_count, max_neighbors );
+
+  if( ( NULL == p_current_record ) ||
+      ( device_count != current_device_count ) ||
+      ( max_neighbors != current_max_neighbors ) )
+  {
+    p_record = realloc( p_current_record, record_size );
+    if( NULL == p_record )
+    {
+      return 1;
+    }
+
+    memset( p_record, 0, record_size );
+    p_record->record_size = record_size;
+    p_record->device_count = device_count;
+    p_record->max_neighbors = max_neighbors;
+
+    p_current_record = p_record;
+    current_device_count = device_count;
+    current_max_neighbors = max_neighbors;
+  }
+
+  roundlog_map_record( p_current_record, p_tables );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t roundlog_push( roundlog_tables_t* p_tables )
+ *
+ * @brief Queue a record for writing. Never blocks, if the queue is full the
+ *        record is dropped (and counted). Returns 1 if dropped.
+ * ****************************************************************************/
+uint8_t roundlog_push( roundlog_tables_t* p_tables )
+{
+  uint8_t* p_data = (uint8_t*)p_tables->p_record;
+  uint32_t size = p_tables->p_record->record_size;
+  uint64_t head = atomic_load_explicit( &queue_head, memory_order_relaxed );
+  uint64_t tail = atomic_load_explicit( &queue_tail, memory_order_acquire );
+  uint32_t offset = head % ROUNDLOG_QUEUE_SIZE;
+  uint32_t first_part;
+
+  if( ( NULL == queue ) || ( size > ( ROUNDLOG_QUEUE_SIZE - ( head - tail ) ) ) )
+  {
+    dropped_records++;
+    return 1;
+  }
+
+  // Copy in up to two pieces if the record wraps around
+  first_part = ROUNDLOG_QUEUE_SIZE - offset;
+  if( first_part > size )
+  {
+    first_part = size;
+  }
+
+  memcpy( &queue[offset], p_data, first_part );
+  memcpy( queue, p_data + first_part, size - first_part );
+
+  atomic_store_explicit( &queue_head, head + size, memory_order_release );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint32_t roundlog_dropped()
+ *
+ * @brief Number of records dropped because the queue was full
+ * ****************************************************************************/
+uint32_t roundlog_dropped()
+{
+  return dropped_records;
+}
+
+/*******************************************************************************
+ * @fn    void roundlog_map_record( roundlog_record_t* p_record,
+ *                                             roundlog_tables_t* p_tables )
+ *
+ * @brief Fill in pointers to each table in the record's payload
+ * ****************************************************************************/
+void roundlog_map_record( roundlog_record_t* p_record,
+                                                roundlog_tables_t* p_tables )
+{
+  uint8_t device_count = p_record->device_count;
+  uint8_t max_neighbors = p_record->max_neighbors;
+  uint32_t table_cells = ROUNDLOG_TABLE_CELLS( device_count, max_neighbors );
+
+  p_tables->p_record = p_record;
+  p_tables->rssi_table = (energy_t*)( p_record + 1 );
+  p_tables->link_power_table = p_tables->rssi_table + table_cells;
+  p_tables->previous_powers = p_tables->link_power_table + table_cells;
+  p_tables->link_powers = p_tables->previous_powers + device_count;
+  p_tables->energies = p_tables->link_powers + device_count;
+  p_tables->route_table =
+                  (uint8_t*)( p_tables->energies + ( device_count + 1 ) );
+
+  if( max_neighbors > 0 )
+  {
+    p_tables->neighbor_counts = p_tables->route_table + device_count;
+    p_tables->neighbor_ids = p_tables->neighbor_counts + ( device_count + 1 );
+  }
+  else
+  {
+    p_tables->neighbor_counts = NULL;
+    p_tables->neighbor_ids = NULL;
+  }
+}
+
+/*******************************************************************************
+ * @fn    void *roundlog_write_thread( void* arg )
+ *
+ * @brief Periodically write everything queued in each open log to its file
+ * ****************************************************************************/
+static void *roundlog_write_thread( void* arg )
+{
+  uint8_t keep_running;
+  roundlog_t* p_open;
+
+  do
+  {
+    keep_running = atomic_load( &running );
+
+    pthread_mutex_lock( &mutex_open_logs );
+    for( p_open = open_logs; NULL != p_open; p_open = p_open->p_next )
+    {
+      roundlog_flush( p_open );
+    }
+    pthread_mutex_unlock( &mutex_open_logs );
+
+    if( keep_running )
+    {
+      usleep( ROUNDLOG_WRITE_INTERVAL_US );
+    }
+  } while( keep_running );
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * @fn    void roundlog_flush( roundlog_t* p_flush )
+ *
+ * @brief Write all records queued in p_flush (one writev, two pieces if it
+ *        wraps)
+ * ****************************************************************************/
+static void roundlog_flush( roundlog_t* p_flush )
+{
+  uint64_t head = atomic_load_explicit( &p_flush->head,
+                                                        memory_order_acquire );
+  uint64_t tail = atomic_load_explicit( &p_flush->tail,
+                                                        memory_order_relaxed );
+  uint32_t offset;
+  uint32_t first_part;
+  struct iovec iov[2];
+  int32_t iov_count;
+  ssize_t written;
+
+  while( head != tail )
+  {
+    offset = tail % ROUNDLOG_QUEUE_SIZE;
+    first_part = ROUNDLOG_QUEUE_SIZE - offset;
+    if( first_part > ( head - tail ) )
+    {
+      first_part = head - tail;
+    }
+
+    iov[0].iov_base = &p_flush->ring[offset];
+    iov[0].iov_len = first_part;
+    iov[1].iov_base = p_flush->ring;
+    iov[1].iov_len = ( head - tail ) - first_part;
+    iov_count = ( iov[1].iov_len > 0 ) ? 2 : 1;
+
+    written = writev( p_flush->fd, iov, iov_count );
+    if( written <= 0 )
+    {
+      perror( "Error writing round log" );
+      // Drop what's queued so the routing thread can keep going
+      written = head - tail;
+    }
+
+    tail += written;
+    atomic_store_explicit( &p_flush->tail, tail,
+                                                        memory_order_release );
+  }
+}
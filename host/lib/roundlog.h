@@ -0,0 +1,95 @@
+/** @file roundlog.h
+*
+* @brief Binary round log definitions
+*
+* @author Alvaro Prieto
+*/
+#ifndef _ROUNDLOG_H
+#define _ROUNDLOG_H
+
+#include <stdint.h>
+#include "dijkstra.h"
+
+#define ROUNDLOG_MAGIC    ( 0x474C5243 ) // "CRLG"
+#define ROUNDLOG_VERSION  ( 2 )
+
+// Size of the queue between the routing thread and the writer thread
+#define ROUNDLOG_QUEUE_SIZE ( 1 << 20 )
+
+// How often the writer thread writes out queued records
+#define ROUNDLOG_WRITE_INTERVAL_US ( 100000 )
+
+//
+// File layout: roundlog_header_t followed by one record per round. A record
+// is roundlog_record_t followed by the payload below. Record size only
+// depends on the network size (N) and neighbors per row (k, 0 for dense
+// tables) at that round. Rows are N+1 entries long for dense tables and k
+// for sparse ones (see neighbors.h).
+//
+// Payload (energy_t unless noted):
+//   rssi_table[(N+1)*row]         Received power (dBm), row major
+//   link_power_table[(N+1)*row]   Required tx power (dBm)
+//   previous_powers[N]            Tx power each node used for this table (dBm)
+//   link_powers[N]                Power of the selected links (Watts)
+//   energies[N+1]                 Minimum energy, then energy of nodes 1..N
+//   route_table[N]                (uint8_t) Next hop of nodes 1..N
+//   neighbor_counts[N+1]          (uint8_t, sparse only) Entries in each row
+//   neighbor_ids[(N+1)*k]         (uint8_t, sparse only) Transmitter of each
+//                                 entry
+//
+// Version 1 logs are the same with k always 0.
+//
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t energy_size;       // sizeof(energy_t)
+} roundlog_header_t;
+
+typedef struct
+{
+  uint32_t record_size;       // Total size, including this header
+  uint32_t round;
+  uint8_t device_count;
+  uint8_t max_neighbors;      // k (0 for dense tables)
+  uint8_t reserved[6];
+} roundlog_record_t;
+
+// Pointers into a record's payload
+typedef struct
+{
+  roundlog_record_t* p_record;
+  energy_t* rssi_table;
+  energy_t* link_power_table;
+  energy_t* previous_powers;
+  energy_t* link_powers;
+  energy_t* energies;
+  uint8_t* route_table;
+  uint8_t* neighbor_counts;   // NULL for dense tables
+  uint8_t* neighbor_ids;      // NULL for dense tables
+} roundlog_tables_t;
+
+#define ROUNDLOG_TABLE_CELLS( n, k ) \
+  ( ( (uint32_t)(n) + 1 ) * ( (k) ? (k) : ( (n) + 1 ) ) )
+
+// Record size is rounded up so every record starts 8 byte aligned
+#define ROUNDLOG_RECORD_SIZE( n, k ) \
+  ( ( sizeof(roundlog_record_t) + \
+      ( 2 * ROUNDLOG_TABLE_CELLS( n, k ) + 3 * (n) + 1 ) * sizeof(energy_t) + \
+      (n) + ( (k) ? ( (n) + 1 + ROUNDLOG_TABLE_CELLS( n, k ) ) : 0 ) + \
+      7 ) & ~7u )
+
+typedef struct roundlog_s roundlog_t;
+
+roundlog_t* roundlog_create();
+void roundlog_destroy( roundlog_t* );
+void roundlog_select( roundlog_t* );
+uint8_t roundlog_open( const char* filename );
+void roundlog_close();
+uint8_t roundlog_get_record( uint8_t device_count, uint8_t max_neighbors,
+                                                      roundlog_tables_t* );
+uint8_t roundlog_push( roundlog_tables_t* );
+uint32_t roundlog_dropped();
+void roundlog_map_record( roundlog_record_t*, roundlog_tables_t* );
+
+#endif /* _ROUNDLOG_H */
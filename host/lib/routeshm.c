@@ -0,0 +1,337 @@
+/** @file routeshm.c
+*
+* @brief Live routing state in POSIX shared memory. The routing thread
+*        publishes every round (see routing_publish) and any number of other
+*        processes read it without locks (see routeshm.h for the layout).
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "routeshm.h"
+
+// Tables start here, so energy_t arrays are aligned
+#define HEADER_SIZE ( ( sizeof(routeshm_header_t) + 63 ) & ~63u )
+
+// Entries in a table row by row (see routeshm.h)
+#define TABLE_CELLS( n, k ) \
+  ( ( (uint32_t)(n) + 1 ) * ( (k) ? (k) : ( (n) + 1 ) ) )
+
+static uint32_t segment_size( uint16_t max_device_count );
+static void map_tables( uint8_t* p_base, uint16_t max_device_count,
+                        uint8_t max_neighbors, routeshm_tables_t* p_tables );
+static void copy_tables( routeshm_tables_t* p_to, routeshm_tables_t* p_from,
+                         uint8_t device_count, uint8_t max_neighbors );
+
+/*******************************************************************************
+ * @fn    uint8_t routeshm_open( routeshm_t* p_shm, const char* name )
+ *
+ * @brief Create (or take over) shared memory segment 'name' (i.e.
+ *        "/routing_port16") for publishing rounds. Returns 1 on error.
+ * ****************************************************************************/
+uint8_t routeshm_open( routeshm_t* p_shm, const char* name )
+{
+  uint32_t size = segment_size( ROUTESHM_MAX_DEVICES );
+
+  snprintf( p_shm->name, sizeof(p_shm->name), "%s", name );
+
+  p_shm->fd = shm_open( name, O_CREAT | O_RDWR | O_TRUNC, 0644 );
+  if( p_shm->fd < 0 )
+  {
+    return 1;
+  }
+
+  // Pages that are never used (large networks only) are never allocated
+  if( ftruncate( p_shm->fd, size ) )
+  {
+    close( p_shm->fd );
+    shm_unlink( name );
+    return 1;
+  }
+
+  p_shm->p_header = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                              p_shm->fd, 0 );
+  if( MAP_FAILED == p_shm->p_header )
+  {
+    close( p_shm->fd );
+    shm_unlink( name );
+    return 1;
+  }
+
+  p_shm->p_header->magic = ROUTESHM_MAGIC;
+  p_shm->p_header->version = ROUTESHM_VERSION;
+  p_shm->p_header->energy_size = sizeof(energy_t);
+  p_shm->p_header->segment_size = size;
+  p_shm->p_header->max_device_count = ROUTESHM_MAX_DEVICES;
+  atomic_store( &p_shm->p_header->sequence, 0 );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void routeshm_close( routeshm_t* p_shm )
+ *
+ * @brief Stop publishing and remove the segment (readers still attached keep
+ *        the last round)
+ * ****************************************************************************/
+void routeshm_close( routeshm_t* p_shm )
+{
+  munmap( p_shm->p_header, p_shm->p_header->segment_size );
+  close( p_shm->fd );
+  shm_unlink( p_shm->name );
+}
+
+/*******************************************************************************
+ * @fn    void routeshm_begin( routeshm_t* p_shm,
+ *                                      const routeshm_state_t* p_state,
+ *                                      routeshm_tables_t* p_tables )
+ *
+ * @brief Start publishing a round. Fill in p_tables (sized for
+ *        p_state->device_count and max_neighbors) and call routeshm_end.
+ * ****************************************************************************/
+void routeshm_begin( routeshm_t* p_shm, const routeshm_state_t* p_state,
+                                                  routeshm_tables_t* p_tables )
+{
+  atomic_uint* p_sequence = &p_shm->p_header->sequence;
+
+  // Odd while writing, readers retry
+  atomic_store_explicit( p_sequence,
+            atomic_load_explicit( p_sequence, memory_order_relaxed ) + 1,
+            memory_order_relaxed );
+  atomic_thread_fence( memory_order_release );
+
+  p_shm->p_header->state = *p_state;
+
+  map_tables( (uint8_t*)p_shm->p_header, ROUTESHM_MAX_DEVICES,
+                                            p_state->max_neighbors, p_tables );
+}
+
+/*******************************************************************************
+ * @fn    void routeshm_end( routeshm_t* p_shm )
+ *
+ * @brief Done publishing a round
+ * ****************************************************************************/
+void routeshm_end( routeshm_t* p_shm )
+{
+  atomic_uint* p_sequence = &p_shm->p_header->sequence;
+
+  atomic_store_explicit( p_sequence,
+            atomic_load_explicit( p_sequence, memory_order_relaxed ) + 1,
+            memory_order_release );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t routeshm_attach( routeshm_reader_t* p_reader,
+ *                                                      const char* name )
+ *
+ * @brief Map shared memory segment 'name' for reading. Returns 1 if it
+ *        doesn't exist or isn't a routing state segment.
+ * ****************************************************************************/
+uint8_t routeshm_attach( routeshm_reader_t* p_reader, const char* name )
+{
+  struct stat info;
+
+  memset( p_reader, 0, sizeof(routeshm_reader_t) );
+
+  p_reader->fd = shm_open( name, O_RDONLY, 0 );
+  if( p_reader->fd < 0 )
+  {
+    return 1;
+  }
+
+  if( fstat( p_reader->fd, &info ) ||
+      ( info.st_size < (off_t)HEADER_SIZE ) )
+  {
+    close( p_reader->fd );
+    return 1;
+  }
+
+  p_reader->p_header = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED,
+                                                            p_reader->fd, 0 );
+  if( MAP_FAILED == p_reader->p_header )
+  {
+    close( p_reader->fd );
+    return 1;
+  }
+
+  if( ( ROUTESHM_MAGIC != p_reader->p_header->magic ) ||
+      ( ROUTESHM_VERSION != p_reader->p_header->version ) ||
+      ( sizeof(energy_t) != p_reader->p_header->energy_size ) ||
+      ( p_reader->p_header->segment_size != info.st_size ) ||
+      ( segment_size( p_reader->p_header->max_device_count ) !=
+                                      p_reader->p_header->segment_size ) )
+  {
+    munmap( p_reader->p_header, info.st_size );
+    close( p_reader->fd );
+    return 1;
+  }
+
+  p_reader->p_copy = malloc( p_reader->p_header->segment_size );
+  if( NULL == p_reader->p_copy )
+  {
+    munmap( p_reader->p_header, info.st_size );
+    close( p_reader->fd );
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void routeshm_detach( routeshm_reader_t* p_reader )
+ *
+ * @brief Unmap a segment from routeshm_attach
+ * ****************************************************************************/
+void routeshm_detach( routeshm_reader_t* p_reader )
+{
+  munmap( p_reader->p_header, p_reader->p_header->segment_size );
+  close( p_reader->fd );
+  free( p_reader->p_copy );
+  p_reader->p_copy = NULL;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t routeshm_read( routeshm_reader_t* p_reader )
+ *
+ * @brief Copy the last round published into p_reader->state and
+ *        p_reader->tables. Never blocks the writer. Returns 1 if nothing was
+ *        published yet or no consistent copy could be made (writer too busy).
+ * ****************************************************************************/
+uint8_t routeshm_read( routeshm_reader_t* p_reader )
+{
+  routeshm_header_t* p_header = p_reader->p_header;
+  routeshm_tables_t shared_tables;
+  uint32_t sequence;
+  uint32_t attempt;
+
+  for( attempt = 0; attempt < ROUTESHM_READ_RETRIES; attempt++ )
+  {
+    sequence = atomic_load_explicit( &p_header->sequence,
+                                                      memory_order_acquire );
+    if( 0 == sequence )
+    {
+      return 1;
+    }
+
+    if( sequence & 1 )
+    {
+      // Round being written
+      sched_yield();
+      continue;
+    }
+
+    p_reader->state = p_header->state;
+
+    // Sizes can be torn too, only trust them once the sequence is checked
+    if( ( p_reader->state.device_count <= p_header->max_device_count ) &&
+        ( p_reader->state.max_neighbors <= p_header->max_device_count ) )
+    {
+      map_tables( (uint8_t*)p_header, p_header->max_device_count,
+                            p_reader->state.max_neighbors, &shared_tables );
+      map_tables( p_reader->p_copy, p_header->max_device_count,
+                            p_reader->state.max_neighbors, &p_reader->tables );
+      copy_tables( &p_reader->tables, &shared_tables,
+                  p_reader->state.device_count, p_reader->state.max_neighbors );
+    }
+
+    atomic_thread_fence( memory_order_acquire );
+
+    if( sequence == atomic_load_explicit( &p_header->sequence,
+                                                      memory_order_relaxed ) )
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn    uint32_t segment_size( uint16_t max_device_count )
+ *
+ * @brief Size of a segment with room for max_device_count devices
+ * ****************************************************************************/
+static uint32_t segment_size( uint16_t max_device_count )
+{
+  uint32_t cells = TABLE_CELLS( max_device_count, 0 );
+
+  return HEADER_SIZE +
+          ( 2 * cells + 3 * max_device_count + 1 ) * sizeof(energy_t) +
+          2 * max_device_count + ( max_device_count + 1 ) + cells;
+}
+
+/*******************************************************************************
+ * @fn    void map_tables( uint8_t* p_base, uint16_t max_device_count,
+ *                         uint8_t max_neighbors, routeshm_tables_t* p_tables )
+ *
+ * @brief Point p_tables at the tables of a segment (or a copy of one) that
+ *        starts at p_base
+ * ****************************************************************************/
+static void map_tables( uint8_t* p_base, uint16_t max_device_count,
+                        uint8_t max_neighbors, routeshm_tables_t* p_tables )
+{
+  uint32_t cells = TABLE_CELLS( max_device_count, 0 );
+  energy_t* p_energy = (energy_t*)( p_base + HEADER_SIZE );
+  uint8_t* p_byte;
+
+  p_tables->rssi_table = p_energy;
+  p_tables->link_power_table = p_tables->rssi_table + cells;
+  p_tables->previous_powers = p_tables->link_power_table + cells;
+  p_tables->link_powers = p_tables->previous_powers + max_device_count;
+  p_tables->energies = p_tables->link_powers + max_device_count;
+
+  p_byte = (uint8_t*)( p_tables->energies + max_device_count + 1 );
+  p_tables->route_table = p_byte;
+  p_tables->power_table = p_tables->route_table + max_device_count;
+
+  if( max_neighbors > 0 )
+  {
+    p_tables->neighbor_counts = p_tables->power_table + max_device_count;
+    p_tables->neighbor_ids = p_tables->neighbor_counts + max_device_count + 1;
+  }
+  else
+  {
+    p_tables->neighbor_counts = NULL;
+    p_tables->neighbor_ids = NULL;
+  }
+}
+
+/*******************************************************************************
+ * @fn    void copy_tables( routeshm_tables_t* p_to, routeshm_tables_t* p_from,
+ *                          uint8_t device_count, uint8_t max_neighbors )
+ *
+ * @brief Copy the part of each table used by a network of device_count
+ *        devices
+ * ****************************************************************************/
+static void copy_tables( routeshm_tables_t* p_to, routeshm_tables_t* p_from,
+                         uint8_t device_count, uint8_t max_neighbors )
+{
+  uint32_t cells = TABLE_CELLS( device_count, max_neighbors );
+
+  memcpy( p_to->rssi_table, p_from->rssi_table, cells * sizeof(energy_t) );
+  memcpy( p_to->link_power_table, p_from->link_power_table,
+                                                  cells * sizeof(energy_t) );
+  memcpy( p_to->previous_powers, p_from->previous_powers,
+                                            device_count * sizeof(energy_t) );
+  memcpy( p_to->link_powers, p_from->link_powers,
+                                            device_count * sizeof(energy_t) );
+  memcpy( p_to->energies, p_from->energies,
+                                    ( device_count + 1 ) * sizeof(energy_t) );
+  memcpy( p_to->route_table, p_from->route_table, device_count );
+  memcpy( p_to->power_table, p_from->power_table, device_count );
+
+  if( max_neighbors > 0 )
+  {
+    memcpy( p_to->neighbor_counts, p_from->neighbor_counts,
+                                                          device_count + 1 );
+    memcpy( p_to->neighbor_ids, p_from->neighbor_ids, cells );
+  }
+}
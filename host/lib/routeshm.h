@@ -0,0 +1,114 @@
+/** @file routeshm.h
+*
+* @brief Live routing state in POSIX shared memory, for external readers
+*
+* @author Alvaro Prieto
+*/
+#ifndef _ROUTESHM_H
+#define _ROUTESHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "dijkstra.h"
+
+#define ROUTESHM_MAGIC    ( 0x48535243 ) // "CRSH"
+#define ROUTESHM_VERSION  ( 1 )
+
+// Segment name of the network on a serial port (threadtest and routingd)
+#define ROUTESHM_NAME_FORMAT "/routing_port%d"
+
+// Largest network the segment has room for (same as MAX_NETWORK_SIZE)
+#define ROUTESHM_MAX_DEVICES ( 254 )
+
+// Times a reader tries to get a consistent copy before giving up
+#define ROUTESHM_READ_RETRIES ( 1000 )
+
+//
+// Segment layout: routeshm_header_t, then the last round's tables. Each
+// table has room for ROUTESHM_MAX_DEVICES devices, but only the start of it
+// is used, packed like a round log record (see roundlog.h): rows are N+1
+// entries long for dense tables and k for sparse ones.
+//
+//   rssi_table[(N+1)*row]         Received power (dBm), row major
+//   link_power_table[(N+1)*row]   Required tx power (dBm)
+//   previous_powers[N]            Tx power each node used for this table (dBm)
+//   link_powers[N]                Power of the selected links (Watts)
+//   energies[N+1]                 Minimum energy, then energy of nodes 1..N
+//   route_table[N]                (uint8_t) Next hop of nodes 1..N
+//   power_table[N]                (uint8_t) Power register setting sent
+//   neighbor_counts[N+1]          (uint8_t, sparse only) Entries in each row
+//   neighbor_ids[(N+1)*k]         (uint8_t, sparse only) Transmitter of each
+//                                 entry
+//
+// Everything after sequence is written under a seqlock: the writer makes
+// sequence odd, updates the round and makes it even again. Readers copy the
+// round and start over if sequence was odd or changed in between, so they
+// never hold up the routing thread.
+//
+typedef struct
+{
+  uint32_t round;
+  uint8_t device_count;
+  uint8_t max_neighbors;        // k (0 for dense tables)
+  uint8_t reserved[2];
+  energy_t c_factor;
+  uint64_t round_start_ns;      // CLOCK_REALTIME when routing started
+  uint64_t round_end_ns;        // and when the tables were ready
+} routeshm_state_t;
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t energy_size;         // sizeof(energy_t)
+  uint32_t segment_size;
+  uint16_t max_device_count;
+  uint16_t reserved;
+  atomic_uint sequence;         // Rounds published * 2, odd while writing
+  uint32_t reserved_2;
+  routeshm_state_t state;
+} routeshm_header_t;
+
+// Pointers to the tables of a segment (or of a reader's copy)
+typedef struct
+{
+  energy_t* rssi_table;
+  energy_t* link_power_table;
+  energy_t* previous_powers;
+  energy_t* link_powers;
+  energy_t* energies;
+  uint8_t* route_table;
+  uint8_t* power_table;
+  uint8_t* neighbor_counts;     // NULL for dense tables
+  uint8_t* neighbor_ids;        // NULL for dense tables
+} routeshm_tables_t;
+
+// Writer side
+typedef struct
+{
+  int fd;
+  char name[64];
+  routeshm_header_t* p_header;
+} routeshm_t;
+
+// Reader side. After routeshm_read, state and tables hold a consistent copy
+// of the last round published.
+typedef struct
+{
+  int fd;
+  routeshm_header_t* p_header;
+  uint8_t* p_copy;
+  routeshm_state_t state;
+  routeshm_tables_t tables;
+} routeshm_reader_t;
+
+uint8_t routeshm_open( routeshm_t*, const char* );
+void routeshm_close( routeshm_t* );
+void routeshm_begin( routeshm_t*, const routeshm_state_t*, routeshm_tables_t* );
+void routeshm_end( routeshm_t* );
+
+uint8_t routeshm_attach( routeshm_reader_t*, const char* );
+void routeshm_detach( routeshm_reader_t* );
+uint8_t routeshm_read( routeshm_reader_t* );
+
+#endif /* _ROUTESHM_H */
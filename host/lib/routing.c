@@ -9,349 +9,1267 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "routing.h"
+#include "roundlog.h"
+#include "latency.h"
+#include "rssifilter.h"
+#include "routeshm.h"
+#include "deframer.h"
 
 #define INBUFSIZE (512)
 
-void clean_table( energy_t p_rssi_table[][MAX_DEVICES+1] );
-void add_links_from_table( energy_t p_rssi_table[][MAX_DEVICES+1] );
+// Packets from the AP are deframed whole, up to the largest sparse table
+#if DEFRAMER_BUFFER_SIZE < \
+                  NEIGHBOR_PACKET_MAX_SIZE( MAX_NETWORK_SIZE, NEIGHBORS_MAX_K )
+#error "DEFRAMER_BUFFER_SIZE can't hold the largest neighbor packet"
+#endif
+
+void build_links_from_table();
 void compute_required_powers( energy_t*, uint8_t* );
-void print_rssi_table();
+void log_round( uint32_t round );
+static void publish_round( const uint8_t* p_power_table,
+                                        const struct timespec* p_start );
+static void record_history();
+static uint8_t allocate_tables( uint8_t new_device_count,
+                                                  uint8_t new_max_neighbors );
+static void free_tables();
+static uint8_t create_links();
+static void build_directed_links();
+static void build_neighbor_links();
+static void compute_neighbor_link_powers( const energy_t* p_tx_powers );
+static void compute_link_power_table( const energy_t* p_tx_powers );
+static void compute_link_power_row( energy_t* p_link_powers,
+                                    const energy_t* p_rssi,
+                                    const energy_t* p_tx_powers,
+                                    uint16_t size );
+static void dbm_to_watt_row( energy_t* p_watts, const energy_t* p_dbm,
+                                                              uint16_t size );
 
 uint8_t find_closest_power( energy_t power );
 double dbm_to_watt( double power );
 double watt_to_dbm( double power );
 
-energy_t target_rssi;
-energy_t rssi_table[MAX_DEVICES+1][MAX_DEVICES+1];
-energy_t link_power_table[MAX_DEVICES+1][MAX_DEVICES+1];
-energy_t link_powers[MAX_DEVICES];
-static energy_t previous_powers[MAX_DEVICES];
-static energy_t previous_powers_debug[MAX_DEVICES];
-uint8_t route_table_debug[MAX_DEVICES];
+//
+// Everything about one network. Each thread works on the context picked with
+// routing_select(), which also picks the context's graph, RSSI filter and
+// round log, so one process can route several networks at the same time.
+//
+struct routing_context_s
+{
+  // Number of devices in the network (not including the AP)
+  uint8_t device_count;
+
+  // Network size of the last tables handed to compute_routes_thread's caller
+  volatile uint8_t rp_device_count;
+
+  //
+  // With sparse tables (max_neighbors > 0) each row of rssi_table and
+  // link_power_table only holds up to max_neighbors entries, the transmitter
+  // of each entry is in neighbor_ids and the entries used in
+  // neighbor_counts (see neighbors.h). Nothing is sized by (N+1)^2 then.
+  //
+  uint8_t max_neighbors;
+  uint8_t* neighbor_ids;
+  uint8_t* neighbor_counts;
+
+  // Target received power (dBm)
+  energy_t target_rssi;
+  energy_t* rssi_table;
+
+  // Transmit power (dBm) required to meet target_rssi on each link
+  energy_t* link_power_table;
+  energy_t* link_powers;
+  energy_t* previous_powers;
+  energy_t* previous_powers_debug;
+  uint8_t* route_table_debug;
+
+  // Scratch rows used every round
+  energy_t* tx_powers;
+  energy_t* link_watts;
+
+  // Dijkstra link for each (upper triangle) table entry, or for every entry
+  // but the diagonal with directed links. Created when the network size
+  // changes and updated in place every round.
+  link_t** table_links;
+
+  // Links requiring more than this (dBm) are disabled
+  energy_t link_threshold;
+
+  // Held during a round so tables aren't updated (or resized) under it
+  pthread_mutex_t mutex_tables;
+
+  energy_t c_factor;
+
+  // Rounds computed
+  uint32_t round;
+
+  // What gets printed (see routing_output_t)
+  routing_output_t verbose;
+
+  // Rounds are written to the round log (routing_start was given a file)
+  uint8_t log_rounds;
+
+  // Rounds are published for other processes (see routing_publish)
+  routeshm_t* p_shm;
+
+  //
+  // Dense input tables of the last history_rounds rounds, each the RSSI table
+  // followed by the tx power of every device (ROUTING_HISTORY_SIZE values).
+  // Kept in a ring, the oldest round is at history_next once it's full. Only
+  // allocated if routing_set_history was called (see ctuner.c).
+  //
+  energy_t* history;
+  uint16_t history_rounds;
+  uint16_t history_count;
+  uint16_t history_next;
+  uint8_t history_device_count;
+
+  // Selected along with the context (NULL for the defaults)
+  graph_t* p_graph;
+  rssi_filter_t* p_filter;
+  roundlog_t* p_log;
+};
+
+// Context used by threads that never call routing_select()
+static routing_context_t default_context =
+{
+  .mutex_tables = PTHREAD_MUTEX_INITIALIZER,
+  .verbose = ROUTING_OUTPUT_ROUNDS
+};
+static __thread routing_context_t* p_ctx = &default_context;
+
+//
+// All tables are sized at runtime by routing_set_size(). The (N+1)x(N+1)
+// tables are stored row major and index 0 is the access point.
+//
+#define TABLE_SIZE ( p_ctx->device_count + 1 )
+#define TABLE( p_table, row, col ) ( p_table[(row) * TABLE_SIZE + (col)] )
+
+#define ROW_SIZE \
+  ( p_ctx->max_neighbors ? p_ctx->max_neighbors : TABLE_SIZE )
+
+// Link powers (dBm) above this come from tables where no packet was received
+// (RSSI of -999) and are not passed through the RSSI filter
+#define LINK_POWER_NO_SAMPLE ( 500.0 )
+
+#define AP_NODE_ID ( p_ctx->device_count + 1 )
+
+/*******************************************************************************
+ * @fn    routing_context_t* routing_context_create()
+ *
+ * @brief Allocate a context for one more network, with its own graph, RSSI
+ *        filter and round log. Select it (routing_select) and call
+ *        routing_start before using it.
+ * ****************************************************************************/
+routing_context_t* routing_context_create()
+{
+  routing_context_t* p_new = calloc( 1, sizeof(routing_context_t) );
+
+  if( NULL == p_new )
+  {
+    return NULL;
+  }
+
+  p_new->p_graph = graph_create();
+  p_new->p_filter = rssi_filter_create();
+  p_new->p_log = roundlog_create();
+  p_new->verbose = ROUTING_OUTPUT_ROUNDS;
+
+  if( ( NULL == p_new->p_graph ) || ( NULL == p_new->p_filter ) ||
+      ( NULL == p_new->p_log ) ||
+      pthread_mutex_init( &p_new->mutex_tables, NULL ) )
+  {
+    graph_destroy( p_new->p_graph );
+    rssi_filter_destroy( p_new->p_filter );
+    roundlog_destroy( p_new->p_log );
+    free( p_new );
+    return NULL;
+  }
+
+  return p_new;
+}
+
+/*******************************************************************************
+ * @fn    void routing_context_destroy( routing_context_t* p_destroy )
+ *
+ * @brief Free a context from routing_context_create. Call routing_finalize
+ *        with it selected first.
+ * ****************************************************************************/
+void routing_context_destroy( routing_context_t* p_destroy )
+{
+  if( NULL == p_destroy )
+  {
+    return;
+  }
+
+  if( p_ctx == p_destroy )
+  {
+    routing_select( NULL );
+  }
+
+  graph_destroy( p_destroy->p_graph );
+  rssi_filter_destroy( p_destroy->p_filter );
+  roundlog_destroy( p_destroy->p_log );
+  pthread_mutex_destroy( &p_destroy->mutex_tables );
+  free( p_destroy );
+}
+
+/*******************************************************************************
+ * @fn    void routing_select( routing_context_t* p_select )
+ *
+ * @brief Make the calling thread work on p_select (NULL for the default
+ *        context used by single network programs). Everything else in this
+ *        file, and the graph, RSSI filter and round log functions, then
+ *        apply to that network. A context must only be used by one thread
+ *        at a time (parse_* and compute_routes_thread excepted, they lock).
+ * ****************************************************************************/
+void routing_select( routing_context_t* p_select )
+{
+  p_ctx = ( NULL != p_select ) ? p_select : &default_context;
+
+  graph_select( p_ctx->p_graph );
+  rssi_filter_select( p_ctx->p_filter );
+  roundlog_select( p_ctx->p_log );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t routing_start( energy_t dijkstra_c_factor,
+ *                                             const char* log_filename )
+ *
+ * @brief Open round log and set routing parameters of the selected context.
+ *        Rounds aren't logged if log_filename is NULL. Tables are allocated
+ *        when the first RSSI table arrives (see routing_set_size)
+ * ****************************************************************************/
+uint8_t routing_start( energy_t dijkstra_c_factor, const char* log_filename )
+{
+  // Open binary round log (use logexport to generate the csv files)
+  if( NULL != log_filename )
+  {
+    if( roundlog_open( log_filename ) )
+    {
+      printf( "Error opening round log %s.\r\n", log_filename );
+      return 1;
+    }
+
+    p_ctx->log_rounds = 1;
+  }
+
+  // Store c_factor for later use
+  p_ctx->c_factor = dijkstra_c_factor;
+
+  p_ctx->target_rssi = -60.0;
+
+  p_ctx->link_threshold = watt_to_dbm( MAX_LINK_POWER * 100 );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t routing_publish( const char* shm_name )
+ *
+ * @brief Publish every round of the selected context in shared memory
+ *        segment shm_name (i.e. "/routing_port16"), until routing_finalize.
+ *        Other processes can read it with the functions in routeshm.h.
+ * ****************************************************************************/
+uint8_t routing_publish( const char* shm_name )
+{
+  p_ctx->p_shm = malloc( sizeof(routeshm_t) );
+
+  if( ( NULL == p_ctx->p_shm ) || routeshm_open( p_ctx->p_shm, shm_name ) )
+  {
+    printf( "Error opening shared memory %s.\r\n", shm_name );
+    free( p_ctx->p_shm );
+    p_ctx->p_shm = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void routing_set_verbose( routing_output_t verbose )
+ *
+ * @brief Choose what the selected context prints (every shortest path and
+ *        round number by default)
+ * ****************************************************************************/
+void routing_set_verbose( routing_output_t verbose )
+{
+  p_ctx->verbose = verbose;
+}
+
+/*******************************************************************************
+ * @fn    routing_context_t* routing_get_context()
+ *
+ * @brief Context selected by the calling thread (the default context if
+ *        routing_select was never called)
+ * ****************************************************************************/
+routing_context_t* routing_get_context()
+{
+  return p_ctx;
+}
+
+/*******************************************************************************
+ * @fn    void routing_set_c_factor( energy_t dijkstra_c_factor )
+ *
+ * @brief Change the cost function exponent of the selected context. Safe to
+ *        call while compute_routes_thread runs, it applies from the next
+ *        round on.
+ * ****************************************************************************/
+void routing_set_c_factor( energy_t dijkstra_c_factor )
+{
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
+  p_ctx->c_factor = dijkstra_c_factor;
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
+}
+
+/*******************************************************************************
+ * @fn    energy_t routing_get_c_factor()
+ *
+ * @brief Cost function exponent of the selected context
+ * ****************************************************************************/
+energy_t routing_get_c_factor()
+{
+  energy_t c_factor;
+
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
+  c_factor = p_ctx->c_factor;
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
+
+  return c_factor;
+}
+
+/*******************************************************************************
+ * @fn    void routing_set_history( uint16_t rounds )
+ *
+ * @brief Keep the dense input tables of the last 'rounds' rounds of the
+ *        selected context (0 to stop), see routing_get_history. Sparse
+ *        tables are not kept.
+ * ****************************************************************************/
+void routing_set_history( uint16_t rounds )
+{
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
+
+  // Allocated on the next round
+  free( p_ctx->history );
+  p_ctx->history = NULL;
+  p_ctx->history_rounds = rounds;
+  p_ctx->history_count = 0;
+  p_ctx->history_next = 0;
+  p_ctx->history_device_count = 0;
+
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
+}
+
+/*******************************************************************************
+ * @fn    uint16_t routing_get_history( energy_t** pp_history,
+ *                                               uint8_t* p_device_count )
+ *
+ * @brief Copy the rounds kept by routing_set_history, oldest first, into a
+ *        new array (ROUTING_HISTORY_SIZE( *p_device_count ) values per round)
+ *        the caller must free. Only rounds since the last network size
+ *        change are kept. Returns the number of rounds, 0 if there are none
+ *        (*pp_history is NULL then).
+ * ****************************************************************************/
+uint16_t routing_get_history( energy_t** pp_history, uint8_t* p_device_count )
+{
+  uint32_t round_size;
+  uint16_t rounds;
+  uint16_t oldest;
+
+  *pp_history = NULL;
+
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
+
+  rounds = p_ctx->history_count;
+  round_size = ROUTING_HISTORY_SIZE( p_ctx->history_device_count );
+
+  if( rounds > 0 )
+  {
+    *pp_history = malloc( rounds * round_size * sizeof(energy_t) );
+  }
+
+  if( NULL == *pp_history )
+  {
+    pthread_mutex_unlock ( &p_ctx->mutex_tables );
+    return 0;
+  }
+
+  // Ring is in two pieces once it wrapped around
+  oldest = ( rounds < p_ctx->history_rounds ) ? 0 : p_ctx->history_next;
+
+  memcpy( *pp_history, &p_ctx->history[oldest * round_size],
+                        ( rounds - oldest ) * round_size * sizeof(energy_t) );
+  memcpy( &(*pp_history)[( rounds - oldest ) * round_size], p_ctx->history,
+                                      oldest * round_size * sizeof(energy_t) );
 
-energy_t c_factor;
+  *p_device_count = p_ctx->history_device_count;
 
-FILE *fp_energies, *fp_routes, *fp_powers, *fp_rssi, *fp_debug;
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
 
-#define AP_NODE_ID (MAX_DEVICES+1)
+  return rounds;
+}
 
 /*******************************************************************************
  * @fn    uint8_t routing_initialize( energy_t dijkstra_c_factor )
  *
- * @brief Open all debugging files and initialize routing system
+ * @brief Open round log and initialize routing system for a single network
+ *        run by compute_routes_thread. Tables are allocated when the first
+ *        RSSI table arrives (see routing_set_size)
  * ****************************************************************************/
 uint8_t routing_initialize( energy_t dijkstra_c_factor )
 {
-  char node_id_string[3];
+  if( routing_start( dijkstra_c_factor, "./logs/rounds.bin" ) )
+  {
+    return 1;
+  }
+
+  pthread_mutex_init( &mutex_route_start, NULL );
+  pthread_mutex_init( &mutex_route_done, NULL );
+
+  // Start mutex locked
+  pthread_mutex_lock ( &mutex_route_start );
+
+  //print_node_energy( 0, fp_out );
+
+  printf("Round 0\n");
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void routing_finalize()
+ *
+ * @brief Call when finished. Write out and close round log and print route
+ *        change statistics.
+ * ****************************************************************************/
+void routing_finalize()
+{
+  route_stats_t stats;
+
+  roundlog_close();
+  p_ctx->log_rounds = 0;
+
+  if( NULL != p_ctx->p_shm )
+  {
+    routeshm_close( p_ctx->p_shm );
+    free( p_ctx->p_shm );
+    p_ctx->p_shm = NULL;
+  }
+
+  rssi_filter_finalize();
+
+  get_route_stats( &stats );
+  if( ( stats.rounds > 0 ) && ( p_ctx->verbose >= ROUTING_OUTPUT_SUMMARY ) )
+  {
+    printf( "Route changes: %d in %d rounds (%g per round)\n", stats.changes,
+                          stats.rounds, (double)stats.changes / stats.rounds );
+    printf( "Held back: %d, undone to break loops: %d\n", stats.suppressed,
+                                                                stats.loops );
+    printf( "Extra link power: %g W per round\n",
+                                            stats.extra_power / stats.rounds );
+  }
+
+  free_tables();
+  graph_finalize();
+}
+
+/*******************************************************************************
+ * @fn    uint8_t routing_set_size( uint8_t new_device_count,
+ *                                             uint8_t new_max_neighbors )
+ *
+ * @brief Size all tables and the routing graph for a network with
+ *        new_device_count devices (plus the AP) and sparse tables with up to
+ *        new_max_neighbors neighbors per row (0 for dense tables). Does
+ *        nothing if the size didn't change. Accumulated energy and previous
+ *        tx power are kept for the devices that are still in the network.
+ *        NOTE: Must not be called while a round is running (parse_table and
+ *        parse_table_d take care of this).
+ * ****************************************************************************/
+uint8_t routing_set_size( uint8_t new_device_count,
+                                                    uint8_t new_max_neighbors )
+{
+  char node_id_string[4];
+  uint8_t old_device_count = p_ctx->device_count;
   uint8_t node_index;
+  energy_t* saved_energies;
 
-  // Open output csv files
-  fp_energies = fopen( "./logs/energies.csv", "w" );
-  if( NULL == fp_energies )
+  if( ( new_device_count == p_ctx->device_count ) &&
+      ( new_max_neighbors == p_ctx->max_neighbors ) )
   {
-    printf( "Error opening energies file.\r\n" );
-    return 1;
+    return 0;
   }
 
-  fp_routes = fopen( "./logs/routes.csv", "w" );
-  if( NULL == fp_routes )
+  if( ( 0 == new_device_count ) || ( new_device_count > MAX_NETWORK_SIZE ) ||
+      ( new_max_neighbors > NEIGHBORS_MAX_K ) )
   {
-    printf( "Error opening routes file.\r\n" );
+    printf( "Invalid network size (%d devices, %d neighbors).\r\n",
+                                      new_device_count, new_max_neighbors );
     return 1;
   }
 
-  fp_powers = fopen( "./logs/powers.csv", "w" );
-  if( NULL == fp_powers )
+  // Keep accumulated energies for the nodes that stay in the network
+  saved_energies = calloc( new_device_count, sizeof(energy_t) );
+  if( NULL == saved_energies )
   {
-    printf( "Error opening powers file.\r\n" );
     return 1;
   }
 
-  fp_rssi = fopen( "./logs/rssi.csv", "w" );
-  if( NULL == fp_rssi )
+  for( node_index = 1; node_index <= old_device_count; node_index++ )
   {
-    printf( "Error opening rssi file.\r\n" );
-    return 1;
+    if( node_index <= new_device_count )
+    {
+      saved_energies[node_index - 1] = get_node_energy( node_index );
+    }
   }
 
-  fp_debug = fopen( "./logs/debug.csv", "w" );
-  if( NULL == fp_debug )
+  // Sparse tables only need room for the links in them, which are added
+  // again every round
+  graph_set_link_limit( ( new_device_count + 1 ) * new_max_neighbors );
+
+  // NOTE: RSSI filter state starts over when the network size changes. It
+  // is only used with dense tables, since the neighbors in a sparse row
+  // change from round to round.
+  if( allocate_tables( new_device_count, new_max_neighbors ) ||
+      graph_initialize( new_device_count + 1 ) ||
+      ( ( RSSI_FILTER_NONE != rssi_filter_get_type() ) &&
+        ( 0 == new_max_neighbors ) &&
+        rssi_filter_initialize( ( new_device_count + 1 ) *
+                                ( new_device_count + 1 ) ) ) )
   {
-    printf( "Error opening debug file.\r\n" );
+    printf( "Error allocating tables for %d devices.\r\n", new_device_count );
+    free( saved_energies );
+    free_tables();
+    p_ctx->device_count = 0;
+    p_ctx->max_neighbors = 0;
     return 1;
   }
 
-  // Store c_factor for later use
-  c_factor = dijkstra_c_factor;
-
-  target_rssi = dbm_to_watt(-60l);
+  p_ctx->device_count = new_device_count;
+  p_ctx->max_neighbors = new_max_neighbors;
 
   // Add nodes
   sprintf( node_id_string, "AP" );
   add_labeled_node( AP_NODE_ID, 0, node_id_string );
 
-  for( node_index = 0; node_index < MAX_DEVICES; node_index++ )
+  for( node_index = 0; node_index < p_ctx->device_count; node_index++ )
   {
     sprintf( node_id_string, "%d", ( node_index + 1 ) );
     add_labeled_node( ( node_index + 1 ), 0, node_id_string );
 
-    // Initialize previous power to maximum
-    previous_powers[node_index] =
+    // Initialize previous power to maximum for new nodes
+    if( node_index >= old_device_count )
+    {
+      p_ctx->previous_powers[node_index] =
                     power_values[sizeof(power_values)/sizeof(energy_t) - 1];
+    }
   }
 
-  pthread_mutex_init( &mutex_route_start, NULL );
-  pthread_mutex_init( &mutex_route_done, NULL );
-
-  // Start mutex locked
-  pthread_mutex_lock ( &mutex_route_start );
+  // Create every link up front (sparse tables build them every round)
+  if( ( 0 == p_ctx->max_neighbors ) && create_links() )
+  {
+    free( saved_energies );
+    return 1;
+  }
 
   initialize_node_energy( AP_NODE_ID );
 
-  //print_node_energy( 0, fp_out );
+  for( node_index = 1; node_index <= old_device_count; node_index++ )
+  {
+    if( node_index <= p_ctx->device_count )
+    {
+      set_node_energy( node_index, saved_energies[node_index - 1] );
+    }
+  }
 
-  printf("Round 0\n");
+  free( saved_energies );
+
+  if( ( p_ctx->verbose >= ROUTING_OUTPUT_SUMMARY ) &&
+      ( p_ctx->max_neighbors > 0 ) )
+  {
+    printf( "Network size set to %d devices, %d neighbors each\n",
+                                  p_ctx->device_count, p_ctx->max_neighbors );
+  }
+  else if( p_ctx->verbose >= ROUTING_OUTPUT_SUMMARY )
+  {
+    printf( "Network size set to %d devices\n", p_ctx->device_count );
+  }
 
   return 0;
 }
 
 /*******************************************************************************
- * @fn    void routing_finalize()
+ * @fn    uint8_t routing_get_device_count()
  *
- * @brief Call when finished. Close all files.
+ * @brief Number of devices in the last routing and power tables computed by
+ *        compute_routes_thread (tables are 2*count bytes long)
  * ****************************************************************************/
-void routing_finalize()
+uint8_t routing_get_device_count()
+{
+  return p_ctx->rp_device_count;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t allocate_tables( uint8_t new_device_count,
+ *                                             uint8_t new_max_neighbors )
+ *
+ * @brief (Re)allocate all tables. previous_powers is resized in place so
+ *        existing nodes keep their values.
+ * ****************************************************************************/
+static uint8_t allocate_tables( uint8_t new_device_count,
+                                                    uint8_t new_max_neighbors )
+{
+  uint32_t table_cells = ( new_device_count + 1 ) *
+          ( new_max_neighbors ? new_max_neighbors : ( new_device_count + 1 ) );
+  energy_t* new_previous_powers;
+
+  new_previous_powers = realloc( p_ctx->previous_powers,
+                                        new_device_count * sizeof(energy_t) );
+  if( NULL == new_previous_powers )
+  {
+    return 1;
+  }
+  p_ctx->previous_powers = new_previous_powers;
+
+  free( p_ctx->rssi_table );
+  free( p_ctx->link_power_table );
+  free( p_ctx->link_powers );
+  free( p_ctx->previous_powers_debug );
+  free( p_ctx->route_table_debug );
+  free( p_ctx->tx_powers );
+  free( p_ctx->link_watts );
+  free( p_ctx->table_links );
+  free( p_ctx->neighbor_ids );
+  free( p_ctx->neighbor_counts );
+
+  p_ctx->table_links = NULL;
+  p_ctx->neighbor_ids = NULL;
+  p_ctx->neighbor_counts = NULL;
+
+  p_ctx->rssi_table = calloc( table_cells, sizeof(energy_t) );
+  p_ctx->link_power_table = calloc( table_cells, sizeof(energy_t) );
+  p_ctx->link_powers = calloc( new_device_count, sizeof(energy_t) );
+  p_ctx->previous_powers_debug = calloc( new_device_count, sizeof(energy_t) );
+  p_ctx->route_table_debug = calloc( new_device_count, sizeof(uint8_t) );
+  p_ctx->tx_powers = calloc( new_device_count + 1, sizeof(energy_t) );
+  p_ctx->link_watts = calloc( new_device_count + 1, sizeof(energy_t) );
+
+  if( new_max_neighbors > 0 )
+  {
+    p_ctx->neighbor_ids = calloc( table_cells, sizeof(uint8_t) );
+    p_ctx->neighbor_counts = calloc( new_device_count + 1, sizeof(uint8_t) );
+  }
+  else
+  {
+    p_ctx->table_links = calloc( table_cells, sizeof(link_t*) );
+  }
+
+  if( ( NULL == p_ctx->rssi_table ) || ( NULL == p_ctx->link_power_table ) ||
+      ( NULL == p_ctx->link_powers ) ||
+      ( NULL == p_ctx->previous_powers_debug ) ||
+      ( NULL == p_ctx->route_table_debug ) || ( NULL == p_ctx->tx_powers ) ||
+      ( NULL == p_ctx->link_watts ) ||
+      ( ( 0 == new_max_neighbors ) && ( NULL == p_ctx->table_links ) ) ||
+      ( ( new_max_neighbors > 0 ) &&
+        ( ( NULL == p_ctx->neighbor_ids ) ||
+          ( NULL == p_ctx->neighbor_counts ) ) ) )
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t create_links()
+ *
+ * @brief Create the dijkstra link for each table entry, table index 0 is the
+ *        access point. Rows are receivers and columns transmitters, so with
+ *        directed links entry (row, col) is the link from col to row.
+ * ****************************************************************************/
+static uint8_t create_links()
+{
+  uint8_t row_index;
+  uint8_t col_index;
+
+  for( row_index = 0; row_index <= p_ctx->device_count; row_index++ )
+  {
+    for( col_index = 0; col_index <= p_ctx->device_count; col_index++ )
+    {
+      // Only the upper triangle is used without directed links
+      if( ( row_index == col_index ) ||
+          ( ( !graph_is_directed() ) && ( col_index < row_index ) ) )
+      {
+        continue;
+      }
+
+      if( graph_is_directed() )
+      {
+        TABLE( p_ctx->table_links, row_index, col_index ) =
+                      get_link( ( col_index == 0 ) ? AP_NODE_ID : col_index,
+                                ( row_index == 0 ) ? AP_NODE_ID : row_index );
+      }
+      else
+      {
+        TABLE( p_ctx->table_links, row_index, col_index ) =
+                      get_link( ( row_index == 0 ) ? AP_NODE_ID : row_index,
+                                col_index );
+      }
+
+      if( NULL == TABLE( p_ctx->table_links, row_index, col_index ) )
+      {
+        printf( "Error creating link %d-%d.\r\n", row_index, col_index );
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void free_tables()
+ *
+ * @brief Free all tables
+ * ****************************************************************************/
+static void free_tables()
 {
-  fclose( fp_energies );
-  fclose( fp_routes );
-  fclose( fp_powers );
-  fclose( fp_rssi );
-  fclose( fp_debug );
+  free( p_ctx->rssi_table );
+  free( p_ctx->link_power_table );
+  free( p_ctx->link_powers );
+  free( p_ctx->previous_powers );
+  free( p_ctx->previous_powers_debug );
+  free( p_ctx->route_table_debug );
+  free( p_ctx->tx_powers );
+  free( p_ctx->link_watts );
+  free( p_ctx->table_links );
+  free( p_ctx->neighbor_ids );
+  free( p_ctx->neighbor_counts );
+  free( p_ctx->history );
+
+  p_ctx->rssi_table = NULL;
+  p_ctx->link_power_table = NULL;
+  p_ctx->link_powers = NULL;
+  p_ctx->previous_powers = NULL;
+  p_ctx->previous_powers_debug = NULL;
+  p_ctx->route_table_debug = NULL;
+  p_ctx->tx_powers = NULL;
+  p_ctx->link_watts = NULL;
+  p_ctx->table_links = NULL;
+  p_ctx->neighbor_ids = NULL;
+  p_ctx->neighbor_counts = NULL;
+  p_ctx->history = NULL;
+  p_ctx->history_count = 0;
+  p_ctx->history_device_count = 0;
 }
 
 /*******************************************************************************
  * @fn    void *compute_routes_thread( void *rp_tables )
  *
- * @brief Thread that takes care of routing
+ * @brief Thread that takes care of routing. rp_tables must hold at least
+ *        RP_TABLES_SIZE bytes. Routes are stored in the first N bytes and
+ *        powers in the next N (N = routing_get_device_count())
  * ****************************************************************************/
 void *compute_routes_thread( void *rp_tables )
 {
-  static uint32_t index;
-  uint8_t node_index;
-  uint8_t *route_table = &((uint8_t*)rp_tables)[0];
-  uint8_t *power_table = &((uint8_t*)rp_tables)[MAX_DEVICES];
-  
-  
   // loop forever
   for (;;)
   {
     // Block until next table is ready
     pthread_mutex_lock ( &mutex_route_start );
 
-    // Assuming rssi_table has been updated
-    clean_table( rssi_table );
+    routing_compute_round( rp_tables );
+
+    LATENCY_ROUND_ROUTED();
+
+    // Block until next table is ready
+    pthread_mutex_unlock ( &mutex_route_done );
+
+  }
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * @fn    void routing_compute_round( uint8_t* p_rp_tables )
+ *
+ * @brief Compute routes and powers from the last table parsed. p_rp_tables
+ *        must hold at least RP_TABLES_SIZE bytes, routes are stored in the
+ *        first N bytes and powers in the next N
+ *        (N = routing_get_device_count())
+ * ****************************************************************************/
+void routing_compute_round( uint8_t* p_rp_tables )
+{
+  uint8_t node_index;
+  uint8_t *route_table;
+  uint8_t *power_table;
+  struct timespec start_time;
 
-    add_links_from_table( rssi_table );
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
 
-    // Run dijkstra's algorithm with 0 being the access point
-    dijkstra( AP_NODE_ID, c_factor );
+  LATENCY_STAMP( LAT_ROUND_START );
 
-    // Display shortest paths and update energies
-    for( node_index = 1; node_index < (MAX_DEVICES + 1); node_index++ )
+  if( NULL != p_ctx->p_shm )
+  {
+    clock_gettime( CLOCK_REALTIME, &start_time );
+  }
+
+  route_table = &p_rp_tables[0];
+  power_table = &p_rp_tables[p_ctx->device_count];
+
+  // Assuming rssi_table has been updated
+  build_links_from_table();
+
+  LATENCY_STAMP( LAT_GRAPH_BUILT );
+
+  // Run dijkstra's algorithm with 0 being the access point
+  dijkstra( AP_NODE_ID, p_ctx->c_factor );
+
+  // Hold back parent changes that aren't worth the update
+  apply_route_hysteresis( AP_NODE_ID );
+
+  LATENCY_STAMP( LAT_DIJKSTRA );
+
+  // Display shortest paths and update energies
+  for( node_index = 1; node_index < (p_ctx->device_count + 1); node_index++ )
+  {
+    compute_shortest_path( node_index );
+    if( p_ctx->verbose >= ROUTING_OUTPUT_ROUNDS )
     {
-      compute_shortest_path( node_index );
       print_shortest_path( node_index );
     }
+  }
 
-    // Compute routing table
-    compute_rp_tables( route_table, link_powers );
+  // Compute routing table
+  compute_rp_tables( route_table, p_ctx->link_powers );
 
-    // Debug
-    memcpy( previous_powers_debug, previous_powers, sizeof(previous_powers) );
-    memcpy( route_table_debug, route_table, sizeof(route_table_debug) );
+  // Debug
+  memcpy( p_ctx->previous_powers_debug, p_ctx->previous_powers,
+                                    p_ctx->device_count * sizeof(energy_t) );
+  memcpy( p_ctx->route_table_debug, route_table, p_ctx->device_count );
 
-    // Compute power table
-    compute_required_powers( link_powers, power_table );
+  // Compute power table
+  compute_required_powers( p_ctx->link_powers, power_table );
 
-    print_rssi_table();
+  LATENCY_STAMP( LAT_POSTPROCESS );
 
-    print_node_energy( AP_NODE_ID, fp_energies );
+  if( p_ctx->log_rounds )
+  {
+    log_round( p_ctx->round );
+  }
 
-    index++;
-    printf("\nRound %d\n", index);
+  if( NULL != p_ctx->p_shm )
+  {
+    publish_round( power_table, &start_time );
+  }
 
-    // Block until next table is ready
-    pthread_mutex_unlock ( &mutex_route_done );
+  LATENCY_STAMP( LAT_LOGGED );
 
+  if( p_ctx->history_rounds > 0 )
+  {
+    record_history();
   }
 
-  return NULL;
+  p_ctx->rp_device_count = p_ctx->device_count;
+
+  p_ctx->round++;
+
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
+
+  if( p_ctx->verbose >= ROUTING_OUTPUT_ROUNDS )
+  {
+    printf("\nRound %d\n", p_ctx->round);
+  }
 }
 
 /*******************************************************************************
- * @fn    uint8_t parse_table ( int8_t p_rssi_table[][MAX_DEVICES+1] )
+ * @fn    uint8_t parse_table ( uint8_t* p_rssi_table, uint8_t device_count )
  *
  * @brief Get RSSI table, convert, store and print it(gets uint8_t rssi array)
+ *        p_rssi_table is (new_device_count+1)x(new_device_count+1), row major
  * ****************************************************************************/
-uint8_t parse_table ( uint8_t p_rssi_table[][MAX_DEVICES+1] )
+uint8_t parse_table ( uint8_t* p_rssi_table, uint8_t new_device_count )
 {
   uint8_t row_index;
   uint8_t col_index;
-  energy_t tx_power;
-  energy_t alpha;
+  uint32_t table_index = 0;
+
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
+
+  if( routing_set_size( new_device_count, 0 ) )
+  {
+    pthread_mutex_unlock ( &p_ctx->mutex_tables );
+    return 1;
+  }
 
   // Convert table to rssi values from raw data and copy to local array
-  for( row_index = 0; row_index <= MAX_DEVICES; row_index++ )
+  for( row_index = 0; row_index <= p_ctx->device_count; row_index++ )
   {
-    for( col_index = 0; col_index <= MAX_DEVICES; col_index++ )
+    for( col_index = 0; col_index <= p_ctx->device_count; col_index++ )
     {
       // If RSSI is the minimum (-136.0), make it much lower so that the maximum
       // transmit power is used.
-      if( p_rssi_table[row_index][col_index] == 0x80 )
-      {
-        rssi_table[row_index][col_index] = -999.0;
-      }
-      else
-      {
-        rssi_table[row_index][col_index] =
-                               rssi_values[p_rssi_table[row_index][col_index]];
-      }
-
-      if( 0 == col_index )
+      if( p_rssi_table[table_index] == 0x80 )
       {
-        // AP always transmits with max power
-        tx_power = dbm_to_watt( get_power_from_setting( 0xff ) );
+        p_ctx->rssi_table[table_index] = -999.0;
       }
       else
       {
-        // Use previous transmit settings
-        tx_power = dbm_to_watt( previous_powers[col_index + 1] );
+        p_ctx->rssi_table[table_index] = rssi_values[p_rssi_table[table_index]];
       }
+      table_index++;
+    }
+  }
 
-      //tx_power = dbm_to_watt( 1.5l ); // uncomment to override
+  // AP always transmits with max power, the rest use previous settings
+  p_ctx->tx_powers[0] = get_power_from_setting( 0xff );
+  for( col_index = 1; col_index <= p_ctx->device_count; col_index++ )
+  {
+    p_ctx->tx_powers[col_index] = p_ctx->previous_powers[col_index - 1];
+  }
 
-      // Compute the minimum power required to meet this link with 'target_rssi'
-      // alpha is the channel attenuation, that is received/transmitted power
-      alpha = dbm_to_watt( rssi_table[row_index][col_index] ) / tx_power;
+  compute_link_power_table( p_ctx->tx_powers );
 
-      // Transmit power required is the target rssi / channel attenuation
-      link_power_table[row_index][col_index] = target_rssi / alpha;
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
 
-    }
-  }
+  LATENCY_STAMP( LAT_PARSED );
 
   // Did not read table successfully
   return 0;
 }
 
 /*******************************************************************************
- * @fn    uint8_t parse_table_d ( energy_t p_rssi_table[][MAX_DEVICES+1]
- *                                            energy_t *p_previous_powers )
+ * @fn    uint8_t parse_table_d ( energy_t* p_rssi_table,
+ *                   energy_t *p_previous_powers, uint8_t new_device_count )
  *
  * @brief Get RSSI table, convert, store and print it 
  * (gets energy_t rssi array AND energy_t previous tx power array)
  * ****************************************************************************/
-uint8_t parse_table_d ( energy_t p_rssi_table[][MAX_DEVICES+1], 
-                                      energy_t *p_previous_powers )
+uint8_t parse_table_d ( energy_t* p_rssi_table, energy_t *p_previous_powers,
+                                                    uint8_t new_device_count )
 {
-  uint8_t row_index;
   uint8_t col_index;
-  energy_t tx_power;
-  energy_t alpha;
 
-  // Convert table to rssi values from raw data and copy to local array
-  for( row_index = 0; row_index <= MAX_DEVICES; row_index++ )
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
+
+  if( routing_set_size( new_device_count, 0 ) )
   {
-    for( col_index = 0; col_index <= MAX_DEVICES; col_index++ )
-    {
-      // Copy rssi table
-      rssi_table[row_index][col_index] = p_rssi_table[row_index][col_index];
-      
-      if( 0 == col_index )
-      {
-        // AP always transmits with max power
-        tx_power = dbm_to_watt( get_power_from_setting( 0xff ) );
-      }
-      else
-      {
-        // Use previous transmit settings
-        tx_power = dbm_to_watt( p_previous_powers[col_index + 1] );
-      }
+    pthread_mutex_unlock ( &p_ctx->mutex_tables );
+    return 1;
+  }
 
-      //tx_power = dbm_to_watt( 1.5l ); // uncomment for no power control
+  // Copy rssi table
+  memcpy( p_ctx->rssi_table, p_rssi_table,
+                                TABLE_SIZE * TABLE_SIZE * sizeof(energy_t) );
 
-      // Compute the minimum power required to meet this link with 'target_rssi'
-      // alpha is the channel attenuation, that is received/transmitted power
-      alpha = dbm_to_watt( rssi_table[row_index][col_index] ) / tx_power;
+  // AP always transmits with max power, the rest use previous settings
+  p_ctx->tx_powers[0] = get_power_from_setting( 0xff );
+  for( col_index = 1; col_index <= p_ctx->device_count; col_index++ )
+  {
+    p_ctx->tx_powers[col_index] = p_previous_powers[col_index - 1];
+  }
 
-      // Transmit power required is the target rssi / channel attenuation
-      link_power_table[row_index][col_index] = target_rssi / alpha;
+  compute_link_power_table( p_ctx->tx_powers );
 
-    }
-  }
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
+
+  LATENCY_STAMP( LAT_PARSED );
 
   // Did not read table successfully
   return 0;
 }
 
 /*******************************************************************************
- * @fn    void clean_table( int8_t rssi_table[][MAX_DEVICES+1] )
+ * @fn    uint8_t parse_neighbors( const neighbor_table_t* p_neighbors,
+ *                                           energy_t* p_previous_powers )
+ *
+ * @brief Get sparse RSSI table (see neighbors.h) and store it. Uses
+ *        p_previous_powers as the tx power of each device, or the powers
+ *        sent last round if it's NULL.
+ * ****************************************************************************/
+uint8_t parse_neighbors( const neighbor_table_t* p_neighbors,
+                                                  energy_t* p_previous_powers )
+{
+  uint8_t col_index;
+
+  pthread_mutex_lock ( &p_ctx->mutex_tables );
+
+  if( routing_set_size( p_neighbors->device_count,
+                                            p_neighbors->max_neighbors ) )
+  {
+    pthread_mutex_unlock ( &p_ctx->mutex_tables );
+    return 1;
+  }
+
+  memcpy( p_ctx->neighbor_counts, p_neighbors->counts, TABLE_SIZE );
+  memcpy( p_ctx->neighbor_ids, p_neighbors->ids,
+                                      TABLE_SIZE * p_ctx->max_neighbors );
+  memcpy( p_ctx->rssi_table, p_neighbors->rssi,
+                      TABLE_SIZE * p_ctx->max_neighbors * sizeof(energy_t) );
+
+  // AP always transmits with max power, the rest use previous settings
+  p_ctx->tx_powers[0] = get_power_from_setting( 0xff );
+  for( col_index = 1; col_index <= p_ctx->device_count; col_index++ )
+  {
+    p_ctx->tx_powers[col_index] = ( NULL != p_previous_powers ) ?
+                                    p_previous_powers[col_index - 1] :
+                                    p_ctx->previous_powers[col_index - 1];
+  }
+
+  compute_link_power_table( p_ctx->tx_powers );
+
+  pthread_mutex_unlock ( &p_ctx->mutex_tables );
+
+  LATENCY_STAMP( LAT_PARSED );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void compute_link_power_table( const energy_t* p_tx_powers )
+ *
+ * @brief Compute the minimum power required to meet each link with
+ *        'target_rssi'. Everything is in dBm, so the channel attenuation
+ *        (rssi - tx_power) is a subtraction instead of two pow() calls and
+ *        a division per link. Columns are transmitters, so p_tx_powers holds
+ *        the transmit power used by each column. The selected RSSI filter
+ *        then smooths every link (see rssifilter.c).
+ * ****************************************************************************/
+static void compute_link_power_table( const energy_t* p_tx_powers )
+{
+  uint8_t row_index;
+
+  if( p_ctx->max_neighbors > 0 )
+  {
+    compute_neighbor_link_powers( p_tx_powers );
+    return;
+  }
+
+  for( row_index = 0; row_index <= p_ctx->device_count; row_index++ )
+  {
+    compute_link_power_row( &TABLE( p_ctx->link_power_table, row_index, 0 ),
+                            &TABLE( p_ctx->rssi_table, row_index, 0 ),
+                            p_tx_powers,
+                            TABLE_SIZE );
+  }
+
+  // Smooth out link powers (does nothing if there's no filter selected)
+  rssi_filter_update( p_ctx->link_power_table, TABLE_SIZE * TABLE_SIZE,
+                                                      LINK_POWER_NO_SAMPLE );
+}
+
+/*******************************************************************************
+ * @fn    void compute_neighbor_link_powers( const energy_t* p_tx_powers )
  *
- * @brief Compare the RSSI from two links and only keep the best value
+ * @brief Required power for every entry of a sparse table, with the tx power
+ *        of each entry's transmitter
  * ****************************************************************************/
-void clean_table( energy_t rssi_table[][MAX_DEVICES+1] )
+static void compute_neighbor_link_powers( const energy_t* p_tx_powers )
+{
+  uint16_t row_index;
+  uint8_t slot;
+  uint32_t cell_index;
+
+  for( row_index = 0; row_index <= p_ctx->device_count; row_index++ )
+  {
+    cell_index = row_index * p_ctx->max_neighbors;
+
+    for( slot = 0; slot < p_ctx->neighbor_counts[row_index]; slot++ )
+    {
+      p_ctx->link_power_table[cell_index + slot] = p_ctx->target_rssi -
+                    ( p_ctx->rssi_table[cell_index + slot] -
+                      p_tx_powers[p_ctx->neighbor_ids[cell_index + slot]] );
+    }
+  }
+}
+
+/*******************************************************************************
+ * @fn    void compute_link_power_row( energy_t* p_link_powers,
+ *                                     const energy_t* p_rssi,
+ *                                     const energy_t* p_tx_powers,
+ *                                     uint16_t size )
+ *
+ * @brief Required power for one table row:
+ *        link_power = target_rssi - ( rssi - tx_power )   [dBm]
+ * ****************************************************************************/
+static void compute_link_power_row( energy_t* p_link_powers,
+                                    const energy_t* p_rssi,
+                                    const energy_t* p_tx_powers,
+                                    uint16_t size )
+{
+  uint16_t col_index = 0;
+
+#ifdef __SSE2__
+  // NOTE: assumes energy_t is double
+  const __m128d target = _mm_set1_pd( p_ctx->target_rssi );
+
+  for( ; ( col_index + 2 ) <= size; col_index += 2 )
+  {
+    __m128d rssi = _mm_loadu_pd( &p_rssi[col_index] );
+    __m128d tx_power = _mm_loadu_pd( &p_tx_powers[col_index] );
+
+    // Same order as the scalar loop, so every column rounds the same way
+    _mm_storeu_pd( &p_link_powers[col_index],
+                        _mm_sub_pd( target, _mm_sub_pd( rssi, tx_power ) ) );
+  }
+#endif
+
+  for( ; col_index < size; col_index++ )
+  {
+    p_link_powers[col_index] = p_ctx->target_rssi -
+                                ( p_rssi[col_index] - p_tx_powers[col_index] );
+  }
+}
+
+/*******************************************************************************
+ * @fn    void build_links_from_table()
+ *
+ * @brief Generate dijkstra links from link_power_table in a single pass.
+ *        For each pair only the best of the two directions is kept (written
+ *        back to the upper triangle for logging), links needing too much
+ *        power are disabled and the links created in routing_set_size()
+ *        are updated in place. With directed links both directions are
+ *        kept as they are (see build_directed_links).
+ * ****************************************************************************/
+void build_links_from_table()
 {
   uint16_t col_index, row_index;
 
-  for( row_index = 0; row_index < ( MAX_DEVICES+1 ); row_index++ )
+  if( p_ctx->max_neighbors > 0 )
+  {
+    build_neighbor_links();
+    return;
+  }
+
+  if( graph_is_directed() )
+  {
+    build_directed_links();
+    return;
+  }
+
+  for( row_index = 0; row_index < p_ctx->device_count; row_index++ )
   {
-    for( col_index = row_index; col_index < ( MAX_DEVICES+1 ); col_index++ )
+    // Compare the power from both directions and only keep the best value
+    for( col_index = row_index + 1; col_index <= p_ctx->device_count;
+                                                                  col_index++ )
     {
-      if( link_power_table[row_index][col_index] >
-                                      link_power_table[col_index][row_index] )
+      if( TABLE( p_ctx->link_power_table, row_index, col_index ) >
+                      TABLE( p_ctx->link_power_table, col_index, row_index ) )
       {
-        link_power_table[row_index][col_index] =
-                                        link_power_table[col_index][row_index];
+        TABLE( p_ctx->link_power_table, row_index, col_index ) =
+                        TABLE( p_ctx->link_power_table, col_index, row_index );
       }
+    }
+
+    // Only the upper triangle is used, convert it to Watts for the cost
+    // function in one pass
+    dbm_to_watt_row( &p_ctx->link_watts[row_index + 1],
+                 &TABLE( p_ctx->link_power_table, row_index, row_index + 1 ),
+                 ( p_ctx->device_count - row_index ) );
 
+    for( col_index = row_index + 1; col_index <= p_ctx->device_count;
+                                                                  col_index++ )
+    {
+      set_link_power( TABLE( p_ctx->table_links, row_index, col_index ),
+                p_ctx->link_watts[col_index],
+                ( TABLE( p_ctx->link_power_table, row_index, col_index ) <=
+                                                    p_ctx->link_threshold ) );
     }
+  }
+}
+
+/*******************************************************************************
+ * @fn    void build_directed_links()
+ *
+ * @brief Update each directed link with the power its transmitter (column)
+ *        needs to reach the receiver (row). Links can be very asymmetric
+ *        (i.e. body shadowing), so a node is never given the power of the
+ *        better reverse direction.
+ * ****************************************************************************/
+static void build_directed_links()
+{
+  uint16_t col_index, row_index;
+
+  for( row_index = 0; row_index <= p_ctx->device_count; row_index++ )
+  {
+    dbm_to_watt_row( p_ctx->link_watts,
+                     &TABLE( p_ctx->link_power_table, row_index, 0 ),
+                     TABLE_SIZE );
+
+    for( col_index = 0; col_index <= p_ctx->device_count; col_index++ )
+    {
+      if( col_index == row_index )
+      {
+        continue;
+      }
 
+      set_link_power( TABLE( p_ctx->table_links, row_index, col_index ),
+                p_ctx->link_watts[col_index],
+                ( TABLE( p_ctx->link_power_table, row_index, col_index ) <=
+                                                    p_ctx->link_threshold ) );
+    }
   }
 }
 
 /*******************************************************************************
- * @fn    void add_links_from_table( int8_t rssi_table[][MAX_DEVICES+1] )
+ * @fn    void build_neighbor_links()
  *
- * @brief Generate dijkstra links from cleaned up table
+ * @brief Add a link for every entry of a sparse table. Links are removed and
+ *        added again each round, so only this round's neighbors are in the
+ *        graph. Without directed links, a pair can be in both rows and the
+ *        best of the two directions is kept.
  * ****************************************************************************/
-void add_links_from_table( energy_t rssi_table[][MAX_DEVICES+1] )
+static void build_neighbor_links()
 {
-  uint16_t col_index, row_index, source, destination;
+  uint16_t row_index;
+  uint8_t col_index;
+  uint8_t slot;
+  uint32_t cell_index;
+  link_t* p_link;
+  energy_t link_watt;
 
+  graph_clear_links();
 
-  for( row_index = 0; row_index < ( MAX_DEVICES ); row_index++ )
+  for( row_index = 0; row_index <= p_ctx->device_count; row_index++ )
   {
+    cell_index = row_index * p_ctx->max_neighbors;
 
-    for( col_index = row_index + 1; col_index < ( MAX_DEVICES+1 ); col_index++ )
-    {
+    dbm_to_watt_row( p_ctx->link_watts, &p_ctx->link_power_table[cell_index],
+                                          p_ctx->neighbor_counts[row_index] );
 
-      source = row_index;
-      destination = col_index;
+    for( slot = 0; slot < p_ctx->neighbor_counts[row_index]; slot++ )
+    {
+      col_index = p_ctx->neighbor_ids[cell_index + slot];
 
-      // Make sure the access point has the correct address
-      if( 0 == source )
+      // Column transmits to row
+      if( graph_is_directed() )
+      {
+        p_link = get_link( ( col_index == 0 ) ? AP_NODE_ID : col_index,
+                           ( row_index == 0 ) ? AP_NODE_ID : row_index );
+      }
+      else
       {
-        source = AP_NODE_ID;
+        p_link = get_link( ( row_index == 0 ) ? AP_NODE_ID : row_index,
+                           ( col_index == 0 ) ? AP_NODE_ID : col_index );
       }
-      if( 0 == destination )
+
+      if( NULL == p_link )
       {
-        destination = AP_NODE_ID;
+        continue;
       }
 
-      // Add link
-      add_link( source, destination, link_power_table[row_index][col_index] );
+      // New links start at MAX_DISTANCE
+      link_watt = p_ctx->link_watts[slot];
+      if( link_watt < p_link->links_power )
+      {
+        set_link_power( p_link, link_watt,
+                        ( p_ctx->link_power_table[cell_index + slot] <=
+                                                    p_ctx->link_threshold ) );
+      }
     }
   }
 }
@@ -367,7 +1285,7 @@ void compute_required_powers( energy_t* p_link_powers, uint8_t* power_table )
   uint8_t node_index;
 
 
-  for( node_index = 0; node_index < MAX_DEVICES; node_index++ )
+  for( node_index = 0; node_index < p_ctx->device_count; node_index++ )
   {
 
     // Store required power in power table
@@ -375,7 +1293,7 @@ void compute_required_powers( energy_t* p_link_powers, uint8_t* power_table )
                 find_closest_power( watt_to_dbm( p_link_powers[node_index] ) );
 
     // Save current required power to be used as tx_power next round
-    previous_powers[node_index] =
+    p_ctx->previous_powers[node_index] =
                             //get_power_from_setting( 0xff );  // no power control
                             get_power_from_setting( power_table[node_index] );
 
@@ -383,88 +1301,147 @@ void compute_required_powers( energy_t* p_link_powers, uint8_t* power_table )
 }
 
 /*******************************************************************************
- * @fn    void print_rssi_table()
+ * @fn    void log_round( uint32_t round )
  *
- * @brief Save current data to files
+ * @brief Queue this round's tables for the round log writer thread
  * ****************************************************************************/
-void print_rssi_table()
+void log_round( uint32_t round )
 {
-  uint8_t row_index;
-  uint8_t col_index;
-
-  //printf("   ");
+  roundlog_tables_t record;
+  uint8_t node_index;
 
-  for( col_index = 0; col_index <= MAX_DEVICES; col_index++ )
+  if( roundlog_get_record( p_ctx->device_count, p_ctx->max_neighbors,
+                                                                  &record ) )
   {
-    //printf(" %3d   ", col_index );
+    return;
   }
 
-  //printf("\r\n");
+  record.p_record->round = round;
 
-  // Print packet in hex
-  for( row_index = 0; row_index <= MAX_DEVICES; row_index++ )
+  memcpy( record.rssi_table, p_ctx->rssi_table,
+                                TABLE_SIZE * ROW_SIZE * sizeof(energy_t) );
+  memcpy( record.link_power_table, p_ctx->link_power_table,
+                                TABLE_SIZE * ROW_SIZE * sizeof(energy_t) );
+
+  if( p_ctx->max_neighbors > 0 )
+  {
+    memcpy( record.neighbor_counts, p_ctx->neighbor_counts, TABLE_SIZE );
+    memcpy( record.neighbor_ids, p_ctx->neighbor_ids,
+                                      TABLE_SIZE * p_ctx->max_neighbors );
+  }
+  memcpy( record.previous_powers, p_ctx->previous_powers_debug,
+                                    p_ctx->device_count * sizeof(energy_t) );
+  memcpy( record.link_powers, p_ctx->link_powers,
+                                    p_ctx->device_count * sizeof(energy_t) );
+  memcpy( record.route_table, p_ctx->route_table_debug, p_ctx->device_count );
+
+  record.energies[0] = get_mean_energy();
+  for( node_index = 1; node_index <= p_ctx->device_count; node_index++ )
   {
-    //printf("%2d ", row_index );
+    record.energies[node_index] = get_node_energy( node_index );
+  }
 
-    // RSSI table
-    for( col_index = 0; col_index < MAX_DEVICES; col_index++ )
-    {
-      //printf("%06.1f ", rssi_table[row_index][col_index] );
-      fprintf( fp_debug, "%g,", rssi_table[row_index][col_index] );
-      fprintf( fp_rssi, "%g,", rssi_table[row_index][col_index] );
-    }
-    //printf("%06.1f ", rssi_table[row_index][col_index] );
-    fprintf( fp_debug, "%g,", rssi_table[row_index][col_index] );
-    fprintf( fp_rssi, "%g\n", rssi_table[row_index][col_index] );
+  roundlog_push( &record );
+}
 
-    if( row_index > 0 )
-    {
-      //printf("%g ", previous_powers_debug[row_index-1] );
-      fprintf( fp_debug, "%g,", ( previous_powers_debug[row_index-1] ) );
+/*******************************************************************************
+ * @fn    void publish_round( const uint8_t* p_power_table,
+ *                                        const struct timespec* p_start )
+ *
+ * @brief Publish this round's tables in shared memory (see routing_publish)
+ * ****************************************************************************/
+static void publish_round( const uint8_t* p_power_table,
+                                        const struct timespec* p_start )
+{
+  routeshm_state_t state;
+  routeshm_tables_t tables;
+  struct timespec end_time;
+  uint8_t node_index;
 
-      //printf("%g ", link_powers[row_index-1] );
-      fprintf( fp_debug, "%g,", watt_to_dbm( link_powers[row_index-1] ) );
-      fprintf( fp_powers, "%g,", watt_to_dbm( link_powers[row_index-1] ) );
+  clock_gettime( CLOCK_REALTIME, &end_time );
 
-      //printf("%d ", route_table_debug[row_index-1] );
-      fprintf( fp_debug, "%d,", route_table_debug[row_index-1] );
-      fprintf( fp_routes, "%d,", route_table_debug[row_index-1] );
+  memset( &state, 0, sizeof(state) );
+  state.round = p_ctx->round;
+  state.device_count = p_ctx->device_count;
+  state.max_neighbors = p_ctx->max_neighbors;
+  state.c_factor = p_ctx->c_factor;
+  state.round_start_ns = p_start->tv_sec * 1000000000ULL + p_start->tv_nsec;
+  state.round_end_ns = end_time.tv_sec * 1000000000ULL + end_time.tv_nsec;
 
-    }
-    else
-    {
-      //printf("%g ", 1.5 ); // AP always transmits max power
-      fprintf( fp_debug, "%g,", ( 1.5 ) );
+  routeshm_begin( p_ctx->p_shm, &state, &tables );
 
-      //printf("%g ", 1.5 ); // AP always transmits max power
-      fprintf( fp_debug, "%g,", ( 1.5 ) );
-      fprintf( fp_powers, "%g,", 1.5 );
+  memcpy( tables.rssi_table, p_ctx->rssi_table,
+                                TABLE_SIZE * ROW_SIZE * sizeof(energy_t) );
+  memcpy( tables.link_power_table, p_ctx->link_power_table,
+                                TABLE_SIZE * ROW_SIZE * sizeof(energy_t) );
 
-      //printf("0 ");
-      fprintf( fp_debug, "0," );
-      fprintf( fp_routes, "0," );
+  if( p_ctx->max_neighbors > 0 )
+  {
+    memcpy( tables.neighbor_counts, p_ctx->neighbor_counts, TABLE_SIZE );
+    memcpy( tables.neighbor_ids, p_ctx->neighbor_ids,
+                                      TABLE_SIZE * p_ctx->max_neighbors );
+  }
+  memcpy( tables.previous_powers, p_ctx->previous_powers_debug,
+                                    p_ctx->device_count * sizeof(energy_t) );
+  memcpy( tables.link_powers, p_ctx->link_powers,
+                                    p_ctx->device_count * sizeof(energy_t) );
+  memcpy( tables.route_table, p_ctx->route_table_debug, p_ctx->device_count );
+  memcpy( tables.power_table, p_power_table, p_ctx->device_count );
+
+  tables.energies[0] = get_mean_energy();
+  for( node_index = 1; node_index <= p_ctx->device_count; node_index++ )
+  {
+    tables.energies[node_index] = get_node_energy( node_index );
+  }
 
-    }
+  routeshm_end( p_ctx->p_shm );
+}
 
+/*******************************************************************************
+ * @fn    void record_history()
+ *
+ * @brief Add this round's RSSI table and tx powers to the history ring (see
+ *        routing_set_history). The ring starts over when the network size
+ *        changes.
+ * ****************************************************************************/
+static void record_history()
+{
+  uint32_t round_size = ROUTING_HISTORY_SIZE( p_ctx->device_count );
+  energy_t* p_round;
+
+  if( p_ctx->max_neighbors > 0 )
+  {
+    return;
+  }
 
-    for( col_index = 0; col_index < MAX_DEVICES; col_index++ )
+  if( p_ctx->history_device_count != p_ctx->device_count )
+  {
+    free( p_ctx->history );
+    p_ctx->history = malloc( p_ctx->history_rounds * round_size *
+                                                          sizeof(energy_t) );
+    p_ctx->history_count = 0;
+    p_ctx->history_next = 0;
+    p_ctx->history_device_count = p_ctx->device_count;
+
+    if( NULL == p_ctx->history )
     {
-      //printf("%g ", link_power_table[row_index][col_index] );
-      fprintf( fp_debug, "%g,", watt_to_dbm( link_power_table[row_index][col_index] ) );
+      p_ctx->history_device_count = 0;
+      return;
     }
+  }
 
-    //printf("%g ", link_power_table[row_index][col_index] );
-    fprintf( fp_debug, "%g,", watt_to_dbm( link_power_table[row_index][col_index] ) );
+  p_round = &p_ctx->history[p_ctx->history_next * round_size];
 
-    //printf("\r\n");
-    fprintf( fp_debug, "\n" );
-  }
+  memcpy( p_round, p_ctx->rssi_table,
+                                TABLE_SIZE * TABLE_SIZE * sizeof(energy_t) );
+  memcpy( &p_round[TABLE_SIZE * TABLE_SIZE], &p_ctx->tx_powers[1],
+                                    p_ctx->device_count * sizeof(energy_t) );
 
-  //printf("\r\n");
-  fprintf( fp_debug, "\n" );
-  fprintf( fp_rssi, "\n" );
-  fprintf( fp_routes, "\n" );
-  fprintf( fp_powers, "\n" );
+  p_ctx->history_next = ( p_ctx->history_next + 1 ) % p_ctx->history_rounds;
+  if( p_ctx->history_count < p_ctx->history_rounds )
+  {
+    p_ctx->history_count++;
+  }
 }
 
 /*******************************************************************************
@@ -534,6 +1511,25 @@ double dbm_to_watt( double power )
   return pow(10, power/10l)/1000l;
 }
 
+/*******************************************************************************
+ * @fn    void dbm_to_watt_row( energy_t* p_watts, const energy_t* p_dbm,
+ *                                                            uint16_t size )
+ *
+ * @brief Convert a contiguous run of powers from dBm to Watts. Written as a
+ *        plain exp() loop so the compiler can use vector math routines.
+ * ****************************************************************************/
+static void dbm_to_watt_row( energy_t* p_watts, const energy_t* p_dbm,
+                                                              uint16_t size )
+{
+  uint16_t index;
+
+  for( index = 0; index < size; index++ )
+  {
+    // 10^(dBm/10) / 1000 == e^(dBm * ln(10)/10) / 1000
+    p_watts[index] = exp( p_dbm[index] * ( M_LN10 / 10.0 ) ) / 1000.0;
+  }
+}
+
 /*******************************************************************************
  * @fn    double watt_to_dbm( double power )
  *
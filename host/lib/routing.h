@@ -8,14 +8,32 @@
 #define _ROUTING_H
 #include <pthread.h>
 #include "dijkstra.h"
+#include "neighbors.h"
 
 pthread_mutex_t mutex_route_start;
 pthread_mutex_t mutex_route_done;
 
-#ifndef MAX_DEVICES
-#define MAX_DEVICES (3)
-#warning MAX_DEVICES not defined, defaulting to 3
-#endif
+// State of one network (see routing_select)
+typedef struct routing_context_s routing_context_t;
+
+// Largest network supported (node ids are 8 bit and the AP uses N+1)
+#define MAX_NETWORK_SIZE (254)
+
+// Size of the routing and power tables buffer given to compute_routes_thread
+#define RP_TABLES_SIZE ( MAX_NETWORK_SIZE * 2 )
+
+// Values kept for each round by routing_set_history: the RSSI table, then
+// the tx power of each device
+#define ROUTING_HISTORY_SIZE( device_count ) \
+  ( ( (device_count) + 1 ) * ( (device_count) + 1 ) + (device_count) )
+
+// What a context prints (see routing_set_verbose)
+typedef enum
+{
+  ROUTING_OUTPUT_NONE = 0,    // Nothing but errors
+  ROUTING_OUTPUT_SUMMARY,     // Network size changes and route statistics
+  ROUTING_OUTPUT_ROUNDS       // Also every shortest path and round number
+} routing_output_t;
 
 // Lookup table for converting cc2500 rssi value to received power in dBm
 static const energy_t rssi_values[256] = {
@@ -80,12 +98,27 @@ static const energy_t power_values[] = {
 -4.30, -3.80, -3.70, -3.50, -3.10, -2.70, -2.30, -1.90, -1.80, -1.30,
 -0.80, -0.60, -0.40, -0.20, -0.10, +0.00, +0.30, +0.70, +1.10, +1.50 };
 
+routing_context_t* routing_context_create();
+void routing_context_destroy( routing_context_t* );
+void routing_select( routing_context_t* );
+uint8_t routing_start( energy_t, const char* );
+uint8_t routing_publish( const char* );
+void routing_set_verbose( routing_output_t );
+routing_context_t* routing_get_context();
+void routing_set_c_factor( energy_t );
+energy_t routing_get_c_factor();
+void routing_set_history( uint16_t );
+uint16_t routing_get_history( energy_t**, uint8_t* );
 uint8_t routing_initialize( energy_t );
 void routing_finalize();
+uint8_t routing_set_size( uint8_t, uint8_t );
+uint8_t routing_get_device_count();
 void *compute_routes_thread( void* );
-uint8_t parse_table ( uint8_t p_rssi_table[][MAX_DEVICES+1] );
-uint8_t parse_table_d ( energy_t p_rssi_table[][MAX_DEVICES+1], 
-                                      energy_t *p_previous_powers );
+void routing_compute_round( uint8_t* );
+uint8_t parse_table ( uint8_t* p_rssi_table, uint8_t device_count );
+uint8_t parse_table_d ( energy_t* p_rssi_table, energy_t *p_previous_powers,
+                                                      uint8_t device_count );
+uint8_t parse_neighbors( const neighbor_table_t*, energy_t* );
 energy_t get_power_from_setting( uint8_t setting );
 
 #endif /*_ROUTING_H */
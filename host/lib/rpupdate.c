@@ -0,0 +1,285 @@
+/** @file rpupdate.c
+*
+* @brief Encode route/power tables as full or delta update messages and
+*        decode them again (what the AP does). See rpupdate.h for the format.
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rpupdate.h"
+
+static uint16_t encode_full( rp_encoder_t*, const uint8_t*, uint8_t* );
+static uint16_t encode_delta( rp_encoder_t*, const uint8_t*, uint8_t* );
+
+/*******************************************************************************
+ * @fn    void rp_encoder_initialize( rp_encoder_t* p_encoder )
+ *
+ * @brief Reset encoder, the next message will be a keyframe
+ * ****************************************************************************/
+void rp_encoder_initialize( rp_encoder_t* p_encoder )
+{
+  memset( p_encoder, 0, sizeof(rp_encoder_t) );
+}
+
+/*******************************************************************************
+ * @fn    void rp_update_force_keyframe( rp_encoder_t* p_encoder )
+ *
+ * @brief Send full tables in the next message (i.e. if the AP lost sync)
+ * ****************************************************************************/
+void rp_update_force_keyframe( rp_encoder_t* p_encoder )
+{
+  p_encoder->valid = 0;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t rp_update_encode( rp_encoder_t* p_encoder,
+ *                              const uint8_t* p_rp_tables,
+ *                              uint8_t device_count, uint8_t* p_message )
+ *
+ * @brief Build the update message for this round's tables (routes then
+ *        powers, device_count each). p_message must hold
+ *        RP_MESSAGE_MAX_SIZE bytes. Returns the message size.
+ * ****************************************************************************/
+uint16_t rp_update_encode( rp_encoder_t* p_encoder, const uint8_t* p_rp_tables,
+                                    uint8_t device_count, uint8_t* p_message )
+{
+  uint16_t message_size = 0;
+  uint16_t full_size = RP_HEADER_SIZE + 2 * device_count;
+
+  // Keyframe if there's nothing to compare against or it's time for one
+  if( ( !p_encoder->valid ) || ( device_count != p_encoder->device_count ) ||
+      ( p_encoder->since_keyframe >= ( RP_KEYFRAME_INTERVAL - 1 ) ) )
+  {
+    p_encoder->device_count = device_count;
+  }
+  else
+  {
+    message_size = encode_delta( p_encoder, p_rp_tables, p_message );
+  }
+
+  // Fall back to full tables if the delta isn't any smaller
+  if( ( 0 == message_size ) || ( message_size >= full_size ) )
+  {
+    message_size = encode_full( p_encoder, p_rp_tables, p_message );
+  }
+  else
+  {
+    p_encoder->since_keyframe++;
+  }
+
+  p_message[1] = ++p_encoder->sequence;
+  p_message[2] = device_count;
+
+  // Remember what was sent
+  memcpy( p_encoder->routes, p_rp_tables, device_count );
+  memcpy( p_encoder->powers, &p_rp_tables[device_count], device_count );
+  p_encoder->valid = 1;
+
+  p_encoder->messages++;
+  p_encoder->bytes += message_size;
+  p_encoder->full_bytes += full_size;
+
+  return message_size;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t encode_full( rp_encoder_t* p_encoder,
+ *                          const uint8_t* p_rp_tables, uint8_t* p_message )
+ *
+ * @brief Copy full tables into message payload. Returns message size.
+ * ****************************************************************************/
+static uint16_t encode_full( rp_encoder_t* p_encoder,
+                              const uint8_t* p_rp_tables, uint8_t* p_message )
+{
+  p_message[0] = RP_MSG_FULL;
+  memcpy( &p_message[RP_HEADER_SIZE], p_rp_tables,
+                                              2 * p_encoder->device_count );
+
+  p_encoder->since_keyframe = 0;
+  p_encoder->keyframes++;
+
+  return RP_HEADER_SIZE + 2 * p_encoder->device_count;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t encode_delta( rp_encoder_t* p_encoder,
+ *                          const uint8_t* p_rp_tables, uint8_t* p_message )
+ *
+ * @brief Write bitmaps and changed values into message payload. Stops and
+ *        returns 0 as soon as it would be larger than full tables.
+ *        Returns message size.
+ * ****************************************************************************/
+static uint16_t encode_delta( rp_encoder_t* p_encoder,
+                              const uint8_t* p_rp_tables, uint8_t* p_message )
+{
+  uint8_t device_count = p_encoder->device_count;
+  uint16_t bitmap_size = RP_BITMAP_SIZE( device_count );
+  uint16_t full_size = RP_HEADER_SIZE + 2 * device_count;
+  uint8_t* p_route_bitmap = &p_message[RP_HEADER_SIZE];
+  uint8_t* p_power_bitmap = p_route_bitmap + bitmap_size;
+  const uint8_t* p_routes = p_rp_tables;
+  const uint8_t* p_powers = &p_rp_tables[device_count];
+  uint16_t message_size = RP_HEADER_SIZE + 2 * bitmap_size;
+  uint8_t node_index;
+
+  if( message_size >= full_size )
+  {
+    return 0;
+  }
+
+  p_message[0] = RP_MSG_DELTA;
+  memset( p_route_bitmap, 0, 2 * bitmap_size );
+
+  for( node_index = 0; node_index < device_count; node_index++ )
+  {
+    if( p_routes[node_index] != p_encoder->routes[node_index] )
+    {
+      if( message_size >= full_size )
+      {
+        return 0;
+      }
+      p_route_bitmap[node_index >> 3] |= ( 1 << ( node_index & 7 ) );
+      p_message[message_size++] = p_routes[node_index];
+    }
+  }
+
+  for( node_index = 0; node_index < device_count; node_index++ )
+  {
+    if( p_powers[node_index] != p_encoder->powers[node_index] )
+    {
+      if( message_size >= full_size )
+      {
+        return 0;
+      }
+      p_power_bitmap[node_index >> 3] |= ( 1 << ( node_index & 7 ) );
+      p_message[message_size++] = p_powers[node_index];
+    }
+  }
+
+  return message_size;
+}
+
+/*******************************************************************************
+ * @fn    void rp_decoder_initialize( rp_decoder_t* p_decoder )
+ *
+ * @brief Reset decoder, it will wait for a keyframe
+ * ****************************************************************************/
+void rp_decoder_initialize( rp_decoder_t* p_decoder )
+{
+  memset( p_decoder, 0, sizeof(rp_decoder_t) );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t rp_update_decode( rp_decoder_t* p_decoder,
+ *                                   const uint8_t* p_message, uint16_t size )
+ *
+ * @brief Apply update message to the decoder's tables. Returns 1 if the
+ *        message couldn't be used (bad message or missed one, wait for the
+ *        next keyframe), 0 otherwise.
+ * ****************************************************************************/
+uint8_t rp_update_decode( rp_decoder_t* p_decoder, const uint8_t* p_message,
+                                                                uint16_t size )
+{
+  uint8_t device_count;
+  uint8_t sequence;
+  uint16_t bitmap_size;
+  uint16_t message_index;
+  const uint8_t* p_route_bitmap;
+  const uint8_t* p_power_bitmap;
+  uint8_t* p_routes;
+  uint8_t* p_powers;
+  uint8_t node_index;
+
+  if( size < RP_HEADER_SIZE )
+  {
+    return 1;
+  }
+
+  sequence = p_message[1];
+  device_count = p_message[2];
+
+  if( ( 0 == device_count ) || ( device_count > MAX_NETWORK_SIZE ) )
+  {
+    return 1;
+  }
+
+  p_routes = p_decoder->rp_tables;
+  p_powers = &p_decoder->rp_tables[device_count];
+
+  if( RP_MSG_FULL == p_message[0] )
+  {
+    if( size != ( RP_HEADER_SIZE + 2 * device_count ) )
+    {
+      return 1;
+    }
+
+    memcpy( p_decoder->rp_tables, &p_message[RP_HEADER_SIZE],
+                                                          2 * device_count );
+  }
+  else if( RP_MSG_DELTA == p_message[0] )
+  {
+    // Only valid on top of the previous message
+    if( ( !p_decoder->valid ) || ( device_count != p_decoder->device_count ) ||
+        ( sequence != (uint8_t)( p_decoder->sequence + 1 ) ) )
+    {
+      p_decoder->valid = 0;
+      return 1;
+    }
+
+    bitmap_size = RP_BITMAP_SIZE( device_count );
+    p_route_bitmap = &p_message[RP_HEADER_SIZE];
+    p_power_bitmap = p_route_bitmap + bitmap_size;
+    message_index = RP_HEADER_SIZE + 2 * bitmap_size;
+
+    if( size < message_index )
+    {
+      p_decoder->valid = 0;
+      return 1;
+    }
+
+    for( node_index = 0; node_index < device_count; node_index++ )
+    {
+      if( p_route_bitmap[node_index >> 3] & ( 1 << ( node_index & 7 ) ) )
+      {
+        if( message_index >= size )
+        {
+          p_decoder->valid = 0;
+          return 1;
+        }
+        p_routes[node_index] = p_message[message_index++];
+      }
+    }
+
+    for( node_index = 0; node_index < device_count; node_index++ )
+    {
+      if( p_power_bitmap[node_index >> 3] & ( 1 << ( node_index & 7 ) ) )
+      {
+        if( message_index >= size )
+        {
+          p_decoder->valid = 0;
+          return 1;
+        }
+        p_powers[node_index] = p_message[message_index++];
+      }
+    }
+
+    if( message_index != size )
+    {
+      p_decoder->valid = 0;
+      return 1;
+    }
+  }
+  else
+  {
+    return 1;
+  }
+
+  p_decoder->device_count = device_count;
+  p_decoder->sequence = sequence;
+  p_decoder->valid = 1;
+
+  return 0;
+}
@@ -0,0 +1,69 @@
+/** @file rpupdate.h
+*
+* @brief Route/power table update messages (host to AP)
+*
+* @author Alvaro Prieto
+*/
+#ifndef _RPUPDATE_H
+#define _RPUPDATE_H
+
+#include <stdint.h>
+#include "routing.h"
+
+//
+// Message layout (before SLIP escaping):
+//   [type][sequence][device_count] payload
+//
+// RP_MSG_FULL payload:  routes[N] powers[N] (same layout as rp_tables)
+// RP_MSG_DELTA payload: route_bitmap[B] power_bitmap[B]
+//                       changed routes, changed powers (in node order)
+// where B = RP_BITMAP_SIZE(N). Bit (i % 8) of byte (i / 8) is set if entry i
+// (node i+1) changed since the previous message.
+//
+// A delta only applies on top of the message with the previous sequence
+// number. Keyframes (full tables) are sent every RP_KEYFRAME_INTERVAL
+// messages, when the network size changes, or when a delta would not be
+// smaller, so a receiver that missed a message resyncs on its own.
+//
+#define RP_MSG_FULL   ( 0x46 ) // 'F'
+#define RP_MSG_DELTA  ( 0x44 ) // 'D'
+
+#define RP_HEADER_SIZE ( 3 )
+#define RP_BITMAP_SIZE( n ) ( ( (n) + 7 ) / 8 )
+
+// Largest message (a delta is never sent if it is larger than a full table)
+#define RP_MESSAGE_MAX_SIZE ( RP_HEADER_SIZE + RP_TABLES_SIZE )
+
+#define RP_KEYFRAME_INTERVAL ( 32 )
+
+typedef struct
+{
+  uint8_t routes[MAX_NETWORK_SIZE];   // Last tables sent
+  uint8_t powers[MAX_NETWORK_SIZE];
+  uint8_t device_count;
+  uint8_t sequence;
+  uint8_t valid;                      // 0 until the first keyframe
+  uint16_t since_keyframe;
+
+  // Statistics
+  uint32_t messages;
+  uint32_t keyframes;
+  uint64_t bytes;                     // Bytes sent
+  uint64_t full_bytes;                // Bytes if full tables were always sent
+} rp_encoder_t;
+
+typedef struct
+{
+  uint8_t rp_tables[RP_TABLES_SIZE];  // Routes then powers, N each
+  uint8_t device_count;
+  uint8_t sequence;
+  uint8_t valid;                      // 0 until a keyframe is received
+} rp_decoder_t;
+
+void rp_encoder_initialize( rp_encoder_t* );
+uint16_t rp_update_encode( rp_encoder_t*, const uint8_t*, uint8_t, uint8_t* );
+void rp_update_force_keyframe( rp_encoder_t* );
+void rp_decoder_initialize( rp_decoder_t* );
+uint8_t rp_update_decode( rp_decoder_t*, const uint8_t*, uint16_t );
+
+#endif /* _RPUPDATE_H */
@@ -37,29 +37,162 @@
 
 #ifdef __linux__   /* Linux */
 
+#include <linux/serial.h>
 
-int Cport[22],
-    error;
+#include <stdlib.h>
+
+/* ports are registered by ComportNumber() (or OpenComport() for a plain */
+/* number). each one is allocated once and never moves, the table of */
+/* pointers to them grows as needed. register every port before starting */
+/* threads that use them */
+struct comport
+{
+  int fd;
+  int baudrate;
+  char *path;
+  struct termios old_port_settings;
+};
+
+static struct comport **ports=NULL;
+static int port_count=0;
+
+int error;
+
+struct termios new_port_settings;
 
-struct termios new_port_settings,
-       old_port_settings[22];
 
-char comports[22][13]={"/dev/ttyS0","/dev/ttyS1","/dev/ttyS2","/dev/ttyS3","/dev/ttyS4","/dev/ttyS5",
-                       "/dev/ttyS6","/dev/ttyS7","/dev/ttyS8","/dev/ttyS9","/dev/ttyS10","/dev/ttyS11",
-                       "/dev/ttyS12","/dev/ttyS13","/dev/ttyS14","/dev/ttyS15","/dev/ttyUSB0",
-                       "/dev/ttyUSB1","/dev/ttyUSB2","/dev/ttyUSB3","/dev/ttyUSB4","/dev/ttyUSB5"};
+static struct comport *port_slot(int);
+static int register_port(int, const char *);
+static int configure_port(int, int, struct termios *);
+
+
+/* port number of a command line argument: a number is used as is (0-15 */
+/* are /dev/ttyS0-15, 16 and up /dev/ttyUSB0 and up), anything else is */
+/* taken as the path of the device (i.e. a pty, or a /dev/serial/by-id/ */
+/* link that survives the adapter being plugged back in) and given the */
+/* first free number from RS232_PATH_PORTS. returns -1 on error */
+int ComportNumber(const char *name)
+{
+  char path[32];
+  int i;
+  long n;
+  char *end;
+
+  n = strtol(name, &end, 10);
+  if((end!=name)&&(*end=='\0'))
+  {
+    if((n<0)||(n>=RS232_MAX_NUMBER))  return(-1);
+    if(n<16)  sprintf(path, "/dev/ttyS%ld", n);
+    else  sprintf(path, "/dev/ttyUSB%ld", n-16);
+    if(register_port((int)n, path))  return(-1);
+    return((int)n);
+  }
+
+  for(i=0; i<port_count; i++)
+  {
+    if((ports[i]!=NULL)&&(ports[i]->path!=NULL)&&
+       (!strcmp(ports[i]->path, name)))  return(i);
+  }
+
+  for(i=RS232_PATH_PORTS; ; i++)
+  {
+    if((i>=port_count)||(ports[i]==NULL)||(ports[i]->path==NULL))
+    {
+      if(register_port(i, name))  return(-1);
+      return(i);
+    }
+  }
+}
+
+
+/* port of a number, allocated if it has none yet. the table grows to fit */
+/* it, but the one it replaces is kept so a thread still reading it finds */
+/* the same ports. NULL if out of memory */
+static struct comport *port_slot(int comport_number)
+{
+  struct comport **grown;
+  int count;
+
+  if(comport_number<0)  return(NULL);
+
+  if(comport_number>=port_count)
+  {
+    count = (comport_number<RS232_PATH_PORTS) ? RS232_PATH_PORTS : comport_number + 1;
+    if(count<2*port_count)  count = 2*port_count;
+
+    grown = calloc(count, sizeof(struct comport *));
+    if(grown==NULL)  return(NULL);
+
+    if(port_count>0)  memcpy(grown, ports, port_count*sizeof(struct comport *));
+    ports = grown;
+    port_count = count;
+  }
+
+  if(ports[comport_number]==NULL)
+  {
+    ports[comport_number] = calloc(1, sizeof(struct comport));
+    if(ports[comport_number]==NULL)  return(NULL);
+    ports[comport_number]->fd = -1;
+  }
+
+  return(ports[comport_number]);
+}
+
+
+/* give a port number its device. fails if the number already has another */
+/* one (a number from the command line clashing with a path) */
+static int register_port(int comport_number, const char *path)
+{
+  struct comport *port;
+
+  port = port_slot(comport_number);
+  if(port==NULL)  return(1);
+
+  if(port->path!=NULL)
+  {
+    if(strcmp(port->path, path))
+    {
+      printf("comport %d is already %s\n", comport_number, port->path);
+      return(1);
+    }
+    return(0);
+  }
+
+  port->path = strdup(path);
+  if(port->path==NULL)  return(1);
+  port->fd = -1;
+
+  return(0);
+}
 
 
 int OpenComport(int comport_number, int baudrate)
 {
   int baudr;
 
-  if((comport_number>21)||(comport_number<0))
+  char name[16];
+  struct comport *port;
+  int fd;
+
+  if(comport_number<0)
   {
     printf("illegal comport number\n");
     return(1);
   }
 
+  /* numbers not given to ComportNumber() are the default devices */
+  if((comport_number>=port_count)||(ports[comport_number]==NULL)||
+     (ports[comport_number]->path==NULL))
+  {
+    sprintf(name, "%d", comport_number);
+    if(ComportNumber(name)!=comport_number)
+    {
+      printf("illegal comport number\n");
+      return(1);
+    }
+  }
+  port = ports[comport_number];
+
   switch(baudrate)
   {
     case      50 : baudr = B50;
@@ -113,35 +246,26 @@ int OpenComport(int comport_number, int baudrate)
                    break;
   }
 
-  Cport[comport_number] = open(comports[comport_number], O_RDWR | O_NOCTTY | O_NDELAY);
-  if(Cport[comport_number]==-1)
+  fd = open(port->path, O_RDWR | O_NOCTTY | O_NDELAY);
+  if(fd==-1)
   {
     perror("unable to open comport ");
     return(1);
   }
 
-  error = tcgetattr(Cport[comport_number], old_port_settings + comport_number);
-  if(error==-1)
+  if(configure_port(fd, baudr, &port->old_port_settings))
   {
-    close(Cport[comport_number]);
-    perror("unable to read portsettings ");
+    close(fd);
     return(1);
   }
-  memset(&new_port_settings, 0, sizeof(new_port_settings));  /* clear the new struct */
 
-  new_port_settings.c_cflag = baudr | CS8 | CLOCAL | CREAD;
-  new_port_settings.c_iflag = IGNPAR;
-  new_port_settings.c_oflag = 0;
-  new_port_settings.c_lflag = 0;
-  new_port_settings.c_cc[VMIN] = 0;      /* block untill n bytes are received */
-  new_port_settings.c_cc[VTIME] = 0;     /* block untill a timer expires (n * 100 mSec.) */
-  error = tcsetattr(Cport[comport_number], TCSANOW, &new_port_settings);
-  if(error==-1)
-  {
-    close(Cport[comport_number]);
-    perror("unable to adjust portsettings ");
-    return(1);
-  }
+  port->fd = fd;
+  port->baudrate = baudr;
+
+#ifdef SERIAL_LOW_LATENCY
+  /* not every port supports it (i.e. ptys), reads still work without */
+  SetComportLowLatency(comport_number, 1);
+#endif
 
   return(0);
 }
@@ -157,7 +281,7 @@ int PollComport(int comport_number, unsigned char *buf, int size)
   if(size>4096)  size = 4096;
 #endif
 
-  n = read(Cport[comport_number], buf, size);
+  n = read(ports[comport_number]->fd, buf, size);
 
   return(n);
 }
@@ -167,7 +291,7 @@ int SendByte(int comport_number, unsigned char byte)
 {
   int n;
 
-  n = write(Cport[comport_number], &byte, 1);
+  n = write(ports[comport_number]->fd, &byte, 1);
   if(n<0)  return(1);
 
   return(0);
@@ -176,14 +300,79 @@ int SendByte(int comport_number, unsigned char byte)
 
 int SendBuf(int comport_number, unsigned char *buf, int size)
 {
-  return(write(Cport[comport_number], buf, size));
+  return(write(ports[comport_number]->fd, buf, size));
 }
 
 
 void CloseComport(int comport_number)
 {
-  close(Cport[comport_number]);
-  tcsetattr(Cport[comport_number], TCSANOW, old_port_settings + comport_number);
+  tcsetattr(ports[comport_number]->fd, TCSANOW, &ports[comport_number]->old_port_settings);
+  close(ports[comport_number]->fd);
+  ports[comport_number]->fd = -1;
+}
+
+
+/* open the port's device again after it went away (i.e. a USB adapter */
+/* unplugged and plugged back in, under a by-id path if it may come back */
+/* as another ttyUSB), with the settings it had. the new device takes over */
+/* the old file descriptor, so whoever has it (GetComportFd) keeps using it, */
+/* but it has to be added to poll/epoll again. returns 1 if the device */
+/* isn't back yet */
+int ReattachComport(int comport_number)
+{
+  struct comport *port = ports[comport_number];
+  struct termios old_port_settings;
+  int fd;
+
+  fd = open(port->path, O_RDWR | O_NOCTTY | O_NDELAY);
+  if(fd==-1)  return(1);
+
+  if(configure_port(fd, port->baudrate, &old_port_settings))
+  {
+    close(fd);
+    return(1);
+  }
+
+  if(dup2(fd, port->fd)==-1)
+  {
+    close(fd);
+    return(1);
+  }
+  close(fd);
+
+#ifdef SERIAL_LOW_LATENCY
+  SetComportLowLatency(comport_number, 1);
+#endif
+
+  return(0);
+}
+
+
+/* raw mode at baudr (a B... constant), the settings before go in old */
+static int configure_port(int fd, int baudr, struct termios *old)
+{
+  error = tcgetattr(fd, old);
+  if(error==-1)
+  {
+    perror("unable to read portsettings ");
+    return(1);
+  }
+  memset(&new_port_settings, 0, sizeof(new_port_settings));  /* clear the new struct */
+
+  new_port_settings.c_cflag = baudr | CS8 | CLOCAL | CREAD;
+  new_port_settings.c_iflag = IGNPAR;
+  new_port_settings.c_oflag = 0;
+  new_port_settings.c_lflag = 0;
+  new_port_settings.c_cc[VMIN] = 0;      /* block untill n bytes are received */
+  new_port_settings.c_cc[VTIME] = 0;     /* block untill a timer expires (n * 100 mSec.) */
+  error = tcsetattr(fd, TCSANOW, &new_port_settings);
+  if(error==-1)
+  {
+    perror("unable to adjust portsettings ");
+    return(1);
+  }
+
+  return(0);
 }
 
 /*
@@ -205,13 +394,62 @@ int IsCTSEnabled(int comport_number)
 {
   int status;
 
-  status = ioctl(Cport[comport_number], TIOCMGET, &status);
+  status = ioctl(ports[comport_number]->fd, TIOCMGET, &status);
 
   if(status&TIOCM_CTS) return(1);
   else return(0);
 }
 
 
+/* file descriptor of an open port, to wait on it with poll/epoll */
+int GetComportFd(int comport_number)
+{
+  return(ports[comport_number]->fd);
+}
+
+
+/* the port is opened with O_NDELAY, so VMIN/VTIME don't apply and reads */
+/* never block. Waiting here and then reading is what VMIN=1, VTIME=0 would */
+/* do: wake up on the first byte, and PollComport then gets all there is. */
+/* returns >0 if there is data (or the port hung up, PollComport will say), */
+/* 0 if timeout_ms (-1 waits forever) went by and -1 on error */
+int WaitComport(int comport_number, int timeout_ms)
+{
+  struct pollfd port;
+  int n;
+
+  port.fd = ports[comport_number]->fd;
+  port.events = POLLIN;
+
+  do
+  {
+    n = poll(&port, 1, timeout_ms);
+  } while((n<0)&&(errno==EINTR));
+
+  if((n>0)&&(port.revents&POLLNVAL))  return(-1);
+
+  return(n);
+}
+
+
+/* low latency mode: the driver hands received bytes over right away */
+/* instead of batching them (i.e. FTDI adapters wait up to 16 mSec.) */
+/* returns 1 if the port doesn't support it */
+int SetComportLowLatency(int comport_number, int enable)
+{
+  struct serial_struct serial;
+
+  if(ioctl(ports[comport_number]->fd, TIOCGSERIAL, &serial)==-1)  return(1);
+
+  if(enable)  serial.flags |= ASYNC_LOW_LATENCY;
+  else  serial.flags &= ~ASYNC_LOW_LATENCY;
+
+  if(ioctl(ports[comport_number]->fd, TIOCSSERIAL, &serial)==-1)  return(1);
+
+  return(0);
+}
+
+
 #else         /* windows */
 
 
@@ -226,6 +464,18 @@ char comports[16][10]={"\\\\.\\COM1",  "\\\\.\\COM2",  "\\\\.\\COM3",  "\\\\.\\C
 char baudr[64];
 
 
+/* only numbered ports on windows */
+int ComportNumber(const char *name)
+{
+  int n;
+
+  n = atoi(name);
+  if((n<0)||(n>15))  return(-1);
+
+  return(n);
+}
+
+
 int OpenComport(int comport_number, int baudrate)
 {
   if((comport_number>15)||(comport_number<0))
@@ -375,6 +625,21 @@ int IsCTSEnabled(int comport_number)
 }
 
 
+/* no overlapped I/O here, so just don't spin: callers read right after */
+int WaitComport(int comport_number, int timeout_ms)
+{
+  if(timeout_ms!=0)  Sleep(1);
+
+  return(1);
+}
+
+
+int SetComportLowLatency(int comport_number, int enable)
+{
+  return(1);
+}
+
+
 #endif
 
 
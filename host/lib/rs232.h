@@ -46,6 +46,8 @@ extern "C" {
 #ifdef __linux__
 
 #include <termios.h>
+#include <poll.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -53,6 +55,13 @@ extern "C" {
 #include <sys/stat.h>
 #include <limits.h>
 
+/* numbers given as such go up to RS232_MAX_NUMBER-1 (/dev/ttyS0-15 and */
+/* /dev/ttyUSB0-47), devices opened by path get any free number from */
+/* RS232_PATH_PORTS (after /dev/ttyS0-15 and /dev/ttyUSB0-5) up, with no */
+/* limit, see ComportNumber() */
+#define RS232_MAX_NUMBER  64
+#define RS232_PATH_PORTS  22
+
 #else
 
 #include <windows.h>
@@ -66,6 +75,14 @@ int SendBuf(int, unsigned char *, int);
 void CloseComport(int);
 void cprintf(int, const char *);
 int IsCTSEnabled(int);
+int WaitComport(int, int);
+int SetComportLowLatency(int, int);
+int ComportNumber(const char *);
+
+#ifdef __linux__
+int GetComportFd(int);
+int ReattachComport(int);
+#endif
 
 
 #ifdef __cplusplus
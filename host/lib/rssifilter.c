@@ -0,0 +1,509 @@
+/** @file rssifilter.c
+*
+* @brief Per-link smoothing filters. State for every link is kept in
+*        separate arrays (estimate and variance) so a whole table is
+*        filtered in one pass, two links at a time with SSE2.
+*
+*        Filtering the required tx power (target - attenuation) is the same
+*        as filtering the attenuation, since both filters are linear.
+*
+*        The forecast filter doesn't smooth, it predicts. Routes computed
+*        from a table are only used the round after, so with quasi-periodic
+*        links (i.e. gait while walking) they are always a round late. Each
+*        link's deviation from its slow level is fitted with an AR(2) model
+*        (enough for one dominant period) by recursive least squares, and
+*        the table is replaced with next round's forecast. Constant work per
+*        link, whatever the history.
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "rssifilter.h"
+
+static void ewma_update( energy_t*, uint32_t, energy_t );
+static void kalman_update( energy_t*, uint32_t, energy_t );
+static void forecast_update( energy_t*, uint32_t, energy_t );
+
+// Forecast model of each link: last two deviations from the link level, AR
+// weights and the (symmetric) RLS covariance
+enum
+{
+  MODEL_D1 = 0,
+  MODEL_D2,
+  MODEL_W1,
+  MODEL_W2,
+  MODEL_P11,
+  MODEL_P12,
+  MODEL_P22,
+  MODEL_SIZE
+};
+
+// Covariance a new model starts with (large, the first samples count most)
+#define MODEL_P_START ( 100.0 )
+
+// Covariance doesn't grow past this while a link is flat (RLS windup)
+#define MODEL_P_MAX ( 1000.0 )
+
+//
+// Filter settings and state for one network. Each thread works on the
+// filter picked with rssi_filter_select().
+//
+struct rssi_filter_s
+{
+  rssi_filter_type_t type;
+
+  // EWMA: alpha, unused
+  // Kalman: process noise (q), measurement noise (r)
+  // Forecast: forgetting factor (lambda), level alpha
+  energy_t param_1;
+  energy_t param_2;
+
+  // Filter state for each link. A negative variance means the link has no
+  // estimate yet (the next valid sample is used as is). Forecasts keep the
+  // link level in estimates and MODEL_SIZE values per link in models.
+  energy_t* estimates;
+  energy_t* variances;
+  energy_t* models;
+  uint32_t cells;
+};
+
+// Filter used by threads that never call rssi_filter_select()
+static rssi_filter_t default_filter = { RSSI_FILTER_NONE };
+static __thread rssi_filter_t* p_filter = &default_filter;
+
+// Fields of the selected filter
+#define filter_type ( p_filter->type )
+#define filter_param_1 ( p_filter->param_1 )
+#define filter_param_2 ( p_filter->param_2 )
+#define estimates ( p_filter->estimates )
+#define variances ( p_filter->variances )
+#define models ( p_filter->models )
+#define filter_cells ( p_filter->cells )
+
+/*******************************************************************************
+ * @fn    rssi_filter_t* rssi_filter_create()
+ *
+ * @brief Allocate a filter (no filtering selected), see rssi_filter_select
+ * ****************************************************************************/
+rssi_filter_t* rssi_filter_create()
+{
+  return calloc( 1, sizeof(rssi_filter_t) );
+}
+
+/*******************************************************************************
+ * @fn    void rssi_filter_destroy( rssi_filter_t* p_destroy )
+ *
+ * @brief Free a filter from rssi_filter_create and its state
+ * ****************************************************************************/
+void rssi_filter_destroy( rssi_filter_t* p_destroy )
+{
+  rssi_filter_t* p_selected = p_filter;
+
+  if( NULL == p_destroy )
+  {
+    return;
+  }
+
+  p_filter = p_destroy;
+  rssi_filter_finalize();
+
+  p_filter = ( p_selected == p_destroy ) ? &default_filter : p_selected;
+  free( p_destroy );
+}
+
+/*******************************************************************************
+ * @fn    void rssi_filter_select( rssi_filter_t* p_select )
+ *
+ * @brief Make the calling thread use p_select from now on (NULL for the
+ *        default filter). A filter must only be used by one thread at a time.
+ * ****************************************************************************/
+void rssi_filter_select( rssi_filter_t* p_select )
+{
+  p_filter = ( NULL != p_select ) ? p_select : &default_filter;
+}
+
+/*******************************************************************************
+ * @fn    void rssi_filter_configure( rssi_filter_type_t type,
+ *                                  energy_t param_1, energy_t param_2 )
+ *
+ * @brief Select filter. EWMA uses param_1 as alpha (0.0-1.0), Kalman uses
+ *        param_1 as process noise and param_2 as measurement noise (dB^2),
+ *        forecast uses param_1 as forgetting factor and param_2 as level
+ *        alpha (both 0.0-1.0).
+ * ****************************************************************************/
+void rssi_filter_configure( rssi_filter_type_t type, energy_t param_1,
+                                                            energy_t param_2 )
+{
+  filter_type = type;
+  filter_param_1 = param_1;
+  filter_param_2 = param_2;
+}
+
+/*******************************************************************************
+ * @fn    rssi_filter_type_t rssi_filter_get_type()
+ *
+ * @brief Returns the selected filter
+ * ****************************************************************************/
+rssi_filter_type_t rssi_filter_get_type()
+{
+  return filter_type;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t rssi_filter_initialize( uint32_t cells )
+ *
+ * @brief Allocate (and reset) state for cells links
+ * ****************************************************************************/
+uint8_t rssi_filter_initialize( uint32_t cells )
+{
+  uint32_t cell_index;
+
+  rssi_filter_finalize();
+
+  estimates = calloc( cells, sizeof(energy_t) );
+  variances = malloc( cells * sizeof(energy_t) );
+
+  if( RSSI_FILTER_FORECAST == filter_type )
+  {
+    models = malloc( cells * MODEL_SIZE * sizeof(energy_t) );
+  }
+
+  if( ( NULL == estimates ) || ( NULL == variances ) ||
+      ( ( RSSI_FILTER_FORECAST == filter_type ) && ( NULL == models ) ) )
+  {
+    rssi_filter_finalize();
+    return 1;
+  }
+
+  for( cell_index = 0; cell_index < cells; cell_index++ )
+  {
+    variances[cell_index] = -1;
+  }
+
+  filter_cells = cells;
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void rssi_filter_finalize()
+ *
+ * @brief Free filter state
+ * ****************************************************************************/
+void rssi_filter_finalize()
+{
+  free( estimates );
+  free( variances );
+  free( models );
+
+  estimates = NULL;
+  variances = NULL;
+  models = NULL;
+  filter_cells = 0;
+}
+
+/*******************************************************************************
+ * @fn    void rssi_filter_update( energy_t* p_values, uint32_t cells,
+ *                                                      energy_t max_valid )
+ *
+ * @brief Add this round's samples and replace them with the filtered values.
+ *        Samples above max_valid mean there was no measurement, they are
+ *        left as they are and don't change the link's state.
+ * ****************************************************************************/
+void rssi_filter_update( energy_t* p_values, uint32_t cells,
+                                                          energy_t max_valid )
+{
+  if( cells > filter_cells )
+  {
+    return;
+  }
+
+  switch( filter_type )
+  {
+    case RSSI_FILTER_EWMA:
+      ewma_update( p_values, cells, max_valid );
+      break;
+
+    case RSSI_FILTER_KALMAN:
+      kalman_update( p_values, cells, max_valid );
+      break;
+
+    case RSSI_FILTER_FORECAST:
+      if( NULL != models )
+      {
+        forecast_update( p_values, cells, max_valid );
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*******************************************************************************
+ * @fn    void ewma_update( energy_t* p_values, uint32_t cells,
+ *                                                      energy_t max_valid )
+ *
+ * @brief estimate += alpha * ( sample - estimate )
+ *        variance = ( 1 - alpha ) * ( variance + alpha * error^2 )
+ * ****************************************************************************/
+static void ewma_update( energy_t* p_values, uint32_t cells,
+                                                          energy_t max_valid )
+{
+  const energy_t alpha = filter_param_1;
+  uint32_t cell_index = 0;
+  energy_t error;
+
+#ifdef __SSE2__
+  // NOTE: assumes energy_t is double
+  const __m128d v_alpha = _mm_set1_pd( alpha );
+  const __m128d v_one_minus_alpha = _mm_set1_pd( 1 - alpha );
+  const __m128d v_max_valid = _mm_set1_pd( max_valid );
+  const __m128d v_zero = _mm_setzero_pd();
+
+  for( ; ( cell_index + 2 ) <= cells; cell_index += 2 )
+  {
+    __m128d sample = _mm_loadu_pd( &p_values[cell_index] );
+    __m128d estimate = _mm_loadu_pd( &estimates[cell_index] );
+    __m128d variance = _mm_loadu_pd( &variances[cell_index] );
+    __m128d valid = _mm_cmple_pd( sample, v_max_valid );
+    __m128d first = _mm_cmplt_pd( variance, v_zero );
+    __m128d error_v = _mm_sub_pd( sample, estimate );
+    __m128d new_estimate = _mm_add_pd( estimate,
+                                              _mm_mul_pd( v_alpha, error_v ) );
+    __m128d new_variance = _mm_mul_pd( v_one_minus_alpha,
+                    _mm_add_pd( variance,
+                      _mm_mul_pd( v_alpha, _mm_mul_pd( error_v, error_v ) ) ) );
+
+    // First sample of a link is used as is
+    new_estimate = _mm_or_pd( _mm_and_pd( first, sample ),
+                              _mm_andnot_pd( first, new_estimate ) );
+    new_variance = _mm_andnot_pd( first, new_variance );
+
+    // Only valid samples change the state
+    estimate = _mm_or_pd( _mm_and_pd( valid, new_estimate ),
+                          _mm_andnot_pd( valid, estimate ) );
+    variance = _mm_or_pd( _mm_and_pd( valid, new_variance ),
+                          _mm_andnot_pd( valid, variance ) );
+    sample = _mm_or_pd( _mm_and_pd( valid, estimate ),
+                        _mm_andnot_pd( valid, sample ) );
+
+    _mm_storeu_pd( &estimates[cell_index], estimate );
+    _mm_storeu_pd( &variances[cell_index], variance );
+    _mm_storeu_pd( &p_values[cell_index], sample );
+  }
+#endif
+
+  for( ; cell_index < cells; cell_index++ )
+  {
+    if( p_values[cell_index] > max_valid )
+    {
+      continue;
+    }
+
+    if( variances[cell_index] < 0 )
+    {
+      estimates[cell_index] = p_values[cell_index];
+      variances[cell_index] = 0;
+    }
+    else
+    {
+      error = p_values[cell_index] - estimates[cell_index];
+      estimates[cell_index] += alpha * error;
+      variances[cell_index] = ( 1 - alpha ) *
+                              ( variances[cell_index] + alpha * error * error );
+    }
+
+    p_values[cell_index] = estimates[cell_index];
+  }
+}
+
+/*******************************************************************************
+ * @fn    void kalman_update( energy_t* p_values, uint32_t cells,
+ *                                                      energy_t max_valid )
+ *
+ * @brief Scalar Kalman filter for a random walk, for each link:
+ *        predicted = variance + q
+ *        gain = predicted / ( predicted + r )
+ *        estimate += gain * ( sample - estimate )
+ *        variance = ( 1 - gain ) * predicted
+ * ****************************************************************************/
+static void kalman_update( energy_t* p_values, uint32_t cells,
+                                                          energy_t max_valid )
+{
+  const energy_t q = filter_param_1;
+  const energy_t r = filter_param_2;
+  uint32_t cell_index = 0;
+  energy_t predicted;
+  energy_t gain;
+
+#ifdef __SSE2__
+  // NOTE: assumes energy_t is double
+  const __m128d v_q = _mm_set1_pd( q );
+  const __m128d v_r = _mm_set1_pd( r );
+  const __m128d v_one = _mm_set1_pd( 1 );
+  const __m128d v_max_valid = _mm_set1_pd( max_valid );
+  const __m128d v_zero = _mm_setzero_pd();
+
+  for( ; ( cell_index + 2 ) <= cells; cell_index += 2 )
+  {
+    __m128d sample = _mm_loadu_pd( &p_values[cell_index] );
+    __m128d estimate = _mm_loadu_pd( &estimates[cell_index] );
+    __m128d variance = _mm_loadu_pd( &variances[cell_index] );
+    __m128d valid = _mm_cmple_pd( sample, v_max_valid );
+    __m128d first = _mm_cmplt_pd( variance, v_zero );
+    __m128d predicted_v = _mm_add_pd( variance, v_q );
+    __m128d gain_v = _mm_div_pd( predicted_v, _mm_add_pd( predicted_v, v_r ) );
+    __m128d new_estimate = _mm_add_pd( estimate,
+                          _mm_mul_pd( gain_v, _mm_sub_pd( sample, estimate ) ) );
+    __m128d new_variance = _mm_mul_pd( _mm_sub_pd( v_one, gain_v ),
+                                                                predicted_v );
+
+    // First sample of a link is used as is, with measurement noise variance
+    new_estimate = _mm_or_pd( _mm_and_pd( first, sample ),
+                              _mm_andnot_pd( first, new_estimate ) );
+    new_variance = _mm_or_pd( _mm_and_pd( first, v_r ),
+                              _mm_andnot_pd( first, new_variance ) );
+
+    // Only valid samples change the state
+    estimate = _mm_or_pd( _mm_and_pd( valid, new_estimate ),
+                          _mm_andnot_pd( valid, estimate ) );
+    variance = _mm_or_pd( _mm_and_pd( valid, new_variance ),
+                          _mm_andnot_pd( valid, variance ) );
+    sample = _mm_or_pd( _mm_and_pd( valid, estimate ),
+                        _mm_andnot_pd( valid, sample ) );
+
+    _mm_storeu_pd( &estimates[cell_index], estimate );
+    _mm_storeu_pd( &variances[cell_index], variance );
+    _mm_storeu_pd( &p_values[cell_index], sample );
+  }
+#endif
+
+  for( ; cell_index < cells; cell_index++ )
+  {
+    if( p_values[cell_index] > max_valid )
+    {
+      continue;
+    }
+
+    if( variances[cell_index] < 0 )
+    {
+      estimates[cell_index] = p_values[cell_index];
+      variances[cell_index] = r;
+    }
+    else
+    {
+      predicted = variances[cell_index] + q;
+      gain = predicted / ( predicted + r );
+      estimates[cell_index] += gain *
+                                ( p_values[cell_index] - estimates[cell_index] );
+      variances[cell_index] = ( 1 - gain ) * predicted;
+    }
+
+    p_values[cell_index] = estimates[cell_index];
+  }
+}
+
+/*******************************************************************************
+ * @fn    void forecast_update( energy_t* p_values, uint32_t cells,
+ *                                                      energy_t max_valid )
+ *
+ * @brief Replace each sample with next round's forecast. For each link:
+ *        d = sample - level
+ *        error = d - ( w1 * d1 + w2 * d2 )
+ *        RLS update of w1, w2 with error, regressors (d1, d2) and lambda
+ *        level += alpha * d
+ *        forecast = level + w1 * d + w2 * d1
+ * ****************************************************************************/
+static void forecast_update( energy_t* p_values, uint32_t cells,
+                                                          energy_t max_valid )
+{
+  const energy_t lambda = filter_param_1;
+  const energy_t alpha = filter_param_2;
+  uint32_t cell_index;
+  energy_t* p_model;
+  energy_t deviation;
+  energy_t error;
+  energy_t pphi_1;
+  energy_t pphi_2;
+  energy_t gain_1;
+  energy_t gain_2;
+  energy_t denominator;
+  energy_t forget;
+  energy_t step;
+
+  for( cell_index = 0; cell_index < cells; cell_index++ )
+  {
+    if( p_values[cell_index] > max_valid )
+    {
+      continue;
+    }
+
+    p_model = &models[cell_index * MODEL_SIZE];
+
+    // First sample of a link is used as is
+    if( variances[cell_index] < 0 )
+    {
+      estimates[cell_index] = p_values[cell_index];
+      variances[cell_index] = 0;
+
+      p_model[MODEL_D1] = 0;
+      p_model[MODEL_D2] = 0;
+      p_model[MODEL_W1] = 0;
+      p_model[MODEL_W2] = 0;
+      p_model[MODEL_P11] = MODEL_P_START;
+      p_model[MODEL_P12] = 0;
+      p_model[MODEL_P22] = MODEL_P_START;
+      continue;
+    }
+
+    deviation = p_values[cell_index] - estimates[cell_index];
+    error = deviation - ( p_model[MODEL_W1] * p_model[MODEL_D1] +
+                          p_model[MODEL_W2] * p_model[MODEL_D2] );
+
+    // gain = P * phi / ( lambda + phi' * P * phi )
+    pphi_1 = p_model[MODEL_P11] * p_model[MODEL_D1] +
+             p_model[MODEL_P12] * p_model[MODEL_D2];
+    pphi_2 = p_model[MODEL_P12] * p_model[MODEL_D1] +
+             p_model[MODEL_P22] * p_model[MODEL_D2];
+    denominator = lambda + p_model[MODEL_D1] * pphi_1 +
+                           p_model[MODEL_D2] * pphi_2;
+    gain_1 = pphi_1 / denominator;
+    gain_2 = pphi_2 / denominator;
+
+    p_model[MODEL_W1] += gain_1 * error;
+    p_model[MODEL_W2] += gain_2 * error;
+
+    // P = ( P - gain * phi' * P ) / lambda, without forgetting once P is
+    // large (nothing new was learned for a while)
+    forget = ( ( p_model[MODEL_P11] + p_model[MODEL_P22] ) < MODEL_P_MAX ) ?
+                                                                lambda : 1.0;
+    p_model[MODEL_P11] = ( p_model[MODEL_P11] - gain_1 * pphi_1 ) / forget;
+    p_model[MODEL_P12] = ( p_model[MODEL_P12] - gain_1 * pphi_2 ) / forget;
+    p_model[MODEL_P22] = ( p_model[MODEL_P22] - gain_2 * pphi_2 ) / forget;
+
+    estimates[cell_index] += alpha * deviation;
+
+    p_model[MODEL_D2] = p_model[MODEL_D1];
+    p_model[MODEL_D1] = deviation;
+
+    step = p_model[MODEL_W1] * p_model[MODEL_D1] +
+           p_model[MODEL_W2] * p_model[MODEL_D2];
+    if( step > RSSI_FILTER_FORECAST_MAX_STEP )
+    {
+      step = RSSI_FILTER_FORECAST_MAX_STEP;
+    }
+    else if( step < -RSSI_FILTER_FORECAST_MAX_STEP )
+    {
+      step = -RSSI_FILTER_FORECAST_MAX_STEP;
+    }
+
+    p_values[cell_index] = estimates[cell_index] + step;
+  }
+}
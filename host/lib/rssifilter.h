@@ -0,0 +1,48 @@
+/** @file rssifilter.h
+*
+* @brief Per-link smoothing filters for the link power table
+*
+* @author Alvaro Prieto
+*/
+#ifndef _RSSIFILTER_H
+#define _RSSIFILTER_H
+
+#include <stdint.h>
+#include "dijkstra.h"
+
+typedef enum
+{
+  RSSI_FILTER_NONE = 0,
+  RSSI_FILTER_EWMA,
+  RSSI_FILTER_KALMAN,
+  RSSI_FILTER_FORECAST
+} rssi_filter_type_t;
+
+typedef struct rssi_filter_s rssi_filter_t;
+
+// EWMA weight of the newest sample
+#define RSSI_FILTER_EWMA_ALPHA ( 0.3 )
+
+// Kalman filter process noise (how much a link can change per round) and
+// measurement noise, both in dB^2
+#define RSSI_FILTER_KALMAN_Q ( 1.0 )
+#define RSSI_FILTER_KALMAN_R ( 16.0 )
+
+// Forecast: forgetting factor of the per-link AR(2) fit (closer to 1 fits
+// over more rounds) and EWMA weight of the slow link level it's fitted around
+#define RSSI_FILTER_FORECAST_LAMBDA ( 0.98 )
+#define RSSI_FILTER_FORECAST_ALPHA ( 0.05 )
+
+// Forecasts never move further than this from the link level (dB)
+#define RSSI_FILTER_FORECAST_MAX_STEP ( 20.0 )
+
+rssi_filter_t* rssi_filter_create();
+void rssi_filter_destroy( rssi_filter_t* );
+void rssi_filter_select( rssi_filter_t* );
+void rssi_filter_configure( rssi_filter_type_t, energy_t, energy_t );
+rssi_filter_type_t rssi_filter_get_type();
+uint8_t rssi_filter_initialize( uint32_t );
+void rssi_filter_finalize();
+void rssi_filter_update( energy_t*, uint32_t, energy_t );
+
+#endif /* _RSSIFILTER_H */
@@ -5,20 +5,29 @@
 * @author Alvaro Prieto
 */
 #include <stdlib.h>
+#include <errno.h>
 #include "serial.h"
 #include "rs232.h"
+#include "deframer.h"
+#include "txqueue.h"
+#include "capture.h"
+#include "latency.h"
 
 static int32_t serial_port_number;
+static deframer_t deframer;
+static txqueue_t tx_queue;
+static capture_t* p_capture = NULL;
+
+#ifdef SERIAL_CAPTURE
+// Everything read and written, for ../../capreplay
+static capture_t capture;
+#define CAPTURE_FILENAME "./serial.cap"
+#endif
 
-uint8_t packet_in_buffer( uint8_t* );
-uint16_t find_and_escape_packet( uint8_t*, uint8_t* );
 static uint8_t dummy_callback( uint8_t* buffer, uint32_t size );
 
 static uint8_t (*serial_read_callback)( uint8_t*, uint32_t ) = dummy_callback;
 
-#define SYNC_BYTE   ( 0x7E )
-#define ESCAPE_BYTE ( 0x7D )
-
 /*******************************************************************************
  * @fn     uint8_t serial_open( int32_t port_number, int32_t baud_rate,
  *                                     uint8_t (*callback)( uint8_t*, uint32_t) )
@@ -35,6 +44,21 @@ uint8_t serial_open( int32_t port_number, int32_t baud_rate,
     return 1;
   }
 
+#ifdef SERIAL_CAPTURE
+  if( 0 == capture_open( &capture, CAPTURE_FILENAME ) )
+  {
+    p_capture = &capture;
+  }
+#endif
+
+  // Outgoing frames are written by their own thread
+  if( txqueue_start( &tx_queue, serial_port_number, p_capture ) )
+  {
+    printf("Unable to start serial transmit thread.\r\n");
+    CloseComport( serial_port_number );
+    return 1;
+  }
+
   // Set a callback function for receiving packets
   serial_read_callback = callback;
 
@@ -43,216 +67,101 @@ uint8_t serial_open( int32_t port_number, int32_t baud_rate,
 
 /*******************************************************************************
  * @fn     void serial_close()
- * @brief  Close serial port
+ * @brief  Send what is still queued and close serial port
  * ****************************************************************************/
 void serial_close()
 {
+  txqueue_stop( &tx_queue );
+  txqueue_print_stats( &tx_queue );
+
   CloseComport( serial_port_number );
+
+  if( NULL != p_capture )
+  {
+    // After the writer thread, with everything it sent
+    capture_close( p_capture );
+  }
 }
 
 /*******************************************************************************
  * @fn     void *serial_read_thread()
- * @brief  Run as thread. Polls serial port and builds packets. Calls
- *         serial_callback function with each new packet
+ * @brief  Run as thread. Sleeps until there is data on the serial port and
+ *         deframes it. Calls serial_callback function with each new
+ *         packet, as soon as its closing sync byte is read.
  * ****************************************************************************/
 void *serial_read_thread()
 {
-  uint8_t serial_buffer[BUFFER_SIZE];
-  uint8_t packet_buffer[BUFFER_SIZE];
-  uint8_t final_buffer[BUFFER_SIZE];
-
-  uint16_t buffer_offset = 0;
-  uint8_t new_packet = 0;
-
-  uint16_t bytes_read = 0;
+  uint8_t* p_packet;
+  uint8_t* p_space;
+  uint16_t packet_size;
+  uint16_t room;
+  int32_t bytes_read = 0;
 
   printf("Starting serial read.\r\n");
 
-  // Flush the port
-  while( PollComport( serial_port_number, serial_buffer, BUFFER_SIZE ) );
+  // Flush the port (through the deframer's buffer, it starts over after)
+  deframer_initialize( &deframer );
+  p_space = deframer_space( &deframer, &room );
+  while( PollComport( serial_port_number, p_space, room ) > 0 );
 
-  memset( serial_buffer, 0x00, sizeof(serial_buffer) );
+  deframer_initialize( &deframer );
 
   // Run forever
   for(;;)
   {
-    // Read a buffer full of data (if available)
-    bytes_read = PollComport( serial_port_number, serial_buffer, BUFFER_SIZE );
-    if( bytes_read > 0 )
+    // Sleep until something arrives
+    WaitComport( serial_port_number, -1 );
+
+    // Read straight into the deframer (the rest waits in the driver until
+    // the next read)
+    p_space = deframer_space( &deframer, &room );
+    bytes_read = PollComport( serial_port_number, p_space, room );
+    if( ( bytes_read < 0 ) && ( ( EAGAIN == errno ) || ( EINTR == errno ) ) )
     {
-
-      if( bytes_read >= BUFFER_SIZE )
-      {
-        printf("Read more bytes than buffer can handle.\n");
-      }
-      else
+      continue;
+    }
+    if( bytes_read <= 0 )
+    {
+      // Woken up with nothing to read, the port hung up (i.e. adapter
+      // unplugged). Don't spin on it, open it again until it's back.
+      usleep(250000);
+      if( 0 == ReattachComport( serial_port_number ) )
       {
-
-        memcpy( packet_buffer + buffer_offset, serial_buffer, bytes_read );
-
-        if ( packet_in_buffer( packet_buffer ) )
-        {
-
-          buffer_offset = 0;
-
-          new_packet = 1;
-          bytes_read = find_and_escape_packet( packet_buffer, final_buffer );
-
-        }
-        else
-        {
-
-          buffer_offset += bytes_read;
-
-          if( buffer_offset > BUFFER_SIZE )
-          {
-            printf("Buffer has overflowed. Flushing.\n");
-            memset( packet_buffer, 0x00, sizeof(packet_buffer) );
-            memset( serial_buffer, 0x00, sizeof(serial_buffer) );
-            buffer_offset = 0;
-          }
-        }
-
-        if( new_packet == 1 )
-        {
-          // Call serial callback. If it returns 0, flush the buffer
-          if ( !serial_read_callback( final_buffer, (bytes_read-1) ) )
-          {
-            // Wait ~250ms
-            usleep(250000);
-            // Flush the port
-            while( PollComport( serial_port_number, serial_buffer, 
-                                                                BUFFER_SIZE ) );
-
-            memset( serial_buffer, 0x00, sizeof(serial_buffer) );
-          }
-
-          new_packet = 0;
-          memset( packet_buffer, 0x00, sizeof(packet_buffer) );
-
-        }
-
+        printf("Serial port reattached.\r\n");
       }
+      continue;
     }
-    memset( serial_buffer, 0x00, sizeof(serial_buffer) );
 
-    // Don't take up all the processor time
-    usleep(2000);
+    LATENCY_STAMP( LAT_PACKET_IN );
 
-  }
-
-}
+    capture_write( p_capture, CAPTURE_RX, p_space, bytes_read );
 
-/*******************************************************************************
- * @fn     uint8_t packet_in_buffer( uint8_t* old_buffer )
- * @brief  Check if there is a packet in the buffer
- * ****************************************************************************/
-uint8_t packet_in_buffer( uint8_t* old_buffer )
-{
-  // replace escaped characters
-  uint16_t buffer_index = 0;
-  uint8_t sync_bytes=0;
+    deframer_received( &deframer, bytes_read );
 
-  // find first SYNC_BYTE
-  while( (sync_bytes < 2) & (buffer_index < BUFFER_SIZE) )
-  {
-    if( old_buffer[buffer_index] == SYNC_BYTE )
+    // A read can finish any number of packets
+    while( deframer_next( &deframer, &p_packet, &packet_size ) )
     {
-      sync_bytes++;
-    }
-    buffer_index++;
-  }
-
-  // No packet found
-  if ( sync_bytes < 2 )
-  {
-    return 0;
-  }
-
-  return 1;
-}
-
-/*******************************************************************************
- * @fn     uint16_t find_and_escape_packet( uint8_t* old_buffer,
- *                                                         uint8_t* new_buffer )
- * @brief  Find packet in buffer, remove escape characters, and return size
- * ****************************************************************************/
-uint16_t find_and_escape_packet( uint8_t* old_buffer, uint8_t* new_buffer )
-{
-  // replace escaped characters
-  uint16_t buffer_index = 0;
-  uint16_t packet_size = 0;
-  uint8_t start=0;
+      LATENCY_STAMP( LAT_DEFRAMED );
 
-  // find first SYNC_BYTE
-  while( (!start) & (buffer_index < BUFFER_SIZE) )
-  {
-    if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      start = 1;
-      // Don't include first sync byte for alignment issues
-      //new_buffer[packet_size++] = old_buffer[buffer_index];
+      // Packets the callback rejects are just dropped, the deframer is
+      // already waiting for the next sync byte
+      serial_read_callback( p_packet, packet_size );
     }
-    buffer_index++;
   }
 
-
-  // process until next SYNC_BYTE is found
-  while ( (start) & (buffer_index < BUFFER_SIZE) )
-  {
-    // Handle escape characters
-    if( old_buffer[buffer_index] == ESCAPE_BYTE )
-    {
-      buffer_index++;
-      old_buffer[buffer_index] ^= 0x20;
-    }
-    // Handle end character
-    else if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      start = 0;
-    }
-    new_buffer[packet_size++] = old_buffer[buffer_index];
-    buffer_index++;
-  }
-  if( start == 1 )
-  {
-    return 0;
-  }
-  return packet_size;
 }
 
-
 /*******************************************************************************
- * @fn     void send_serial_message( uint8_t* packet_buffer,
- *                                                        int16_t buffer_size )
- * @brief  Escape buffer and transmit through serial port
+ * @fn     uint8_t send_serial_message( const uint8_t* packet_buffer,
+ *                                                       uint16_t buffer_size )
+ * @brief  Escape buffer and queue it for the serial port. Doesn't wait for
+ *         the port, returns 1 if the packet was dropped because the port
+ *         isn't keeping up.
  * ****************************************************************************/
-void send_serial_message( uint8_t* packet_buffer, int16_t buffer_size )
+uint8_t send_serial_message( const uint8_t* packet_buffer,
+                                                        uint16_t buffer_size )
 {
-  uint8_t p_tmp_buffer[BUFFER_SIZE];
-  uint8_t total_size = 0;
-  uint8_t buffer_index = 0;
-
-  // Add start character
-  p_tmp_buffer[total_size++] = SYNC_BYTE;
-
-  for(; buffer_size > 0; buffer_size-- )
-  {
-    if( ( SYNC_BYTE == packet_buffer[buffer_index] ) ||
-        ( ESCAPE_BYTE == packet_buffer[buffer_index] ) )
-    {
-      p_tmp_buffer[total_size++] = ESCAPE_BYTE;
-      p_tmp_buffer[total_size++] = packet_buffer[buffer_index++] ^ 0x20;
-    }
-    else
-    {
-      p_tmp_buffer[total_size++] = packet_buffer[buffer_index++];
-    }
-  }
-
-  p_tmp_buffer[total_size++] = SYNC_BYTE;
-
-  SendBuf(serial_port_number, p_tmp_buffer, total_size);
+  return txqueue_send( &tx_queue, packet_buffer, buffer_size );
 }
 
 /*******************************************************************************
@@ -9,12 +9,11 @@
 
 #include <stdint.h>
 
-#define BUFFER_SIZE ( 512 )
-
 // Function Prototypes
 uint8_t serial_open( int32_t, int32_t, uint8_t (*)( uint8_t*, uint32_t) );
 void *serial_read_thread();
 void serial_close();
+uint8_t send_serial_message( const uint8_t*, uint16_t );
 
 #endif /* _SERIAL_H */
 
@@ -0,0 +1,294 @@
+/** @file trace.c
+*
+* @brief Binary trace of a recorded experiment (see trace.h)
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+static uint64_t trace_layout( trace_column_t*, uint8_t, uint32_t );
+
+/*******************************************************************************
+ * @fn    uint64_t trace_layout( trace_column_t* p_columns,
+ *                                uint8_t device_count, uint32_t round_count )
+ *
+ * @brief Fill in the columns of a trace of device_count nodes and
+ *        round_count rounds. Returns the file size.
+ * ****************************************************************************/
+static uint64_t trace_layout( trace_column_t* p_columns, uint8_t device_count,
+                                                        uint32_t round_count )
+{
+  static const uint8_t type_sizes[] = { sizeof(int16_t), sizeof(uint8_t),
+                                                          sizeof(energy_t) };
+  uint32_t row_size = (uint32_t)device_count + 1;
+  uint64_t offset;
+  uint8_t column_index;
+
+  memset( p_columns, 0, TRACE_COLUMN_COUNT * sizeof(trace_column_t) );
+
+  p_columns[TRACE_RSSI].count = row_size * row_size;
+  p_columns[TRACE_RSSI].type = TRACE_INT16;
+  p_columns[TRACE_RSSI].scale = TRACE_RSSI_SCALE;
+  strcpy( p_columns[TRACE_RSSI].unit, "dBm" );
+
+  p_columns[TRACE_PREVIOUS_POWERS].count = row_size;
+  p_columns[TRACE_PREVIOUS_POWERS].type = TRACE_ENERGY;
+  p_columns[TRACE_PREVIOUS_POWERS].scale = 1;
+  strcpy( p_columns[TRACE_PREVIOUS_POWERS].unit, "dBm" );
+
+  p_columns[TRACE_ROUTES].count = row_size;
+  p_columns[TRACE_ROUTES].type = TRACE_UINT8;
+  p_columns[TRACE_ROUTES].scale = 1;
+  strcpy( p_columns[TRACE_ROUTES].unit, "node" );
+
+  p_columns[TRACE_POWERS].count = row_size;
+  p_columns[TRACE_POWERS].type = TRACE_ENERGY;
+  p_columns[TRACE_POWERS].scale = 1;
+  strcpy( p_columns[TRACE_POWERS].unit, "dBm" );
+
+  p_columns[TRACE_ENERGIES].count = row_size;
+  p_columns[TRACE_ENERGIES].type = TRACE_ENERGY;
+  p_columns[TRACE_ENERGIES].scale = 1;
+  strcpy( p_columns[TRACE_ENERGIES].unit, "W" );
+
+  offset = sizeof(trace_header_t) +
+                              TRACE_COLUMN_COUNT * sizeof(trace_column_t);
+
+  for( column_index = 0; column_index < TRACE_COLUMN_COUNT; column_index++ )
+  {
+    p_columns[column_index].stride = p_columns[column_index].count *
+                                  type_sizes[p_columns[column_index].type];
+
+    // Every column starts 8 byte aligned
+    offset = ( offset + 7 ) & ~7ull;
+    p_columns[column_index].offset = offset;
+    offset += (uint64_t)p_columns[column_index].stride * round_count;
+  }
+
+  return ( offset + 7 ) & ~7ull;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t trace_create( trace_file_t* p_file, const char* filename,
+ *                                uint8_t device_count, uint32_t round_count )
+ *
+ * @brief Create a trace of round_count rounds of device_count nodes and map
+ *        it for writing. The rounds are filled in through trace_get_round
+ *        and written out by trace_unmap. Returns 1 on error.
+ * ****************************************************************************/
+uint8_t trace_create( trace_file_t* p_file, const char* filename,
+                                  uint8_t device_count, uint32_t round_count )
+{
+  trace_column_t columns[TRACE_COLUMN_COUNT];
+  uint64_t size;
+  int fd;
+
+  memset( p_file, 0, sizeof(trace_file_t) );
+
+  size = trace_layout( columns, device_count, round_count );
+
+  fd = open( filename, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if( fd < 0 )
+  {
+    return 1;
+  }
+
+  if( ftruncate( fd, size ) )
+  {
+    close( fd );
+    return 1;
+  }
+
+  p_file->size = size;
+  p_file->p_map = mmap( NULL, p_file->size, PROT_READ | PROT_WRITE,
+                                                        MAP_SHARED, fd, 0 );
+
+  // The mapping stays valid after closing
+  close( fd );
+
+  if( MAP_FAILED == p_file->p_map )
+  {
+    p_file->p_map = NULL;
+    return 1;
+  }
+
+  p_file->p_header = (trace_header_t*)p_file->p_map;
+  p_file->p_columns = (trace_column_t*)( p_file->p_header + 1 );
+
+  p_file->p_header->magic = TRACE_MAGIC;
+  p_file->p_header->version = TRACE_VERSION;
+  p_file->p_header->energy_size = sizeof(energy_t);
+  p_file->p_header->round_count = round_count;
+  p_file->p_header->device_count = device_count;
+  p_file->p_header->column_count = TRACE_COLUMN_COUNT;
+
+  memcpy( p_file->p_columns, columns, sizeof(columns) );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t trace_map( trace_file_t* p_file, const char* filename )
+ *
+ * @brief Map a trace for reading. The header and columns are checked against
+ *        the layout of its network size, so readers can trust the pointers
+ *        from trace_get_round. Returns 1 if the file can't be read or isn't
+ *        a valid trace.
+ * ****************************************************************************/
+uint8_t trace_map( trace_file_t* p_file, const char* filename )
+{
+  trace_column_t columns[TRACE_COLUMN_COUNT];
+  trace_header_t* p_header;
+  struct stat info;
+  uint8_t column_index;
+  int fd;
+
+  memset( p_file, 0, sizeof(trace_file_t) );
+
+  fd = open( filename, O_RDONLY );
+  if( fd < 0 )
+  {
+    return 1;
+  }
+
+  if( fstat( fd, &info ) ||
+      ( (size_t)info.st_size < sizeof(trace_header_t) +
+                              TRACE_COLUMN_COUNT * sizeof(trace_column_t) ) )
+  {
+    close( fd );
+    return 1;
+  }
+
+  p_file->size = info.st_size;
+  p_file->p_map = mmap( NULL, p_file->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+  // The mapping stays valid after closing
+  close( fd );
+
+  if( MAP_FAILED == p_file->p_map )
+  {
+    p_file->p_map = NULL;
+    return 1;
+  }
+
+  p_header = (trace_header_t*)p_file->p_map;
+
+  if( ( TRACE_MAGIC != p_header->magic ) ||
+      ( TRACE_VERSION != p_header->version ) ||
+      ( sizeof(energy_t) != p_header->energy_size ) ||
+      ( TRACE_COLUMN_COUNT != p_header->column_count ) ||
+      ( trace_layout( columns, p_header->device_count,
+                            p_header->round_count ) > p_file->size ) )
+  {
+    trace_unmap( p_file );
+    return 1;
+  }
+
+  p_file->p_header = p_header;
+  p_file->p_columns = (trace_column_t*)( p_header + 1 );
+
+  // Units are informative, everything else has to match
+  for( column_index = 0; column_index < TRACE_COLUMN_COUNT; column_index++ )
+  {
+    if( ( columns[column_index].offset !=
+                                p_file->p_columns[column_index].offset ) ||
+        ( columns[column_index].stride !=
+                                p_file->p_columns[column_index].stride ) ||
+        ( columns[column_index].count !=
+                                p_file->p_columns[column_index].count ) ||
+        ( columns[column_index].type !=
+                                p_file->p_columns[column_index].type ) ||
+        ( columns[column_index].scale !=
+                                p_file->p_columns[column_index].scale ) )
+    {
+      trace_unmap( p_file );
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void trace_unmap( trace_file_t* p_file )
+ *
+ * @brief Unmap a trace from trace_map or trace_create
+ * ****************************************************************************/
+void trace_unmap( trace_file_t* p_file )
+{
+  if( NULL != p_file->p_map )
+  {
+    munmap( p_file->p_map, p_file->size );
+    p_file->p_map = NULL;
+    p_file->p_header = NULL;
+    p_file->p_columns = NULL;
+  }
+}
+
+/*******************************************************************************
+ * @fn    uint8_t trace_get_round( const trace_file_t* p_file, uint32_t round,
+ *                                                  trace_round_t* p_round )
+ *
+ * @brief Point p_round to the values of a round. Returns 1 if the trace
+ *        doesn't have that round.
+ * ****************************************************************************/
+uint8_t trace_get_round( const trace_file_t* p_file, uint32_t round,
+                                                    trace_round_t* p_round )
+{
+  const trace_column_t* p_columns = p_file->p_columns;
+
+  if( round >= p_file->p_header->round_count )
+  {
+    return 1;
+  }
+
+  p_round->rssi_table = (int16_t*)( p_file->p_map +
+                        p_columns[TRACE_RSSI].offset +
+                        (uint64_t)round * p_columns[TRACE_RSSI].stride );
+
+  p_round->previous_powers = (energy_t*)( p_file->p_map +
+                  p_columns[TRACE_PREVIOUS_POWERS].offset +
+                  (uint64_t)round * p_columns[TRACE_PREVIOUS_POWERS].stride );
+
+  p_round->route_table = p_file->p_map + p_columns[TRACE_ROUTES].offset +
+                          (uint64_t)round * p_columns[TRACE_ROUTES].stride;
+
+  p_round->powers = (energy_t*)( p_file->p_map +
+                          p_columns[TRACE_POWERS].offset +
+                          (uint64_t)round * p_columns[TRACE_POWERS].stride );
+
+  p_round->energies = (energy_t*)( p_file->p_map +
+                          p_columns[TRACE_ENERGIES].offset +
+                          (uint64_t)round * p_columns[TRACE_ENERGIES].stride );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void trace_get_rssi( const trace_round_t* p_round,
+ *                              uint8_t device_count, energy_t* p_rssi_table )
+ *
+ * @brief Copy a round's RSSI table to p_rssi_table in dBm, (N+1)x(N+1)
+ *        entries for N = device_count
+ * ****************************************************************************/
+void trace_get_rssi( const trace_round_t* p_round, uint8_t device_count,
+                                                      energy_t* p_rssi_table )
+{
+  uint32_t cell_count = ( (uint32_t)device_count + 1 ) * ( device_count + 1 );
+  uint32_t cell_index;
+
+  for( cell_index = 0; cell_index < cell_count; cell_index++ )
+  {
+    p_rssi_table[cell_index] =
+                          TRACE_RSSI_DBM( p_round->rssi_table[cell_index] );
+  }
+}
@@ -0,0 +1,97 @@
+/** @file trace.h
+*
+* @brief Binary trace of a recorded experiment. Holds what the five csv files
+*        of a run have (see ../logexport) in fixed size columns, so any round
+*        is found with one multiplication and read straight from the mapping.
+*        Written by ../tracepack. Linux only.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dijkstra.h"
+
+#define TRACE_MAGIC    ( 0x43525443 ) // "CTRC"
+#define TRACE_VERSION  ( 1 )
+
+// Columns, in file order
+#define TRACE_RSSI            ( 0 )
+#define TRACE_PREVIOUS_POWERS ( 1 )
+#define TRACE_ROUTES          ( 2 )
+#define TRACE_POWERS          ( 3 )
+#define TRACE_ENERGIES        ( 4 )
+#define TRACE_COLUMN_COUNT    ( 5 )
+
+// Type of the values in a column
+#define TRACE_INT16   ( 0 )
+#define TRACE_UINT8   ( 1 )
+#define TRACE_ENERGY  ( 2 )           // energy_t
+
+// The cc2500 measures RSSI in 0.5 dB steps, so it's kept in half dBm
+#define TRACE_RSSI_SCALE ( 2 )
+#define TRACE_RSSI_DBM( raw ) ( (energy_t)(raw) / TRACE_RSSI_SCALE )
+
+//
+// File layout: trace_header_t, then one trace_column_t per column (the
+// offset index), then the columns. Every column is the values of all rounds
+// back to back, starting 8 byte aligned. Value v of round r of a column is
+// at offset + r * stride + v * (size of its type).
+// Every round of a trace has the same network size (N), with per round:
+//   rssi_table[(N+1)*(N+1)]   (int16_t) Received power (half dBm), row major
+//   previous_powers[N+1]      Tx power each node used for this table (dBm)
+//   route_table[N+1]          (uint8_t) Next hop of nodes 0..N
+//   powers[N+1]               Tx power selected for nodes 0..N (dBm)
+//   energies[N+1]             Minimum energy, then energy of nodes 1..N
+// Entry 0 of the per node columns is the AP, as in the csv files.
+//
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t energy_size;       // sizeof(energy_t)
+  uint32_t round_count;
+  uint8_t device_count;       // N
+  uint8_t column_count;
+  uint16_t reserved;
+} trace_header_t;
+
+typedef struct
+{
+  uint64_t offset;            // Of round 0
+  uint32_t stride;            // Bytes per round
+  uint32_t count;             // Values per round
+  uint8_t type;
+  uint8_t scale;              // Values are stored multiplied by this
+  uint8_t reserved[6];
+  char unit[8];               // i.e. "dBm"
+} trace_column_t;
+
+// Trace being read or written (mapped)
+typedef struct
+{
+  uint8_t* p_map;
+  size_t size;
+  trace_header_t* p_header;
+  trace_column_t* p_columns;
+} trace_file_t;
+
+// Pointers to one round's values, into the mapping
+typedef struct
+{
+  int16_t* rssi_table;
+  energy_t* previous_powers;
+  uint8_t* route_table;
+  energy_t* powers;
+  energy_t* energies;
+} trace_round_t;
+
+uint8_t trace_create( trace_file_t*, const char*, uint8_t, uint32_t );
+uint8_t trace_map( trace_file_t*, const char* );
+void trace_unmap( trace_file_t* );
+uint8_t trace_get_round( const trace_file_t*, uint32_t, trace_round_t* );
+void trace_get_rssi( const trace_round_t*, uint8_t, energy_t* );
+
+#endif /* _TRACE_H */
@@ -0,0 +1,297 @@
+/** @file txqueue.c
+*
+* @brief Serial transmit queue (see txqueue.h)
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include "rs232.h"
+#include "txqueue.h"
+
+static void *txqueue_thread( void* );
+static uint16_t pending_iovecs( txqueue_t*, struct iovec* );
+static void consume( txqueue_t*, uint32_t );
+static void capture_written( txqueue_t*, const struct iovec*, uint32_t );
+
+/*******************************************************************************
+ * @fn    uint8_t txqueue_start( txqueue_t* p_queue, int32_t port_number,
+ *                                                    capture_t* p_capture )
+ *
+ * @brief Start sending on an open port (see OpenComport). What is written
+ *        goes to p_capture too, unless it is NULL. Returns 1 on error.
+ * ****************************************************************************/
+uint8_t txqueue_start( txqueue_t* p_queue, int32_t port_number,
+                                                      capture_t* p_capture )
+{
+  memset( p_queue, 0, sizeof(txqueue_t) );
+
+  p_queue->port_number = port_number;
+  p_queue->p_capture = p_capture;
+  p_queue->fd = GetComportFd( port_number );
+  p_queue->running = 1;
+
+  pthread_mutex_init( &p_queue->mutex, NULL );
+  pthread_cond_init( &p_queue->cond, NULL );
+
+  if( pthread_create( &p_queue->thread, NULL, txqueue_thread, p_queue ) )
+  {
+    p_queue->running = 0;
+    pthread_mutex_destroy( &p_queue->mutex );
+    pthread_cond_destroy( &p_queue->cond );
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void txqueue_stop( txqueue_t* p_queue )
+ *
+ * @brief Send what is pending (unless the port stalls for TX_STALL_MS) and
+ *        stop the writer thread. Call before closing the port.
+ * ****************************************************************************/
+void txqueue_stop( txqueue_t* p_queue )
+{
+  if( !p_queue->running )
+  {
+    return;
+  }
+
+  pthread_mutex_lock( &p_queue->mutex );
+  p_queue->running = 0;
+  pthread_cond_signal( &p_queue->cond );
+  pthread_mutex_unlock( &p_queue->mutex );
+
+  pthread_join( p_queue->thread, NULL );
+
+  pthread_mutex_destroy( &p_queue->mutex );
+  pthread_cond_destroy( &p_queue->cond );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t txqueue_send( txqueue_t* p_queue, const uint8_t* p_packet,
+ *                                                             uint16_t size )
+ *
+ * @brief Frame a packet and queue it, never waits for the port. Returns 1 if
+ *        it wasn't queued: too big, or TX_QUEUE_FRAMES frames are already
+ *        waiting (the port can't keep up, the caller decides what to drop).
+ * ****************************************************************************/
+uint8_t txqueue_send( txqueue_t* p_queue, const uint8_t* p_packet,
+                                                              uint16_t size )
+{
+  tx_frame_t* p_frame;
+
+  if( size > TX_PACKET_MAX_SIZE )
+  {
+    return 1;
+  }
+
+  pthread_mutex_lock( &p_queue->mutex );
+
+  if( !p_queue->running || ( TX_QUEUE_FRAMES == p_queue->count ) )
+  {
+    p_queue->refused++;
+    pthread_mutex_unlock( &p_queue->mutex );
+    return 1;
+  }
+
+  // The writer thread never touches frames past head + count
+  p_frame = &p_queue->frames[( p_queue->head + p_queue->count ) %
+                                                          TX_QUEUE_FRAMES];
+  p_frame->size = frame_escape( p_frame->data, p_packet, size );
+
+  p_queue->count++;
+  p_queue->packets++;
+  if( p_queue->count > p_queue->max_count )
+  {
+    p_queue->max_count = p_queue->count;
+  }
+
+  pthread_cond_signal( &p_queue->cond );
+  pthread_mutex_unlock( &p_queue->mutex );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void *txqueue_thread( void* arg )
+ *
+ * @brief Writer thread. Sleeps until frames are queued and sends all of them
+ *        with one writev (as many as the port takes), waiting for the port
+ *        to drain when it is full.
+ * ****************************************************************************/
+static void *txqueue_thread( void* arg )
+{
+  txqueue_t* p_queue = (txqueue_t*)arg;
+  struct iovec iovecs[TX_QUEUE_FRAMES];
+  struct pollfd port;
+  uint16_t iovec_count;
+  ssize_t bytes_written;
+  int32_t rc;
+
+  port.fd = p_queue->fd;
+  port.events = POLLOUT;
+
+  pthread_mutex_lock( &p_queue->mutex );
+
+  for(;;)
+  {
+    while( p_queue->running && ( 0 == p_queue->count ) )
+    {
+      pthread_cond_wait( &p_queue->cond, &p_queue->mutex );
+    }
+
+    if( 0 == p_queue->count )
+    {
+      // Stopped and nothing left
+      break;
+    }
+
+    // Frames past these can be added meanwhile, they go next time
+    iovec_count = pending_iovecs( p_queue, iovecs );
+
+    pthread_mutex_unlock( &p_queue->mutex );
+
+    bytes_written = writev( p_queue->fd, iovecs, iovec_count );
+
+    if( ( bytes_written > 0 ) && ( NULL != p_queue->p_capture ) )
+    {
+      // Frames are only freed by consume, still safe to read
+      capture_written( p_queue, iovecs, bytes_written );
+    }
+
+    if( ( bytes_written < 0 ) && ( ( EAGAIN == errno ) ||
+                                          ( EWOULDBLOCK == errno ) ) )
+    {
+      // Port buffer full (the port is non-blocking), wait for it to drain
+      do
+      {
+        rc = poll( &port, 1, TX_STALL_MS );
+      } while( ( rc < 0 ) && ( EINTR == errno ) );
+
+      pthread_mutex_lock( &p_queue->mutex );
+      p_queue->stalls++;
+      if( ( 0 == rc ) && !p_queue->running )
+      {
+        // Stopping and the port doesn't take anything, give up
+        break;
+      }
+      continue;
+    }
+
+    pthread_mutex_lock( &p_queue->mutex );
+
+    if( bytes_written < 0 )
+    {
+      if( EINTR != errno )
+      {
+        // Port gone (i.e. adapter unplugged), drop what is pending
+        p_queue->errors++;
+        consume( p_queue, UINT32_MAX );
+      }
+      continue;
+    }
+
+    p_queue->writes++;
+    p_queue->bytes += bytes_written;
+    consume( p_queue, bytes_written );
+  }
+
+  pthread_mutex_unlock( &p_queue->mutex );
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t pending_iovecs( txqueue_t* p_queue, struct iovec* p_iovecs )
+ *
+ * @brief Point p_iovecs at what is left of every pending frame. Returns how
+ *        many there are.
+ * ****************************************************************************/
+static uint16_t pending_iovecs( txqueue_t* p_queue, struct iovec* p_iovecs )
+{
+  tx_frame_t* p_frame;
+  uint16_t index;
+
+  for( index = 0; index < p_queue->count; index++ )
+  {
+    p_frame = &p_queue->frames[( p_queue->head + index ) % TX_QUEUE_FRAMES];
+    p_iovecs[index].iov_base = p_frame->data;
+    p_iovecs[index].iov_len = p_frame->size;
+  }
+
+  // Part of the first frame may be out already
+  p_iovecs[0].iov_base = (uint8_t*)p_iovecs[0].iov_base + p_queue->head_sent;
+  p_iovecs[0].iov_len -= p_queue->head_sent;
+
+  return p_queue->count;
+}
+
+/*******************************************************************************
+ * @fn    void consume( txqueue_t* p_queue, uint32_t bytes )
+ *
+ * @brief Take bytes sent off the front of the queue, freeing frames that
+ *        are done
+ * ****************************************************************************/
+static void consume( txqueue_t* p_queue, uint32_t bytes )
+{
+  uint16_t left;
+
+  while( ( p_queue->count > 0 ) && ( bytes > 0 ) )
+  {
+    left = p_queue->frames[p_queue->head].size - p_queue->head_sent;
+
+    if( bytes < left )
+    {
+      p_queue->head_sent += bytes;
+      return;
+    }
+
+    bytes -= left;
+    p_queue->head = ( p_queue->head + 1 ) % TX_QUEUE_FRAMES;
+    p_queue->head_sent = 0;
+    p_queue->count--;
+  }
+}
+
+/*******************************************************************************
+ * @fn    void capture_written( txqueue_t* p_queue,
+ *                        const struct iovec* p_iovecs, uint32_t bytes )
+ *
+ * @brief Log the first bytes of p_iovecs, what the port took
+ * ****************************************************************************/
+static void capture_written( txqueue_t* p_queue, const struct iovec* p_iovecs,
+                                                              uint32_t bytes )
+{
+  uint32_t size;
+
+  while( bytes > 0 )
+  {
+    size = ( bytes < p_iovecs->iov_len ) ? bytes : p_iovecs->iov_len;
+    capture_write( p_queue->p_capture, CAPTURE_TX, p_iovecs->iov_base, size );
+    bytes -= size;
+    p_iovecs++;
+  }
+}
+
+/*******************************************************************************
+ * @fn    void txqueue_print_stats( txqueue_t* p_queue )
+ *
+ * @brief Print how the port kept up
+ * ****************************************************************************/
+void txqueue_print_stats( txqueue_t* p_queue )
+{
+  printf( "Port %d TX: %d packets in %d writes, %g bytes each, "
+          "%d refused (queue full), %d stalls, %d errors, "
+          "%d frames pending at most\n",
+          p_queue->port_number, p_queue->packets, p_queue->writes,
+          p_queue->writes ? (double)p_queue->bytes / p_queue->writes : 0.0,
+          p_queue->refused, p_queue->stalls, p_queue->errors,
+          p_queue->max_count );
+}
@@ -0,0 +1,71 @@
+/** @file txqueue.h
+*
+* @brief Serial transmit queue. Packets are framed into a preallocated pool
+*        and a writer thread sends everything pending with one writev, so
+*        whoever sends (the routing loop, a read thread) never waits on the
+*        serial port. Linux only.
+*
+* @author Alvaro Prieto
+*/
+#ifndef _TXQUEUE_H
+#define _TXQUEUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "escape.h"
+#include "capture.h"
+
+// Largest packet (route/power tables of the largest network plus header)
+#define TX_PACKET_MAX_SIZE ( 512 )
+
+// Frames waiting to be sent at once. More than this and the port can't keep
+// up, new packets are refused (see txqueue_send).
+#define TX_QUEUE_FRAMES ( 8 )
+
+// Longest wait for the port to take more bytes before the frames left are
+// dropped on txqueue_stop (ms)
+#define TX_STALL_MS ( 1000 )
+
+typedef struct
+{
+  uint8_t data[FRAME_MAX_SIZE( TX_PACKET_MAX_SIZE )];
+  uint16_t size;
+} tx_frame_t;
+
+//
+// Frames are a ring: head is being written (sent bytes of it so far in
+// head_sent), count frames are pending after it. Only the writer thread
+// moves head, only txqueue_send adds frames, both under mutex.
+//
+typedef struct
+{
+  int32_t port_number;
+  int fd;
+  capture_t* p_capture;     // Bytes written are logged here (may be NULL)
+
+  tx_frame_t frames[TX_QUEUE_FRAMES];
+  uint16_t head;
+  uint16_t count;
+  uint16_t head_sent;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  uint8_t running;
+
+  // Statistics
+  uint32_t packets;         // Packets queued
+  uint32_t refused;         // Packets refused because the queue was full
+  uint32_t writes;          // writev calls that sent something
+  uint32_t stalls;          // Times the port couldn't take more bytes
+  uint32_t errors;          // Write errors
+  uint16_t max_count;       // Most frames pending at once
+  uint64_t bytes;           // Bytes sent
+} txqueue_t;
+
+uint8_t txqueue_start( txqueue_t*, int32_t, capture_t* );
+void txqueue_stop( txqueue_t* );
+uint8_t txqueue_send( txqueue_t*, const uint8_t*, uint16_t );
+void txqueue_print_stats( txqueue_t* );
+
+#endif /* _TXQUEUE_H */
@@ -0,0 +1,324 @@
+/** @file main.c
+*
+* @brief Convert binary round log to the csv files
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "roundlog.h"
+#include "main.h"
+
+#define OUTPUT_FILES (5)
+
+uint8_t open_output_files( const char* directory );
+void close_output_files();
+void export_round( roundlog_tables_t* p_tables );
+static void expand_row( roundlog_tables_t* p_tables, uint16_t row_index );
+double watt_to_dbm( double power );
+
+static FILE *fp_energies, *fp_routes, *fp_powers, *fp_rssi, *fp_debug;
+
+// Rows of sparse tables expanded to N+1 entries
+static energy_t rssi_row[MAX_TABLE_SIZE];
+static energy_t link_power_row[MAX_TABLE_SIZE];
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  FILE* fp_log;
+  roundlog_header_t header;
+  roundlog_record_t record_header;
+  roundlog_record_t* p_record = NULL;
+  roundlog_tables_t tables;
+  uint32_t buffer_size = 0;
+  uint32_t rounds = 0;
+  char directory[256];
+  char* p_separator;
+
+  if ( argc < 2 )
+  {
+    printf( "Usage: %s rounds.bin [output directory]\r\n", argv[0] );
+    return 1;
+  }
+
+  fp_log = fopen( argv[1], "rb" );
+  if( NULL == fp_log )
+  {
+    printf( "Error opening round log.\r\n" );
+    return 1;
+  }
+
+  if( ( fread( &header, sizeof(header), 1, fp_log ) != 1 ) ||
+      ( ROUNDLOG_MAGIC != header.magic ) ||
+      ( header.version < 1 ) || ( header.version > ROUNDLOG_VERSION ) ||
+      ( sizeof(energy_t) != header.energy_size ) )
+  {
+    printf( "Not a valid round log.\r\n" );
+    fclose( fp_log );
+    return 1;
+  }
+
+  // Default to the same directory as the log
+  if( argc > 2 )
+  {
+    snprintf( directory, sizeof(directory), "%s", argv[2] );
+  }
+  else
+  {
+    snprintf( directory, sizeof(directory), "%s", argv[1] );
+    p_separator = strrchr( directory, '/' );
+    if( NULL != p_separator )
+    {
+      *p_separator = 0;
+    }
+    else
+    {
+      sprintf( directory, "." );
+    }
+  }
+
+  if( open_output_files( directory ) )
+  {
+    fclose( fp_log );
+    return 1;
+  }
+
+  while( fread( &record_header, sizeof(record_header), 1, fp_log ) == 1 )
+  {
+    if( record_header.record_size !=
+                            ROUNDLOG_RECORD_SIZE( record_header.device_count,
+                                              record_header.max_neighbors ) )
+    {
+      printf( "Invalid record after round %d.\r\n", rounds );
+      break;
+    }
+
+    // Only reallocate if the network grew
+    if( record_header.record_size > buffer_size )
+    {
+      free( p_record );
+      buffer_size = record_header.record_size;
+      p_record = malloc( buffer_size );
+      if( NULL == p_record )
+      {
+        printf( "Error allocating record.\r\n" );
+        break;
+      }
+    }
+
+    memcpy( p_record, &record_header, sizeof(record_header) );
+
+    if( fread( p_record + 1, record_header.record_size - sizeof(record_header),
+                                                          1, fp_log ) != 1 )
+    {
+      printf( "Truncated record after round %d.\r\n", rounds );
+      break;
+    }
+
+    roundlog_map_record( p_record, &tables );
+
+    export_round( &tables );
+
+    rounds++;
+  }
+
+  printf( "Exported %d rounds to %s\n", rounds, directory );
+
+  free( p_record );
+  close_output_files();
+  fclose( fp_log );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    FILE* open_output_file( const char* directory, const char* name )
+ *
+ * @brief Open one csv file with a large buffer
+ * ****************************************************************************/
+static FILE* open_output_file( const char* directory, const char* name )
+{
+  char filename[512];
+  FILE* fp_file;
+
+  snprintf( filename, sizeof(filename), "%s/%s", directory, name );
+
+  fp_file = fopen( filename, "w" );
+  if( NULL == fp_file )
+  {
+    printf( "Error opening %s.\r\n", filename );
+    return NULL;
+  }
+
+  setvbuf( fp_file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE );
+
+  return fp_file;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t open_output_files( const char* directory )
+ *
+ * @brief Open all output csv files
+ * ****************************************************************************/
+uint8_t open_output_files( const char* directory )
+{
+  fp_energies = open_output_file( directory, "energies.csv" );
+  fp_routes = open_output_file( directory, "routes.csv" );
+  fp_powers = open_output_file( directory, "powers.csv" );
+  fp_rssi = open_output_file( directory, "rssi.csv" );
+  fp_debug = open_output_file( directory, "debug.csv" );
+
+  if( ( NULL == fp_energies ) || ( NULL == fp_routes ) ||
+      ( NULL == fp_powers ) || ( NULL == fp_rssi ) || ( NULL == fp_debug ) )
+  {
+    close_output_files();
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void close_output_files()
+ *
+ * @brief Close all output csv files
+ * ****************************************************************************/
+void close_output_files()
+{
+  FILE** files[OUTPUT_FILES] = { &fp_energies, &fp_routes, &fp_powers,
+                                 &fp_rssi, &fp_debug };
+  uint8_t file_index;
+
+  for( file_index = 0; file_index < OUTPUT_FILES; file_index++ )
+  {
+    if( NULL != *files[file_index] )
+    {
+      fclose( *files[file_index] );
+      *files[file_index] = NULL;
+    }
+  }
+}
+
+/*******************************************************************************
+ * @fn    void export_round( roundlog_tables_t* p_tables )
+ *
+ * @brief Write one round to the csv files (same format the routing thread
+ *        used to write directly)
+ * ****************************************************************************/
+void export_round( roundlog_tables_t* p_tables )
+{
+  uint8_t device_count = p_tables->p_record->device_count;
+  uint16_t table_size = device_count + 1;
+  uint16_t row_index;
+  uint16_t col_index;
+  energy_t* p_rssi_row;
+  energy_t* p_link_power_row;
+
+  for( row_index = 0; row_index <= device_count; row_index++ )
+  {
+    if( NULL != p_tables->neighbor_counts )
+    {
+      expand_row( p_tables, row_index );
+      p_rssi_row = rssi_row;
+      p_link_power_row = link_power_row;
+    }
+    else
+    {
+      p_rssi_row = &p_tables->rssi_table[row_index * table_size];
+      p_link_power_row = &p_tables->link_power_table[row_index * table_size];
+    }
+
+    // RSSI table
+    for( col_index = 0; col_index < device_count; col_index++ )
+    {
+      fprintf( fp_debug, "%g,", p_rssi_row[col_index] );
+      fprintf( fp_rssi, "%g,", p_rssi_row[col_index] );
+    }
+    fprintf( fp_debug, "%g,", p_rssi_row[col_index] );
+    fprintf( fp_rssi, "%g\n", p_rssi_row[col_index] );
+
+    if( row_index > 0 )
+    {
+      fprintf( fp_debug, "%g,", p_tables->previous_powers[row_index-1] );
+
+      fprintf( fp_debug, "%g,",
+                        watt_to_dbm( p_tables->link_powers[row_index-1] ) );
+      fprintf( fp_powers, "%g,",
+                        watt_to_dbm( p_tables->link_powers[row_index-1] ) );
+
+      fprintf( fp_debug, "%d,", p_tables->route_table[row_index-1] );
+      fprintf( fp_routes, "%d,", p_tables->route_table[row_index-1] );
+    }
+    else
+    {
+      // AP always transmits max power
+      fprintf( fp_debug, "%g,", ( 1.5 ) );
+      fprintf( fp_debug, "%g,", ( 1.5 ) );
+      fprintf( fp_powers, "%g,", 1.5 );
+
+      fprintf( fp_debug, "0," );
+      fprintf( fp_routes, "0," );
+    }
+
+    for( col_index = 0; col_index <= device_count; col_index++ )
+    {
+      fprintf( fp_debug, "%g,", p_link_power_row[col_index] );
+    }
+
+    fprintf( fp_debug, "\n" );
+  }
+
+  fprintf( fp_debug, "\n" );
+  fprintf( fp_rssi, "\n" );
+  fprintf( fp_routes, "\n" );
+  fprintf( fp_powers, "\n" );
+
+  // Minimum energy followed by each node's energy
+  for( row_index = 0; row_index <= device_count; row_index++ )
+  {
+    fprintf( fp_energies, "%g,", p_tables->energies[row_index] );
+  }
+  fprintf( fp_energies, "\n" );
+}
+
+/*******************************************************************************
+ * @fn    void expand_row( roundlog_tables_t* p_tables, uint16_t row_index )
+ *
+ * @brief Fill rssi_row and link_power_row from a sparse table row, so the csv
+ *        files look the same as with dense tables. Pairs that aren't
+ *        neighbors get NO_SIGNAL_RSSI and NO_SIGNAL_LINK_POWER.
+ * ****************************************************************************/
+static void expand_row( roundlog_tables_t* p_tables, uint16_t row_index )
+{
+  uint8_t max_neighbors = p_tables->p_record->max_neighbors;
+  uint16_t col_index;
+  uint8_t slot;
+  uint32_t cell_index = row_index * max_neighbors;
+
+  for( col_index = 0; col_index <= p_tables->p_record->device_count;
+                                                                  col_index++ )
+  {
+    rssi_row[col_index] = NO_SIGNAL_RSSI;
+    link_power_row[col_index] = NO_SIGNAL_LINK_POWER;
+  }
+
+  for( slot = 0; slot < p_tables->neighbor_counts[row_index]; slot++ )
+  {
+    col_index = p_tables->neighbor_ids[cell_index + slot];
+    rssi_row[col_index] = p_tables->rssi_table[cell_index + slot];
+    link_power_row[col_index] = p_tables->link_power_table[cell_index + slot];
+  }
+}
+
+/*******************************************************************************
+ * @fn    double watt_to_dbm( double power )
+ *
+ * @brief Convert power from Watts to dBm
+ * ****************************************************************************/
+double watt_to_dbm( double power )
+{
+  return 10l * log10( 1000l * power );
+}
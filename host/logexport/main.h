@@ -0,0 +1,22 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+
+// Buffer size for each output file
+#define OUTPUT_BUFFER_SIZE ( 1 << 16 )
+
+// Largest table row ( N+1 )
+#define MAX_TABLE_SIZE ( 255 )
+
+// Written for pairs that aren't in a sparse table
+#define NO_SIGNAL_RSSI ( -999.0 )
+#define NO_SIGNAL_LINK_POWER ( 999.0 )
+
+#endif /*_MAIN_H */
@@ -9,13 +9,15 @@
 #include <string.h>
 #include <signal.h>
 #include <math.h>
+#include <time.h>
 #include "main.h"
 #include "rs232.h"
+#include "deframer.h"
 
 static int32_t serial_port_number;
+static deframer_t deframer;
 static FILE* main_fp;
 
-volatile uint8_t send_message = 1;
 volatile uint8_t next_power = 0xff;
 
 double tx_power;
@@ -26,14 +28,15 @@ double get_power_from_setting( uint8_t );
 int main( int argc, char *argv[] )
 {   
   uint8_t serial_buffer[BUFFER_SIZE]; 
-  uint8_t packet_buffer[BUFFER_SIZE];
-  uint8_t final_buffer[BUFFER_SIZE];  
   //uint8_t adc_sample_buffer[ADC_MAX_SAMPLES];    
-  uint16_t buffer_offset = 0;
-  uint8_t new_packet = 0;
- 
-  uint16_t bytes_read = 0;  
-  
+  uint8_t* p_packet;
+  uint8_t* p_space;
+  uint16_t packet_size;
+  uint16_t room;
+  int32_t bytes_read = 0;
+  uint64_t next_send_ms;
+  uint64_t now_ms;
+
   // Handle interrupt events to make sure files are closed before exiting
   (void) signal( SIGINT, sigint_handler );
 
@@ -49,8 +52,8 @@ int main( int argc, char *argv[] )
   
   printf("Power control test\r\n");
   
-  // Convert string serial number to integer
-  serial_port_number = atoi( argv[1] );
+  // Port number or device path (i.e. a pty from ../apemu)
+  serial_port_number = ComportNumber( argv[1] );
   
  
   // Use RS232 library to open serial port  
@@ -62,84 +65,78 @@ int main( int argc, char *argv[] )
   }
     
   // Flush the port
-  while( PollComport( serial_port_number, serial_buffer, BUFFER_SIZE ) );
-  
-  memset( serial_buffer, 0x00, sizeof(serial_buffer) );
+  while( PollComport( serial_port_number, serial_buffer, BUFFER_SIZE ) > 0 );
   
+  deframer_initialize( &deframer );
   
+  next_send_ms = get_time_ms() + SEND_PERIOD_MS;
    
   // Run forever
   for(;;)
   {  
-    // Read a buffer full of data (if available)
-    bytes_read = PollComport( serial_port_number, serial_buffer, BUFFER_SIZE );
-    if( bytes_read > 0 )
+    // Sleep until something arrives or it's time to send the next power
+    now_ms = get_time_ms();
+    if( ( now_ms < next_send_ms ) &&
+        ( WaitComport( serial_port_number, next_send_ms - now_ms ) > 0 ) )
     {
-
-      if( bytes_read >= BUFFER_SIZE )
+      // Read straight into the deframer
+      p_space = deframer_space( &deframer, &room );
+      bytes_read = PollComport( serial_port_number, p_space, room );
+      if( bytes_read <= 0 )
       {
-        printf("Uh oh!\n");
+        // Nothing to read after a wake up, the port hung up
+        usleep(250000);
+        continue;
       }
-      else
+
+      deframer_received( &deframer, bytes_read );
+
+      while( deframer_next( &deframer, &p_packet, &packet_size ) )
       {
-        
-        memcpy( packet_buffer + buffer_offset, serial_buffer, bytes_read );                        
-       
-        if ( packet_in_buffer( packet_buffer ) )
-        {          
-                             
-          buffer_offset = 0;
-          
-          new_packet = 1;
-          bytes_read = find_and_escape_packet( packet_buffer, final_buffer );          
-          
-        } 
-        else
-        {   
-          
-          buffer_offset += bytes_read;
-          
-          if( buffer_offset > BUFFER_SIZE )
-          {
-            printf("damn...\n");
-            memset( packet_buffer, 0x00, sizeof(packet_buffer) );
-            memset( serial_buffer, 0x00, sizeof(serial_buffer) );
-            buffer_offset = 0;
-          }
-        }
-        
-        if( new_packet == 1 )
+        // Device reports are power setting and two RSSI values
+        if( packet_size >= 3 )
         {
-          
-          process_packet( final_buffer );
-          
-          new_packet = 0;
-          memset( packet_buffer, 0x00, sizeof(packet_buffer) );
-        }      
-
+          process_packet( p_packet );
+        }
       }
+
+      continue;
     }
-    memset( serial_buffer, 0x00, sizeof(serial_buffer) );
-    
-    // Don't take up all the processor time    
-    usleep(20000);
-    if( 0 == send_message-- )
+
+    SendByte( serial_port_number, next_power ); // Send initial packet
+    next_send_ms += SEND_PERIOD_MS;
+
+    // Don't send a burst to catch up after a stall
+    if( next_send_ms < now_ms )
     {
-      SendByte( serial_port_number, next_power ); // Send initial packet
-      send_message = 1;
-      
-      if(next_power == 0xff)
-      {
-        printf("*");
-      }
-      // If no message is received before the next round, use full power
-      next_power = 0xff;
+      next_send_ms = now_ms + SEND_PERIOD_MS;
     }
+
+    if(next_power == 0xff)
+    {
+      printf("*");
+    }
+    // If no message is received before the next round, use full power
+    next_power = 0xff;
   }  
 
   return 0;
 }
 
+/*******************************************************************************
+ * @fn    uint64_t get_time_ms()
+ *
+ * @brief Milliseconds from an arbitrary start (never goes back)
+ * ****************************************************************************/
+uint64_t get_time_ms()
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 void process_packet( uint8_t* buffer )
 {
   tx_power = dbm_to_watt(get_power_from_setting( buffer[0] ));
@@ -177,82 +174,6 @@ double get_power_from_setting( uint8_t setting )
   return power_values[( sizeof(power_values)/sizeof(double) - 1 )];
 }
 
-/*!
-  @brief Find a packet in the buffer
-*/
-uint8_t packet_in_buffer( uint8_t* old_buffer )
-{
-  // replace escaped characters
-  uint16_t buffer_index = 0;
-  uint8_t sync_bytes=0;
-
-  // find first SYNC_BYTE
-  while( (sync_bytes < 2) & (buffer_index < BUFFER_SIZE) )
-  {
-    if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      sync_bytes++;      
-    }
-    buffer_index++;
-  }
-  
-  // No packet found
-  if ( sync_bytes < 2 )
-  {
-    return 0;
-  }  
-  
-  return 1;  
-}
-
-
-/*!
-  @brief Find a packet in the buffer, remove escape characters, and return size
-*/
-uint16_t find_and_escape_packet( uint8_t* old_buffer, uint8_t* new_buffer )
-{
-  // replace escaped characters
-  uint16_t buffer_index = 0;
-  uint16_t packet_size = 0;
-  uint8_t start=0;
-
-  // find first SYNC_BYTE
-  while( (!start) & (buffer_index < BUFFER_SIZE) )
-  {
-    if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      start = 1;
-      // Don't include first sync byte for alignment issues
-      //new_buffer[packet_size++] = old_buffer[buffer_index];
-    }
-    buffer_index++;
-  }
-
-  
-  // process until next SYNC_BYTE is found
-  while ( (start) & (buffer_index < BUFFER_SIZE) )
-  {
-    // Handle escape characters
-    if( old_buffer[buffer_index] == ESCAPE_BYTE )
-    {
-      buffer_index++;
-      old_buffer[buffer_index] ^= 0x20;
-    }
-    // Handle end character
-    else if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      start = 0;
-    }
-    new_buffer[packet_size++] = old_buffer[buffer_index];
-    buffer_index++;
-  }
-  if( start == 1 )
-  {
-    return 0;
-  }
-  return packet_size;  
-}
-
 /*******************************************************************************
  * @fn    uint8_t find_closest_power( double power )
  *
@@ -15,8 +15,8 @@
 
 #define BUFFER_SIZE ( 512 )
 
-#define SYNC_BYTE   ( 0x7E )
-#define ESCAPE_BYTE ( 0x7D )
+// Time between power settings sent to the device (ms)
+#define SEND_PERIOD_MS ( 40 )
 
 #define BROADCAST_ADDRESS (0x00)
 
@@ -37,14 +37,13 @@
 
 // Function Prototypes
 void process_packet( uint8_t* buffer );
-uint8_t packet_in_buffer( uint8_t* );
-uint16_t find_and_escape_packet( uint8_t*, uint8_t* );
 
 uint8_t find_closest_power( double power );
 double dbm_to_watt( double power );
 double watt_to_dbm( double power );
 
 void sigint_handler( int32_t sig );
+uint64_t get_time_ms();
 
 // Lookup table for converting cc2500 rssi value to received power in dBm
 static const double rssi_values[256] = {
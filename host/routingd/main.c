@@ -0,0 +1,670 @@
+/** @file main.c
+*
+* @brief Routing daemon for several access points (one network each). One
+*        thread waits on every serial port with epoll and deframes packets,
+*        a fixed pool of workers routes whichever networks have a new table.
+*        Each network has its own routing context (see routing_select), so
+*        networks don't share any state and can be routed at the same time.
+*        Ports that hang up are taken out of epoll and opened again every
+*        REATTACH_INTERVAL_MS until their AP is back.
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include "rs232.h"
+#include "routing.h"
+#include "rpupdate.h"
+#include "routeshm.h"
+#include "main.h"
+
+static uint8_t open_network( network_t* p_network, int32_t port_number,
+                                    int32_t baud_rate, energy_t c_factor );
+static void close_network( network_t* p_network );
+static void close_capture( network_t* p_network );
+static uint8_t read_port( network_t* p_network );
+static uint8_t attach_port( network_t* p_network );
+static void detach_port( network_t* p_network );
+static void reattach_ports();
+static void table_ready( network_t* p_network, const uint8_t* p_packet,
+                                                            uint16_t size );
+static void *worker_thread( void* );
+static void route_network( network_t* p_network, uint8_t* p_table,
+                                                            uint16_t size );
+static void send_tables( network_t* p_network );
+static uint8_t send_packet( network_t* p_network, const uint8_t* p_packet,
+                                                            uint16_t size );
+
+static network_t networks[MAX_NETWORKS];
+static uint8_t network_count;
+
+static pthread_t workers[MAX_WORKERS];
+static uint8_t worker_count;
+
+// Networks waiting for a worker (each one is in here at most once)
+static pthread_mutex_t mutex_pool = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_pool = PTHREAD_COND_INITIALIZER;
+static network_t* ready_queue[MAX_NETWORKS];
+static uint8_t ready_head;
+static uint8_t ready_count;
+static uint8_t stopping;
+
+static volatile sig_atomic_t running = 1;
+
+// Ports being waited on, and a timer that is only armed while a port is
+// hung up (I/O thread only)
+static int32_t epoll_fd;
+static int32_t reattach_timer;
+static uint8_t detached_count;
+
+int main( int argc, char *argv[] )
+{
+  int32_t baud_rate;
+  energy_t c_factor;
+  int32_t requested_workers;
+  int32_t event_count;
+  int32_t event_index;
+  uint8_t network_index;
+  struct epoll_event event;
+  struct epoll_event events[MAX_NETWORKS + 1];
+  network_t* p_network;
+  sigset_t signal_mask;
+
+  // Make sure input is correct
+  if( argc < 5 )
+  {
+    printf( "Usage: %s baudrate C(0.0-1000.0) workers (0 one per CPU) "
+                                        "port [port ...]\n", argv[0] );
+    return 0;
+  }
+
+  if( ( argc - 4 ) > MAX_NETWORKS )
+  {
+    printf( "Too many ports (%d max).\n", MAX_NETWORKS );
+    return 1;
+  }
+
+  baud_rate = atoi( argv[1] );
+  c_factor = (energy_t)strtod( argv[2], NULL );
+
+  requested_workers = atoi( argv[3] );
+  if( requested_workers <= 0 )
+  {
+    requested_workers = sysconf( _SC_NPROCESSORS_ONLN );
+  }
+  if( requested_workers > MAX_WORKERS )
+  {
+    requested_workers = MAX_WORKERS;
+  }
+  if( requested_workers > ( argc - 4 ) )
+  {
+    // More workers than networks would never have anything to do
+    requested_workers = argc - 4;
+  }
+
+  epoll_fd = epoll_create1( 0 );
+  if( epoll_fd < 0 )
+  {
+    perror( "Error creating epoll instance" );
+    return 1;
+  }
+
+  reattach_timer = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if( ( reattach_timer < 0 ) ||
+      epoll_ctl( epoll_fd, EPOLL_CTL_ADD, reattach_timer, &event ) )
+  {
+    perror( "Error creating reattach timer" );
+    return 1;
+  }
+
+  mkdir( "./logs", 0755 );
+
+  for( network_index = 0; network_index < ( argc - 4 ); network_index++ )
+  {
+    if( open_network( &networks[network_index],
+                      ComportNumber( argv[network_index + 4] ), baud_rate,
+                      c_factor ) )
+    {
+      sigint_handler( 1 );
+    }
+    network_count++;
+
+    if( attach_port( &networks[network_index] ) )
+    {
+      perror( "Error adding port to epoll" );
+      sigint_handler( 1 );
+    }
+  }
+
+  // Only this thread handles SIGINT, so it's the one woken up in epoll_wait
+  sigemptyset( &signal_mask );
+  sigaddset( &signal_mask, SIGINT );
+  pthread_sigmask( SIG_BLOCK, &signal_mask, NULL );
+
+  for( worker_count = 0; worker_count < requested_workers; worker_count++ )
+  {
+    if( pthread_create( &workers[worker_count], NULL, worker_thread, NULL ) )
+    {
+      printf( "Error creating worker thread\n" );
+      sigint_handler( 1 );
+    }
+  }
+
+  (void) signal( SIGINT, sigint_handler );
+  pthread_sigmask( SIG_UNBLOCK, &signal_mask, NULL );
+
+  printf( "Routing %d networks with %d workers\n", network_count,
+                                                                worker_count );
+
+  while( running )
+  {
+    event_count = epoll_wait( epoll_fd, events, MAX_NETWORKS + 1, -1 );
+
+    if( event_count < 0 )
+    {
+      if( EINTR != errno )
+      {
+        perror( "Error waiting for ports" );
+        break;
+      }
+      continue;
+    }
+
+    for( event_index = 0; event_index < event_count; event_index++ )
+    {
+      p_network = (network_t*)events[event_index].data.ptr;
+
+      if( NULL == p_network )
+      {
+        reattach_ports();
+      }
+      else if( read_port( p_network ) ||
+          ( events[event_index].events & ( EPOLLHUP | EPOLLERR ) ) )
+      {
+        // Otherwise epoll keeps waking up for it
+        detach_port( p_network );
+      }
+    }
+  }
+
+  close( reattach_timer );
+  close( epoll_fd );
+
+  sigint_handler( 0 );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     void sigint_handler( int32_t sig )
+ * @brief  Called on SIGINT to stop the I/O loop, and again from main to stop
+ *         the workers, write out the round logs and exit.
+ * ****************************************************************************/
+void sigint_handler( int32_t sig )
+{
+  uint8_t network_index;
+  uint8_t worker_index;
+
+  if( SIGINT == sig )
+  {
+    running = 0;
+    return;
+  }
+
+  pthread_mutex_lock( &mutex_pool );
+  stopping = 1;
+  pthread_cond_broadcast( &cond_pool );
+  pthread_mutex_unlock( &mutex_pool );
+
+  for( worker_index = 0; worker_index < worker_count; worker_index++ )
+  {
+    pthread_join( workers[worker_index], NULL );
+  }
+
+  for( network_index = 0; network_index < network_count; network_index++ )
+  {
+    close_network( &networks[network_index] );
+  }
+
+  printf( "\nExiting...\n" );
+  exit( sig );
+}
+
+/*******************************************************************************
+ * @fn     uint8_t open_network( network_t* p_network, int32_t port_number,
+ *                                    int32_t baud_rate, energy_t c_factor )
+ * @brief  Open serial port and set up routing for one AP. Rounds are logged
+ *         to ./logs/port<port_number>/rounds.bin and published in shared
+ *         memory as /routing_port<port_number>. With -DSERIAL_CAPTURE the
+ *         port is captured to ./logs/port<port_number>/serial.cap.
+ * ****************************************************************************/
+static uint8_t open_network( network_t* p_network, int32_t port_number,
+                                      int32_t baud_rate, energy_t c_factor )
+{
+  char log_filename[64];
+  char shm_name[32];
+
+  memset( p_network, 0, sizeof(network_t) );
+  p_network->port_number = port_number;
+  deframer_initialize( &p_network->deframer );
+
+  if( OpenComport( port_number, baud_rate ) )
+  {
+    printf( "Error opening serial port %d.\r\n", port_number );
+    return 1;
+  }
+
+  sprintf( log_filename, "./logs/port%d", port_number );
+  mkdir( log_filename, 0755 );
+
+#ifdef SERIAL_CAPTURE
+  sprintf( log_filename, "./logs/port%d/serial.cap", port_number );
+  if( 0 == capture_open( &p_network->capture, log_filename ) )
+  {
+    p_network->p_capture = &p_network->capture;
+  }
+#endif
+
+  if( txqueue_start( &p_network->tx_queue, port_number,
+                                                    p_network->p_capture ) )
+  {
+    printf( "Error starting transmit thread for port %d.\n", port_number );
+    close_capture( p_network );
+    CloseComport( port_number );
+    return 1;
+  }
+
+  p_network->p_context = routing_context_create();
+  if( NULL == p_network->p_context )
+  {
+    printf( "Error creating routing context.\n" );
+    txqueue_stop( &p_network->tx_queue );
+    close_capture( p_network );
+    CloseComport( port_number );
+    return 1;
+  }
+
+  sprintf( log_filename, "./logs/port%d/rounds.bin", port_number );
+
+  routing_select( p_network->p_context );
+  routing_set_verbose( ROUTING_OUTPUT_SUMMARY );
+
+  if( routing_start( c_factor, log_filename ) )
+  {
+    routing_select( NULL );
+    routing_context_destroy( p_network->p_context );
+    txqueue_stop( &p_network->tx_queue );
+    close_capture( p_network );
+    CloseComport( port_number );
+    return 1;
+  }
+
+  // Not being able to publish doesn't stop routing
+  sprintf( shm_name, ROUTESHM_NAME_FORMAT, port_number );
+  routing_publish( shm_name );
+
+  routing_select( NULL );
+
+  // Tables sent until the first round is done
+  memset( p_network->rp_tables, 0xff, sizeof(p_network->rp_tables) );
+
+#ifdef RP_DELTA_UPDATES
+  rp_encoder_initialize( &p_network->rp_encoder );
+#endif
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     void close_network( network_t* p_network )
+ * @brief  Print statistics, write out the round log, send what is still
+ *         queued and close the port. Workers must be stopped.
+ * ****************************************************************************/
+static void close_network( network_t* p_network )
+{
+  printf( "\nPort %d: %d rounds, %d tables replaced before routing, "
+          "%d invalid packets, %d oversized, reattached %d times\n",
+          p_network->port_number, p_network->rounds, p_network->replaced,
+          p_network->invalid, p_network->deframer.oversized,
+          p_network->reattached );
+
+  routing_select( p_network->p_context );
+  routing_finalize();
+  routing_select( NULL );
+
+  routing_context_destroy( p_network->p_context );
+  neighbor_table_free( &p_network->neighbors );
+
+  txqueue_stop( &p_network->tx_queue );
+  txqueue_print_stats( &p_network->tx_queue );
+
+  // The I/O thread is done, nothing else is read
+  close_capture( p_network );
+
+  CloseComport( p_network->port_number );
+}
+
+/*******************************************************************************
+ * @fn     void close_capture( network_t* p_network )
+ * @brief  Finish the port's capture, if there is one
+ * ****************************************************************************/
+static void close_capture( network_t* p_network )
+{
+  if( NULL != p_network->p_capture )
+  {
+    capture_close( p_network->p_capture );
+    p_network->p_capture = NULL;
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint8_t attach_port( network_t* p_network )
+ * @brief  Start waiting on the network's port. Returns 1 on error.
+ * ****************************************************************************/
+static uint8_t attach_port( network_t* p_network )
+{
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  event.data.ptr = p_network;
+  if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD,
+                        GetComportFd( p_network->port_number ), &event ) )
+  {
+    return 1;
+  }
+
+  p_network->attached = 1;
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     void detach_port( network_t* p_network )
+ * @brief  Stop waiting on a port that hung up and try opening it again every
+ *         REATTACH_INTERVAL_MS. The port stays open meanwhile, so its file
+ *         descriptor isn't reused (the transmit queue drops what is sent).
+ * ****************************************************************************/
+static void detach_port( network_t* p_network )
+{
+  struct itimerspec interval;
+
+  epoll_ctl( epoll_fd, EPOLL_CTL_DEL, GetComportFd( p_network->port_number ),
+                                                                      NULL );
+  p_network->attached = 0;
+
+  printf( "Port %d hung up, waiting for it to come back\n",
+                                                    p_network->port_number );
+
+  if( 0 == detached_count++ )
+  {
+    interval.it_interval.tv_sec = REATTACH_INTERVAL_MS / 1000;
+    interval.it_interval.tv_nsec = ( REATTACH_INTERVAL_MS % 1000 ) * 1000000;
+    interval.it_value = interval.it_interval;
+    timerfd_settime( reattach_timer, 0, &interval, NULL );
+  }
+}
+
+/*******************************************************************************
+ * @fn     void reattach_ports()
+ * @brief  Open the ports that hung up again (see ReattachComport), the ones
+ *         that are back are waited on again
+ * ****************************************************************************/
+static void reattach_ports()
+{
+  struct itimerspec stop;
+  uint64_t expirations;
+  uint8_t network_index;
+  network_t* p_network;
+
+  if( read( reattach_timer, &expirations, sizeof(expirations) ) < 0 )
+  {
+    return;
+  }
+
+  for( network_index = 0; network_index < network_count; network_index++ )
+  {
+    p_network = &networks[network_index];
+
+    if( p_network->attached || ReattachComport( p_network->port_number ) )
+    {
+      continue;
+    }
+
+    if( attach_port( p_network ) )
+    {
+      continue;
+    }
+
+    p_network->reattached++;
+    detached_count--;
+
+    printf( "Port %d is back\n", p_network->port_number );
+  }
+
+  if( 0 == detached_count )
+  {
+    memset( &stop, 0, sizeof(stop) );
+    timerfd_settime( reattach_timer, 0, &stop, NULL );
+  }
+}
+
+/*******************************************************************************
+ * @fn     uint8_t read_port( network_t* p_network )
+ * @brief  Read everything available from the AP's port and deframe it.
+ *         Returns 1 if the port hung up.
+ * ****************************************************************************/
+static uint8_t read_port( network_t* p_network )
+{
+  uint8_t* p_space;
+  uint8_t* p_packet;
+  uint16_t room;
+  uint16_t packet_size;
+  int32_t bytes_read;
+
+  do
+  {
+    p_space = deframer_space( &p_network->deframer, &room );
+    bytes_read = PollComport( p_network->port_number, p_space, room );
+    if( bytes_read < 0 )
+    {
+      // Nothing left to read, or the port is gone
+      return ( EAGAIN != errno ) && ( EINTR != errno );
+    }
+    if( 0 == bytes_read )
+    {
+      // Hung up
+      return 1;
+    }
+
+    capture_write( p_network->p_capture, CAPTURE_RX, p_space, bytes_read );
+
+    deframer_received( &p_network->deframer, bytes_read );
+
+    while( deframer_next( &p_network->deframer, &p_packet, &packet_size ) )
+    {
+      table_ready( p_network, p_packet, packet_size );
+    }
+  } while( room == bytes_read );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn     void table_ready( network_t* p_network, const uint8_t* p_packet,
+ *                                                             uint16_t size )
+ * @brief  Hand the packet just deframed to the worker pool. If the network
+ *         is already queued or being routed, only the newest table is kept.
+ * ****************************************************************************/
+static void table_ready( network_t* p_network, const uint8_t* p_packet,
+                                                              uint16_t size )
+{
+  pthread_mutex_lock( &mutex_pool );
+
+  memcpy( p_network->table, p_packet, size );
+  p_network->table_size = size;
+
+  switch( p_network->state )
+  {
+    case NETWORK_IDLE:
+      p_network->state = NETWORK_QUEUED;
+      ready_queue[( ready_head + ready_count ) % MAX_NETWORKS] = p_network;
+      ready_count++;
+      pthread_cond_signal( &cond_pool );
+      break;
+
+    case NETWORK_QUEUED:
+      p_network->replaced++;
+      break;
+
+    case NETWORK_BUSY:
+      if( p_network->pending )
+      {
+        p_network->replaced++;
+      }
+      p_network->pending = 1;
+      break;
+  }
+
+  pthread_mutex_unlock( &mutex_pool );
+}
+
+/*******************************************************************************
+ * @fn     void *worker_thread( void* arg )
+ * @brief  Route networks as their tables come in, until stopped
+ * ****************************************************************************/
+static void *worker_thread( void* arg )
+{
+  uint8_t table[BUFFER_SIZE];
+  uint16_t table_size;
+  network_t* p_network;
+
+  pthread_mutex_lock( &mutex_pool );
+
+  for(;;)
+  {
+    while( ( 0 == ready_count ) && !stopping )
+    {
+      pthread_cond_wait( &cond_pool, &mutex_pool );
+    }
+
+    if( stopping )
+    {
+      break;
+    }
+
+    p_network = ready_queue[ready_head];
+    ready_head = ( ready_head + 1 ) % MAX_NETWORKS;
+    ready_count--;
+
+    p_network->state = NETWORK_BUSY;
+    table_size = p_network->table_size;
+    memcpy( table, p_network->table, table_size );
+
+    pthread_mutex_unlock( &mutex_pool );
+
+    route_network( p_network, table, table_size );
+
+    pthread_mutex_lock( &mutex_pool );
+
+    // A newer table came in while routing, go around again (at the back of
+    // the queue so other networks get their turn)
+    if( p_network->pending )
+    {
+      p_network->pending = 0;
+      p_network->state = NETWORK_QUEUED;
+      ready_queue[( ready_head + ready_count ) % MAX_NETWORKS] = p_network;
+      ready_count++;
+    }
+    else
+    {
+      p_network->state = NETWORK_IDLE;
+    }
+  }
+
+  pthread_mutex_unlock( &mutex_pool );
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * @fn     void route_network( network_t* p_network, uint8_t* p_table,
+ *                                                            uint16_t size )
+ * @brief  Route one table from the AP and send it the new routes and powers.
+ *         The packet is either an (N+1)x(N+1) RSSI table or a sparse neighbor
+ *         table (see neighbors.h), like threadtest.
+ * ****************************************************************************/
+static void route_network( network_t* p_network, uint8_t* p_table,
+                                                              uint16_t size )
+{
+  uint32_t table_size = (uint32_t)( sqrt( (double)size ) + 0.5 );
+
+  routing_select( p_network->p_context );
+
+  if( is_neighbor_packet( p_table, size ) )
+  {
+    if( neighbor_table_unpack( &p_network->neighbors, p_table, size ) ||
+        parse_neighbors( &p_network->neighbors, NULL ) )
+    {
+      p_network->invalid++;
+      return;
+    }
+  }
+  else if( ( table_size * table_size != size ) || ( table_size < 2 ) ||
+           ( table_size > ( MAX_NETWORK_SIZE + 1 ) ) ||
+           parse_table( p_table, table_size - 1 ) )
+  {
+    p_network->invalid++;
+    return;
+  }
+
+  routing_compute_round( p_network->rp_tables );
+  p_network->rounds++;
+
+  send_tables( p_network );
+}
+
+/*******************************************************************************
+ * @fn     void send_tables( network_t* p_network )
+ * @brief  Send the network's routing and power tables to its AP
+ * ****************************************************************************/
+static void send_tables( network_t* p_network )
+{
+  uint8_t device_count = routing_get_device_count();
+#ifdef RP_DELTA_UPDATES
+  uint16_t message_size;
+
+  // Send route/power changes to AP
+  message_size = rp_update_encode( &p_network->rp_encoder,
+                  p_network->rp_tables, device_count, p_network->rp_message );
+  if( send_packet( p_network, p_network->rp_message, message_size ) )
+  {
+    // The AP never sees this delta, so the next one has to be a keyframe
+    rp_update_force_keyframe( &p_network->rp_encoder );
+  }
+#else
+  send_packet( p_network, p_network->rp_tables, device_count * 2 );
+#endif
+}
+
+/*******************************************************************************
+ * @fn     uint8_t send_packet( network_t* p_network, const uint8_t* p_packet,
+ *                                                            uint16_t size )
+ * @brief  Queue packet for the network's AP. Doesn't wait for the port,
+ *         returns 1 if it was dropped because the port isn't keeping up.
+ * ****************************************************************************/
+static uint8_t send_packet( network_t* p_network, const uint8_t* p_packet,
+                                                              uint16_t size )
+{
+  return txqueue_send( &p_network->tx_queue, p_packet, size );
+}
@@ -0,0 +1,83 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+#include "routing.h"
+#include "rpupdate.h"
+#include "deframer.h"
+#include "txqueue.h"
+#include "capture.h"
+
+// Largest packet from an AP
+#define BUFFER_SIZE ( DEFRAMER_BUFFER_SIZE )
+
+// Most access points (serial ports) handled at once
+#define MAX_NETWORKS ( 16 )
+
+// Most worker threads (0 on the command line uses one per CPU)
+#define MAX_WORKERS ( 32 )
+
+// How often ports that hung up (i.e. adapter unplugged) are opened again (ms)
+#define REATTACH_INTERVAL_MS ( 1000 )
+
+// Network (AP) states, see network_t
+typedef enum
+{
+  NETWORK_IDLE = 0,   // Waiting for a table from the AP
+  NETWORK_QUEUED,     // Table ready, waiting for a worker
+  NETWORK_BUSY        // A worker is routing it
+} network_state_t;
+
+//
+// One access point and its network. The I/O thread deframes packets and
+// hands complete ones over in table (protected by mutex_pool).
+// Everything else is only touched by the worker routing the network, and
+// only one worker has a network at a time.
+//
+typedef struct
+{
+  int32_t port_number;
+
+  // I/O thread only
+  deframer_t deframer;
+  uint8_t attached;         // Port is open and in the epoll set
+
+  // Frames to the AP, written by the queue's own thread
+  txqueue_t tx_queue;
+
+  // Everything read and written (-DSERIAL_CAPTURE), NULL if not capturing
+  capture_t capture;
+  capture_t* p_capture;
+
+  // Latest table from the AP, replaced if a new one arrives before a
+  // worker gets to it
+  uint8_t table[BUFFER_SIZE];
+  uint16_t table_size;
+  network_state_t state;
+  uint8_t pending;
+
+  // Routing state (worker only)
+  routing_context_t* p_context;
+  neighbor_table_t neighbors;
+  uint8_t rp_tables[RP_TABLES_SIZE];
+#ifdef RP_DELTA_UPDATES
+  rp_encoder_t rp_encoder;
+  uint8_t rp_message[RP_MESSAGE_MAX_SIZE];
+#endif
+
+  // Statistics
+  uint32_t rounds;          // Tables routed
+  uint32_t replaced;        // Tables replaced by a newer one before routing
+  uint32_t invalid;         // Packets that weren't a valid table
+  uint32_t reattached;      // Times the port came back after hanging up
+} network_t;
+
+void sigint_handler( int32_t sig );
+
+#endif /*_MAIN_H */
@@ -8,21 +8,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <math.h>
 #include "main.h"
 #include "rs232.h"
+#include "deframer.h"
+#include "txqueue.h"
+#include "capture.h"
 
 static int32_t serial_port_number;
+static deframer_t deframer;
+static txqueue_t tx_queue;
+static capture_t* p_capture = NULL;
+
+#ifdef SERIAL_CAPTURE
+static capture_t capture;
+#define CAPTURE_FILENAME "./serial.cap"
+#endif
 static uint32_t time_counter = 0;
 static FILE* main_fp;
 
-// Table with all the RSSIs from all devices. This is sent back to the host.
-static volatile uint8_t rssi_table[MAX_DEVICES+1][MAX_DEVICES+1];
+// Number of devices in the network (from the size of the last RSSI table)
+static uint8_t device_count;
 
 // Table storing all device transmit powers
-static volatile uint8_t power_table[MAX_DEVICES];
+static volatile uint8_t power_table[MAX_NETWORK_SIZE];
 
 // Table storing all device routes
-static volatile uint8_t routing_table[MAX_DEVICES];
+static volatile uint8_t routing_table[MAX_NETWORK_SIZE];
 
 static const double rssi_values[256] = {
 -72.0,-71.5,-71.0,-70.5,-70.0,-69.5,-69.0,-68.5,-68.0,-67.5,-67.0,
@@ -52,24 +65,17 @@ static const double rssi_values[256] = {
 -79.5,-79.0,-78.5,-78.0,-77.5,-77.0,-76.5,-76.0,-75.5,-75.0,
 -74.5,-74.0,-73.5,-73.0,-72.5, };
 
-void send_serial_message( uint8_t* packet_buffer, int16_t buffer_size );
-
 int main( int argc, char *argv[] )
 {   
   uint8_t serial_buffer[BUFFER_SIZE]; 
-  uint8_t packet_buffer[BUFFER_SIZE];
-  uint8_t final_buffer[BUFFER_SIZE];
-  uint8_t tx_buffer[BUFFER_SIZE];  
-  
-  uint16_t buffer_offset = 0;
-  uint8_t new_packet = 0;
+  uint8_t* p_packet;
+  uint8_t* p_space;
+  uint16_t packet_size;
+  uint16_t room;
  
-  uint16_t bytes_read = 0;  
+  int32_t bytes_read = 0;
   
   memset((uint8_t*)power_table, 0xff, sizeof(power_table));
-  memset((uint8_t*)routing_table, (MAX_DEVICES+1), sizeof(routing_table));
-  
-  routing_table[0] = 3; // route device 1 through device 3
   
   // Handle interrupt events to make sure files are closed before exiting
   (void) signal( SIGINT, sigint_handler );
@@ -83,8 +89,8 @@ int main( int argc, char *argv[] )
   
   printf("CC2500 Sniffer\r\n");
   
-  // Convert string serial number to integer
-  serial_port_number = atoi( argv[1] );
+  // Port number or device path (i.e. a pty from ../apemu)
+  serial_port_number = ComportNumber( argv[1] );
   
   // Use RS232 library to open serial port  
   if ( OpenComport( serial_port_number, atoi(argv[2]) ) )
@@ -93,10 +99,26 @@ int main( int argc, char *argv[] )
     printf("Error opening serial port.\n");
     return 1;
   }
+
+#ifdef SERIAL_CAPTURE
+  // Everything read and written, for ../capreplay
+  if( 0 == capture_open( &capture, CAPTURE_FILENAME ) )
+  {
+    p_capture = &capture;
+  }
+#endif
+
+  // Routing tables go out from their own thread, reads never wait on them
+  if( txqueue_start( &tx_queue, serial_port_number, p_capture ) )
+  {
+    printf("Error starting serial transmit thread.\n");
+    return 1;
+  }
+
   // Flush the port
-  while( PollComport( serial_port_number, serial_buffer, BUFFER_SIZE ) );
+  while( PollComport( serial_port_number, serial_buffer, BUFFER_SIZE ) > 0 );
   
-  memset( serial_buffer, 0x00, sizeof(serial_buffer) );
+  deframer_initialize( &deframer );
   
   // Open capture file
   main_fp = fopen( "./rssi_tables.csv", "w" );
@@ -104,78 +126,70 @@ int main( int argc, char *argv[] )
   // Run forever
   for(;;)
   {  
-    // Read a buffer full of data (if available)
-    bytes_read = PollComport( serial_port_number, serial_buffer, BUFFER_SIZE );
-    if( bytes_read > 0 )
-    {
+    // Sleep until something arrives
+    WaitComport( serial_port_number, -1 );
 
-      if( bytes_read >= BUFFER_SIZE )
+    // Read straight into the deframer
+    p_space = deframer_space( &deframer, &room );
+    bytes_read = PollComport( serial_port_number, p_space, room );
+    if( ( bytes_read < 0 ) && ( ( EAGAIN == errno ) || ( EINTR == errno ) ) )
+    {
+      continue;
+    }
+    if( bytes_read <= 0 )
+    {
+      // Nothing to read after a wake up, the port hung up. Open it again
+      // until it's back.
+      usleep(250000);
+      if( 0 == ReattachComport( serial_port_number ) )
       {
-        printf("Uh oh!\n");
-      }
-      else
-      {
-        
-        memcpy( packet_buffer + buffer_offset, serial_buffer, bytes_read );                        
-       
-        if ( packet_in_buffer( packet_buffer ) )
-        {          
-                             
-          buffer_offset = 0;
-          
-          new_packet = 1;
-          bytes_read = find_and_escape_packet( packet_buffer, final_buffer );          
-          
-        } 
-        else
-        {   
-          
-          buffer_offset += bytes_read;
-          
-          if( buffer_offset > BUFFER_SIZE )
-          {
-            printf("damn...\n");
-            memset( packet_buffer, 0x00, sizeof(packet_buffer) );
-            memset( serial_buffer, 0x00, sizeof(serial_buffer) );
-            buffer_offset = 0;
-          }
-        }
-        
-        if( new_packet == 1 )
-        {
-          
-          process_packet( final_buffer );
-          
-          new_packet = 0;
-          memset( packet_buffer, 0x00, sizeof(packet_buffer) );
-          
-          // send new routing table
-          send_serial_message( (uint8_t *)routing_table, sizeof(routing_table) );
-        }      
-
+        printf("Serial port reattached.\n");
       }
+      continue;
     }
-    memset( serial_buffer, 0x00, sizeof(serial_buffer) );
-    
-    // Don't take up all the processor time    
-    usleep(20000);
-    //
 
+    capture_write( p_capture, CAPTURE_RX, p_space, bytes_read );
+
+    deframer_received( &deframer, bytes_read );
+
+    while( deframer_next( &deframer, &p_packet, &packet_size ) )
+    {
+      process_packet( p_packet, packet_size );
+
+      // send new routing table (if the port is behind, the next one will do)
+      txqueue_send( &tx_queue, (uint8_t *)routing_table, device_count );
+    }
   }  
 
   return 0;
 }
 
-void process_packet( uint8_t* buffer )
+void process_packet( uint8_t* buffer, uint16_t size )
 {
   uint8_t row_index;
   uint8_t col_index;
-    
-  memcpy( rssi_table, buffer, sizeof(rssi_table) );
+  uint16_t table_size = (uint16_t)( sqrt( (double)size ) + 0.5 );
+
+  // The network size comes from the table size
+  if( ( table_size * table_size != size ) || ( table_size < 2 ) ||
+      ( table_size > ( MAX_NETWORK_SIZE + 1 ) ) )
+  {
+    printf( "Received packet is not a valid RSSI table (%d)\r\n", size );
+    return;
+  }
+
+  if( device_count != ( table_size - 1 ) )
+  {
+    device_count = table_size - 1;
+
+    // Route everything to the AP except device 1 (through device 3)
+    memset( (uint8_t*)routing_table, ( device_count + 1 ), device_count );
+    routing_table[0] = 3;
+  }
   
   printf("   ");
   
-  for( col_index = 0; col_index <= MAX_DEVICES; col_index++ )
+  for( col_index = 0; col_index <= device_count; col_index++ )
   {
     printf(" %3d   ", col_index );
   }
@@ -183,18 +197,18 @@ void process_packet( uint8_t* buffer )
   printf("\r\n");
   
   // Print packet in hex
-  for( row_index = 0; row_index <= MAX_DEVICES; row_index++ )
+  for( row_index = 0; row_index <= device_count; row_index++ )
   { 
     printf("%2d ", row_index );
     
-    for( col_index = 0; col_index < MAX_DEVICES; col_index++ )
+    for( col_index = 0; col_index < device_count; col_index++ )
     {
-      printf("%06.1f ", rssi_values[rssi_table[row_index][col_index]]  );
-      fprintf( main_fp, "%d,", rssi_table[row_index][col_index] );
+      printf("%06.1f ", rssi_values[buffer[row_index * table_size + col_index]]  );
+      fprintf( main_fp, "%d,", buffer[row_index * table_size + col_index] );
     }
     
-    printf("%06.1f ", rssi_values[rssi_table[row_index][col_index]]  );
-    fprintf( main_fp, "%d", rssi_table[row_index][col_index] );
+    printf("%06.1f ", rssi_values[buffer[row_index * table_size + col_index]]  );
+    fprintf( main_fp, "%d", buffer[row_index * table_size + col_index] );
     
     printf("\r\n");
     fprintf( main_fp, "\n" );
@@ -207,113 +221,6 @@ void process_packet( uint8_t* buffer )
   return;
 }
 
-/*!
-  @brief Find a packet in the buffer
-*/
-uint8_t packet_in_buffer( uint8_t* old_buffer )
-{
-  // replace escaped characters
-  uint16_t buffer_index = 0;
-  uint8_t sync_bytes=0;
-
-  // find first SYNC_BYTE
-  while( (sync_bytes < 2) & (buffer_index < BUFFER_SIZE) )
-  {
-    if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      sync_bytes++;      
-    }
-    buffer_index++;
-  }
-  
-  // No packet found
-  if ( sync_bytes < 2 )
-  {
-    return 0;
-  }  
-  
-  return 1;  
-}
-
-
-/*!
-  @brief Find a packet in the buffer, remove escape characters, and return size
-*/
-uint16_t find_and_escape_packet( uint8_t* old_buffer, uint8_t* new_buffer )
-{
-  // replace escaped characters
-  uint16_t buffer_index = 0;
-  uint16_t packet_size = 0;
-  uint8_t start=0;
-
-  // find first SYNC_BYTE
-  while( (!start) & (buffer_index < BUFFER_SIZE) )
-  {
-    if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      start = 1;
-      // Don't include first sync byte for alignment issues
-      //new_buffer[packet_size++] = old_buffer[buffer_index];
-    }
-    buffer_index++;
-  }
-
-  
-  // process until next SYNC_BYTE is found
-  while ( (start) & (buffer_index < BUFFER_SIZE) )
-  {
-    // Handle escape characters
-    if( old_buffer[buffer_index] == ESCAPE_BYTE )
-    {
-      buffer_index++;
-      old_buffer[buffer_index] ^= 0x20;
-    }
-    // Handle end character
-    else if( old_buffer[buffer_index] == SYNC_BYTE )
-    {
-      start = 0;
-    }
-    new_buffer[packet_size++] = old_buffer[buffer_index];
-    buffer_index++;
-  }
-  if( start == 1 )
-  {
-    return 0;
-  }
-  return packet_size;  
-}
-
-/*!
-  @brief Set-up outgoing packet's address and am_type
-*/
-void send_serial_message( uint8_t* packet_buffer, int16_t buffer_size )
-{
-  uint8_t p_tmp_buffer[BUFFER_SIZE];
-  uint8_t total_size = 0;
-  uint8_t buffer_index = 0;
- 
-  // Add start character
-  p_tmp_buffer[total_size++] = SYNC_BYTE; 
-   
-  for(; buffer_size > 0; buffer_size-- )
-  {
-    if( ( SYNC_BYTE == packet_buffer[buffer_index] ) || 
-        ( ESCAPE_BYTE == packet_buffer[buffer_index] ) )
-    {
-      p_tmp_buffer[total_size++] = ESCAPE_BYTE;
-      p_tmp_buffer[total_size++] = packet_buffer[buffer_index++] ^ 0x20;
-    }
-    else
-    {
-      p_tmp_buffer[total_size++] = packet_buffer[buffer_index++];
-    }
-  }
-  
-  p_tmp_buffer[total_size++] = SYNC_BYTE;
-  
-  SendBuf(serial_port_number, p_tmp_buffer, total_size);
-}
-
 /*!
   @brief Handle interrupt event (SIGINT) so program exits cleanly
 */
@@ -322,7 +229,13 @@ void sigint_handler( int32_t sig )
     // Close the file
     fclose( main_fp );
     
-    // Close the serial port
+    // Send what is queued and close the serial port
+    txqueue_stop( &tx_queue );
+    txqueue_print_stats( &tx_queue );
+    if( NULL != p_capture )
+    {
+      capture_close( p_capture );
+    }
     CloseComport( serial_port_number );
 
     printf("\nExiting...\n");
@@ -15,10 +15,8 @@
 
 #define BUFFER_SIZE ( 512 )
 
-#define SYNC_BYTE   ( 0x7E )
-#define ESCAPE_BYTE ( 0x7D )
-
-#define MAX_DEVICES (3)
+// Largest network supported (node ids are 8 bit and the AP uses N+1)
+#define MAX_NETWORK_SIZE (254)
 
 #define BROADCAST_ADDRESS (0x00)
 
@@ -38,9 +36,7 @@
 #define FLAG_BURST  ( 0x20 )
 
 // Function Prototypes
-void process_packet( uint8_t* buffer );
-uint8_t packet_in_buffer( uint8_t* );
-uint16_t find_and_escape_packet( uint8_t*, uint8_t* );
+void process_packet( uint8_t* buffer, uint16_t size );
 
 void sigint_handler( int32_t sig );
 
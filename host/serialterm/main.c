@@ -10,11 +10,10 @@
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
+#include "rs232.h"
 #include "serial.h"
 #include "main.h"
 
-void send_serial_message( uint8_t* packet_buffer, int16_t buffer_size );
-
 pthread_t serial_thread;
 
 int main( int argc, char *argv[] )
@@ -33,8 +32,9 @@ int main( int argc, char *argv[] )
 
   printf("Threaded Serial Terminal\r\n");
 
-  // Convert string serial number to integer and open port
-  if( serial_open( atoi( argv[1] ), atoi( argv[2] ), &process_packet ) )
+  // Port number or device path (i.e. a pty from ../apemu) and open port
+  if( serial_open( ComportNumber( argv[1] ), atoi( argv[2] ),
+                                                        &process_packet ) )
   {
     printf("Error opening serial port.\r\n");
     exit(-1);
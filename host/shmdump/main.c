@@ -0,0 +1,217 @@
+/** @file main.c
+*
+* @brief Print the live routing state published in shared memory
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "routeshm.h"
+#include "main.h"
+
+void print_round( routeshm_reader_t* p_reader, uint8_t print_tables );
+void print_table( routeshm_reader_t* p_reader, energy_t* p_table,
+                                                        const char* title );
+double watt_to_dbm( double power );
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  routeshm_reader_t reader;
+  char shm_name[64];
+  uint8_t watch = 0;
+  uint8_t print_tables = 0;
+  uint32_t last_round = 0;
+  uint8_t printed = 0;
+
+  if ( argc < 2 )
+  {
+    printf( "Usage: %s port|name [watch (0,1)] [tables (0,1)]\r\n", argv[0] );
+    return 1;
+  }
+
+  // A port number is the segment of threadtest or routingd on that port
+  if( isdigit( (uint8_t)argv[1][0] ) )
+  {
+    snprintf( shm_name, sizeof(shm_name), ROUTESHM_NAME_FORMAT,
+                                                          atoi( argv[1] ) );
+  }
+  else
+  {
+    snprintf( shm_name, sizeof(shm_name), "%s", argv[1] );
+  }
+
+  if( argc > 2 )
+  {
+    watch = atoi( argv[2] );
+  }
+
+  if( argc > 3 )
+  {
+    print_tables = atoi( argv[3] );
+  }
+
+  if( routeshm_attach( &reader, shm_name ) )
+  {
+    printf( "Error opening shared memory %s.\r\n", shm_name );
+    return 1;
+  }
+
+  do
+  {
+    if( ( 0 == routeshm_read( &reader ) ) &&
+        ( !printed || ( reader.state.round != last_round ) ) )
+    {
+      print_round( &reader, print_tables );
+      fflush( stdout );
+
+      last_round = reader.state.round;
+      printed = 1;
+    }
+    else if( !watch && !printed )
+    {
+      printf( "Nothing published yet.\r\n" );
+      break;
+    }
+
+    if( watch )
+    {
+      usleep( POLL_INTERVAL_US );
+    }
+  } while( watch );
+
+  routeshm_detach( &reader );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void print_round( routeshm_reader_t* p_reader,
+ *                                                  uint8_t print_tables )
+ *
+ * @brief Print routes, powers and energies of the round read last (and the
+ *        RSSI and link power tables if print_tables is set)
+ * ****************************************************************************/
+void print_round( routeshm_reader_t* p_reader, uint8_t print_tables )
+{
+  routeshm_state_t* p_state = &p_reader->state;
+  routeshm_tables_t* p_tables = &p_reader->tables;
+  struct timespec now;
+  uint64_t now_ns;
+  uint8_t node_index;
+
+  clock_gettime( CLOCK_REALTIME, &now );
+  now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+  printf( "Round %d, %d devices", p_state->round, p_state->device_count );
+  if( p_state->max_neighbors > 0 )
+  {
+    printf( " (%d neighbors each)", p_state->max_neighbors );
+  }
+  printf( ", C %g\n", p_state->c_factor );
+
+  printf( "Routed in %.3f ms, %.1f ms ago\n",
+          ( p_state->round_end_ns - p_state->round_start_ns ) / 1e6,
+          ( (int64_t)( now_ns - p_state->round_end_ns ) ) / 1e6 );
+
+  printf( "Node Next Setting Tx(dBm) Link(dBm) Energy\n" );
+  for( node_index = 1; node_index <= p_state->device_count; node_index++ )
+  {
+    if( ( p_state->device_count + 1 ) ==
+                                      p_tables->route_table[node_index - 1] )
+    {
+      printf( "%4d   AP", node_index );
+    }
+    else
+    {
+      printf( "%4d %4d", node_index, p_tables->route_table[node_index - 1] );
+    }
+
+    printf( "    0x%02X %7.1f %9.1f %g\n",
+            p_tables->power_table[node_index - 1],
+            p_tables->previous_powers[node_index - 1],
+            watt_to_dbm( p_tables->link_powers[node_index - 1] ),
+            p_tables->energies[node_index] );
+  }
+  printf( "Minimum energy %g\n", p_tables->energies[0] );
+
+  if( print_tables )
+  {
+    print_table( p_reader, p_tables->rssi_table, "RSSI (dBm)" );
+    print_table( p_reader, p_tables->link_power_table, "Link power (dBm)" );
+  }
+
+  printf( "\n" );
+}
+
+/*******************************************************************************
+ * @fn    void print_table( routeshm_reader_t* p_reader, energy_t* p_table,
+ *                                                      const char* title )
+ *
+ * @brief Print a table, rows are receivers and columns transmitters (0 is
+ *        the AP). Pairs that aren't in a sparse table are left blank.
+ * ****************************************************************************/
+void print_table( routeshm_reader_t* p_reader, energy_t* p_table,
+                                                          const char* title )
+{
+  routeshm_state_t* p_state = &p_reader->state;
+  routeshm_tables_t* p_tables = &p_reader->tables;
+  uint16_t table_size = p_state->device_count + 1;
+  uint16_t row_size = p_state->max_neighbors ? p_state->max_neighbors :
+                                                                  table_size;
+  energy_t row[MAX_TABLE_SIZE];
+  uint8_t present[MAX_TABLE_SIZE];
+  uint16_t row_index;
+  uint16_t col_index;
+  uint8_t slot;
+
+  printf( "%s\n", title );
+
+  for( row_index = 0; row_index < table_size; row_index++ )
+  {
+    if( p_state->max_neighbors > 0 )
+    {
+      memset( present, 0, table_size );
+      for( slot = 0; slot < p_tables->neighbor_counts[row_index]; slot++ )
+      {
+        col_index = p_tables->neighbor_ids[row_index * row_size + slot];
+        row[col_index] = p_table[row_index * row_size + slot];
+        present[col_index] = 1;
+      }
+    }
+    else
+    {
+      memcpy( row, &p_table[row_index * row_size],
+                                              table_size * sizeof(energy_t) );
+      memset( present, 1, table_size );
+    }
+
+    for( col_index = 0; col_index < table_size; col_index++ )
+    {
+      if( present[col_index] )
+      {
+        printf( "%7.1f", row[col_index] );
+      }
+      else
+      {
+        printf( "       " );
+      }
+    }
+    printf( "\n" );
+  }
+}
+
+/*******************************************************************************
+ * @fn    double watt_to_dbm( double power )
+ *
+ * @brief Convert power from Watts to dBm
+ * ****************************************************************************/
+double watt_to_dbm( double power )
+{
+  return 10l * log10( 1000l * power );
+}
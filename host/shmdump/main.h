@@ -0,0 +1,18 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+
+// How often the segment is checked for a new round when watching
+#define POLL_INTERVAL_US ( 50000 )
+
+// Largest table row ( N+1 )
+#define MAX_TABLE_SIZE ( 255 )
+
+#endif /*_MAIN_H */
@@ -10,19 +10,28 @@
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include "rs232.h"
 #include "serial.h"
 #include "routing.h"
+#include "rpupdate.h"
+#include "rssifilter.h"
+#include "ctuner.h"
+#include "routeshm.h"
+#include "latency.h"
 #include "main.h"
 
-#ifndef MAX_DEVICES
-#define MAX_DEVICES (3)
-#warning MAX_DEVICES not defined, defaulting to 3
-#endif
-
 #define MAX_ROUNDS (3000)
 
-void send_serial_message( uint8_t* packet_buffer, int16_t buffer_size );
+void send_tables( uint8_t* p_tables, uint8_t device_count );
+void print_deadline_stats();
 void *graph_thread();
+static void *routing_round_thread( void *p_rp_tables );
+static void timespec_add_ms( struct timespec* p_time, uint32_t ms );
+static int64_t timespec_diff_ns( struct timespec* p_end,
+                                                struct timespec* p_start );
 
 pthread_t serial_thread;
 pthread_t routing_thread;
@@ -30,19 +39,57 @@ pthread_t graphing_thread;
 
 pthread_mutex_t mutex_graph;
 
-// Routing and power tables (all in one array)
-static volatile uint8_t rp_tables[MAX_DEVICES * 2];
+// Routing and power tables (all in one array, sized for the largest network)
+// The first N bytes are routes and the next N are transmit powers, where
+// N = routing_get_device_count()
+static volatile uint8_t rp_tables[RP_TABLES_SIZE];
 
 // Table storing all device routes
 static volatile uint8_t *routing_table = &rp_tables[0];
 
-// Table storing all device transmit powers
-static volatile uint8_t *power_table = &rp_tables[MAX_DEVICES];
+// Last sparse table received from the AP (see neighbors.h)
+static neighbor_table_t neighbors;
+
+#ifdef RP_DELTA_UPDATES
+// Only send route/power changes to the AP. The decoder stands in for the AP
+// to check every message.
+static rp_encoder_t rp_encoder;
+static rp_decoder_t rp_decoder;
+static uint8_t rp_message[RP_MESSAGE_MAX_SIZE];
+#endif
+
+// Round deadline. Written by the serial thread when a round starts and by
+// the routing thread when it's done, round_changed is signalled on both.
+static pthread_mutex_t mutex_deadline = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t round_changed = PTHREAD_COND_INITIALIZER;
+static uint32_t rounds_started;
+static uint32_t rounds_finished;    // rounds_started when routing last ended
+static struct timespec round_arrival;
+
+// Tables of the last round routed, copied by the routing thread before it
+// moves on to the next round in rp_tables (protected by mutex_deadline)
+static uint8_t routed_tables[RP_TABLES_SIZE];
+static uint8_t routed_device_count;
+
+// Last tables that were ready on time (sent if a round is late)
+static uint8_t last_good_tables[RP_TABLES_SIZE];
+static uint8_t last_good_device_count;
+
+// Deadline statistics
+static uint32_t missed_deadlines;
+static uint32_t fallbacks_sent;
+static uint32_t late_rounds;
+static latency_histogram_t overrun_histogram;
+
+// Optional C factor tuning in the background (see ctuner.h)
+static ctuner_t tuner;
 
 int main( int argc, char *argv[] )
 {
   int32_t rc;
   int32_t timeout;
+  int32_t port_number;
+  char shm_name[32];
 
   // Handle interrupt events to make sure files are closed before exiting
   (void) signal( SIGINT, sigint_handler );
@@ -50,15 +97,20 @@ int main( int argc, char *argv[] )
   // Make sure input is correct
   if( argc < 6 )
   {
-    printf("Usage: %s port baudrate C(0.0-1000.0) [graph (0,1)] timeout\n", 
-                                                                      argv[0]);
+    printf("Usage: %s port baudrate C(0.0-1000.0) [graph (0,1)] timeout "
+                              "[margin (0.0-1.0)] [dwell rounds] "
+                              "[filter (0 none, 1 EWMA, 2 Kalman, 3 forecast)] "
+                              "[directed (0,1)] "
+                              "[tune C (0 off, 1 lifetime, 2 variance)]\n",
+                                                                    argv[0]);
     return 0;
   }
 
   printf("Threaded Serial Terminal\r\n");
 
-  // Convert string serial number to integer and open port
-  if( serial_open( atoi( argv[1] ), atoi( argv[2] ), &process_packet ) )
+  // Port number or device path (i.e. a pty from ../apemu) and open port
+  port_number = ComportNumber( argv[1] );
+  if( serial_open( port_number, atoi( argv[2] ), &process_packet ) )
   {
     printf("Error opening serial port.\r\n");
     exit(-1);
@@ -71,9 +123,9 @@ int main( int argc, char *argv[] )
 #ifdef ENABLE_MUSIC  
   system("banshee --play");
 #endif
-  // Initialize routing an power tables
-  memset( (uint8_t*)power_table, 0xff, MAX_DEVICES );
-  memset( (uint8_t*)routing_table, ( MAX_DEVICES + 1 ), MAX_DEVICES );
+  // Initialize routing an power tables (filled in once the network size
+  // is known from the first RSSI table)
+  memset( (uint8_t*)rp_tables, 0xff, sizeof(rp_tables) );
 
   if ( routing_initialize( (energy_t)strtod( argv[3], NULL ) ) )
   {
@@ -81,6 +133,68 @@ int main( int argc, char *argv[] )
     exit(-1);
   }
 
+  // Publish every round for other processes (see ../shmdump), routing goes
+  // on without it
+  sprintf( shm_name, ROUTESHM_NAME_FORMAT, port_number );
+  routing_publish( shm_name );
+
+  // Optional directed links (both directions of a link are merged by default)
+  if( argc > 9 )
+  {
+    graph_set_directed( atoi( argv[9] ) );
+  }
+
+  // Optional RSSI filter (disabled by default)
+  if( argc > 8 )
+  {
+    switch( atoi( argv[8] ) )
+    {
+      case RSSI_FILTER_EWMA:
+        rssi_filter_configure( RSSI_FILTER_EWMA, RSSI_FILTER_EWMA_ALPHA, 0 );
+        break;
+
+      case RSSI_FILTER_KALMAN:
+        rssi_filter_configure( RSSI_FILTER_KALMAN, RSSI_FILTER_KALMAN_Q,
+                                                      RSSI_FILTER_KALMAN_R );
+        break;
+
+      case RSSI_FILTER_FORECAST:
+        rssi_filter_configure( RSSI_FILTER_FORECAST,
+                                              RSSI_FILTER_FORECAST_LAMBDA,
+                                              RSSI_FILTER_FORECAST_ALPHA );
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  // Optional route hysteresis (disabled by default)
+  if( argc > 7 )
+  {
+    set_route_hysteresis( (energy_t)strtod( argv[6], NULL ), atoi( argv[7] ) );
+  }
+  else if( argc > 6 )
+  {
+    set_route_hysteresis( (energy_t)strtod( argv[6], NULL ), 0 );
+  }
+
+  // Optional C factor tuning (off by default)
+  if( ( argc > 10 ) && ( atoi( argv[10] ) > 0 ) )
+  {
+    ctuner_initialize( &tuner, routing_get_context(),
+                ( 2 == atoi( argv[10] ) ) ? CTUNER_SCORE_VARIANCE :
+                                            CTUNER_SCORE_LIFETIME );
+
+    if( ctuner_start( &tuner, CTUNER_PERIOD_MS ) )
+    {
+      printf("Error creating C tuner thread\n");
+      exit(-1);
+    }
+  }
+
+  LATENCY_INITIALIZE();
+
   rc = pthread_create( &serial_thread, NULL, serial_read_thread, NULL );
 
   if (rc)
@@ -89,7 +203,7 @@ int main( int argc, char *argv[] )
     exit(-1);
   }
 
-  rc = pthread_create( &routing_thread, NULL, compute_routes_thread,
+  rc = pthread_create( &routing_thread, NULL, routing_round_thread,
                                                         (void*) routing_table );
 
   if (rc)
@@ -112,16 +226,99 @@ int main( int argc, char *argv[] )
   }  
 
   uint32_t round = 0;
+  struct timespec deadline;
+  struct timespec missed_deadline;
+  struct timespec now;
+  uint32_t rounds_sent = 0;
+  uint8_t round_missed = 0;
+
+#ifdef RP_DELTA_UPDATES
+  rp_encoder_initialize( &rp_encoder );
+  rp_decoder_initialize( &rp_decoder );
+#endif
 
   for(;;)
   {
     //uint8_t index;
-    
-    // Wait until routing is done
-    pthread_mutex_lock ( &mutex_route_done );
 
-    // Send new routes to AP
-    send_serial_message( (uint8_t *)rp_tables, sizeof(rp_tables) );
+    // Wait until routing is done, or the deadline. Without a round pending
+    // there's no deadline, so just sleep until one starts.
+    rc = 0;
+    pthread_mutex_lock( &mutex_deadline );
+    while( ( rounds_finished == rounds_sent ) && ( ETIMEDOUT != rc ) )
+    {
+      if( rounds_started == rounds_finished )
+      {
+        rc = pthread_cond_wait( &round_changed, &mutex_deadline );
+      }
+      else
+      {
+        if( !round_missed )
+        {
+          deadline = round_arrival;
+          timespec_add_ms( &deadline, ROUND_DEADLINE_MS );
+        }
+
+        rc = pthread_cond_timedwait( &round_changed, &mutex_deadline,
+                                                                  &deadline );
+      }
+    }
+    rc = ( rounds_finished == rounds_sent ) ? ETIMEDOUT : 0;
+    if( 0 == rc )
+    {
+      LATENCY_ROUND_TAKEN();
+
+      // Tables that finish late are only kept with APPLY_LATE_ROUNDS
+      if( !round_missed || APPLY_LATE_ROUNDS )
+      {
+        memcpy( last_good_tables, routed_tables, routed_device_count * 2 );
+        last_good_device_count = routed_device_count;
+      }
+    }
+    rounds_sent = rounds_finished;
+    pthread_mutex_unlock( &mutex_deadline );
+
+    if( ETIMEDOUT == rc )
+    {
+      if( !round_missed )
+      {
+        round_missed = 1;
+        missed_deadline = deadline;
+        missed_deadlines++;
+      }
+
+      // Send last good tables (if there are any yet) and try again next
+      // period
+      if( last_good_device_count > 0 )
+      {
+        send_tables( last_good_tables, last_good_device_count );
+        fallbacks_sent++;
+      }
+
+      timespec_add_ms( &deadline, ROUND_PERIOD_MS );
+      continue;
+    }
+
+    LATENCY_STAMP( LAT_TX_START );
+
+    if( round_missed )
+    {
+      // The AP already got the last good tables for this round
+      clock_gettime( CLOCK_REALTIME, &now );
+      latency_histogram_add( &overrun_histogram,
+                                  timespec_diff_ns( &now, &missed_deadline ) );
+      late_rounds++;
+      round_missed = 0;
+    }
+    else
+    {
+      // Send new routes to AP
+      send_tables( last_good_tables, last_good_device_count );
+
+      LATENCY_STAMP( LAT_TX_DONE );
+    }
+
+    LATENCY_ROUND_DONE();
 
     // Only graph when asked to
     if ( argv[4][0] == '1')
@@ -132,16 +329,16 @@ int main( int argc, char *argv[] )
 
     // Print routes and powers
     /*
-    for( index = 0; index < MAX_DEVICES; index++ )
+    for( index = 0; index < routing_get_device_count(); index++ )
     {
       printf( "%d->%d ", index+1, routing_table[index] );
     }
 
     printf("\n");
 
-    for( index = 0; index < MAX_DEVICES; index++ )
+    for( index = 0; index < routing_get_device_count(); index++ )
     {
-      printf( "%02X ", power_table[index] );
+      printf( "%02X ", rp_tables[routing_get_device_count() + index] );
     }
     printf("\n");*/
     //printf("Round %d\n", round);
@@ -162,28 +359,168 @@ int main( int argc, char *argv[] )
 
 /*******************************************************************************
  * @fn     void process_packet( uint8_t* buffer, uint32_t size )
- * @brief  Process incoming serial packet
+ * @brief  Process incoming serial packet. The packet is either an
+ *         (N+1)x(N+1) RSSI table, so the network size comes from the packet
+ *         size, or a sparse neighbor table (see neighbors.h).
  * ****************************************************************************/
 uint8_t process_packet( uint8_t* buffer, uint32_t size )
 {
-  uint8_t rssi_table[MAX_DEVICES+1][MAX_DEVICES+1];
+  uint32_t table_size = (uint32_t)( sqrt( (double)size ) + 0.5 );
+  struct timespec arrival;
+
+  clock_gettime( CLOCK_REALTIME, &arrival );
 
-  if( size < sizeof(rssi_table) )
+  if( is_neighbor_packet( buffer, size ) )
+  {
+    if( neighbor_table_unpack( &neighbors, buffer, size ) )
+    {
+      printf( "Received packet is not a valid neighbor table (%d)\r\n",
+                                                                        size );
+      return 0;
+    }
+
+    if( parse_neighbors( &neighbors, NULL ) )
+    {
+      return 0;
+    }
+  }
+  else if( ( table_size * table_size != size ) || ( table_size < 2 ) ||
+           ( table_size > ( MAX_NETWORK_SIZE + 1 ) ) )
+  {
+    printf( "Received packet is not a valid RSSI table (%d)\r\n", size );
+    return 0;
+  }
+  else if( parse_table( buffer, table_size - 1 ) )
   {
-    printf( "Received packet smaller than RSSI table (%d)\r\n", size );
     return 0;
   }
 
-  memcpy( rssi_table, buffer, sizeof(rssi_table) );
-
-  parse_table( rssi_table );
+  // Start the round deadline
+  pthread_mutex_lock( &mutex_deadline );
+  round_arrival = arrival;
+  rounds_started++;
 
   // Let the routing algorithm run
-  pthread_mutex_unlock ( &mutex_route_start );
+  pthread_cond_broadcast( &round_changed );
+  pthread_mutex_unlock( &mutex_deadline );
 
   return 1;
 }
 
+/*******************************************************************************
+ * @fn     void *routing_round_thread( void *p_rp_tables )
+ * @brief  Run as thread. Computes routes and powers (see
+ *         routing_compute_round) whenever a round has started since the
+ *         last time. Rounds that start while it's busy are done together.
+ * ****************************************************************************/
+static void *routing_round_thread( void *p_rp_tables )
+{
+  uint32_t round_target;
+
+  for(;;)
+  {
+    // Block until next table is ready
+    pthread_mutex_lock( &mutex_deadline );
+    while( rounds_started == rounds_finished )
+    {
+      pthread_cond_wait( &round_changed, &mutex_deadline );
+    }
+    round_target = rounds_started;
+    pthread_mutex_unlock( &mutex_deadline );
+
+    routing_compute_round( p_rp_tables );
+
+    pthread_mutex_lock( &mutex_deadline );
+    memcpy( routed_tables, p_rp_tables, routing_get_device_count() * 2 );
+    routed_device_count = routing_get_device_count();
+    LATENCY_ROUND_ROUTED();
+    rounds_finished = round_target;
+    pthread_cond_broadcast( &round_changed );
+    pthread_mutex_unlock( &mutex_deadline );
+  }
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * @fn     void send_tables( uint8_t* p_tables, uint8_t device_count )
+ * @brief  Send routing and power tables to AP
+ * ****************************************************************************/
+void send_tables( uint8_t* p_tables, uint8_t device_count )
+{
+#ifdef RP_DELTA_UPDATES
+  uint16_t message_size;
+
+  // Send route/power changes to AP
+  message_size = rp_update_encode( &rp_encoder, p_tables, device_count,
+                                                                rp_message );
+  if( send_serial_message( rp_message, message_size ) )
+  {
+    // The AP never sees this delta, so the next one has to be a keyframe
+    rp_update_force_keyframe( &rp_encoder );
+  }
+
+  if( rp_update_decode( &rp_decoder, rp_message, message_size ) ||
+      memcmp( rp_decoder.rp_tables, p_tables, device_count * 2 ) )
+  {
+    printf( "Route/power update did not decode correctly!\n" );
+    rp_update_force_keyframe( &rp_encoder );
+  }
+#else
+  send_serial_message( p_tables, device_count * 2 );
+#endif
+}
+
+/*******************************************************************************
+ * @fn     void print_deadline_stats()
+ * @brief  Print missed deadlines and how late those rounds were
+ * ****************************************************************************/
+void print_deadline_stats()
+{
+  printf( "Round deadline %d ms: %d rounds, %d missed, %d fallbacks sent\n",
+            ROUND_DEADLINE_MS, rounds_finished, missed_deadlines,
+            fallbacks_sent );
+
+  if( overrun_histogram.count > 0 )
+  {
+    printf( "Late rounds %s: %d, overrun p50 %.1f ms, p99 %.1f ms, "
+            "max %.1f ms\n",
+            APPLY_LATE_ROUNDS ? "applied next round" : "discarded",
+            late_rounds,
+            latency_histogram_percentile( &overrun_histogram, 0.5 ) / 1e6,
+            latency_histogram_percentile( &overrun_histogram, 0.99 ) / 1e6,
+            overrun_histogram.max / 1e6 );
+  }
+}
+
+/*******************************************************************************
+ * @fn     void timespec_add_ms( struct timespec* p_time, uint32_t ms )
+ * @brief  Add ms milliseconds to p_time
+ * ****************************************************************************/
+static void timespec_add_ms( struct timespec* p_time, uint32_t ms )
+{
+  p_time->tv_sec += ms / 1000;
+  p_time->tv_nsec += ( ms % 1000 ) * 1000000l;
+
+  if( p_time->tv_nsec >= 1000000000l )
+  {
+    p_time->tv_sec++;
+    p_time->tv_nsec -= 1000000000l;
+  }
+}
+
+/*******************************************************************************
+ * @fn     int64_t timespec_diff_ns( struct timespec* p_end,
+ *                                                  struct timespec* p_start )
+ * @brief  Time from p_start to p_end in ns
+ * ****************************************************************************/
+static int64_t timespec_diff_ns( struct timespec* p_end,
+                                                struct timespec* p_start )
+{
+  return ( (int64_t)( p_end->tv_sec - p_start->tv_sec ) * 1000000000l ) +
+                                        ( p_end->tv_nsec - p_start->tv_nsec );
+}
+
 /*******************************************************************************
  * @fn     void *graph_thread()
  * @brief  Run as thread. Generates graph from routing table
@@ -191,6 +528,7 @@ uint8_t process_packet( uint8_t* buffer, uint32_t size )
 void *graph_thread()
 {
   uint8_t link_index;
+  uint8_t device_count;
   FILE* f_graph;
   char command[100];
   char filename[100];
@@ -205,7 +543,7 @@ void *graph_thread()
 
     printf("%s\n", filename);
 
-
+    device_count = routing_get_device_count();
 
     f_graph = fopen(filename, "w" );
 
@@ -220,33 +558,33 @@ void *graph_thread()
       fprintf( f_graph, "edge [len=3]\n");
       fprintf( f_graph, "nodesep=0.25\n");
       fprintf( f_graph, "node[shape = doublecircle]; %d;\n",
-                                                        ( MAX_DEVICES + 1 ) );
+                                                        ( device_count + 1 ) );
 
       fprintf( f_graph, "node[shape = circle];\n");
 
       // All connections
-      for( link_index = 0; link_index < MAX_DEVICES; link_index++ )
+      for( link_index = 0; link_index < device_count; link_index++ )
       {
         if ( routing_table[link_index] != 0 )
         {
           fprintf( f_graph, "%d -> %d", ( link_index + 1 ),
                                                     routing_table[link_index] );
           fprintf( f_graph, "[ label=\"");
-          fprintf( f_graph,  "%5.1f dBm",
-                      get_power_from_setting( power_table[link_index] ) );
+          fprintf( f_graph,  "%5.1f dBm", get_power_from_setting(
+                                  routing_table[device_count + link_index] ) );
           fprintf( f_graph, "\" ]");
           fprintf( f_graph,  ";\n" );
         }
       }
 
       // print_node_name to file
-      for( link_index = 0; link_index < MAX_DEVICES; link_index++ )
+      for( link_index = 0; link_index < device_count; link_index++ )
       {
           fprintf( f_graph, "%d [label=\"%d\"];\n", ( link_index + 1 ),
                                                           ( link_index + 1 ) );
       }
 
-      fprintf( f_graph, "%d [label=\"AP\"];\n", ( MAX_DEVICES + 1 ) );
+      fprintf( f_graph, "%d [label=\"AP\"];\n", ( device_count + 1 ) );
 
       fprintf( f_graph,  "}\n" );
 
@@ -274,12 +612,32 @@ void *graph_thread()
 void sigint_handler( int32_t sig )
 {
 
+    // Before the routing thread, which could be cancelled holding the tables
+    ctuner_stop( &tuner );
+
     pthread_cancel( serial_thread );
     pthread_cancel( routing_thread );
     pthread_cancel( graphing_thread );
 
     routing_finalize();
 
+    LATENCY_SUMMARY();
+
+    print_deadline_stats();
+
+    ctuner_print_stats( &tuner );
+
+#ifdef RP_DELTA_UPDATES
+    if( rp_encoder.messages > 0 )
+    {
+      printf( "Route/power updates: %g bytes per round (full tables: %g), "
+              "%d keyframes\n",
+              (double)rp_encoder.bytes / rp_encoder.messages,
+              (double)rp_encoder.full_bytes / rp_encoder.messages,
+              rp_encoder.keyframes );
+    }
+#endif
+
     // Close the serial port
     serial_close();
 
@@ -9,7 +9,15 @@
 
 #include <stdint.h>
 
-#define BUFFER_SIZE ( 512 )
+// Tables must be sent this long after the RSSI table arrives. If routing
+// isn't done by then, the last tables that were sent on time go out instead,
+// and again every ROUND_PERIOD_MS (AP poll period) until routing is done.
+#define ROUND_DEADLINE_MS ( 150 )
+#define ROUND_PERIOD_MS ( 200 )
+
+// 1 - Tables that finish late are sent if the next round is late too
+// 0 - Tables that finish late are discarded
+#define APPLY_LATE_ROUNDS ( 1 )
 
 // Function Prototypes
 uint8_t process_packet( uint8_t*, uint32_t );
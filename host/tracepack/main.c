@@ -0,0 +1,397 @@
+/** @file main.c
+*
+* @brief Convert the csv files of a recorded run to a binary trace, and print
+*        rounds of a trace
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "csvmap.h"
+#include "trace.h"
+#include "main.h"
+
+uint8_t pack_run( const char* directory, const char* filename );
+uint8_t pack_round( trace_round_t* p_round, uint8_t device_count );
+uint8_t print_round( const char* filename, uint32_t round );
+static uint8_t read_values( csv_file_t* p_csv, energy_t* p_values,
+                                          uint16_t skip, uint16_t count );
+static uint32_t count_lines( csv_file_t* p_csv );
+static void print_values( const char* name, const trace_column_t* p_column,
+                                    const energy_t* p_values, uint16_t count );
+
+// Files are in the order of this list
+enum { RSSI_CSV, DEBUG_CSV, POWERS_CSV, ROUTES_CSV, ENERGIES_CSV };
+
+static const char* csv_names[CSV_FILE_COUNT] = { "rssi.csv", "debug.csv",
+                                "powers.csv", "routes.csv", "energies.csv" };
+
+static csv_file_t csv_files[CSV_FILE_COUNT];
+
+static energy_t row[MAX_TABLE_SIZE];
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  char filename[256];
+  struct stat info;
+
+  if ( argc < 2 )
+  {
+    printf( "Usage: %s run_directory [trace file]\r\n"
+            "       %s trace file [round]\r\n", argv[0], argv[0] );
+    return 1;
+  }
+
+  if( stat( argv[1], &info ) )
+  {
+    printf( "Error opening %s.\r\n", argv[1] );
+    return 1;
+  }
+
+  if( !S_ISDIR( info.st_mode ) )
+  {
+    return print_round( argv[1], ( argc > 2 ) ? atoi( argv[2] ) : 0 );
+  }
+
+  // Default to the run's directory
+  if( argc > 2 )
+  {
+    snprintf( filename, sizeof(filename), "%s", argv[2] );
+  }
+  else
+  {
+    snprintf( filename, sizeof(filename), "%s/%s", argv[1],
+                                                        DEFAULT_TRACE_NAME );
+  }
+
+  return pack_run( argv[1], filename );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t pack_run( const char* directory, const char* filename )
+ *
+ * @brief Convert the csv files in directory to a trace. The network size
+ *        comes from the first RSSI table and the round count from the
+ *        shortest file, so the trace can be sized before it's written.
+ *        Returns 1 on error.
+ * ****************************************************************************/
+uint8_t pack_run( const char* directory, const char* filename )
+{
+  trace_file_t trace;
+  trace_round_t round_tables;
+  char path[512];
+  const char* p_line;
+  const char* p_end;
+  uint64_t csv_size = 0;
+  uint64_t trace_size;
+  uint32_t round_count = UINT32_MAX;
+  uint32_t rounds;
+  uint32_t round;
+  uint16_t row_size;
+  uint8_t file_index;
+  uint8_t rc = 0;
+
+  for( file_index = 0; file_index < CSV_FILE_COUNT; file_index++ )
+  {
+    snprintf( path, sizeof(path), "%s/%s", directory, csv_names[file_index] );
+    if( csv_open( &csv_files[file_index], path ) )
+    {
+      printf( "Error opening %s.\r\n", path );
+      return 1;
+    }
+
+    csv_size += csv_files[file_index].size;
+  }
+
+  // The first line of the first RSSI table has N+1 values
+  row_size = 0;
+  if( csv_next_line( &csv_files[RSSI_CSV], &p_line, &p_end ) )
+  {
+    row_size = csv_parse_line( p_line, p_end, row, 0, MAX_TABLE_SIZE );
+  }
+
+  if( row_size < 2 )
+  {
+    printf( "No RSSI table in %s/%s.\r\n", directory, csv_names[RSSI_CSV] );
+    return 1;
+  }
+
+  for( file_index = 0; file_index < CSV_FILE_COUNT; file_index++ )
+  {
+    rounds = count_lines( &csv_files[file_index] );
+
+    // RSSI tables and debug rounds are N+1 lines long
+    if( ( RSSI_CSV == file_index ) || ( DEBUG_CSV == file_index ) )
+    {
+      rounds /= row_size;
+    }
+
+    if( rounds < round_count )
+    {
+      round_count = rounds;
+    }
+  }
+
+  if( trace_create( &trace, filename, row_size - 1, round_count ) )
+  {
+    printf( "Error creating %s.\r\n", filename );
+    return 1;
+  }
+
+  for( round = 0; round < round_count; round++ )
+  {
+    trace_get_round( &trace, round, &round_tables );
+
+    if( pack_round( &round_tables, row_size - 1 ) )
+    {
+      printf( "Error in round %d.\r\n", round );
+      rc = 1;
+      break;
+    }
+  }
+
+  trace_size = trace.size;
+  trace_unmap( &trace );
+
+  for( file_index = 0; file_index < CSV_FILE_COUNT; file_index++ )
+  {
+    csv_close( &csv_files[file_index] );
+  }
+
+  if( rc )
+  {
+    // Don't leave a trace with rounds missing
+    unlink( filename );
+    return 1;
+  }
+
+  printf( "Packed %d rounds of %d nodes to %s, %g MB of csv files in %g MB "
+          "(%.1f times smaller)\n", round_count, row_size - 1, filename,
+          csv_size / 1e6, trace_size / 1e6,
+          trace_size ? (double)csv_size / trace_size : 0 );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t pack_round( trace_round_t* p_round, uint8_t device_count )
+ *
+ * @brief Read the next round from every csv file into p_round. Returns 1 if a
+ *        file ends early, a line is short, or a value doesn't fit its column.
+ * ****************************************************************************/
+uint8_t pack_round( trace_round_t* p_round, uint8_t device_count )
+{
+  uint16_t row_size = (uint16_t)device_count + 1;
+  uint16_t row_index;
+  uint16_t item_index;
+  long raw;
+
+  for( row_index = 0; row_index < row_size; row_index++ )
+  {
+    if( read_values( &csv_files[RSSI_CSV], row, 0, row_size ) )
+    {
+      return 1;
+    }
+
+    for( item_index = 0; item_index < row_size; item_index++ )
+    {
+      raw = lrint( row[item_index] * TRACE_RSSI_SCALE );
+
+      if( ( raw < INT16_MIN ) || ( raw > INT16_MAX ) ||
+          ( TRACE_RSSI_DBM( raw ) != row[item_index] ) )
+      {
+        printf( "RSSI %g is not in 0.5 dB steps.\r\n", row[item_index] );
+        return 1;
+      }
+
+      p_round->rssi_table[row_index * row_size + item_index] = raw;
+    }
+
+    // After the RSSI row is the power its transmitter used
+    if( read_values( &csv_files[DEBUG_CSV],
+                      &p_round->previous_powers[row_index], row_size, 1 ) )
+    {
+      return 1;
+    }
+  }
+
+  if( read_values( &csv_files[ROUTES_CSV], row, 0, row_size ) )
+  {
+    return 1;
+  }
+
+  for( item_index = 0; item_index < row_size; item_index++ )
+  {
+    if( ( row[item_index] < 0 ) || ( row[item_index] > UINT8_MAX ) ||
+        ( row[item_index] != (uint8_t)row[item_index] ) )
+    {
+      printf( "Invalid route %g.\r\n", row[item_index] );
+      return 1;
+    }
+
+    p_round->route_table[item_index] = (uint8_t)row[item_index];
+  }
+
+  // Doubles are stored as they are
+  if( read_values( &csv_files[POWERS_CSV], p_round->powers, 0, row_size ) ||
+      read_values( &csv_files[ENERGIES_CSV], p_round->energies, 0, row_size ) )
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t read_values( csv_file_t* p_csv, energy_t* p_values,
+ *                                          uint16_t skip, uint16_t count )
+ *
+ * @brief Parse count values of the next line that isn't empty, after
+ *        skipping the first skip of them. Returns 1 if there are no more
+ *        lines or the line is short.
+ * ****************************************************************************/
+static uint8_t read_values( csv_file_t* p_csv, energy_t* p_values,
+                                            uint16_t skip, uint16_t count )
+{
+  const char* p_line;
+  const char* p_end;
+
+  do
+  {
+    if( !csv_next_line( p_csv, &p_line, &p_end ) )
+    {
+      return 1;
+    }
+  } while( p_line == p_end );
+
+  if( csv_parse_line( p_line, p_end, p_values, skip, count ) != count )
+  {
+    printf( "Line %d has less than %d values.\r\n", p_csv->line,
+                                                              skip + count );
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint32_t count_lines( csv_file_t* p_csv )
+ *
+ * @brief Count the lines of a csv file that aren't empty, from its start.
+ *        Leaves it rewound.
+ * ****************************************************************************/
+static uint32_t count_lines( csv_file_t* p_csv )
+{
+  const char* p_line;
+  const char* p_end;
+  uint32_t lines = 0;
+
+  p_csv->offset = 0;
+  p_csv->line = 0;
+
+  while( csv_next_line( p_csv, &p_line, &p_end ) )
+  {
+    if( p_line != p_end )
+    {
+      lines++;
+    }
+  }
+
+  p_csv->offset = 0;
+  p_csv->line = 0;
+
+  return lines;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t print_round( const char* filename, uint32_t round )
+ *
+ * @brief Print a trace's header and one of its rounds. Returns 1 on error.
+ * ****************************************************************************/
+uint8_t print_round( const char* filename, uint32_t round )
+{
+  trace_file_t trace;
+  trace_round_t round_tables;
+  uint16_t row_size;
+  uint16_t row_index;
+  uint16_t item_index;
+
+  if( trace_map( &trace, filename ) )
+  {
+    printf( "Not a valid trace.\r\n" );
+    return 1;
+  }
+
+  row_size = trace.p_header->device_count + 1;
+
+  printf( "%d rounds of %d nodes, %d bytes per round\n",
+          trace.p_header->round_count, trace.p_header->device_count,
+          trace.p_columns[TRACE_RSSI].stride +
+          trace.p_columns[TRACE_PREVIOUS_POWERS].stride +
+          trace.p_columns[TRACE_ROUTES].stride +
+          trace.p_columns[TRACE_POWERS].stride +
+          trace.p_columns[TRACE_ENERGIES].stride );
+
+  // Rounds are found straight from the index, no need to read the others
+  if( trace_get_round( &trace, round, &round_tables ) )
+  {
+    printf( "No round %d.\r\n", round );
+    trace_unmap( &trace );
+    return 1;
+  }
+
+  printf( "Round %d\nrssi (%.8s):\n", round,
+                                          trace.p_columns[TRACE_RSSI].unit );
+  for( row_index = 0; row_index < row_size; row_index++ )
+  {
+    for( item_index = 0; item_index < row_size; item_index++ )
+    {
+      printf( "%g,", TRACE_RSSI_DBM(
+                round_tables.rssi_table[row_index * row_size + item_index] ) );
+    }
+    printf( "\n" );
+  }
+
+  print_values( "previous powers", &trace.p_columns[TRACE_PREVIOUS_POWERS],
+                                      round_tables.previous_powers, row_size );
+
+  printf( "routes:\n" );
+  for( item_index = 0; item_index < row_size; item_index++ )
+  {
+    printf( "%d,", round_tables.route_table[item_index] );
+  }
+  printf( "\n" );
+
+  print_values( "powers", &trace.p_columns[TRACE_POWERS],
+                                                round_tables.powers, row_size );
+  print_values( "energies", &trace.p_columns[TRACE_ENERGIES],
+                                              round_tables.energies, row_size );
+
+  trace_unmap( &trace );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void print_values( const char* name, const trace_column_t* p_column,
+ *                                  const energy_t* p_values, uint16_t count )
+ *
+ * @brief Print a line of values, after their name and unit
+ * ****************************************************************************/
+static void print_values( const char* name, const trace_column_t* p_column,
+                                    const energy_t* p_values, uint16_t count )
+{
+  uint16_t item_index;
+
+  printf( "%s (%.8s):\n", name, p_column->unit );
+  for( item_index = 0; item_index < count; item_index++ )
+  {
+    printf( "%g,", p_values[item_index] );
+  }
+  printf( "\n" );
+}
@@ -0,0 +1,21 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+
+// Largest table row ( N+1 )
+#define MAX_TABLE_SIZE ( 255 )
+
+// Csv files of a run, as written by ../logexport
+#define CSV_FILE_COUNT ( 5 )
+
+// Written next to the csv files if no trace file is given
+#define DEFAULT_TRACE_NAME "trace.bin"
+
+#endif /*_MAIN_H */
@@ -11,16 +11,270 @@
 #include <math.h>
 #include "dijkstra.h"
 
-static nodes_t s_nodes;
-static links_t s_links;
+// Route hysteresis state, indexed by node id
+typedef struct
+{
+  uint8_t parent;     // Parent used last round (0 if none)
+  uint8_t best;       // Parent selected by dijkstra() this round
+  uint8_t pending_parent; // Parent that has been better for pending rounds
+  uint16_t pending;   // Consecutive rounds pending_parent was better
+} route_state_t;
+
+#ifdef DEBUG_ON
+typedef struct
+{
+  uint8_t id;
+  char* label;
+} node_info_t;
+#endif
+
+//
+// Everything about one graph. Each thread works on the graph picked with
+// graph_select(), so several networks can be routed at the same time.
+//
+struct graph_s
+{
+  nodes_t nodes;
+  links_t links;
+
+  // Node id -> index in nodes ( + 1, 0 means the id is not in use )
+  uint8_t node_lookup[256];
+
+  // Link between two nodes, indexed by node index (both directions are
+  // stored unless the graph is directed)
+  // link_lookup[source_index * max_nodes + destination_index]
+  link_t** link_lookup;
+
+  // Links touching each node, in the order they were created. In a directed
+  // graph only the links arriving at the node are listed, since dijkstra()
+  // works outward from the AP and a node transmits towards it.
+  // adjacency[node_index * max_nodes + n]
+  link_t** adjacency;
+  uint8_t* adjacency_count;
+
+  // Links are directed (source transmits to destination), see
+  // graph_set_directed
+  uint8_t directed;
+
+  // Room for this many links (0 for every pair), see graph_set_link_limit
+  uint16_t link_limit;
+
+  energy_t mean_energy;
+
+  // Cost function parameters of the last dijkstra() run
+  energy_t current_minimum;
+  energy_t c_factor;
+
+  route_state_t route_state[256];
+  uint8_t route_state_valid;
+
+  // Path must be this much (fraction) cheaper to switch parent right away
+  energy_t hysteresis_margin;
 
-static energy_t s_mean_energy;
+  // Switch anyway after the new parent was better this many rounds in a row
+  uint16_t hysteresis_dwell;
 
-uint32_t current_round;
+  route_stats_t route_stats;
+
+  uint32_t current_round;
+
+#ifdef DEBUG_ON
+  node_info_t node_info[256];
+  uint8_t node_info_index;
+#endif
+};
+
+// Graph used by threads that never call graph_select()
+static graph_t s_default_graph;
+static __thread graph_t* s_graph = &s_default_graph;
+
+// Fields of the selected graph
+#define s_nodes ( s_graph->nodes )
+#define s_links ( s_graph->links )
+#define s_node_lookup ( s_graph->node_lookup )
+#define s_link_lookup ( s_graph->link_lookup )
+#define s_adjacency ( s_graph->adjacency )
+#define s_adjacency_count ( s_graph->adjacency_count )
+#define s_directed ( s_graph->directed )
+#define s_link_limit ( s_graph->link_limit )
+#define s_mean_energy ( s_graph->mean_energy )
+#define s_current_minimum ( s_graph->current_minimum )
+#define s_c_factor ( s_graph->c_factor )
+#define s_route_state ( s_graph->route_state )
+#define s_route_state_valid ( s_graph->route_state_valid )
+#define s_hysteresis_margin ( s_graph->hysteresis_margin )
+#define s_hysteresis_dwell ( s_graph->hysteresis_dwell )
+#define s_route_stats ( s_graph->route_stats )
+#define current_round ( s_graph->current_round )
+#ifdef DEBUG_ON
+#define node_info ( s_graph->node_info )
+#define node_info_index ( s_graph->node_info_index )
+#endif
 
 node_t* find_node( uint8_t );
 node_t* node_with_smallest_distance( );
 link_t* find_link( uint8_t, uint8_t );
+static energy_t link_cost( link_t*, node_t* );
+static energy_t capped_link_power( link_t* );
+static uint8_t break_route_loops();
+
+//
+// Allocate storage for a graph of up to max_nodes nodes. Any existing nodes
+// and links are removed. Only needs to be called again when the network size
+// changes, adding nodes and updating links afterwards does not allocate.
+//
+uint8_t graph_initialize( uint8_t max_nodes )
+{
+  graph_finalize();
+
+  s_nodes.nodes = calloc( max_nodes, sizeof(node_t) );
+  if( s_directed )
+  {
+    s_links.max_links = (uint16_t)max_nodes * max_nodes;
+  }
+  else
+  {
+    s_links.max_links = ( (uint16_t)max_nodes * ( max_nodes + 1 ) ) / 2;
+  }
+
+  if( ( s_link_limit > 0 ) && ( s_link_limit < s_links.max_links ) )
+  {
+    s_links.max_links = s_link_limit;
+  }
+  s_links.links = calloc( s_links.max_links, sizeof(link_t) );
+  s_link_lookup = calloc( (uint32_t)max_nodes * max_nodes, sizeof(link_t*) );
+  s_adjacency = calloc( (uint32_t)max_nodes * max_nodes, sizeof(link_t*) );
+  s_adjacency_count = calloc( max_nodes, sizeof(uint8_t) );
+
+  if( ( NULL == s_nodes.nodes ) || ( NULL == s_links.links ) ||
+      ( NULL == s_link_lookup ) || ( NULL == s_adjacency ) ||
+      ( NULL == s_adjacency_count ) )
+  {
+    graph_finalize();
+    return 1;
+  }
+
+  s_nodes.max_nodes = max_nodes;
+
+  return 0;
+}
+
+//
+// Free all graph storage
+//
+void graph_finalize()
+{
+  free( s_nodes.nodes );
+  free( s_links.links );
+  free( s_link_lookup );
+  free( s_adjacency );
+  free( s_adjacency_count );
+
+  memset( &s_nodes, 0, sizeof(s_nodes) );
+  memset( &s_links, 0, sizeof(s_links) );
+  memset( s_node_lookup, 0, sizeof(s_node_lookup) );
+  memset( s_route_state, 0, sizeof(s_route_state) );
+  s_route_state_valid = 0;
+  s_link_lookup = NULL;
+  s_adjacency = NULL;
+  s_adjacency_count = NULL;
+
+#ifdef DEBUG_ON
+  cleanup_node_labels();
+#endif
+}
+
+//
+// Allocate an empty graph, see graph_select()
+//
+graph_t* graph_create()
+{
+  return calloc( 1, sizeof(graph_t) );
+}
+
+//
+// Free a graph from graph_create() and everything in it
+//
+void graph_destroy( graph_t* p_graph )
+{
+  graph_t* p_selected = s_graph;
+
+  if( NULL == p_graph )
+  {
+    return;
+  }
+
+  s_graph = p_graph;
+  graph_finalize();
+
+  s_graph = ( p_selected == p_graph ) ? &s_default_graph : p_selected;
+  free( p_graph );
+}
+
+//
+// Make the calling thread work on p_graph from now on (NULL for the default
+// graph). A graph must only be used by one thread at a time.
+//
+void graph_select( graph_t* p_graph )
+{
+  s_graph = ( NULL != p_graph ) ? p_graph : &s_default_graph;
+}
+
+//
+// Select directed links. Each link then only goes from source to destination
+// and needs its own power, instead of one link (and power) for both
+// directions. Takes effect the next time graph_initialize() is called.
+//
+void graph_set_directed( uint8_t directed )
+{
+  s_directed = directed;
+}
+
+//
+// Returns 1 if links are directed
+//
+uint8_t graph_is_directed()
+{
+  return s_directed;
+}
+
+//
+// Only allocate room for max_links links (0 for every possible pair), i.e.
+// when each node only links to a few neighbors. Takes effect the next time
+// graph_initialize() is called.
+//
+void graph_set_link_limit( uint16_t max_links )
+{
+  s_link_limit = max_links;
+}
+
+//
+// Remove all links, keeping the nodes. Only touches the links in use, so
+// links can be rebuilt every round when only a few of them exist.
+//
+void graph_clear_links()
+{
+  uint16_t link_index;
+  uint8_t source_index;
+  uint8_t destination_index;
+
+  for( link_index = 0; link_index < s_links.current_links; link_index++ )
+  {
+    source_index = s_node_lookup[s_links.links[link_index].source] - 1;
+    destination_index =
+                    s_node_lookup[s_links.links[link_index].destination] - 1;
+
+    s_link_lookup[source_index * s_nodes.max_nodes + destination_index] = NULL;
+    s_link_lookup[destination_index * s_nodes.max_nodes + source_index] = NULL;
+  }
+
+  if( NULL != s_adjacency_count )
+  {
+    memset( s_adjacency_count, 0, s_nodes.max_nodes );
+  }
+
+  s_links.current_links = 0;
+}
 
 //
 // Add new node to nodes list
@@ -28,7 +282,14 @@ link_t* find_link( uint8_t, uint8_t );
 uint8_t add_node( uint8_t node_id, uint8_t is_relay )
 {
   node_t* new_node;
-  if( s_nodes.current_nodes < MAX_NODES )
+
+  // Use the default size if the graph was never initialized
+  if( ( NULL == s_nodes.nodes ) && graph_initialize( MAX_NODES ) )
+  {
+    return 1;
+  }
+
+  if( s_nodes.current_nodes < s_nodes.max_nodes )
   {
     new_node = &s_nodes.nodes[s_nodes.current_nodes];
     new_node->id = node_id;
@@ -37,6 +298,7 @@ uint8_t add_node( uint8_t node_id, uint8_t is_relay )
     new_node->is_relay = is_relay;
 
     s_nodes.current_nodes++;
+    s_node_lookup[node_id] = s_nodes.current_nodes;
 
     if( is_relay )
     {
@@ -59,42 +321,95 @@ uint8_t add_link( uint8_t source, uint8_t destination, energy_t link_power )
 {
   link_t* new_link;
 
-  //TODO check if source and destination actually exist!
+  // If the same link already exists, just update it
+  new_link = get_link( source, destination );
 
-  if( s_links.current_links < MAX_LINKS )
+  if( NULL == new_link )
   {
+    // Error, ran out of space in link list (or nodes don't exist)
+    return 1;
+  }
 
-    // If the same link already exists, just update it
-    new_link = find_link(source, destination);
+  // Disable link if the power required is too high
+  set_link_power( new_link, link_power,
+                                    ( link_power <= MAX_LINK_POWER * 100 ) );
 
-    if( new_link == NULL  )
-    {
-      // Add new link
-      new_link = &s_links.links[s_links.current_links];
-      s_links.current_links++;
-    }
+  return 0;
+}
+
+//
+// Return the link between source and destination, creating it if needed.
+// In a directed graph, the link from destination to source is a different one.
+// Links are kept for the life of the graph so callers can hold on to the
+// pointer and update the power every round without searching again.
+// Returns NULL if either node doesn't exist or the link list is full.
+//
+link_t* get_link( uint8_t source, uint8_t destination )
+{
+  link_t* new_link;
+  uint8_t source_index = s_node_lookup[source];
+  uint8_t destination_index = s_node_lookup[destination];
 
-    new_link->links_power = link_power;
-    new_link->source = source;
-    new_link->destination = destination;
+  if( ( 0 == source_index ) || ( 0 == destination_index ) )
+  {
+    return NULL;
+  }
 
-    // Disable link if the power required is too high
-    if( link_power > MAX_LINK_POWER * 100 )
-    {
-      new_link->active = 0;
-    }
-    else
-    {
-      new_link->active = 1;
-    }
+  source_index--;
+  destination_index--;
 
-    return 0;
+  new_link = s_link_lookup[source_index * s_nodes.max_nodes + destination_index];
+
+  if( NULL != new_link )
+  {
+    return new_link;
   }
-  else
+
+  if( s_links.current_links >= s_links.max_links )
   {
-    // Error, ran out of space in link list
-    return 1;
+    return NULL;
+  }
+
+  // Add new link
+  new_link = &s_links.links[s_links.current_links];
+  s_links.current_links++;
+
+  new_link->links_power = MAX_DISTANCE;
+  new_link->source = source;
+  new_link->destination = destination;
+  new_link->active = 0;
+
+  s_link_lookup[source_index * s_nodes.max_nodes + destination_index] =
+                                                                      new_link;
+
+  if( s_directed )
+  {
+    s_adjacency[destination_index * s_nodes.max_nodes +
+                            s_adjacency_count[destination_index]++] = new_link;
+    return new_link;
+  }
+
+  s_link_lookup[destination_index * s_nodes.max_nodes + source_index] =
+                                                                      new_link;
+
+  s_adjacency[source_index * s_nodes.max_nodes +
+                            s_adjacency_count[source_index]++] = new_link;
+  if( source_index != destination_index )
+  {
+    s_adjacency[destination_index * s_nodes.max_nodes +
+                            s_adjacency_count[destination_index]++] = new_link;
   }
+
+  return new_link;
+}
+
+//
+// Update link power and state
+//
+void set_link_power( link_t* link, energy_t link_power, uint8_t active )
+{
+  link->links_power = link_power;
+  link->active = active;
 }
 
 //
@@ -117,6 +432,45 @@ energy_t initialize_node_energy( uint8_t source_id )
   return s_mean_energy;
 }
 
+//
+// Get accumulated energy of node_id (0 if the node doesn't exist)
+//
+energy_t get_node_energy( uint8_t node_id )
+{
+  node_t* p_node = find_node( node_id );
+
+  if( NULL == p_node )
+  {
+    return 0;
+  }
+
+  return p_node->energy;
+}
+
+//
+// Returns 1 if node_id has a path to the source after the last dijkstra()
+// (and route hysteresis), 0 if it's left to broadcast (see compute_rp_tables)
+//
+uint8_t node_has_path( uint8_t node_id )
+{
+  node_t* p_node = find_node( node_id );
+
+  return ( NULL != p_node ) && ( p_node->p_previous != p_node );
+}
+
+//
+// Set accumulated energy of node_id (e.g. to keep it when the graph is rebuilt)
+//
+void set_node_energy( uint8_t node_id, energy_t energy )
+{
+  node_t* p_node = find_node( node_id );
+
+  if( NULL != p_node )
+  {
+    p_node->energy = energy;
+  }
+}
+
 //
 // Find node using the last amount of energy
 //
@@ -153,23 +507,28 @@ energy_t find_min_energy( uint8_t source_id )
   return s_mean_energy;
 }
 
+//
+// Minimum energy found at the start of the last dijkstra() run
+//
+energy_t get_mean_energy()
+{
+  return s_mean_energy;
+}
+
 //
 // Returns pointer to node with matching node_id
 // If node is not found, returns NULL pointer
 //
 node_t* find_node( uint8_t node_id )
 {
-  uint8_t node_index;
+  uint8_t node_index = s_node_lookup[node_id];
 
-  for( node_index = 0; node_index < s_nodes.current_nodes; node_index++ )
+  if( 0 == node_index )
   {
-    if( s_nodes.nodes[node_index].id == node_id )
-    {
-      return &s_nodes.nodes[node_index];
-    }
+    return NULL;
   }
 
-  return NULL;
+  return &s_nodes.nodes[node_index - 1];
 }
 
 //
@@ -178,23 +537,18 @@ node_t* find_node( uint8_t node_id )
 //
 link_t* find_link( uint8_t source_id, uint8_t destination_id )
 {
-  uint8_t link_index;
+  uint8_t source_index = s_node_lookup[source_id];
+  uint8_t destination_index = s_node_lookup[destination_id];
 
-  for( link_index = 0; link_index < s_links.current_links; link_index++ )
+  if( ( 0 == source_index ) || ( 0 == destination_index ) )
   {
-    if( ( s_links.links[link_index].source == source_id &&
-        s_links.links[link_index].destination == destination_id )
-        || ( s_links.links[link_index].destination == source_id &&
-        s_links.links[link_index].source == destination_id ) )
-    {
-      return &s_links.links[link_index];
-    }
+    // If this happens, expect a segfault
+    //printf("NULL LINK!\n");
+    return NULL;
   }
 
-  // If this happens, expect a segfault
-  //printf("NULL LINK!\n");
-
-  return NULL;
+  return s_link_lookup[( source_index - 1 ) * s_nodes.max_nodes +
+                                                      ( destination_index - 1 )];
 }
 
 //
@@ -234,13 +588,42 @@ node_t* node_with_smallest_distance( )
 
 }
 
+//
+// Cost calculation formula
+// cost = link_power * ( 1 + ( node_energy / min_node_energy )^C ) / 2
+// NOTE: Uses the minimum energy and C of the last dijkstra() run
+//
+static energy_t link_cost( link_t* p_link, node_t* p_destination )
+{
+  energy_t cost;
+
+  cost = 1 + pow( ( p_destination->energy / s_current_minimum ), s_c_factor );
+
+  // Normalize
+  cost /= ( 2 );
+
+  cost *= p_link->links_power;
+
+  // A large C overflows the power (inf, or NaN from 0/0 energies), which
+  // would leave the node unreachable instead of just expensive
+  if( !( cost < MAX_LINK_COST ) )
+  {
+    cost = MAX_LINK_COST;
+  }
+
+  return cost;
+}
+
 //
 // Run Dijkstra's algorithm
+// In a directed graph, paths are built from the links going towards the
+// source (each node's previous node is the one it transmits to)
 //
 uint8_t dijkstra( uint8_t source_id, energy_t c_factor )
 {
   uint8_t node_index;
-  uint8_t link_index;
+  uint16_t link_index;
+  uint8_t source_index;
 
   node_t* p_source_node;
   node_t* p_destination_node;
@@ -255,6 +638,10 @@ uint8_t dijkstra( uint8_t source_id, energy_t c_factor )
   // Update round count
   current_round += 1;
 
+  // Keep cost function parameters for link_cost()
+  s_current_minimum = current_minimum;
+  s_c_factor = c_factor;
+
 #ifdef DEBUG_D_ON
   //printf("Initialize s_nodes.\n"); // DEBUG
 #endif
@@ -324,15 +711,21 @@ uint8_t dijkstra( uint8_t source_id, energy_t c_factor )
     //
     // Check for all links leaving this node
     //
-    for( link_index = 0; link_index < s_links.current_links; link_index++ )
+    source_index = p_source_node - s_nodes.nodes;
+
+    for( link_index = 0; link_index < s_adjacency_count[source_index];
+                                                                  link_index++ )
     {
       p_destination_node = NULL;
-      p_current_link = &s_links.links[link_index];
+      p_current_link =
+                  s_adjacency[source_index * s_nodes.max_nodes + link_index];
 
       // Make sure link is active before using
       if ( p_current_link->active )
       {
         // If this link has the source node, use other node as destination
+        // (directed graphs only list links arriving at the node, so it's
+        // always the first case)
         if( p_current_link->destination == p_source_node->id )
         {
           p_destination_node = find_node( p_current_link->source );
@@ -357,19 +750,8 @@ uint8_t dijkstra( uint8_t source_id, energy_t c_factor )
         // Make sure we don't go backwards
         if( ! p_destination_node->visited )
         {
-          //
-          // Cost calculation formula
-          // cost = link_power * ( 1 + ( node_energy / min_node_energy )^C )
-          //
-      
           // Calculate the current cost of the link
-          current_cost = 1 + 
-            pow( ( p_destination_node->energy / current_minimum ), c_factor ) ;
-          
-          // Normalize
-          current_cost /= ( 2 );          
-          
-          current_cost *= p_current_link->links_power;
+          current_cost = link_cost( p_current_link, p_destination_node );
 
 #ifdef DEBUG_D_ON
         printf(" Link power,link_cost=%g,%g\n",p_current_link->links_power, current_cost); // DEBUG
@@ -429,8 +811,9 @@ void compute_shortest_path( uint8_t node_id )
   {
     while( p_node->p_previous != p_node )
     {
+      // Node transmits to the previous one
       tmp_link_power =
-          find_link( p_node->p_previous->id, p_node->id )->links_power;
+          find_link( p_node->id, p_node->p_previous->id )->links_power;
 
       // If the computed link power is greater than the maximum, set it to the
       // maximum. Since the devices can't transmit at a higher power, no extra
@@ -471,26 +854,243 @@ void compute_rp_tables( uint8_t* route_table, energy_t* link_powers )
     {
       route_table[node_id-1] = p_node->p_previous->id;
       link_powers[node_id-1] =
-              find_link( p_node->p_previous->id, p_node->id )->links_power;
+              find_link( p_node->id, p_node->p_previous->id )->links_power;
     }
   }
 
   return;
 }
 
-#ifdef DEBUG_ON
 //
-// Debugging functions
+// Configure route hysteresis. A node only moves to the parent dijkstra()
+// selected if that path is cheaper than the path through its current parent
+// by more than margin (fraction), or if the new parent was the better one for
+// dwell_rounds rounds in a row. Either one can be 0 to only use the other.
+// Both set to 0 disables the hysteresis.
 //
+void set_route_hysteresis( energy_t margin, uint16_t dwell_rounds )
+{
+  s_hysteresis_margin = margin;
+  s_hysteresis_dwell = dwell_rounds;
+}
 
-struct node_info_s
+//
+// Returns the power of a link, limited to what a device can transmit
+//
+static energy_t capped_link_power( link_t* p_link )
 {
-  uint8_t id;
-  char* label;
-};
+  if ( p_link->links_power > MAX_LINK_POWER )
+  {
+    return MAX_LINK_POWER;
+  }
+
+  return p_link->links_power;
+}
+
+//
+// Keep last round's parent where the new one isn't enough of an improvement
+// (see set_route_hysteresis) and update route change statistics.
+// Returns the number of nodes that kept their parent.
+// NOTE: MUST be run AFTER dijkstra() and BEFORE compute_shortest_path()
+//
+uint8_t apply_route_hysteresis( uint8_t source_id )
+{
+  uint8_t node_index;
+  uint8_t kept_count = 0;
+  uint8_t parent_id;
+  node_t* p_node;
+  node_t* p_parent;
+  link_t* p_link;
+  route_state_t* p_state;
+  energy_t keep_distance;
+
+  s_route_stats.rounds++;
+
+  for( node_index = 0; node_index < s_nodes.current_nodes; node_index++ )
+  {
+    p_node = &s_nodes.nodes[node_index];
+    p_state = &s_route_state[p_node->id];
+
+    if( p_node->id == source_id )
+    {
+      continue;
+    }
+
+    if( p_node->p_previous == p_node )
+    {
+      p_state->best = 0;
+    }
+    else
+    {
+      p_state->best = p_node->p_previous->id;
+    }
+
+    // Nothing to hold back (first round, no route before/now or same parent)
+    if( ( !s_route_state_valid ) || ( 0 == p_state->parent ) ||
+        ( 0 == p_state->best ) || ( p_state->parent == p_state->best ) ||
+        ( ( 0 == s_hysteresis_margin ) && ( 0 == s_hysteresis_dwell ) ) )
+    {
+      p_state->pending = 0;
+      continue;
+    }
+
+    p_parent = find_node( p_state->parent );
+    p_link = find_link( p_node->id, p_state->parent );
+
+    // Current parent isn't usable anymore, switch right away
+    if( ( NULL == p_parent ) || ( NULL == p_link ) || ( !p_link->active ) ||
+        ( MAX_DISTANCE == p_parent->distance ) )
+    {
+      p_state->pending = 0;
+      continue;
+    }
+
+    keep_distance = p_parent->distance + link_cost( p_link, p_node );
+
+    // New path is enough of an improvement
+    if( ( s_hysteresis_margin > 0 ) &&
+        ( keep_distance > ( p_node->distance * ( 1 + s_hysteresis_margin ) ) ) )
+    {
+      p_state->pending = 0;
+      continue;
+    }
+
+    // New parent has been better for long enough (the same one every round,
+    // a different candidate starts counting again)
+    if( p_state->best != p_state->pending_parent )
+    {
+      p_state->pending_parent = p_state->best;
+      p_state->pending = 0;
+    }
+
+    p_state->pending++;
+    if( ( s_hysteresis_dwell > 0 ) &&
+        ( p_state->pending >= s_hysteresis_dwell ) )
+    {
+      p_state->pending = 0;
+      continue;
+    }
+
+    // Keep current parent
+    p_node->p_previous = p_parent;
+    kept_count++;
+  }
+
+  if( kept_count > 0 )
+  {
+    kept_count -= break_route_loops();
+  }
+
+  // Update statistics and remember parents for next round
+  for( node_index = 0; node_index < s_nodes.current_nodes; node_index++ )
+  {
+    p_node = &s_nodes.nodes[node_index];
+    p_state = &s_route_state[p_node->id];
+
+    if( p_node->id == source_id )
+    {
+      continue;
+    }
+
+    parent_id = ( p_node->p_previous == p_node ) ? 0 : p_node->p_previous->id;
+
+    if( parent_id != p_state->best )
+    {
+      s_route_stats.suppressed++;
+      s_route_stats.extra_power +=
+                capped_link_power( find_link( p_node->id, parent_id ) ) -
+                capped_link_power( find_link( p_node->id, p_state->best ) );
+    }
+    else
+    {
+      p_state->pending = 0;
+    }
+
+    if( s_route_state_valid && ( parent_id != p_state->parent ) )
+    {
+      s_route_stats.changes++;
+    }
+
+    p_state->parent = parent_id;
+  }
+
+  s_route_state_valid = 1;
+
+  return kept_count;
+}
+
+//
+// Mixing kept parents with new ones can create loops (A keeps B while B
+// moves to A). Put every node in a loop that kept its parent back on the
+// parent dijkstra() selected. Since those always form a tree, this ends.
+// Returns the number of nodes that were moved back.
+//
+static uint8_t break_route_loops()
+{
+  uint8_t node_index;
+  uint8_t hops;
+  uint8_t reverted = 0;
+  uint8_t loop_found;
+  node_t* p_node;
+  node_t* p_next;
+  node_t* p_loop_start;
+  route_state_t* p_state;
+
+  do
+  {
+    loop_found = 0;
+
+    for( node_index = 0; node_index < s_nodes.current_nodes; node_index++ )
+    {
+      // Follow path, a loop-free one ends within current_nodes hops
+      p_node = &s_nodes.nodes[node_index];
+      for( hops = 0; ( hops < s_nodes.current_nodes ) &&
+                              ( p_node->p_previous != p_node ); hops++ )
+      {
+        p_node = p_node->p_previous;
+      }
+
+      if( p_node->p_previous == p_node )
+      {
+        continue;
+      }
+
+      // p_node is now on the loop, go around it once
+      loop_found = 1;
+      p_loop_start = p_node;
+      do
+      {
+        p_next = p_node->p_previous;
+        p_state = &s_route_state[p_node->id];
+
+        if( p_node->p_previous->id != p_state->best )
+        {
+          p_node->p_previous = find_node( p_state->best );
+          p_state->pending = 0;
+          s_route_stats.loops++;
+          reverted++;
+        }
+
+        p_node = p_next;
+      } while( p_node != p_loop_start );
+    }
+  } while( loop_found );
+
+  return reverted;
+}
+
+//
+// Get route change statistics
+//
+void get_route_stats( route_stats_t* p_stats )
+{
+  *p_stats = s_route_stats;
+}
 
-static struct node_info_s node_info[MAX_NODES];
-static uint8_t node_info_index = 0;
+#ifdef DEBUG_ON
+//
+// Debugging functions
+//
 
 //
 // Display shortest path from dijkstra's source to destination with node_id
@@ -594,7 +1194,7 @@ void print_link( link_t* link )
 
 void print_all_links()
 {
-  uint8_t link_index;
+  uint16_t link_index;
 
   printf("LINKS:\n");
 
@@ -665,7 +1265,7 @@ void print_all_nodes( uint8_t source_id )
 void generate_graph( uint8_t source_id, uint32_t file_number )
 {
   uint8_t node_index;
-  uint8_t link_index;
+  uint16_t link_index;
   FILE* f_graph;
   char command[100];
 
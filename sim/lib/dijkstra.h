@@ -7,9 +7,13 @@
 #ifndef _NODES_H
 #define _NODES_H
 
+// Default graph size if graph_initialize() is not called
 #define MAX_NODES (10)
-#define MAX_LINKS (100)
-#define MAX_DISTANCE (1e99)
+// Far above any link cost, (E/Emin)^C gets past 1e99 with C = 100
+#define MAX_DISTANCE (1e300)
+// Most a link can cost, so a path of 255 links still adds up to less
+// than MAX_DISTANCE
+#define MAX_LINK_COST (1e297)
 #define MAX_LINK_POWER (0.001413)
 
 // Use type definition since actual datatype might change
@@ -18,6 +22,7 @@ typedef double energy_t ;
 
 typedef struct node_s node_t;
 typedef struct link_s link_t;
+typedef struct graph_s graph_t;
 
 
 //
@@ -45,22 +50,53 @@ typedef struct
 {
   uint8_t current_nodes;
   uint8_t current_relays;
-  node_t nodes[MAX_NODES];
+  uint8_t max_nodes;
+  node_t* nodes;
 } nodes_t;
 
 typedef struct
 {
-  uint8_t current_links;
-  link_t links[MAX_LINKS];
+  uint16_t current_links;
+  uint16_t max_links;
+  link_t* links;
 } links_t;
 
+// Route change statistics (see apply_route_hysteresis)
+typedef struct
+{
+  uint32_t rounds;        // Rounds processed
+  uint32_t changes;       // Parent changes sent out
+  uint32_t suppressed;    // Parent changes held back by the hysteresis
+  uint32_t loops;         // Held back changes undone because of a loop
+  energy_t extra_power;   // Link power (W) of kept parents minus dijkstra's
+                          // (can be negative, routes are picked by cost)
+} route_stats_t;
+
+uint8_t graph_initialize( uint8_t );
+void graph_finalize();
+graph_t* graph_create();
+void graph_destroy( graph_t* );
+void graph_select( graph_t* );
+void graph_set_directed( uint8_t );
+uint8_t graph_is_directed();
+void graph_set_link_limit( uint16_t );
+void graph_clear_links();
 uint8_t add_node( uint8_t, uint8_t );
 uint8_t add_link( uint8_t, uint8_t, energy_t );
+link_t* get_link( uint8_t, uint8_t );
+void set_link_power( link_t*, energy_t, uint8_t );
 energy_t initialize_node_energy( uint8_t source_id );
+energy_t get_node_energy( uint8_t node_id );
+uint8_t node_has_path( uint8_t node_id );
+void set_node_energy( uint8_t node_id, energy_t energy );
 energy_t find_min_energy( uint8_t source_id );
+energy_t get_mean_energy();
 uint8_t dijkstra( uint8_t, energy_t );
 void compute_shortest_path( uint8_t node_id );
 void compute_rp_tables( uint8_t*, energy_t* );
+void set_route_hysteresis( energy_t, uint16_t );
+uint8_t apply_route_hysteresis( uint8_t );
+void get_route_stats( route_stats_t* );
 
 #ifdef DEBUG_ON
 void print_shortest_path( uint8_t );
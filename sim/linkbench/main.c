@@ -0,0 +1,612 @@
+/** @file main.c
+*
+* @brief Compare the symmetric link model (best of both directions) against
+*        directed links. Runs the same tables through both and reports the
+*        time per round and how often a node is told to transmit with less
+*        power than the direction it actually uses needs (those packets are
+*        lost and retransmitted, so their energy is wasted).
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "dijkstra.h"
+#include "main.h"
+
+#define INBUFSIZE (4096)
+
+#define TABLE( p_table, row, col ) ( p_table[(row) * table_size + (col)] )
+
+uint16_t read_energy_line( char*, energy_t*, uint16_t );
+uint8_t read_power_line ( FILE* , energy_t*, uint8_t );
+uint16_t read_table( FILE* , energy_t* );
+static uint8_t load_trace( FILE*, FILE* );
+static uint8_t generate_random_tables( uint8_t, uint32_t );
+static void run_benchmark( uint8_t, energy_t, uint32_t, bench_result_t* );
+static void build_links( const energy_t*, uint8_t );
+static void check_powers( const energy_t*, const uint8_t*, const energy_t*,
+                                                          bench_result_t* );
+static void print_result( const char*, const bench_result_t* );
+static double dbm_to_watt( double power );
+static double watt_to_dbm( double power );
+
+// Required power (dBm) of every link, for every round. Rows are receivers
+// and columns transmitters, index 0 is the AP.
+static energy_t* link_power_tables;
+static uint32_t round_count;
+static uint16_t table_size;
+
+#define DEVICE_COUNT ( table_size - 1 )
+#define AP_NODE_ID ( table_size )
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  FILE *fp_rssi;
+  FILE *fp_powers;
+  uint32_t repeat = 1;
+  uint8_t arg_offset = 0;
+  energy_t c_factor;
+  bench_result_t symmetric;
+  bench_result_t directed;
+
+  if( ( argc > 4 ) && ( 0 == strcmp( argv[1], "-r" ) ) )
+  {
+    // Random tables (arguments are one further along)
+    arg_offset = 1;
+
+    if( generate_random_tables( atoi( argv[2] ), atoi( argv[3] ) ) )
+    {
+      return 1;
+    }
+  }
+  else if( argc > 3 )
+  {
+    fp_rssi = fopen( argv[1], "r" );
+
+    if( NULL == fp_rssi )
+    {
+      printf( "Error opening rssi input file.\r\n" );
+      return 1;
+    }
+
+    fp_powers = fopen( argv[2], "r" );
+
+    if( NULL == fp_powers )
+    {
+      printf( "Error opening tx powers input file.\r\n" );
+      return 1;
+    }
+
+    if( load_trace( fp_rssi, fp_powers ) )
+    {
+      return 1;
+    }
+
+    fclose( fp_powers );
+    fclose( fp_rssi );
+  }
+  else
+  {
+    printf( "Usage: %s rssi.csv powers.csv C(0.0-1.0) [repeat]\r\n"
+            "       %s -r devices rounds C(0.0-1.0) [repeat]\r\n",
+                                                          argv[0], argv[0] );
+    return 1;
+  }
+
+  c_factor = (energy_t)strtod( argv[3 + arg_offset], NULL );
+
+  if( argc > ( 4 + arg_offset ) )
+  {
+    repeat = atoi( argv[4 + arg_offset] );
+  }
+
+  if( repeat < 1 )
+  {
+    repeat = 1;
+  }
+
+  printf( "%d rounds, %d devices, C=%g, %d repetitions\n", round_count,
+                                        DEVICE_COUNT, c_factor, repeat );
+
+  run_benchmark( 0, c_factor, repeat, &symmetric );
+  run_benchmark( 1, c_factor, repeat, &directed );
+
+  printf( "%-10s %10s %8s %14s %14s %12s %12s\n", "links", "us/round",
+          "routed", "under-powered", "shortfall(dB)", "tx (mW)", "wasted (mW)" );
+  print_result( "symmetric", &symmetric );
+  print_result( "directed", &directed );
+
+  free( link_power_tables );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void run_benchmark( uint8_t directed, energy_t c_factor,
+ *                            uint32_t repeat, bench_result_t* p_result )
+ *
+ * @brief Route every round with the selected link model. The whole trace is
+ *        run repeat times (from a fresh graph) for timing, powers are only
+ *        checked on the first run.
+ * ****************************************************************************/
+static void run_benchmark( uint8_t directed, energy_t c_factor,
+                                    uint32_t repeat, bench_result_t* p_result )
+{
+  uint32_t repeat_index;
+  uint32_t round_index;
+  uint8_t node_index;
+  uint8_t route_table[MAX_TABLE_SIZE];
+  energy_t link_powers[MAX_TABLE_SIZE];
+  const energy_t* p_table;
+  struct timespec start;
+  struct timespec end;
+  double elapsed_ns = 0;
+
+  memset( p_result, 0, sizeof(bench_result_t) );
+
+  for( repeat_index = 0; repeat_index < repeat; repeat_index++ )
+  {
+    graph_set_directed( directed );
+
+    if( graph_initialize( table_size ) )
+    {
+      printf( "Error allocating graph.\r\n" );
+      exit( 1 );
+    }
+
+    add_node( AP_NODE_ID, 0 );
+    for( node_index = 1; node_index <= DEVICE_COUNT; node_index++ )
+    {
+      add_node( node_index, 0 );
+    }
+
+    initialize_node_energy( AP_NODE_ID );
+
+    for( round_index = 0; round_index < round_count; round_index++ )
+    {
+      p_table = &link_power_tables[round_index * table_size * table_size];
+
+      clock_gettime( CLOCK_MONOTONIC, &start );
+
+      build_links( p_table, directed );
+
+      dijkstra( AP_NODE_ID, c_factor );
+
+      for( node_index = 1; node_index <= DEVICE_COUNT; node_index++ )
+      {
+        compute_shortest_path( node_index );
+      }
+
+      compute_rp_tables( route_table, link_powers );
+
+      clock_gettime( CLOCK_MONOTONIC, &end );
+
+      elapsed_ns += ( end.tv_sec - start.tv_sec ) * 1e9 +
+                                              ( end.tv_nsec - start.tv_nsec );
+
+      if( 0 == repeat_index )
+      {
+        check_powers( p_table, route_table, link_powers, p_result );
+      }
+    }
+
+    graph_finalize();
+  }
+
+  p_result->us_per_round = elapsed_ns / 1000.0 / repeat / round_count;
+}
+
+/*******************************************************************************
+ * @fn    void build_links( const energy_t* p_table, uint8_t directed )
+ *
+ * @brief Update links from a required power table. The symmetric model uses
+ *        the best of both directions for each pair (like the host routing
+ *        does by default), the directed one keeps each direction.
+ * ****************************************************************************/
+static void build_links( const energy_t* p_table, uint8_t directed )
+{
+  uint16_t row_index;
+  uint16_t col_index;
+  energy_t link_power;
+
+  for( row_index = 0; row_index < table_size; row_index++ )
+  {
+    for( col_index = 0; col_index < table_size; col_index++ )
+    {
+      if( col_index == row_index )
+      {
+        continue;
+      }
+
+      if( directed )
+      {
+        // Column transmits to row
+        add_link( ( col_index == 0 ) ? AP_NODE_ID : col_index,
+                  ( row_index == 0 ) ? AP_NODE_ID : row_index,
+                  dbm_to_watt( TABLE( p_table, row_index, col_index ) ) );
+      }
+      else if( col_index > row_index )
+      {
+        link_power = TABLE( p_table, row_index, col_index );
+        if( link_power > TABLE( p_table, col_index, row_index ) )
+        {
+          link_power = TABLE( p_table, col_index, row_index );
+        }
+
+        add_link( ( row_index == 0 ) ? AP_NODE_ID : row_index, col_index,
+                                                  dbm_to_watt( link_power ) );
+      }
+    }
+  }
+}
+
+/*******************************************************************************
+ * @fn    void check_powers( const energy_t* p_table,
+ *                           const uint8_t* p_route_table,
+ *                           const energy_t* p_link_powers,
+ *                           bench_result_t* p_result )
+ *
+ * @brief Compare the power each node was given with what the direction it
+ *        transmits in (node to parent) needs
+ * ****************************************************************************/
+static void check_powers( const energy_t* p_table, const uint8_t* p_route_table,
+                  const energy_t* p_link_powers, bench_result_t* p_result )
+{
+  uint8_t node_index;
+  uint8_t parent_index;
+  energy_t required;
+  energy_t assigned;
+
+  for( node_index = 1; node_index <= DEVICE_COUNT; node_index++ )
+  {
+    // Not connected
+    if( 0 == p_route_table[node_index - 1] )
+    {
+      continue;
+    }
+
+    parent_index = ( AP_NODE_ID == p_route_table[node_index - 1] ) ? 0 :
+                                                p_route_table[node_index - 1];
+
+    required = TABLE( p_table, parent_index, node_index );
+    assigned = watt_to_dbm( p_link_powers[node_index - 1] );
+
+    if( assigned > MAX_TX_POWER )
+    {
+      assigned = MAX_TX_POWER;
+    }
+
+    p_result->links++;
+    p_result->tx_power += dbm_to_watt( assigned );
+
+    if( ( required - assigned ) > SHORTFALL_TOLERANCE )
+    {
+      p_result->under_powered++;
+      p_result->shortfall += required - assigned;
+      p_result->wasted_power += dbm_to_watt( assigned );
+    }
+  }
+}
+
+/*******************************************************************************
+ * @fn    void print_result( const char* name, const bench_result_t* p_result )
+ *
+ * @brief Print one line of results (powers are per round)
+ * ****************************************************************************/
+static void print_result( const char* name, const bench_result_t* p_result )
+{
+  printf( "%-10s %10.2f %8d %7d (%4.1f%%) %14.2f %12.3f %12.3f\n", name,
+    p_result->us_per_round, p_result->links, p_result->under_powered,
+    ( p_result->links > 0 ) ?
+        100.0 * p_result->under_powered / p_result->links : 0.0,
+    ( p_result->under_powered > 0 ) ?
+        p_result->shortfall / p_result->under_powered : 0.0,
+    1000.0 * p_result->tx_power / round_count,
+    1000.0 * p_result->wasted_power / round_count );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t load_trace( FILE* fp_rssi, FILE* fp_powers )
+ *
+ * @brief Read all RSSI tables and convert them to required power with the
+ *        transmit powers used at the time (previous line of powers.csv, the
+ *        first round uses maximum power). All tables must be the same size.
+ * ****************************************************************************/
+static uint8_t load_trace( FILE* fp_rssi, FILE* fp_powers )
+{
+  energy_t* rssi_table;
+  energy_t tx_powers[MAX_TABLE_SIZE];
+  energy_t* p_table;
+  uint16_t new_table_size;
+  uint16_t row_index;
+  uint16_t col_index;
+
+  rssi_table = malloc( MAX_TABLE_SIZE * MAX_TABLE_SIZE * sizeof(energy_t) );
+
+  if( NULL == rssi_table )
+  {
+    printf( "Error allocating rssi table.\r\n" );
+    return 1;
+  }
+
+  for( col_index = 0; col_index < MAX_TABLE_SIZE; col_index++ )
+  {
+    tx_powers[col_index] = MAX_TX_POWER;
+  }
+
+  while( ( round_count < MAX_ROUNDS ) &&
+         ( new_table_size = read_table( fp_rssi, rssi_table ) ) )
+  {
+    if( 0 == round_count )
+    {
+      table_size = new_table_size;
+      link_power_tables = malloc( MAX_ROUNDS * table_size * table_size *
+                                                          sizeof(energy_t) );
+      if( NULL == link_power_tables )
+      {
+        printf( "Error allocating tables.\r\n" );
+        free( rssi_table );
+        return 1;
+      }
+    }
+    else if( new_table_size != table_size )
+    {
+      printf( "Network size changed after %d rounds, stopping there.\r\n",
+                                                                round_count );
+      break;
+    }
+
+    p_table = &link_power_tables[round_count * table_size * table_size];
+
+    // link_power = target_rssi - ( rssi - tx_power )
+    for( row_index = 0; row_index < table_size; row_index++ )
+    {
+      for( col_index = 0; col_index < table_size; col_index++ )
+      {
+        TABLE( p_table, row_index, col_index ) = TARGET_RSSI -
+                    ( TABLE( rssi_table, row_index, col_index ) -
+                                                      tx_powers[col_index] );
+      }
+    }
+
+    round_count++;
+
+    // Powers used for the next round (AP stays at maximum)
+    read_power_line( fp_powers, &tx_powers[1], table_size - 1 );
+  }
+
+  free( rssi_table );
+
+  if( 0 == round_count )
+  {
+    printf( "No tables read.\r\n" );
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t generate_random_tables( uint8_t devices, uint32_t rounds )
+ *
+ * @brief Make up required power tables for devices walking around a room.
+ *        Each direction of a link gets its own random shadowing, so links
+ *        are asymmetric.
+ * ****************************************************************************/
+static uint8_t generate_random_tables( uint8_t devices, uint32_t rounds )
+{
+  energy_t x[MAX_TABLE_SIZE];
+  energy_t y[MAX_TABLE_SIZE];
+  energy_t distance;
+  energy_t* p_table;
+  uint16_t row_index;
+  uint16_t col_index;
+
+  if( ( 0 == devices ) || ( devices >= MAX_TABLE_SIZE ) ||
+      ( 0 == rounds ) || ( rounds > MAX_ROUNDS ) )
+  {
+    printf( "Invalid size (1-%d devices, 1-%d rounds).\r\n",
+                                      MAX_TABLE_SIZE - 1, MAX_ROUNDS );
+    return 1;
+  }
+
+  table_size = devices + 1;
+  round_count = rounds;
+
+  link_power_tables = malloc( rounds * table_size * table_size *
+                                                          sizeof(energy_t) );
+  if( NULL == link_power_tables )
+  {
+    printf( "Error allocating tables.\r\n" );
+    return 1;
+  }
+
+  srand( 1 );
+
+  for( row_index = 0; row_index < table_size; row_index++ )
+  {
+    x[row_index] = RANDOM_AREA_SIZE * rand() / RAND_MAX;
+    y[row_index] = RANDOM_AREA_SIZE * rand() / RAND_MAX;
+  }
+
+  while( rounds-- )
+  {
+    p_table = &link_power_tables[rounds * table_size * table_size];
+
+    // Devices move up to 0.5m per round, the AP (index 0) stays put
+    for( row_index = 1; row_index < table_size; row_index++ )
+    {
+      x[row_index] += (energy_t)rand() / RAND_MAX - 0.5;
+      y[row_index] += (energy_t)rand() / RAND_MAX - 0.5;
+    }
+
+    for( row_index = 0; row_index < table_size; row_index++ )
+    {
+      for( col_index = 0; col_index < table_size; col_index++ )
+      {
+        distance = sqrt( pow( x[row_index] - x[col_index], 2 ) +
+                         pow( y[row_index] - y[col_index], 2 ) );
+        if( distance < 1.0 )
+        {
+          distance = 1.0;
+        }
+
+        TABLE( p_table, row_index, col_index ) = TARGET_RSSI +
+            RANDOM_PATH_LOSS_1M +
+            10 * RANDOM_PATH_LOSS_EXPONENT * log10( distance ) +
+            RANDOM_MAX_SHADOWING * rand() / RAND_MAX;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t read_energy_line ( char* csv_line, energy_t* rssi_line,
+ *                                                        uint16_t max_items )
+ *
+ * @brief Parse line from csv file an populate array row with contents.
+ *        Returns the number of items read.
+ * ****************************************************************************/
+uint16_t read_energy_line ( char* csv_line, energy_t* rssi_line,
+                                                          uint16_t max_items )
+{
+  char *p_item;
+  uint16_t item_index = 0;
+
+  p_item = strtok( csv_line, "," );
+  while( ( NULL != p_item ) && ( item_index < max_items ) )
+  {
+    rssi_line[item_index] = (energy_t)strtod( p_item, NULL );
+
+    item_index++;
+    p_item = strtok( NULL, "," );
+  }
+
+  return item_index;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t read_power_line ( FILE* fp_powers, energy_t* power_line,
+ *                                                      uint8_t device_count )
+ *
+ * @brief Parse line from csv file an populate array row with contents
+ *        (the first item is the AP and is skipped)
+ * ****************************************************************************/
+uint8_t read_power_line ( FILE* fp_powers, energy_t* power_line,
+                                                        uint8_t device_count )
+{
+  char csv_line[INBUFSIZE];   // Buffer for reading a line in the file
+  char *p_item;
+  uint16_t item_index = 0;
+
+  if ( NULL != fgets( csv_line, sizeof(csv_line), fp_powers ) )
+  {
+    p_item = strtok( csv_line, "," );
+    while( ( NULL != p_item ) && ( item_index < device_count ) )
+    {
+      p_item = strtok( NULL, "," );
+
+      if( NULL != p_item )
+      {
+        power_line[item_index] = (energy_t)strtod( p_item, NULL );
+      }
+
+      item_index++;
+    }
+
+    // Read table successfully
+    return 1;
+  }
+
+  // Did NOT read table successfully
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t read_table ( FILE* fp_csv_file, energy_t* p_rssi_table )
+ *
+ * @brief Read lines from CSV file and parse them until an empty line is found.
+ *        The table is square, so its size comes from the number of items in
+ *        the first line. p_rssi_table must hold MAX_TABLE_SIZE^2 entries.
+ *        Returns the table size (N+1), or 0 if no table was read.
+ * ****************************************************************************/
+uint16_t read_table ( FILE* fp_csv_file, energy_t* p_rssi_table )
+{
+  char csv_line[INBUFSIZE];   // Buffer for reading a line in the file
+  uint16_t line_index = 0;
+  uint16_t table_size = 0;
+  uint16_t items;
+
+  while( NULL != fgets( csv_line, sizeof(csv_line), fp_csv_file ) )
+  {
+    // Detect empty line
+    if( csv_line[0] == '\n' )
+    {
+      if( ( table_size < 2 ) || ( line_index != table_size ) )
+      {
+        printf( "Table is not square (%d lines of %d).\r\n", line_index,
+                                                                  table_size );
+        return 0;
+      }
+
+      // Read table successfully
+      return table_size;
+    }
+
+    if( line_index >= MAX_TABLE_SIZE )
+    {
+      // Don't want to overflow the array. Return error.
+      return 0;
+    }
+
+    // Remove newline
+    csv_line[(int32_t)strlen(csv_line)-1] = 0;
+
+    // Parse csv line and populate array
+    items = read_energy_line( csv_line, &p_rssi_table[line_index * table_size],
+                                                              MAX_TABLE_SIZE );
+
+    // First line sets the table size
+    if( 0 == line_index )
+    {
+      table_size = items;
+    }
+    else if( items != table_size )
+    {
+      printf( "Line %d has %d items, expected %d.\r\n", line_index, items,
+                                                                  table_size );
+      return 0;
+    }
+
+    line_index++;
+  }
+
+  // Did not read table successfully
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    double dbm_to_watt( double power )
+ *
+ * @brief Convert dBm to Watts
+ * ****************************************************************************/
+static double dbm_to_watt( double power )
+{
+  return pow( 10, power / 10 ) / 1000;
+}
+
+/*******************************************************************************
+ * @fn    double watt_to_dbm( double power )
+ *
+ * @brief Convert Watts to dBm
+ * ****************************************************************************/
+static double watt_to_dbm( double power )
+{
+  return 10 * log10( power * 1000 );
+}
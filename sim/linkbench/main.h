@@ -0,0 +1,45 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+// Largest table that can be read ( (N+1)x(N+1) )
+#define MAX_TABLE_SIZE ( 255 )
+
+// Tables kept in memory (so file reading isn't timed)
+#define MAX_ROUNDS ( 10000 )
+
+// Same target as the host routing (dBm)
+#define TARGET_RSSI ( -60.0 )
+
+// Highest cc2500 transmit power (dBm), the AP always uses it
+#define MAX_TX_POWER ( 1.5 )
+
+// Random tables: node positions in a square this big (m), path loss at 1m
+// and exponent, and up to this much extra loss in each direction (dB) to
+// model body shadowing
+#define RANDOM_AREA_SIZE ( 10.0 )
+#define RANDOM_PATH_LOSS_1M ( 40.0 )
+#define RANDOM_PATH_LOSS_EXPONENT ( 3.0 )
+#define RANDOM_MAX_SHADOWING ( 20.0 )
+
+// A link counts as under-powered if the assigned power is this much (dB)
+// lower than what its direction really needs
+#define SHORTFALL_TOLERANCE ( 0.01 )
+
+// Results of one link model over the whole trace
+typedef struct
+{
+  double us_per_round;      // Graph build, dijkstra and rp tables
+  uint32_t links;           // Routed links (one per node per round)
+  uint32_t under_powered;   // Links given less power than they need
+  energy_t shortfall;       // Total dB missing on under-powered links
+  energy_t tx_power;        // Total assigned transmit power (W)
+  energy_t wasted_power;    // Assigned power (W) of under-powered links
+} bench_result_t;
+
+#endif /*_MAIN_H */
@@ -8,49 +8,110 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include "routing.h"
 #include "dijkstra.h"
+#include "rpupdate.h"
+#include "rssifilter.h"
+#include "ctuner.h"
+#include "latency.h"
+#include "csvmap.h"
+#include "trace.h"
 #include "main.h"
 
-#define INBUFSIZE (4096)
-
-#ifndef MAX_DEVICES
-#define MAX_DEVICES (3)
-#warning MAX_DEVICES not defined, defaulting to 3
-#endif
-
-void read_energy_line( char*, energy_t* );
-uint8_t read_power_line ( FILE* , energy_t* );
-uint8_t read_table( FILE* , energy_t p_rssi_table[][MAX_DEVICES+1] );
+// Largest table that can be read ( (N+1)x(N+1) )
+#define MAX_TABLE_SIZE ( MAX_NETWORK_SIZE + 1 )
+
+uint8_t read_power_line ( csv_file_t* , energy_t*, uint8_t );
+uint16_t read_table( csv_file_t* , energy_t* );
+uint8_t read_trace_power_line( energy_t*, uint8_t );
+uint16_t read_trace_table( energy_t* );
+uint8_t reactive_start( energy_t, uint8_t, energy_t, uint16_t );
+void reactive_compute_round( energy_t*, energy_t*, uint8_t );
+uint8_t score_routes( const uint8_t*, const energy_t*, const energy_t*,
+                                                    uint8_t, route_score_t* );
+void compare_forecast( energy_t*, energy_t*, uint8_t );
+void print_forecast_stats();
 void *graph_thread();
 void sigint_handler( int32_t sig );
+static uint64_t now_ns();
 
 pthread_t routing_thread;
 pthread_t graphing_thread;
 
 pthread_mutex_t mutex_graph;
 
-// Routing and power tables (all in one array)
-static volatile uint8_t rp_tables[MAX_DEVICES * 2];
+// Routing and power tables (all in one array, sized for the largest network)
+// The first N bytes are routes and the next N are transmit powers, where
+// N = routing_get_device_count()
+static volatile uint8_t rp_tables[RP_TABLES_SIZE];
 
 // Table storing all device routes
 static volatile uint8_t *routing_table = &rp_tables[0];
 
-// Table storing all device transmit powers
-static volatile uint8_t *power_table = &rp_tables[MAX_DEVICES];
+// Measure how many bytes route/power updates would take (and check that the
+// AP would decode them)
+static rp_encoder_t rp_encoder;
+static rp_decoder_t rp_decoder;
+static uint8_t rp_message[RP_MESSAGE_MAX_SIZE];
+
+// Sparse tables: what the AP would keep and send, and what the host gets
+static neighbor_table_t ap_neighbors;
+static neighbor_table_t neighbors;
+static uint8_t neighbor_packet[NEIGHBOR_PACKET_MAX_SIZE( MAX_NETWORK_SIZE,
+                                                          NEIGHBORS_MAX_K )];
+
+// Optional C factor tuning, evaluated every CTUNER_PERIOD_ROUNDS rounds
+static ctuner_t tuner;
+static uint8_t tune_c_factor;
+
+// With forecasts, the same tables are also routed as they are (reactive) on
+// a context of their own, and both sets of routes are scored on the table
+// of the round they are used in (see compare_forecast)
+static routing_context_t* p_reactive;
+static uint8_t reactive_tables[RP_TABLES_SIZE];
+static struct
+{
+  uint32_t rounds;
+  uint32_t better;
+  uint32_t worse;
+  route_score_t forecast;
+  route_score_t reactive;
+} forecast_stats;
+
+// Time spent reading the csv files, to see what parsing costs
+static uint64_t read_ns;
+
+// Binary trace read instead of the csv files, and its next round
+static trace_file_t trace;
+static uint32_t trace_round;
 
 int32_t main ( int32_t argc, char *argv[] )
 {
-  FILE *fp_rssi;
-  FILE *fp_powers;
+  csv_file_t rssi_csv;
+  csv_file_t powers_csv;
   int32_t rc;
-  uint8_t node_index;
-  energy_t rssi_table[MAX_DEVICES+1][MAX_DEVICES+1];
-  energy_t previous_powers[MAX_DEVICES];
+  uint16_t node_index;
+  uint16_t table_size;
+  energy_t* rssi_table;
+  energy_t previous_powers[MAX_NETWORK_SIZE];
   uint32_t sample_limit = 10000;
+  uint16_t message_size;
+  uint8_t max_neighbors = 0;
+  uint16_t packet_size;
+  uint32_t neighbor_bytes = 0;
+  uint32_t dense_bytes = 0;
+  uint32_t round = 0;
+  energy_t margin = 0;
+  uint16_t dwell = 0;
+  uint64_t start_ns;
+  uint64_t read_start_ns;
+  double elapsed;
+  uint64_t read_bytes;
   
   // Handle interrupt events to make sure files are closed before exiting
   (void) signal( SIGINT, sigint_handler );
@@ -58,35 +119,60 @@ int32_t main ( int32_t argc, char *argv[] )
   // Make sure the filename is included
   if ( argc < 4 )
   {
-    printf( "Usage: %s rssi.csv powers.csv C(0.0-1.0) [graph (0,1)]\r\n"
-                                                                    , argv[0] );
+    printf( "Usage: %s rssi.csv|trace.bin powers.csv|- C(0.0-1.0) "
+                  "[graph (0,1)] "
+                  "[margin (0.0-1.0)] [dwell rounds] "
+                  "[filter (0 none, 1 EWMA, 2 Kalman, 3 forecast)] "
+                  "[directed (0,1)] [neighbors (0 dense, 1-%d)] "
+                  "[tune C (0 off, 1 lifetime, 2 variance)]\r\n",
+                                                  argv[0], NEIGHBORS_MAX_K );
     return 1;
   }
   
-  // Open input rssi csv file
-  fp_rssi = fopen( argv[1], "r" );
+  // A binary trace (see ../../host/tracepack) has the tables and powers of
+  // both csv files, the second file name is then ignored
+  if( 0 == trace_map( &trace, argv[1] ) )
+  {
+    if( trace.p_header->device_count + 1 > MAX_TABLE_SIZE )
+    {
+      printf( "Trace network is too large.\r\n" );
+      return 1;
+    }
 
-  if( NULL == fp_rssi )
+    memset( &rssi_csv, 0, sizeof(rssi_csv) );
+    memset( &powers_csv, 0, sizeof(powers_csv) );
+  }
+  else
   {
-    printf( "Error opening rssi input file.\r\n" );
-    return 1;
+    // Open input rssi csv file
+    if( csv_open( &rssi_csv, argv[1] ) )
+    {
+      printf( "Error opening rssi input file.\r\n" );
+      return 1;
+    }
+
+    // Open input rssi csv file
+    if( csv_open( &powers_csv, argv[2] ) )
+    {
+      printf( "Error opening tx powers input file.\r\n" );
+      return 1;
+    }
   }
   
-  // Open input rssi csv file
-  fp_powers = fopen( argv[2], "r" );
+  // Room for the largest table, the network size is taken from the file
+  rssi_table = malloc( MAX_TABLE_SIZE * MAX_TABLE_SIZE * sizeof(energy_t) );
 
-  if( NULL == fp_powers )
+  if( NULL == rssi_table )
   {
-    printf( "Error opening tx powers input file.\r\n" );
+    printf( "Error allocating rssi table.\r\n" );
     return 1;
   }
-  
+
   // Initialize routing an power tables
-  memset( (uint8_t*)power_table, 0xff, MAX_DEVICES );
-  memset( (uint8_t*)routing_table, ( MAX_DEVICES + 1 ), MAX_DEVICES );
+  memset( (uint8_t*)rp_tables, 0xff, sizeof(rp_tables) );
   
   // Initialize previous_powers table
-  for( node_index = 0; node_index < MAX_DEVICES; node_index++ )
+  for( node_index = 0; node_index < MAX_NETWORK_SIZE; node_index++ )
   {
 
     // Initialize previous power to maximum
@@ -100,6 +186,76 @@ int32_t main ( int32_t argc, char *argv[] )
     exit(-1);
   }
 
+  // Optional sparse tables, only keeping the strongest neighbors of each node
+  if( argc > 9 )
+  {
+    max_neighbors = atoi( argv[9] );
+    if( max_neighbors > NEIGHBORS_MAX_K )
+    {
+      printf( "Too many neighbors (%d max).\r\n", NEIGHBORS_MAX_K );
+      return 1;
+    }
+  }
+
+  // Optional directed links (both directions of a link are merged by default)
+  if( argc > 8 )
+  {
+    graph_set_directed( atoi( argv[8] ) );
+  }
+
+  // Optional RSSI filter (disabled by default)
+  if( argc > 7 )
+  {
+    switch( atoi( argv[7] ) )
+    {
+      case RSSI_FILTER_EWMA:
+        rssi_filter_configure( RSSI_FILTER_EWMA, RSSI_FILTER_EWMA_ALPHA, 0 );
+        break;
+
+      case RSSI_FILTER_KALMAN:
+        rssi_filter_configure( RSSI_FILTER_KALMAN, RSSI_FILTER_KALMAN_Q,
+                                                      RSSI_FILTER_KALMAN_R );
+        break;
+
+      case RSSI_FILTER_FORECAST:
+        rssi_filter_configure( RSSI_FILTER_FORECAST,
+                                              RSSI_FILTER_FORECAST_LAMBDA,
+                                              RSSI_FILTER_FORECAST_ALPHA );
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  // Optional route hysteresis (disabled by default)
+  if( argc > 5 )
+  {
+    margin = (energy_t)strtod( argv[5], NULL );
+    dwell = ( argc > 6 ) ? atoi( argv[6] ) : 0;
+    set_route_hysteresis( margin, dwell );
+  }
+
+  // Route without the forecast too, to see what it's worth
+  if( ( RSSI_FILTER_FORECAST == rssi_filter_get_type() ) &&
+      reactive_start( (energy_t)strtod( argv[3], NULL ),
+                                    graph_is_directed(), margin, dwell ) )
+  {
+    printf( "Error initializing reactive routes.\n" );
+    exit(-1);
+  }
+
+  // Optional C factor tuning (see ctuner.h)
+  if( ( argc > 10 ) && ( atoi( argv[10] ) > 0 ) )
+  {
+    tune_c_factor = 1;
+    ctuner_initialize( &tuner, routing_get_context(),
+                ( 2 == atoi( argv[10] ) ) ? CTUNER_SCORE_VARIANCE :
+                                            CTUNER_SCORE_LIFETIME );
+  }
+
+  LATENCY_INITIALIZE();
+
   rc = pthread_create( &routing_thread, NULL, compute_routes_thread,
                                                         (void*) routing_table );
 
@@ -126,10 +282,54 @@ int32_t main ( int32_t argc, char *argv[] )
   // Lock this before starting
   pthread_mutex_lock ( &mutex_route_done );
 
-  while( read_table( fp_rssi, rssi_table ) && sample_limit-- )
+  start_ns = now_ns();
+  read_start_ns = start_ns;
+
+  while( ( table_size = ( NULL != trace.p_map ) ?
+                                  read_trace_table( rssi_table ) :
+                                  read_table( &rssi_csv, rssi_table ) ) &&
+                                                              sample_limit-- )
   {
+    read_ns += now_ns() - read_start_ns;
+
+    if( NULL != p_reactive )
+    {
+      // Last round's routes are the ones used with this table
+      compare_forecast( rssi_table, previous_powers, table_size - 1 );
+      reactive_compute_round( rssi_table, previous_powers, table_size - 1 );
+    }
+
+    if( max_neighbors > 0 )
+    {
+      // Do what the AP would: keep the strongest neighbors and pack them
+      if( neighbor_table_allocate( &ap_neighbors, table_size - 1,
+                                                            max_neighbors ) )
+      {
+        printf( "Error allocating neighbor table.\r\n" );
+        break;
+      }
+
+      neighbor_table_from_dense( &ap_neighbors, rssi_table );
+      packet_size = neighbor_table_pack( &ap_neighbors, neighbor_packet );
+
+      neighbor_bytes += packet_size;
+      dense_bytes += table_size * table_size;
+
+      if( neighbor_table_unpack( &neighbors, neighbor_packet, packet_size ) )
+      {
+        printf( "Neighbor table did not decode correctly!\n" );
+        break;
+      }
 
-    parse_table_d( rssi_table, previous_powers );
+      if( parse_neighbors( &neighbors, previous_powers ) )
+      {
+        break;
+      }
+    }
+    else if( parse_table_d( rssi_table, previous_powers, table_size - 1 ) )
+    {
+      break;
+    }
   
     // Let the routing algorithm run
     pthread_mutex_unlock ( &mutex_route_start );
@@ -137,6 +337,28 @@ int32_t main ( int32_t argc, char *argv[] )
     // Wait until routing is done
     pthread_mutex_lock ( &mutex_route_done );
 
+    LATENCY_ROUND_TAKEN();
+    LATENCY_ROUND_DONE();
+
+    message_size = rp_update_encode( &rp_encoder, (uint8_t *)rp_tables,
+                                      routing_get_device_count(), rp_message );
+
+    if( rp_update_decode( &rp_decoder, rp_message, message_size ) ||
+        memcmp( rp_decoder.rp_tables, (uint8_t *)rp_tables,
+                                      routing_get_device_count() * 2 ) )
+    {
+      printf( "Route/power update did not decode correctly!\n" );
+      rp_update_force_keyframe( &rp_encoder );
+    }
+
+    // Tables are replayed faster than real time, so tune between rounds
+    // instead of in the tuner thread
+    round++;
+    if( tune_c_factor && ( 0 == ( round % CTUNER_PERIOD_ROUNDS ) ) )
+    {
+      ctuner_evaluate( &tuner );
+    }
+
     // Only graph when asked to
     if ( argv[4][0] == '1')
     {
@@ -145,7 +367,10 @@ int32_t main ( int32_t argc, char *argv[] )
     }
     
     // Read previous powers
-    if( !read_power_line ( fp_powers, previous_powers ) )
+    read_start_ns = now_ns();
+    if( ( NULL != trace.p_map ) ?
+        !read_trace_power_line( previous_powers, table_size - 1 ) :
+        !read_power_line ( &powers_csv, previous_powers, table_size - 1 ) )
     {
       printf("Error reading from power file!");
     }
@@ -153,58 +378,92 @@ int32_t main ( int32_t argc, char *argv[] )
     sample_limit--;
   }
 
-  fclose( fp_powers );
-  fclose( fp_rssi );
+  elapsed = ( now_ns() - start_ns ) / 1e9;
 
-  return 0;
-}
+  read_bytes = rssi_csv.offset + powers_csv.offset;
+  if( NULL != trace.p_map )
+  {
+    read_bytes = (uint64_t)trace_round *
+                              ( trace.p_columns[TRACE_RSSI].stride +
+                                trace.p_columns[TRACE_POWERS].stride );
+  }
 
-/*******************************************************************************
- * @fn    void read_energy_line ( char* csv_line, int8_t* rssi_line )
- *
- * @brief Parse line from csv file an populate array row with contents
- * ****************************************************************************/
-void read_energy_line ( char* csv_line, energy_t* rssi_line )
-{
-  char *p_item;
-  uint16_t item_index = 0;
+  printf( "Read %d tables, %g MB in %g ms (%g MB/s), %g rounds/s\n", round,
+          read_bytes / 1e6, read_ns / 1e6,
+          read_ns ? read_bytes * 1e3 / read_ns : 0,
+          elapsed > 0 ? round / elapsed : 0 );
+
+  csv_close( &powers_csv );
+  csv_close( &rssi_csv );
+  trace_unmap( &trace );
+
+  free( rssi_table );
+  neighbor_table_free( &ap_neighbors );
+  neighbor_table_free( &neighbors );
+
+  // Stop threads and write out the rest of the round log
+  pthread_cancel( routing_thread );
+  pthread_cancel( graphing_thread );
 
-  p_item = strtok( csv_line, "," );
-  while( NULL != p_item )
+  routing_finalize();
+
+  if( NULL != p_reactive )
   {
-    // Convert string to RSSI value and store in rssi_line
-    rssi_line[item_index] = (energy_t)strtod( p_item, NULL );
+    routing_select( p_reactive );
+    routing_finalize();
+    routing_select( NULL );
+    routing_context_destroy( p_reactive );
+  }
 
-    item_index++;
-    p_item = strtok( NULL, "," );
+  LATENCY_SUMMARY();
+
+  if( tune_c_factor )
+  {
+    ctuner_print_stats( &tuner );
+  }
+
+  if( forecast_stats.rounds > 0 )
+  {
+    print_forecast_stats();
+  }
+
+
+  if( neighbor_bytes > 0 )
+  {
+    printf( "Neighbor tables: %g bytes per round (dense tables: %g)\n",
+            (double)neighbor_bytes / rp_encoder.messages,
+            (double)dense_bytes / rp_encoder.messages );
   }
+
+  if( rp_encoder.messages > 0 )
+  {
+    printf( "Route/power updates: %g bytes per round (full tables: %g), "
+            "%d keyframes\n",
+            (double)rp_encoder.bytes / rp_encoder.messages,
+            (double)rp_encoder.full_bytes / rp_encoder.messages,
+            rp_encoder.keyframes );
+  }
+
+  return 0;
 }
 
 /*******************************************************************************
- * @fn    uint8_t read_power_line ( FILE* fp_powers, energy_t* power_line )
+ * @fn    uint8_t read_power_line ( csv_file_t* p_powers, energy_t* power_line,
+ *                                                      uint8_t device_count )
  *
- * @brief Parse line from csv file an populate array row with contents
+ * @brief Parse line from csv file an populate array row with contents (the
+ *        first item isn't a device power, it's skipped)
  * ****************************************************************************/
-uint8_t read_power_line ( FILE* fp_powers, energy_t* power_line )
+uint8_t read_power_line ( csv_file_t* p_powers, energy_t* power_line,
+                                                        uint8_t device_count )
 {
-  char csv_line[INBUFSIZE];   // Buffer for reading a line in the file
-  char *p_item;
-  uint16_t item_index = 0;
+  const char* p_line;
+  const char* p_end;
 
-  if ( NULL != fgets( csv_line, sizeof(csv_line), fp_powers ) )
+  if ( csv_next_line( p_powers, &p_line, &p_end ) )
   {
-    p_item = strtok( csv_line, "," );
-    while( ( NULL != p_item ) && ( item_index < MAX_DEVICES ) )
-    {
-      p_item = strtok( NULL, "," );
-    
-      // Convert string to RSSI value and store in rssi_line
-      power_line[item_index] = (energy_t)strtod( p_item, NULL );
-      
-      item_index++;
-      
-    }
-   
+    csv_parse_line( p_line, p_end, power_line, 1, device_count );
+
     // Read table successfully
     return 1;
   }
@@ -214,35 +473,56 @@ uint8_t read_power_line ( FILE* fp_powers, energy_t* power_line )
 }
 
 /*******************************************************************************
- * @fn    uint8_t read_table ( FILE* fp_csv_file,
- *                                      int8_t p_rssi_table[][MAX_DEVICES+1] )
+ * @fn    uint16_t read_table ( csv_file_t* p_csv, energy_t* p_rssi_table )
  *
- * @brief Read lines from CSV file and parse them until an empty line is found
+ * @brief Read lines from CSV file and parse them until an empty line is found.
+ *        The table is square, so its size comes from the number of items in
+ *        the first line. p_rssi_table must hold MAX_TABLE_SIZE^2 entries.
+ *        Returns the table size (N+1), or 0 if no table was read.
  * ****************************************************************************/
-uint8_t read_table ( FILE* fp_csv_file, energy_t p_rssi_table[][MAX_DEVICES+1] )
+uint16_t read_table ( csv_file_t* p_csv, energy_t* p_rssi_table )
 {
-  char csv_line[INBUFSIZE];   // Buffer for reading a line in the file
+  const char* p_line;
+  const char* p_end;
   uint16_t line_index = 0;
-  while( NULL != fgets( csv_line, sizeof(csv_line), fp_csv_file ) )
+  uint16_t table_size = 0;
+  uint16_t items;
+
+  while( csv_next_line( p_csv, &p_line, &p_end ) )
   {
     // Detect empty line
-    if( csv_line[0] == '\n' )
+    if( p_line == p_end )
     {
+      if( ( table_size < 2 ) || ( line_index != table_size ) )
+      {
+        printf( "Table is not square (%d lines of %d).\r\n", line_index,
+                                                                  table_size );
+        return 0;
+      }
+
       // Read table successfully
-      return 1;
+      return table_size;
     }
-    else
-    {
-      // Remove newline
-      csv_line[(int32_t)strlen(csv_line)-1] = 0;
 
-      // Parse csv line and populate array
-      read_energy_line( csv_line, p_rssi_table[line_index] );
+    if( line_index >= MAX_TABLE_SIZE )
+    {
+      // Don't want to overflow the array. Return error.
+      return 0;
     }
 
-    if( line_index > MAX_DEVICES )
+    // Parse csv line straight from the file into its row
+    items = csv_parse_line( p_line, p_end,
+                &p_rssi_table[line_index * table_size], 0, MAX_TABLE_SIZE );
+
+    // First line sets the table size
+    if( 0 == line_index )
     {
-      // Don't want to overflow the array. Return error.
+      table_size = items;
+    }
+    else if( items != table_size )
+    {
+      printf( "Line %d has %d items, expected %d.\r\n", line_index, items,
+                                                                  table_size );
       return 0;
     }
 
@@ -253,6 +533,255 @@ uint8_t read_table ( FILE* fp_csv_file, energy_t p_rssi_table[][MAX_DEVICES+1] )
   return 0;
 }
 
+/*******************************************************************************
+ * @fn    uint8_t read_trace_power_line( energy_t* power_line,
+ *                                                      uint8_t device_count )
+ *
+ * @brief Copy the powers selected on the last table read from the trace
+ *        (like read_power_line, without the AP's)
+ * ****************************************************************************/
+uint8_t read_trace_power_line( energy_t* power_line, uint8_t device_count )
+{
+  trace_round_t round_tables;
+
+  if( ( 0 == trace_round ) ||
+      trace_get_round( &trace, trace_round - 1, &round_tables ) )
+  {
+    return 0;
+  }
+
+  memcpy( power_line, &round_tables.powers[1],
+                                          device_count * sizeof(energy_t) );
+
+  return 1;
+}
+
+/*******************************************************************************
+ * @fn    uint16_t read_trace_table( energy_t* p_rssi_table )
+ *
+ * @brief Copy the next RSSI table of the trace to p_rssi_table, same as
+ *        read_table. Returns the table size (N+1), or 0 after the last round.
+ * ****************************************************************************/
+uint16_t read_trace_table( energy_t* p_rssi_table )
+{
+  trace_round_t round_tables;
+
+  if( trace_get_round( &trace, trace_round, &round_tables ) )
+  {
+    return 0;
+  }
+
+  trace_get_rssi( &round_tables, trace.p_header->device_count, p_rssi_table );
+  trace_round++;
+
+  return trace.p_header->device_count + 1;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t reactive_start( energy_t c_factor, uint8_t directed,
+ *                                      energy_t margin, uint16_t dwell )
+ *
+ * @brief Set up the context that routes every table as it is, with the same
+ *        settings as the forecast one. Returns 1 on error.
+ * ****************************************************************************/
+uint8_t reactive_start( energy_t c_factor, uint8_t directed, energy_t margin,
+                                                              uint16_t dwell )
+{
+  routing_context_t* p_caller = routing_get_context();
+  uint8_t rc;
+
+  p_reactive = routing_context_create();
+  if( NULL == p_reactive )
+  {
+    return 1;
+  }
+
+  memset( reactive_tables, 0xff, sizeof(reactive_tables) );
+
+  routing_select( p_reactive );
+  routing_set_verbose( ROUTING_OUTPUT_NONE );
+  graph_set_directed( directed );
+  set_route_hysteresis( margin, dwell );
+  rc = routing_start( c_factor, NULL );
+  routing_select( p_caller );
+
+  if( rc )
+  {
+    routing_context_destroy( p_reactive );
+    p_reactive = NULL;
+  }
+
+  return rc;
+}
+
+/*******************************************************************************
+ * @fn    void reactive_compute_round( energy_t* p_rssi_table,
+ *                    energy_t* p_previous_powers, uint8_t device_count )
+ *
+ * @brief Route this table without the forecast
+ * ****************************************************************************/
+void reactive_compute_round( energy_t* p_rssi_table,
+                            energy_t* p_previous_powers, uint8_t device_count )
+{
+  routing_context_t* p_caller = routing_get_context();
+
+  routing_select( p_reactive );
+  if( 0 == parse_table_d( p_rssi_table, p_previous_powers, device_count ) )
+  {
+    routing_compute_round( reactive_tables );
+  }
+  routing_select( p_caller );
+}
+
+/*******************************************************************************
+ * @fn    uint8_t score_routes( const uint8_t* p_rp_tables,
+ *                  const energy_t* p_rssi_table, const energy_t* p_tx_powers,
+ *                  uint8_t device_count, route_score_t* p_score )
+ *
+ * @brief Add up the power (Watts) every node needs to reach the next hop it
+ *        was given with the attenuation of p_rssi_table (and the link model
+ *        routing uses), and how far the power setting it was given is from
+ *        that (dB). Returns 1 if the routes are for another network size.
+ * ****************************************************************************/
+uint8_t score_routes( const uint8_t* p_rp_tables, const energy_t* p_rssi_table,
+                      const energy_t* p_tx_powers, uint8_t device_count,
+                      route_score_t* p_score )
+{
+  const energy_t max_power = power_values[sizeof(power_values) /
+                                                        sizeof(energy_t) - 1];
+  uint16_t table_size = device_count + 1;
+  uint8_t node_index;
+  uint8_t next_hop;
+  energy_t required;
+  energy_t reverse;
+  energy_t error;
+
+  memset( p_score, 0, sizeof(route_score_t) );
+
+  for( node_index = 1; node_index <= device_count; node_index++ )
+  {
+    next_hop = p_rp_tables[node_index - 1];
+    if( next_hop > table_size )
+    {
+      return 1;
+    }
+
+    // No route (every link needs too much power)
+    if( 0 == next_hop )
+    {
+      continue;
+    }
+
+    // Node transmits (column) to its next hop (row), the AP is row 0
+    if( table_size == next_hop )
+    {
+      next_hop = 0;
+    }
+
+    required = TARGET_RSSI -
+                ( p_rssi_table[next_hop * table_size + node_index] -
+                  p_tx_powers[node_index - 1] );
+
+    // Unless links are directed, routing takes the better direction (the
+    // AP transmits with max power)
+    if( !graph_is_directed() )
+    {
+      reverse = TARGET_RSSI -
+                ( p_rssi_table[node_index * table_size + next_hop] -
+                  ( ( 0 == next_hop ) ? max_power :
+                                        p_tx_powers[next_hop - 1] ) );
+      if( reverse < required )
+      {
+        required = reverse;
+      }
+    }
+
+    if( required > max_power )
+    {
+      required = max_power;
+    }
+
+    error = get_power_from_setting(
+                      p_rp_tables[device_count + node_index - 1] ) - required;
+
+    p_score->power += pow( 10, required / 10 ) / 1000;
+    p_score->error += error;
+    p_score->abs_error += fabs( error );
+    p_score->links++;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void compare_forecast( energy_t* p_rssi_table,
+ *                    energy_t* p_previous_powers, uint8_t device_count )
+ *
+ * @brief Score the routes both contexts computed last round on this round's
+ *        table. Forecast routes win a round if the links they use need less
+ *        power than the reactive ones.
+ * ****************************************************************************/
+void compare_forecast( energy_t* p_rssi_table, energy_t* p_previous_powers,
+                                                        uint8_t device_count )
+{
+  route_score_t forecast;
+  route_score_t reactive;
+
+  if( score_routes( (uint8_t *)rp_tables, p_rssi_table, p_previous_powers,
+                                              device_count, &forecast ) ||
+      score_routes( reactive_tables, p_rssi_table, p_previous_powers,
+                                              device_count, &reactive ) )
+  {
+    return;
+  }
+
+  forecast_stats.rounds++;
+
+  forecast_stats.forecast.power += forecast.power;
+  forecast_stats.forecast.error += forecast.error;
+  forecast_stats.forecast.abs_error += forecast.abs_error;
+  forecast_stats.forecast.links += forecast.links;
+
+  forecast_stats.reactive.power += reactive.power;
+  forecast_stats.reactive.error += reactive.error;
+  forecast_stats.reactive.abs_error += reactive.abs_error;
+  forecast_stats.reactive.links += reactive.links;
+
+  if( forecast.power < reactive.power * ( 1 - 1e-9 ) )
+  {
+    forecast_stats.better++;
+  }
+  else if( forecast.power > reactive.power * ( 1 + 1e-9 ) )
+  {
+    forecast_stats.worse++;
+  }
+}
+
+/*******************************************************************************
+ * @fn    void print_forecast_stats()
+ *
+ * @brief Print how forecast routes did against reactive ones
+ * ****************************************************************************/
+void print_forecast_stats()
+{
+  route_score_t* p_forecast = &forecast_stats.forecast;
+  route_score_t* p_reactive_score = &forecast_stats.reactive;
+
+  printf( "Forecast routes beat reactive ones in %d of %d rounds, "
+          "lost in %d\n", forecast_stats.better, forecast_stats.rounds,
+          forecast_stats.worse );
+  printf( "Power needed by the links used: forecast %g W, "
+          "reactive %g W per round\n",
+          p_forecast->power / forecast_stats.rounds,
+          p_reactive_score->power / forecast_stats.rounds );
+  printf( "Power setting error: forecast %+.2f dB (%.2f dB mean absolute), "
+          "reactive %+.2f dB (%.2f dB)\n",
+          p_forecast->error / p_forecast->links,
+          p_forecast->abs_error / p_forecast->links,
+          p_reactive_score->error / p_reactive_score->links,
+          p_reactive_score->abs_error / p_reactive_score->links );
+}
+
 /*******************************************************************************
  * @fn     void *graph_thread()
  * @brief  Run as thread. Generates graph from routing table
@@ -260,6 +789,7 @@ uint8_t read_table ( FILE* fp_csv_file, energy_t p_rssi_table[][MAX_DEVICES+1] )
 void *graph_thread()
 {
   uint8_t link_index;
+  uint8_t device_count;
   FILE* f_graph;
   char command[100];
   char filename[100];
@@ -274,6 +804,8 @@ void *graph_thread()
 
     printf("%s\n", filename);
 
+    device_count = routing_get_device_count();
+
     f_graph = fopen(filename, "w" );
 
     if ( f_graph != NULL )
@@ -287,33 +819,33 @@ void *graph_thread()
       fprintf( f_graph, "edge [len=3]\n");
       fprintf( f_graph, "nodesep=0.25\n");
       fprintf( f_graph, "node[shape = doublecircle]; %d;\n",
-                                                        ( MAX_DEVICES + 1 ) );
+                                                        ( device_count + 1 ) );
 
       fprintf( f_graph, "node[shape = circle];\n");
 
       // All connections
-      for( link_index = 0; link_index < MAX_DEVICES; link_index++ )
+      for( link_index = 0; link_index < device_count; link_index++ )
       {
         if ( routing_table[link_index] != 0 )
         {
           fprintf( f_graph, "%d -> %d", ( link_index + 1 ),
                                                     routing_table[link_index] );
           fprintf( f_graph, "[ label=\"");
-          fprintf( f_graph,  "%5.1f dBm",
-                      get_power_from_setting( power_table[link_index] ) );
+          fprintf( f_graph,  "%5.1f dBm", get_power_from_setting(
+                                  routing_table[device_count + link_index] ) );
           fprintf( f_graph, "\" ]");
           fprintf( f_graph,  ";\n" );
         }
       }
 
       // print_node_name to file
-      for( link_index = 0; link_index < MAX_DEVICES; link_index++ )
+      for( link_index = 0; link_index < device_count; link_index++ )
       {
           fprintf( f_graph, "%d [label=\"%d\"];\n", ( link_index + 1 ),
                                                           ( link_index + 1 ) );
       }
 
-      fprintf( f_graph, "%d [label=\"AP\"];\n", ( MAX_DEVICES + 1 ) );
+      fprintf( f_graph, "%d [label=\"AP\"];\n", ( device_count + 1 ) );
 
       fprintf( f_graph,  "}\n" );
 
@@ -347,7 +879,21 @@ void sigint_handler( int32_t sig )
 
     routing_finalize();
 
+  LATENCY_SUMMARY();
+
     printf("\nExiting...\n");
     exit(sig);
 }
 
+/*******************************************************************************
+ * @fn     uint64_t now_ns()
+ * @brief  Nanoseconds on the monotonic clock
+ * ****************************************************************************/
+static uint64_t now_ns()
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
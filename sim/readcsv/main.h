@@ -7,6 +7,18 @@
 #ifndef _MAIN_H
 #define _MAIN_H
 
+// Received power routing aims for (dBm), same as routing_start
+#define TARGET_RSSI ( -60.0 )
+
+// How the routes and powers of a round did on the table of the round they
+// were used in (see score_routes)
+typedef struct
+{
+  energy_t power;       // Watts the links used needed
+  energy_t error;       // Sum of power setting - power needed (dB)
+  energy_t abs_error;
+  uint32_t links;
+} route_score_t;
 
 #endif /*_MAIN_H */
 
@@ -0,0 +1,653 @@
+/** @file main.c
+*
+* @brief Replay recorded runs with a grid of C factors, every (run, C) pair
+*        on a routing context of its own in a pool of threads, and print
+*        one summary table
+*
+* @author Alvaro Prieto
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "routing.h"
+#include "dijkstra.h"
+#include "csvmap.h"
+#include "trace.h"
+#include "main.h"
+
+uint8_t load_csv( dataset_t* p_dataset, const char* directory );
+uint8_t load_trace( dataset_t* p_dataset, const char* filename );
+static uint8_t add_round( dataset_t* p_dataset, uint32_t* p_capacity,
+                                                    csv_file_t* p_powers );
+uint8_t parse_c_grid( const char* grid, energy_t* p_c_values );
+void *sweep_thread( void* );
+void run_job( sweep_job_t* p_job );
+void print_summary( FILE* fp, uint8_t csv );
+
+static dataset_t* datasets;
+static uint32_t dataset_count;
+
+// Jobs are handed out in order to whichever thread is free
+static sweep_job_t* jobs;
+static uint32_t job_count;
+static uint32_t next_job;
+static pthread_mutex_t mutex_jobs = PTHREAD_MUTEX_INITIALIZER;
+
+int32_t main ( int32_t argc, char *argv[] )
+{
+  energy_t c_values[MAX_C_VALUES];
+  uint8_t c_count;
+  uint8_t c_index;
+  glob_t matches;
+  struct stat info;
+  struct timespec start;
+  struct timespec end;
+  pthread_t* threads;
+  long thread_count;
+  uint32_t thread_index;
+  uint32_t path_index;
+  uint32_t dataset_index;
+  uint64_t rounds = 0;
+  double elapsed;
+  FILE* fp_summary;
+
+  if ( argc < 2 )
+  {
+    printf( "Usage: %s \"dataset glob\" [C grid (i.e. 0,1,10)] [threads] "
+                                          "[summary.csv]\r\n", argv[0] );
+    return 1;
+  }
+
+  c_count = parse_c_grid( ( argc > 2 ) ? argv[2] : DEFAULT_C_GRID, c_values );
+  if( 0 == c_count )
+  {
+    printf( "Invalid C grid.\r\n" );
+    return 1;
+  }
+
+  // One thread per core by default
+  thread_count = ( argc > 3 ) ? atoi( argv[3] ) :
+                                              sysconf( _SC_NPROCESSORS_ONLN );
+  if( thread_count < 1 )
+  {
+    thread_count = 1;
+  }
+
+  if( glob( argv[1], 0, NULL, &matches ) )
+  {
+    printf( "No datasets match %s.\r\n", argv[1] );
+    return 1;
+  }
+
+  datasets = calloc( matches.gl_pathc, sizeof(dataset_t) );
+  if( NULL == datasets )
+  {
+    printf( "Error allocating datasets.\r\n" );
+    globfree( &matches );
+    return 1;
+  }
+
+  // Datasets are run directories (csv files) or traces (../../host/tracepack)
+  for( path_index = 0; path_index < matches.gl_pathc; path_index++ )
+  {
+    if( 0 != stat( matches.gl_pathv[path_index], &info ) )
+    {
+      continue;
+    }
+
+    if( ( S_ISDIR( info.st_mode ) ?
+            load_csv( &datasets[dataset_count], matches.gl_pathv[path_index] ) :
+            load_trace( &datasets[dataset_count],
+                                          matches.gl_pathv[path_index] ) ) )
+    {
+      printf( "Skipping %s\n", matches.gl_pathv[path_index] );
+      continue;
+    }
+
+    rounds += datasets[dataset_count].rounds;
+    dataset_count++;
+  }
+
+  globfree( &matches );
+
+  job_count = dataset_count * c_count;
+  if( 0 == job_count )
+  {
+    printf( "No datasets to run.\r\n" );
+    return 1;
+  }
+
+  jobs = calloc( job_count, sizeof(sweep_job_t) );
+  if( thread_count > job_count )
+  {
+    thread_count = job_count;
+  }
+  threads = malloc( thread_count * sizeof(pthread_t) );
+
+  if( ( NULL == jobs ) || ( NULL == threads ) )
+  {
+    printf( "Error allocating jobs.\r\n" );
+    return 1;
+  }
+
+  for( dataset_index = 0; dataset_index < dataset_count; dataset_index++ )
+  {
+    for( c_index = 0; c_index < c_count; c_index++ )
+    {
+      jobs[dataset_index * c_count + c_index].p_dataset =
+                                                    &datasets[dataset_index];
+      jobs[dataset_index * c_count + c_index].c_factor = c_values[c_index];
+    }
+  }
+
+  clock_gettime( CLOCK_MONOTONIC, &start );
+
+  for( thread_index = 0; thread_index < thread_count; thread_index++ )
+  {
+    if( pthread_create( &threads[thread_index], NULL, sweep_thread, NULL ) )
+    {
+      printf( "Error creating sweep thread\n" );
+      thread_count = thread_index;
+      break;
+    }
+  }
+
+  if( 0 == thread_count )
+  {
+    return 1;
+  }
+
+  for( thread_index = 0; thread_index < thread_count; thread_index++ )
+  {
+    pthread_join( threads[thread_index], NULL );
+  }
+
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  elapsed = ( end.tv_sec - start.tv_sec ) +
+                                    ( end.tv_nsec - start.tv_nsec ) / 1e9;
+
+  print_summary( stdout, 0 );
+
+  printf( "%d jobs (%d datasets x %d C values), %g rounds on %ld threads "
+          "in %g s (%g rounds/s)\n", job_count, dataset_count, c_count,
+          (double)rounds * c_count, thread_count, elapsed,
+          elapsed > 0 ? rounds * c_count / elapsed : 0 );
+
+  if( argc > 4 )
+  {
+    fp_summary = fopen( argv[4], "w" );
+    if( NULL == fp_summary )
+    {
+      printf( "Error opening %s.\r\n", argv[4] );
+      return 1;
+    }
+
+    print_summary( fp_summary, 1 );
+    fclose( fp_summary );
+  }
+
+  for( dataset_index = 0; dataset_index < dataset_count; dataset_index++ )
+  {
+    free( datasets[dataset_index].rssi_tables );
+    free( datasets[dataset_index].powers );
+  }
+
+  free( datasets );
+  free( jobs );
+  free( threads );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t parse_c_grid( const char* grid, energy_t* p_c_values )
+ *
+ * @brief Parse a comma separated list of C values (MAX_C_VALUES at most).
+ *        Returns how many there are, 0 if the list isn't valid.
+ * ****************************************************************************/
+uint8_t parse_c_grid( const char* grid, energy_t* p_c_values )
+{
+  const char* p_value = grid;
+  char* p_next;
+  uint8_t c_count = 0;
+
+  while( '\0' != *p_value )
+  {
+    if( c_count == MAX_C_VALUES )
+    {
+      return 0;
+    }
+
+    p_c_values[c_count++] = (energy_t)strtod( p_value, &p_next );
+
+    if( ( p_next == p_value ) || ( ( ',' != *p_next ) && ( '\0' != *p_next ) ) )
+    {
+      return 0;
+    }
+
+    p_value = ( ',' == *p_next ) ? p_next + 1 : p_next;
+  }
+
+  return c_count;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t load_csv( dataset_t* p_dataset, const char* directory )
+ *
+ * @brief Read every RSSI table of directory/rssi.csv and the tx powers of
+ *        directory/powers.csv into p_dataset, the same way readcsv reads
+ *        them. Every table must be the same size. Returns 1 on error.
+ * ****************************************************************************/
+uint8_t load_csv( dataset_t* p_dataset, const char* directory )
+{
+  csv_file_t rssi_csv;
+  csv_file_t powers_csv;
+  char path[512];
+  const char* p_line;
+  const char* p_end;
+  energy_t row[MAX_TABLE_SIZE];
+  uint32_t capacity = 0;
+  uint16_t row_size = 0;
+  uint16_t line_index = 0;
+  uint16_t items;
+  uint8_t rc = 0;
+
+  snprintf( p_dataset->name, sizeof(p_dataset->name), "%s", directory );
+
+  snprintf( path, sizeof(path), "%s/rssi.csv", directory );
+  if( csv_open( &rssi_csv, path ) )
+  {
+    return 1;
+  }
+
+  snprintf( path, sizeof(path), "%s/powers.csv", directory );
+  if( csv_open( &powers_csv, path ) )
+  {
+    csv_close( &rssi_csv );
+    return 1;
+  }
+
+  while( csv_next_line( &rssi_csv, &p_line, &p_end ) )
+  {
+    // Tables end with an empty line
+    if( p_line == p_end )
+    {
+      if( line_index > 0 )
+      {
+        if( ( line_index != row_size ) ||
+            add_round( p_dataset, &capacity, &powers_csv ) )
+        {
+          printf( "Table %d of %s is not square.\r\n", p_dataset->rounds,
+                                                                  directory );
+          rc = 1;
+          break;
+        }
+
+        line_index = 0;
+      }
+
+      continue;
+    }
+
+    items = csv_parse_line( p_line, p_end, row, 0, MAX_TABLE_SIZE );
+
+    // First line sets the network size
+    if( 0 == row_size )
+    {
+      row_size = items;
+      p_dataset->device_count = row_size - 1;
+    }
+
+    if( ( row_size < 2 ) || ( items != row_size ) ||
+        ( line_index >= row_size ) )
+    {
+      printf( "Line %d of %s/rssi.csv has %d items, expected %d.\r\n",
+                                rssi_csv.line, directory, items, row_size );
+      rc = 1;
+      break;
+    }
+
+    // Make room for this table before its first row
+    if( ( 0 == line_index ) && ( p_dataset->rounds == capacity ) )
+    {
+      capacity = capacity ? capacity * 2 : 256;
+      p_dataset->rssi_tables = realloc( p_dataset->rssi_tables,
+                  (size_t)capacity * row_size * row_size * sizeof(energy_t) );
+      p_dataset->powers = realloc( p_dataset->powers,
+                  (size_t)capacity * ( row_size - 1 ) * sizeof(energy_t) );
+
+      if( ( NULL == p_dataset->rssi_tables ) || ( NULL == p_dataset->powers ) )
+      {
+        printf( "Error allocating tables.\r\n" );
+        rc = 1;
+        break;
+      }
+    }
+
+    memcpy( &p_dataset->rssi_tables[ ( (size_t)p_dataset->rounds * row_size +
+                                            line_index ) * row_size ],
+                                          row, row_size * sizeof(energy_t) );
+    line_index++;
+  }
+
+  // Last table without an empty line after it
+  if( ( 0 == rc ) && ( line_index > 0 ) )
+  {
+    if( ( line_index != row_size ) ||
+        add_round( p_dataset, &capacity, &powers_csv ) )
+    {
+      rc = 1;
+    }
+  }
+
+  csv_close( &powers_csv );
+  csv_close( &rssi_csv );
+
+  if( rc || ( 0 == p_dataset->rounds ) )
+  {
+    free( p_dataset->rssi_tables );
+    free( p_dataset->powers );
+    memset( p_dataset, 0, sizeof(dataset_t) );
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t add_round( dataset_t* p_dataset, uint32_t* p_capacity,
+ *                                                  csv_file_t* p_powers )
+ *
+ * @brief Finish the table just read with its line of powers.csv (without the
+ *        first item). Powers missing from powers.csv are kept from the last
+ *        round, like readcsv does. Returns 1 on error.
+ * ****************************************************************************/
+static uint8_t add_round( dataset_t* p_dataset, uint32_t* p_capacity,
+                                                      csv_file_t* p_powers )
+{
+  uint8_t device_count = p_dataset->device_count;
+  energy_t* p_round_powers;
+  const char* p_line;
+  const char* p_end;
+  uint8_t node_index;
+
+  if( p_dataset->rounds >= *p_capacity )
+  {
+    return 1;
+  }
+
+  p_round_powers = &p_dataset->powers[(size_t)p_dataset->rounds * device_count];
+
+  for( node_index = 0; node_index < device_count; node_index++ )
+  {
+    p_round_powers[node_index] = ( p_dataset->rounds > 0 ) ?
+                                  p_round_powers[node_index - device_count] :
+                      power_values[sizeof(power_values)/sizeof(energy_t) - 1];
+  }
+
+  if( csv_next_line( p_powers, &p_line, &p_end ) )
+  {
+    csv_parse_line( p_line, p_end, p_round_powers, 1, device_count );
+  }
+
+  p_dataset->rounds++;
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    uint8_t load_trace( dataset_t* p_dataset, const char* filename )
+ *
+ * @brief Read the RSSI tables and tx powers of a binary trace into
+ *        p_dataset. Returns 1 if it isn't a valid trace.
+ * ****************************************************************************/
+uint8_t load_trace( dataset_t* p_dataset, const char* filename )
+{
+  trace_file_t trace;
+  trace_round_t round_tables;
+  uint32_t table_cells;
+  uint32_t round;
+  uint8_t device_count;
+
+  if( trace_map( &trace, filename ) )
+  {
+    return 1;
+  }
+
+  device_count = trace.p_header->device_count;
+  table_cells = ( device_count + 1 ) * ( device_count + 1 );
+
+  snprintf( p_dataset->name, sizeof(p_dataset->name), "%s", filename );
+  p_dataset->device_count = device_count;
+  p_dataset->rounds = trace.p_header->round_count;
+  p_dataset->rssi_tables = malloc( (size_t)p_dataset->rounds * table_cells *
+                                                          sizeof(energy_t) );
+  p_dataset->powers = malloc( (size_t)p_dataset->rounds * device_count *
+                                                          sizeof(energy_t) );
+
+  if( ( device_count + 1 > MAX_TABLE_SIZE ) || ( 0 == p_dataset->rounds ) ||
+      ( NULL == p_dataset->rssi_tables ) || ( NULL == p_dataset->powers ) )
+  {
+    free( p_dataset->rssi_tables );
+    free( p_dataset->powers );
+    memset( p_dataset, 0, sizeof(dataset_t) );
+    trace_unmap( &trace );
+    return 1;
+  }
+
+  for( round = 0; round < p_dataset->rounds; round++ )
+  {
+    trace_get_round( &trace, round, &round_tables );
+    trace_get_rssi( &round_tables, device_count,
+                              &p_dataset->rssi_tables[round * table_cells] );
+
+    // The first power is the AP's
+    memcpy( &p_dataset->powers[round * device_count], &round_tables.powers[1],
+                                          device_count * sizeof(energy_t) );
+  }
+
+  trace_unmap( &trace );
+
+  return 0;
+}
+
+/*******************************************************************************
+ * @fn    void *sweep_thread( void* arg )
+ *
+ * @brief Run jobs until there are none left
+ * ****************************************************************************/
+void *sweep_thread( void* arg )
+{
+  uint32_t job_index;
+
+  (void)arg;
+
+  for(;;)
+  {
+    pthread_mutex_lock( &mutex_jobs );
+    job_index = next_job++;
+    pthread_mutex_unlock( &mutex_jobs );
+
+    if( job_index >= job_count )
+    {
+      break;
+    }
+
+    run_job( &jobs[job_index] );
+  }
+
+  return NULL;
+}
+
+/*******************************************************************************
+ * @fn    void run_job( sweep_job_t* p_job )
+ *
+ * @brief Route every table of the job's dataset with its C on a new context
+ *        (nothing is logged or printed) and score the result. Tables are
+ *        given the recorded powers as previous powers, like readcsv does.
+ *        Rounds a device spends without a route are charged as a broadcast
+ *        at MAX_LINK_POWER, like the C tuner does.
+ * ****************************************************************************/
+void run_job( sweep_job_t* p_job )
+{
+  const dataset_t* p_dataset = p_job->p_dataset;
+  uint8_t device_count = p_dataset->device_count;
+  uint32_t table_cells = ( device_count + 1 ) * ( device_count + 1 );
+  routing_context_t* p_sim;
+  energy_t previous_powers[MAX_NETWORK_SIZE];
+  uint8_t rp_tables[RP_TABLES_SIZE];
+  route_stats_t stats;
+  uint32_t round;
+  uint32_t unrouted_rounds[MAX_NETWORK_SIZE + 1];
+  uint32_t unrouted = 0;
+  uint8_t node_index;
+  energy_t used;
+  energy_t sum = 0;
+  energy_t sum_squares = 0;
+  energy_t max_used = 0;
+  double tx_power_sum = 0;
+
+  p_sim = routing_context_create();
+  if( NULL == p_sim )
+  {
+    p_job->failed = 1;
+    return;
+  }
+
+  routing_select( p_sim );
+  routing_set_verbose( ROUTING_OUTPUT_NONE );
+
+  if( routing_start( p_job->c_factor, NULL ) )
+  {
+    routing_select( NULL );
+    routing_context_destroy( p_sim );
+    p_job->failed = 1;
+    return;
+  }
+
+  for( node_index = 0; node_index < device_count; node_index++ )
+  {
+    // Initialize previous power to maximum
+    previous_powers[node_index] =
+                    power_values[sizeof(power_values)/sizeof(energy_t) - 1];
+  }
+
+  memset( unrouted_rounds, 0, sizeof(unrouted_rounds) );
+
+  for( round = 0; round < p_dataset->rounds; round++ )
+  {
+    // parse_table_d doesn't change the tables it's given
+    if( parse_table_d(
+                (energy_t*)&p_dataset->rssi_tables[(size_t)round * table_cells],
+                previous_powers, device_count ) )
+    {
+      break;
+    }
+
+    routing_compute_round( rp_tables );
+
+    for( node_index = 1; node_index <= device_count; node_index++ )
+    {
+      if( !node_has_path( node_index ) )
+      {
+        unrouted_rounds[node_index]++;
+        unrouted++;
+      }
+    }
+
+    for( node_index = 0; node_index < device_count; node_index++ )
+    {
+      tx_power_sum += pow( 10, get_power_from_setting(
+                            rp_tables[device_count + node_index] ) / 10 );
+    }
+
+    memcpy( previous_powers, &p_dataset->powers[(size_t)round * device_count],
+                                          device_count * sizeof(energy_t) );
+  }
+
+  // Every device starts the run with MAX_LINK_POWER
+  for( node_index = 1; node_index <= device_count; node_index++ )
+  {
+    used = get_node_energy( node_index ) - MAX_LINK_POWER +
+                                  unrouted_rounds[node_index] * MAX_LINK_POWER;
+
+    sum += used;
+    sum_squares += used * used;
+    if( used > max_used )
+    {
+      max_used = used;
+    }
+  }
+
+  get_route_stats( &stats );
+
+  routing_finalize();
+  routing_select( NULL );
+  routing_context_destroy( p_sim );
+
+  p_job->failed = ( round < p_dataset->rounds );
+  p_job->rounds = round;
+  p_job->busiest = max_used;
+  p_job->variance = sum_squares / device_count -
+                              ( sum / device_count ) * ( sum / device_count );
+  p_job->route_changes = stats.changes;
+  p_job->unrouted = unrouted;
+
+  // Compared to a device sending at full power every round
+  p_job->lifetime = ( max_used > 0 ) ? round * MAX_LINK_POWER / max_used : 0;
+
+  // Averaged in mW, shown in dBm
+  p_job->mean_tx_power = ( round > 0 ) ?
+            10 * log10( tx_power_sum / ( (double)round * device_count ) ) : 0;
+}
+
+/*******************************************************************************
+ * @fn    void print_summary( FILE* fp, uint8_t csv )
+ *
+ * @brief Print one line per job, as a table or as csv
+ * ****************************************************************************/
+void print_summary( FILE* fp, uint8_t csv )
+{
+  sweep_job_t* p_job;
+  uint32_t job_index;
+
+  if( csv )
+  {
+    fprintf( fp, "dataset,C,rounds,lifetime,busiest,variance,route_changes,"
+                                              "unrouted,mean_tx_power\n" );
+  }
+  else
+  {
+    fprintf( fp, "%-40s %8s %7s %9s %10s %10s %8s %8s %8s\n", "dataset",
+                "C", "rounds", "lifetime", "busiest", "variance", "changes",
+                "unrouted", "tx (dBm)" );
+  }
+
+  for( job_index = 0; job_index < job_count; job_index++ )
+  {
+    p_job = &jobs[job_index];
+
+    if( csv )
+    {
+      fprintf( fp, "%s,%g,%d,%g,%g,%g,%d,%d,%g\n", p_job->p_dataset->name,
+                p_job->c_factor, p_job->rounds, p_job->lifetime,
+                p_job->busiest, p_job->variance, p_job->route_changes,
+                p_job->unrouted, p_job->mean_tx_power );
+    }
+    else
+    {
+      fprintf( fp, "%-40s %8g %7d %9.4g %10.4g %10.4g %8d %8d %8.3g%s\n",
+                p_job->p_dataset->name, p_job->c_factor, p_job->rounds,
+                p_job->lifetime, p_job->busiest, p_job->variance,
+                p_job->route_changes, p_job->unrouted, p_job->mean_tx_power,
+                p_job->failed ? " (failed)" : "" );
+    }
+  }
+}
@@ -0,0 +1,47 @@
+/** @file main.h
+*
+* @brief Main definitions and data types
+*
+* @author Alvaro Prieto
+*/
+#ifndef _MAIN_H
+#define _MAIN_H
+
+#include <stdint.h>
+#include "routing.h"
+
+// C values swept if no grid is given (same as the C tuner's candidates)
+#define DEFAULT_C_GRID "0,1,2,5,10,20,50,100,200,500,1000"
+
+// Most C values in a grid
+#define MAX_C_VALUES ( 64 )
+
+// Largest table that can be read ( (N+1)x(N+1) )
+#define MAX_TABLE_SIZE ( MAX_NETWORK_SIZE + 1 )
+
+// Recorded run, loaded once and shared by all its jobs (read only)
+typedef struct
+{
+  char name[256];
+  uint8_t device_count;       // N
+  uint32_t rounds;
+  energy_t* rssi_tables;      // (N+1)x(N+1) per round
+  energy_t* powers;           // N per round, tx powers used the next round
+} dataset_t;
+
+// One replay of a dataset with one C, and what came out of it
+typedef struct
+{
+  const dataset_t* p_dataset;
+  energy_t c_factor;
+  uint8_t failed;
+  uint32_t rounds;
+  energy_t lifetime;          // See README
+  energy_t busiest;           // Energy used by the busiest device
+  energy_t variance;          // Of the energy used by the devices
+  uint32_t route_changes;
+  uint32_t unrouted;          // Node-rounds without a route
+  energy_t mean_tx_power;     // dBm, averaged in Watts over nodes and rounds
+} sweep_job_t;
+
+#endif /*_MAIN_H */